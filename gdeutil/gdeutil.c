@@ -21,12 +21,14 @@
 
 #include "argtable2.h"
 #include "libguide/guide.h"
+#include "libguide/stats.h"
 
 #define VERSION		"2.0u"
 
 /* default options, overridden with command line args */
 int opt_verbose = 0;
 int opt_omit_text = 0;
+int opt_profile = 0;
 
 /* helper methods */
 static wchar_t *convert_to_unicode_from_usercp(const char *s)
@@ -115,25 +117,19 @@ void fspace(FILE *fp, int n)
 
 #define INDENT_BY	2 /* spaces */
 
-/* tree traverser for outputting xml */
-static int _export_traverser(struct tree_node_t *node, void *cargo, int after)
+/* tree traverser for outputting xml. The depth comes from the traversal,
+   so no need to walk up the parents of each node to get the indent. */
+static int _export_traverser(struct tree_node_t *node, void *cargo, int level, int index,
+	int after)
 {
 	struct xml_export_cb_data_t *params = (struct xml_export_cb_data_t *)cargo;
 	FILE *fp = params->xml_fp;
-	struct tree_node_t *root = tree_get_root(params->tree), *node2;
 	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
 	unsigned char *utf8;
-	int level = 0;
+	struct guide_text_t t;
+	const char *text;
 
-	/* get level (for indent) */
-	node2 = node;
-	while (node2 && node2 != root)
-	{
-		node2 = tree_get_parent(node2);
-		++level;
-	}
-
-	if (node == root)
+	if (level == 0)
 	{
 		if (after == 0)
 			fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n<guide>\r\n");
@@ -147,7 +143,10 @@ static int _export_traverser(struct tree_node_t *node, void *cargo, int after)
 			/* begin node tag */
 			fspace(fp, level * INDENT_BY);
 			fprintf(fp, "<node state=\"%d\" icon=\"%d\" first_line=\"%d\" color=\"%d\" bgcolor=\"%d\" uid=\"%u\" tc_state=\"%u\">\r\n",
-				data->state, data->icon, data->first_line, data->color, data->bgcolor, data->uid, data->tc_state);
+				guide_nodedata_get_attr(data, NA_STATE), guide_nodedata_get_attr(data, NA_ICON),
+				guide_nodedata_get_attr(data, NA_FIRST_LINE), guide_nodedata_get_attr(data, NA_COLOR),
+				guide_nodedata_get_attr(data, NA_BGCOLOR), data->uid,
+				guide_nodedata_get_attr(data, NA_TC_STATE));
 
 			/* convert title to utf8 and add node->title */
 			utf8 = convert_to_utf8(data->title);
@@ -161,7 +160,11 @@ static int _export_traverser(struct tree_node_t *node, void *cargo, int after)
 			{
 				fspace(fp, (level+1) * INDENT_BY);
 				fprintf(fp, "<text format=\"text/rtf\"><![CDATA[");
-				fwrite(data->text, strlen(data->text), 1, fp);
+				if ((text = guide_nodedata_acquire_text(data, &t)))
+					fwrite(text, strlen(text), 1, fp);
+				else
+					fprintf(stderr, "uid %u: could not read the text\n", data->uid);
+				guide_nodedata_release_text(&t);
 				fprintf(fp, "]]></text>\r\n");
 			}
 		}
@@ -221,7 +224,7 @@ void export_xml(const char *filename)
 	params.xml_fp = xml_fp;
 
 	/* traverse the tree */
-	tree_traverse_preorder2(params.tree, _export_traverser, &params);
+	tree_traverse_preorder_ex(params.tree, _export_traverser, &params);
 
 	/* cleanup */
 	guide_destroy(guide);
@@ -230,6 +233,27 @@ void export_xml(const char *filename)
 	free(xml_filename);
 }
 
+/* print the statistics of the library (--profile) to stderr */
+void print_profile(const char *filename)
+{
+	struct guide_stats_t stats;
+	int i;
+
+	if (guide_get_stats(&stats) < 0)
+	{
+		fprintf(stderr, "%s: no profile, libguide was built without STATS=1\n", filename);
+		return;
+	}
+
+	fprintf(stderr, "%s: profile:", filename);
+	for (i = 0; i < GP_COUNT; ++i)
+		fprintf(stderr, " %s=%.3fms", guide_stats_phase_name(i), stats.phase_ns[i] / 1e6);
+	fprintf(stderr, " lut_probes=%llu allocs=%llu read=%llu written=%llu nodes=%llu\n",
+		(unsigned long long)stats.lut_probes, (unsigned long long)stats.allocs,
+		(unsigned long long)stats.bytes_read, (unsigned long long)stats.bytes_written,
+		(unsigned long long)stats.nodes);
+}
+
 /* display usage information (--help) */
 void usage(void **argtable)
 {
@@ -251,21 +275,23 @@ int main(int argc, char *argv[])
     struct arg_str  *format  = arg_str0("f","format","<format>",	"output format for export (must be \"xml\")");
     struct arg_lit  *omit_txt= arg_lit0(NULL,"omit-text",			"omit <text> tags when exporting to XML");
     struct arg_lit  *verbose = arg_lit0("v","verbose",				"verbose messages");
+    struct arg_lit  *profile = arg_lit0(NULL,"profile",			"print load statistics of each file to stderr");
     struct arg_lit  *help    = arg_lit0(NULL,"help",                "print this help and exit");
     struct arg_lit  *version = arg_lit0(NULL,"version",             "print version information and exit");
     struct arg_file *infiles = arg_filen(NULL,NULL,NULL,1,100,      "input file(s)");
     struct arg_end  *end     = arg_end(20);
-    void* argtable[8];
+    void* argtable[9];
     int nerrors;
 
 	argtable[0] = action;
 	argtable[1] = format;
 	argtable[2] = omit_txt;
 	argtable[3] = verbose;
-	argtable[4] = help;
-	argtable[5] = version;
-	argtable[6] = infiles;
-	argtable[7] = end;
+	argtable[4] = profile;
+	argtable[5] = help;
+	argtable[6] = version;
+	argtable[7] = infiles;
+	argtable[8] = end;
 
 	/* parse command line */
 	nerrors = arg_parse(argc, argv, argtable);
@@ -296,15 +322,22 @@ int main(int argc, char *argv[])
 		opt_verbose = 1;
 	if (omit_txt->count > 0)
 		opt_omit_text = 1;
+	if (profile->count > 0)
+		opt_profile = 1;
 
 	/* perform actions */
 	while (infiles->count-- > 0)
 	{
-		export_xml(*(infiles->filename++));
+		if (opt_profile)
+			guide_reset_stats();
+		export_xml(*infiles->filename);
+		if (opt_profile)
+			print_profile(*infiles->filename);
+		infiles->filename++;
 	}
 	
 	/* done */
 	arg_freetable(argtable, sizeof(argtable)/sizeof(*argtable));
 	exit(0);
 	return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
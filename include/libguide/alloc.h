@@ -0,0 +1,74 @@
+/* 
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <wchar.h>
+#include <libguide/config.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Memory hooks. All memory of the library is allocated and freed through
+ * the allocator in use by the calling thread (see guide_use_allocator()),
+ * or failing that the default one (see guide_set_default_allocator()),
+ * or failing that malloc(), realloc() and free(). A guide switches to its
+ * own allocator while its functions run (see guide_set_allocator()).
+ * Memory is always freed through the allocator that allocated it.
+ */
+struct guide_allocator_t
+{
+	void *(*malloc_fn)(size_t size, void *cargo);
+	/** Called with a NULL `p' too, like realloc(). */
+	void *(*realloc_fn)(void *p, size_t size, void *cargo);
+	void (*free_fn)(void *p, void *cargo);
+	void *cargo;
+};
+
+/**
+ * Set the default allocator (NULL: malloc() and friends), which must stay
+ * valid as long as it's in use. Call it before anything else; memory
+ * allocated before is freed through the new one.
+ */
+LIBGUIDEAPI void guide_set_default_allocator(const struct guide_allocator_t *alloc);
+/**
+ * Use `alloc' (NULL: the default one) for the calling thread, which
+ * includes creating and loading guides. Returns the previous one.
+ */
+LIBGUIDEAPI const struct guide_allocator_t *guide_use_allocator(
+	const struct guide_allocator_t *alloc);
+/** The allocator in use by the calling thread, NULL if it's the default one. */
+LIBGUIDEAPI const struct guide_allocator_t *guide_current_allocator();
+
+/* allocation through the allocator in use, see above */
+LIBGUIDEAPI void *guide_malloc(size_t size);
+LIBGUIDEAPI void *guide_calloc(size_t n, size_t size);
+LIBGUIDEAPI void *guide_realloc(void *p, size_t size);
+LIBGUIDEAPI void guide_free(void *p);
+LIBGUIDEAPI char *guide_strdup(const char *s);
+LIBGUIDEAPI wchar_t *guide_wcsdup(const wchar_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ALLOC_H
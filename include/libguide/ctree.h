@@ -0,0 +1,82 @@
+/*
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CTREE_H
+#define CTREE_H
+
+#include <libguide/config.h>
+#include <libguide/tree.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact tree. An alternative to tree_t, where nodes are not individually
+ * allocated but live in parallel arrays (parent, first child, next and prev
+ * sibling, data) and are referred to by 32-bit handles. A node costs 16
+ * bytes of links plus the data pointer, and a tree built by
+ * ctree_create_from_tree() or compacted with ctree_compact() is stored in
+ * preorder, so a full preorder traversal is a sequential scan.
+ *
+ * Handles stay valid until the node is deleted or ctree_compact() is called.
+ */
+
+struct ctree_t;
+
+/** The "null" handle. */
+#define CTREE_NONE		((uint32)-1)
+
+typedef void (*ctree_node_cleanup_fn_t)(struct ctree_t *, uint32, void *);
+typedef int (*ctree_traverser_fn_t)(struct ctree_t *, uint32, void *);
+
+LIBGUIDEAPI struct ctree_t *ctree_create(uint32 capacity);
+LIBGUIDEAPI struct ctree_t *ctree_create_from_tree(struct tree_t *tree);
+LIBGUIDEAPI void ctree_delete_tree(struct ctree_t *tree, ctree_node_cleanup_fn_t cleanup_fn,
+		void *cargo);
+
+LIBGUIDEAPI uint32 ctree_get_root(struct ctree_t *tree);
+LIBGUIDEAPI uint32 ctree_get_first_child(struct ctree_t *tree, uint32 parent);
+LIBGUIDEAPI uint32 ctree_get_next_sibling(struct ctree_t *tree, uint32 node);
+LIBGUIDEAPI uint32 ctree_get_prev_sibling(struct ctree_t *tree, uint32 node);
+LIBGUIDEAPI uint32 ctree_get_parent(struct ctree_t *tree, uint32 node);
+LIBGUIDEAPI void *ctree_get_data(struct ctree_t *tree, uint32 node);
+LIBGUIDEAPI void ctree_set_data(struct ctree_t *tree, uint32 node, void *data);
+/** Number of live nodes in the tree. */
+LIBGUIDEAPI uint32 ctree_get_count(struct ctree_t *tree);
+
+LIBGUIDEAPI uint32 ctree_add_root(struct ctree_t *tree, void *data);
+LIBGUIDEAPI uint32 ctree_add_child(struct ctree_t *tree, uint32 parent, void *data,
+		uint32 after);
+LIBGUIDEAPI uint32 ctree_add_sibling_after(struct ctree_t *tree, uint32 node, void *data);
+LIBGUIDEAPI uint32 ctree_add_sibling_before(struct ctree_t *tree, uint32 node, void *data);
+LIBGUIDEAPI void ctree_delete_subtree(struct ctree_t *tree, uint32 node,
+		ctree_node_cleanup_fn_t cleanup_fn, void *cargo);
+
+/** Renumber all nodes in preorder and release unused slots. Invalidates handles. */
+LIBGUIDEAPI void ctree_compact(struct ctree_t *tree);
+
+LIBGUIDEAPI int ctree_traverse_preorder(struct ctree_t *tree, ctree_traverser_fn_t tvr, void *cargo);
+LIBGUIDEAPI int ctree_traverse_subtree_preorder(struct ctree_t *tree, uint32 node,
+		ctree_traverser_fn_t tvr, void *cargo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CTREE_H
@@ -20,13 +20,16 @@
 #define GUIDE_H
 
 #include <libguide/config.h>
+#include <libguide/alloc.h>
 #include <libguide/tree.h>
+#include <libguide/treepar.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct guide_t;
+struct guide_builder_t;
 
 /*-----------------------------------------------------------------------------------------------*/
 
@@ -35,45 +38,57 @@ struct guide_t;
  */
 struct guide_nodedata_t
 {
-	/** The title (node name), in unicode format. Should not be modified. */
+	/**
+	 * The title (node name), in unicode format. Should not be modified.
+	 * Short titles are stored along with the node data.
+	 */
 	wchar_t *title;
 
-	/** The text (node contents), in UTF-8 format. Should not be modified. */
-	char *text;
-
-	/** 
-	 * The state of the node. See the enum guide_nodedata_state_e for
-	 * possible values.
+	/**
+	 * The text (node contents), in UTF-8 format, unless it was moved to the
+	 * blob store of the guide (internal): read it with
+	 * guide_nodedata_acquire_text().
 	 */
-	uint32 state;
+	char *_text;
+
+	/** The unique identifier of the node. */
+	uint32 uid;
 
-	/** A number representing the icon for the node. 0 = default. */
-	uint32 icon;
+	/** How the node data and its strings were allocated (internal). */
+	uint32 _flags;
 
-	/** Index of the first visible line in the text pane. */
-	uint32 first_line;
+	/** The guide the node data was created for (internal). */
+	struct guide_t *_guide;
 
-	/**
-	 * The text color of the node in the tree pane. A value of (uint32)(-1)
-	 * means default. Else cast to COLORREF and use.
-	 */
-	uint32 color;
+	/** Where the text is in the blob store, if it's there (internal). */
+	struct _guide_blob_t *_blob;
 
 	/**
-	 * The bg color of the node in the tree pane. A value of (uint32)(-1)
-	 * means default. Else cast to COLORREF and use.
+	 * The attributes not at their default, if any (internal). They used to
+	 * be fields of their own: see guide_nodedata_get_attr(), and the
+	 * guide_nodedata_get_state() etc. macros for older code.
 	 */
-	uint32 bgcolor;
-
-	/** The unique identifier of the node. */
-	uint32 uid;
+	struct _guide_attrs_t *_attrs;
+};
 
-	/** The state value (TVITEM::state) of the node. */
-	uint32 tc_state;
+/**
+ * The other attributes of a node, by their id in the file format. Read and
+ * change them with guide_nodedata_get_attr() and _set_attr(). An attribute
+ * never set has its default value: (uint32)(-1) for the colors, 0 for the
+ * others.
+ */
+enum guide_nodedata_attr_e
+{
+	NA_STATE		= 1,	/**< the state, see guide_nodedata_state_e */
+	NA_ICON			= 2,	/**< a number representing the icon, 0 = default */
+	NA_FIRST_LINE	= 3,	/**< index of the first visible line in the text pane */
+	NA_COLOR		= 4,	/**< text color in the tree pane: cast to COLORREF and use */
+	NA_BGCOLOR		= 5,	/**< bg color in the tree pane: cast to COLORREF and use */
+	NA_TC_STATE		= 7		/**< the state value (TVITEM::state) */
 };
 
 /**
- * How to interpret the 'state' field in guide_nodedata_t. This field is a 
+ * How to interpret the NA_STATE attribute of guide_nodedata_t. It is a
  * bitmask, with the various bits representing the properties listed here.
  */
 enum guide_nodedata_state_e
@@ -92,10 +107,66 @@ LIBGUIDEAPI void guide_nodedata_destroy(struct guide_nodedata_t *data);
 LIBGUIDEAPI void guide_nodedata_set_title(struct guide_nodedata_t *data, const wchar_t *title);
 LIBGUIDEAPI void guide_nodedata_set_text(struct guide_nodedata_t *data, const char *text);
 LIBGUIDEAPI void guide_nodedata_set_textn(struct guide_nodedata_t *data, const char *text, size_t n);
+/**
+ * Like the above, but taking over `title' and `text', which must have been
+ * allocated from the allocator of the guide (malloc() by default, see
+ * guide_set_allocator()), instead of copying them. NULL means empty.
+ */
+LIBGUIDEAPI struct guide_nodedata_t *guide_nodedata_create_take(struct guide_t *guide,
+	wchar_t *title, char *text);
+LIBGUIDEAPI void guide_nodedata_set_title_take(struct guide_nodedata_t *data, wchar_t *title);
+LIBGUIDEAPI void guide_nodedata_set_text_take(struct guide_nodedata_t *data, char *text);
+/** The title of the node data. */
+LIBGUIDEAPI const wchar_t *guide_nodedata_get_title(struct guide_nodedata_t *data);
+/** A text acquired with guide_nodedata_acquire_text(). */
+struct guide_text_t
+{
+	/** The text, in UTF-8 format; NULL if it couldn't be read. */
+	const char *text;
+
+	/** What keeps it alive, if anything (internal). */
+	void *_held;
+};
+/**
+ * Get the text of the node data into `t', read back from the blob store if
+ * it's there, and return t->text: NULL if it couldn't be read from the
+ * file. A text from the store stays good until guide_nodedata_release_text(),
+ * even if it's changed or dropped from the cache meanwhile (see
+ * guide_set_blob_store()); any other is good until the text is changed.
+ * Every text acquired is released, NULL or not.
+ */
+LIBGUIDEAPI const char *guide_nodedata_acquire_text(struct guide_nodedata_t *data,
+	struct guide_text_t *t);
+LIBGUIDEAPI void guide_nodedata_release_text(struct guide_text_t *t);
+
+/** Get or set an attribute, one of guide_nodedata_attr_e. */
+LIBGUIDEAPI uint32 guide_nodedata_get_attr(const struct guide_nodedata_t *data, int attr);
+LIBGUIDEAPI void guide_nodedata_set_attr(struct guide_nodedata_t *data, int attr, uint32 value);
 
 #define guide_nodedata_set_expanded(data, is_expanded)  \
-	((is_expanded) ? ((data)->state |= NS_EXPANDED) : ((data)->state &= ~NS_EXPANDED))
-#define guide_nodedata_get_expanded(data)  ((data)->state & NS_EXPANDED)
+	guide_nodedata_set_attr((data), NA_STATE, (is_expanded) ? \
+		(guide_nodedata_get_attr((data), NA_STATE) | NS_EXPANDED) : \
+		(guide_nodedata_get_attr((data), NA_STATE) & ~NS_EXPANDED))
+#define guide_nodedata_get_expanded(data)  (guide_nodedata_get_attr((data), NA_STATE) & NS_EXPANDED)
+
+/**
+ * Deprecated: the state, icon, first_line, color, bgcolor and tc_state fields
+ * of guide_nodedata_t are gone. Code that used `data->icon' can use
+ * guide_nodedata_get_icon(data), and guide_nodedata_set_icon(data, v) for
+ * `data->icon = v', and so on; new code should use the calls above.
+ */
+#define guide_nodedata_get_state(data)          guide_nodedata_get_attr((data), NA_STATE)
+#define guide_nodedata_set_state(data, v)       guide_nodedata_set_attr((data), NA_STATE, (v))
+#define guide_nodedata_get_icon(data)           guide_nodedata_get_attr((data), NA_ICON)
+#define guide_nodedata_set_icon(data, v)        guide_nodedata_set_attr((data), NA_ICON, (v))
+#define guide_nodedata_get_first_line(data)     guide_nodedata_get_attr((data), NA_FIRST_LINE)
+#define guide_nodedata_set_first_line(data, v)  guide_nodedata_set_attr((data), NA_FIRST_LINE, (v))
+#define guide_nodedata_get_color(data)          guide_nodedata_get_attr((data), NA_COLOR)
+#define guide_nodedata_set_color(data, v)       guide_nodedata_set_attr((data), NA_COLOR, (v))
+#define guide_nodedata_get_bgcolor(data)        guide_nodedata_get_attr((data), NA_BGCOLOR)
+#define guide_nodedata_set_bgcolor(data, v)     guide_nodedata_set_attr((data), NA_BGCOLOR, (v))
+#define guide_nodedata_get_tc_state(data)       guide_nodedata_get_attr((data), NA_TC_STATE)
+#define guide_nodedata_set_tc_state(data, v)    guide_nodedata_set_attr((data), NA_TC_STATE, (v))
 
 
 /*-----------------------------------------------------------------------------------------------*/
@@ -111,7 +182,7 @@ struct guide_t
 	/** The tree. */
 	struct tree_t *tree;
 
-	/** A counter used internally, to create node UIDs. */
+	/** A counter used internally, to create node UIDs (changed atomically). */
 	uint32 _counter;
 
 	/** Lookup table of uid -> node pointer. (not serialized). */
@@ -122,6 +193,24 @@ struct guide_t
 	 * to the new pointer upon load.
 	 */
 	struct tree_node_t *sel_node;
+
+	/** Lookup table of parent uid -> title index (internal). */
+	struct lut_t *_titleidx;
+
+	/** Locks, if in concurrent mode (internal). */
+	struct _guide_sync_t *_sync;
+
+	/** Undo journal, if enabled (internal). */
+	struct _guide_journal_t *_journal;
+
+	/** Nodes added by the open batch, if any (internal). */
+	struct _guide_batch_t *_batch;
+
+	/** Blob store for large texts, if enabled (internal). */
+	struct _guide_blob_store_t *_blobs;
+
+	/** Allocator of everything the guide holds, NULL for the default (internal). */
+	const struct guide_allocator_t *_alloc;
 };
 
 /* operations on the guide itself */
@@ -131,23 +220,258 @@ LIBGUIDEAPI struct guide_t *guide_create();
 /** Load a guide from a file. */
 LIBGUIDEAPI struct guide_t *guide_load(const wchar_t *filename, unsigned *os_errcode,
 	uint32 *format);
-/** Store guide into disk. */
+/**
+ * Store guide into disk. Returns 0, or -1 if the file couldn't be written
+ * or a text couldn't be read back from the blob store, leaving the file
+ * incomplete.
+ */
 LIBGUIDEAPI int guide_store(const wchar_t *filename, struct guide_t *gde);
 /** Destroy the guide object. Do not use the pointer after this call. */
 LIBGUIDEAPI void guide_destroy(struct guide_t *gde);
+/**
+ * Like guide_destroy(), but the guide is freed on a background thread, so
+ * this returns at once (unless a number of guides are already waiting, in
+ * which case it waits for room). Do not use the pointer after this call.
+ */
+LIBGUIDEAPI void guide_destroy_async(struct guide_t *gde);
+/**
+ * Wait until all guides passed to guide_destroy_async() are freed, and stop
+ * the background thread. Call before exit, or before unloading the library.
+ */
+LIBGUIDEAPI void guide_reclaimer_drain();
+/**
+ * Turn the concurrent mode of the guide on or off, while no other thread
+ * uses it. In concurrent mode, the guide_* functions that change the guide
+ * take a write lock, and the lookups (by uid, title or path) take a read
+ * lock, so any number of threads can look up while one changes the guide.
+ * Node data can be created on any thread. Returns 0, or -1 on failure.
+ */
+LIBGUIDEAPI int guide_set_concurrent(struct guide_t *guide, int concurrent);
+/**
+ * Hold the read or write lock of a concurrent guide, for walking the tree
+ * (read), or for changing it with the tree_* functions (write). The thread
+ * holding the write lock can call any guide_* function; a reader must not
+ * call the ones that change the guide. No-ops if not in concurrent mode.
+ */
+LIBGUIDEAPI void guide_lock_read(struct guide_t *guide);
+LIBGUIDEAPI void guide_lock_write(struct guide_t *guide);
+LIBGUIDEAPI void guide_unlock(struct guide_t *guide);
+/**
+ * Turn the undo journal of `guide' on or off. While on, the changes made
+ * with the guide_* functions, guide_nodedata_set_title() and _set_text(),
+ * and tree_move_subtree_*() are recorded as the deltas that undo them, so
+ * that they can be undone and redone. Deleted subtrees are kept, detached,
+ * instead of freed. If `max_bytes' is not 0, the oldest transactions are
+ * dropped to keep the journal about that size. Splitting the guide, and
+ * replacing its tree with guide_build_bulk(), clear the journal.
+ * Returns 0 on success, -1 on failure.
+ */
+LIBGUIDEAPI int guide_set_journal(struct guide_t *guide, int journal, size_t max_bytes);
+/**
+ * Group the changes up to the matching guide_end_transaction() into one
+ * transaction, undone and redone as a whole. Takes the write lock until
+ * then (see guide_set_concurrent()). Transactions nest; without one, each
+ * change is a transaction of its own.
+ */
+LIBGUIDEAPI void guide_begin_transaction(struct guide_t *guide);
+LIBGUIDEAPI void guide_end_transaction(struct guide_t *guide);
+/**
+ * Keep texts of `threshold' bytes or more out of memory, in a file at
+ * `path' (a temporary file if NULL), which must not exist yet and to which
+ * they are appended; the file is not removed afterwards. They are
+ * read back on access, and up to `budget' bytes of them are kept cached,
+ * least recently used first to go. Texts already in the guide are moved
+ * there now, and later ones as they are set. A `threshold' of 0 brings the
+ * texts of the guide back and stops using the store (nodes split off to
+ * other guides keep theirs in it). Returns 0 on success, -1 on failure.
+ */
+LIBGUIDEAPI int guide_set_blob_store(struct guide_t *guide, const char *path,
+	size_t threshold, size_t budget);
+/**
+ * Set the allocator (see alloc.h) that the memory of `guide' comes from,
+ * which must stay valid as long as the guide. The functions of the guide
+ * use it, whichever thread calls them; call tree functions on the tree of
+ * the guide with it in use (guide_use_allocator()). Only for a guide that
+ * holds nothing yet, as from guide_create(): returns -1 otherwise. A guide
+ * created or loaded while a thread uses an allocator gets that one. The
+ * guide_t itself comes from the default allocator. If `guide' is NULL,
+ * sets the default allocator instead (guide_set_default_allocator()).
+ */
+LIBGUIDEAPI int guide_set_allocator(struct guide_t *guide,
+	const struct guide_allocator_t *alloc);
+/**
+ * Batch up the nodes added with guide_add_child() and guide_add_sibling_*()
+ * up to the matching guide_commit_batch(), for loading many at a time:
+ * each is linked in constant time, and the subtree sizes of the tree and
+ * the uid table are brought up to date once for the whole batch, when
+ * committed or when first needed before that. Takes the write lock until
+ * then (see guide_set_concurrent()). Batches nest.
+ */
+LIBGUIDEAPI void guide_begin_batch(struct guide_t *guide);
+LIBGUIDEAPI void guide_commit_batch(struct guide_t *guide);
+/**
+ * Move all nodes and their node data into contiguous memory, in preorder,
+ * so that walking the guide reads memory in sequence. Best done after
+ * loading or heavy editing. Invalidates all node and node data pointers
+ * held outside the guide; look nodes up again by uid. Takes the write
+ * lock. Returns 0, or -1 if the guide has snapshots or on failure.
+ */
+LIBGUIDEAPI int guide_compact_layout(struct guide_t *guide);
+
+/**
+ * Memory held by a guide or a subtree, in bytes, as requested from the
+ * allocator (see guide_memory_usage()).
+ */
+struct guide_memory_t
+{
+	/** The tree nodes, with the children indexes of wide parents. */
+	size_t tree_nodes;
+	/** The node data, with their attributes. */
+	size_t nodedata;
+	size_t titles;
+	/** Texts in the blob store only count the record of where they are. */
+	size_t texts;
+	/**
+	 * The title indexes, and for the whole guide only, the uid table and
+	 * the table of title indexes.
+	 */
+	size_t luts;
+	/** The sum of the above. */
+	size_t total;
+};
+
+/**
+ * Fill in `usage' with the memory held by the subtree at `node', or by the
+ * whole guide if `node' is NULL. The sizes come from the allocations of the
+ * library, not from estimates. The hash tables of the guide are only
+ * counted for the whole guide, as no part of them belongs to any subtree.
+ * Not counted: memory kept for snapshots, the journal, builders and the
+ * blob store cache, and the room not used yet in the blocks that loaded or
+ * compacted nodes are carved from. O(n) for n nodes; takes the read lock.
+ * Returns 0, or -1 on bad arguments.
+ */
+LIBGUIDEAPI int guide_memory_usage(struct guide_t *guide, struct tree_node_t *node,
+	struct guide_memory_t *usage);
+/**
+ * Undo the last transaction, or redo the last one undone. Returns 0, or -1
+ * if there is none, or a transaction is open. Any other change drops what
+ * could be redone.
+ */
+LIBGUIDEAPI int guide_undo(struct guide_t *guide);
+LIBGUIDEAPI int guide_redo(struct guide_t *guide);
+LIBGUIDEAPI int guide_can_undo(struct guide_t *guide);
+LIBGUIDEAPI int guide_can_redo(struct guide_t *guide);
+
 /** Delete a subtree. Do not use tree_delete_subtree() directly. */
 LIBGUIDEAPI void guide_delete_subtree(struct guide_t *guide, struct tree_node_t *node);
+/**
+ * Detach the subtree at `node' into a new guide, taking its uids (and the
+ * selection, if it's in the subtree) along. No node is copied, but the uids
+ * are moved one by one: O(n) for the n nodes of the subtree. Returns NULL
+ * for the root.
+ */
+LIBGUIDEAPI struct guide_t *guide_split_subtree(struct guide_t *guide, struct tree_node_t *node);
+/**
+ * Attach the whole of `other' as the first child of `node', and free
+ * `other'. Nodes whose uid is already in use in `guide' get a new one.
+ * Together with guide_split_subtree(), this moves a subtree between guides
+ * at the cost of re-registering its uids, O(n) for its n nodes, without
+ * copying any node. Both guides must have the same allocator. Batches still
+ * open on `other' are committed first.
+ */
+LIBGUIDEAPI void guide_merge_guide(struct guide_t *guide, struct tree_node_t *node,
+	struct guide_t *other);
+/**
+ * Replace the tree of `guide' with one built from arrays of `n' node ids,
+ * parent ids and node data, in file order (see tree_build_from_parent_array()).
+ * The node data should have been created for `guide'. The nodes are
+ * allocated in one block and the uid table is filled in the same pass.
+ * Returns 0 on success; on failure, or with a batch open (guide_begin_batch()),
+ * -1 is returned and the guide and the node data are left as they were.
+ */
+LIBGUIDEAPI int guide_build_bulk(struct guide_t *guide, uint32 n, const uint32 *ids,
+	const uint32 *parent_ids, struct guide_nodedata_t **data);
 /** Get the tree contained in the guide. */
 #define guide_get_tree(gde)		((gde)->tree)
 
 LIBGUIDEAPI struct tree_t *guide_create_with_root(struct guide_t *guide, struct guide_nodedata_t *data);
 LIBGUIDEAPI struct tree_node_t *guide_add_child(struct guide_t *guide, struct tree_node_t *parent,
 	struct guide_nodedata_t *data, struct tree_node_t *after);
+LIBGUIDEAPI struct tree_node_t *guide_insert_child_at(struct guide_t *guide,
+	struct tree_node_t *parent, struct guide_nodedata_t *data, uint32 index);
 LIBGUIDEAPI struct tree_node_t *guide_add_sibling_after(struct guide_t *guide, 
 	struct tree_node_t *node, struct guide_nodedata_t *data);
 LIBGUIDEAPI struct tree_node_t *guide_add_sibling_before(struct guide_t *guide, 
 	struct tree_node_t *node, struct guide_nodedata_t *data);
 
+/**
+ * Copy the subtree at `src_node' (which may be in another guide) and add
+ * the copy as a child of `parent', after `after' (first if NULL), like
+ * guide_add_child(). The copied nodes get new uids. O(n).
+ */
+LIBGUIDEAPI struct tree_node_t *guide_copy_subtree(struct guide_t *guide,
+	struct tree_node_t *src_node, struct tree_node_t *parent, struct tree_node_t *after);
+
+/**
+ * Builders, for creating nodes from several threads at once. Each thread
+ * builds subtrees with a builder of its own, without locking the guide: the
+ * builder hands out uids from a range it reserves in advance, and allocates
+ * nodes and node data, strings included, in blocks of its own. The subtrees
+ * are then attached to the guide by guide_builder_publish(), in one step.
+ *
+ * A builder is used by one thread at a time. Node data made by a builder
+ * belongs to no guide until published, and is destroyed as usual.
+ */
+LIBGUIDEAPI struct guide_builder_t *guide_builder_create(struct guide_t *guide);
+/** Destroy `builder', and the subtrees it holds that were not published. */
+LIBGUIDEAPI void guide_builder_destroy(struct guide_builder_t *builder);
+LIBGUIDEAPI struct guide_nodedata_t *guide_builder_nodedata(struct guide_builder_t *builder,
+	const wchar_t *title, const char *text);
+/**
+ * Add a node to the subtrees of `builder', as a child of `parent', or as
+ * a new subtree if `parent' is NULL. `after' is as for guide_add_child().
+ */
+LIBGUIDEAPI struct tree_node_t *guide_builder_add_child(struct guide_builder_t *builder,
+	struct tree_node_t *parent, struct guide_nodedata_t *data, struct tree_node_t *after);
+/**
+ * Attach the subtrees of `builder', in their order in the builder, as
+ * children of `parent' after `after' (first if NULL), and register their
+ * uids. The builder is then empty, and can go on building. Returns 0 on
+ * success, -1 if not all subtrees could be attached.
+ */
+LIBGUIDEAPI int guide_builder_publish(struct guide_builder_t *builder,
+	struct tree_node_t *parent, struct tree_node_t *after);
+
+/**
+ * Take a snapshot of the guide, for reading it on other threads while it's
+ * being changed (see tree_snapshot_create()): read it with the
+ * tree_snapshot_* functions, and release it when done. The data of its
+ * nodes is guide_nodedata_t, of which the title and text are kept as they
+ * were; the other fields are read as they are now. The guide may be
+ * destroyed before its snapshots are released.
+ */
+LIBGUIDEAPI struct tree_snapshot_t *guide_snapshot(struct guide_t *guide);
+LIBGUIDEAPI void guide_snapshot_release(struct tree_snapshot_t *snapshot);
+
+/** Call `fn' for every node of the guide, from several threads. See tree_parallel_for_each(). */
+LIBGUIDEAPI int guide_parallel_for_each(struct guide_t *guide, tree_parallel_fn_t fn, void *cargo,
+	const struct tree_parallel_opts_t *opts);
+
+/**
+ * Find the first child of `parent' with the given title. Parents with many
+ * children get a hash index of their titles on the first lookup, which is
+ * kept up to date as the guide changes.
+ */
+LIBGUIDEAPI struct tree_node_t *guide_find_child_by_title(struct guide_t *guide,
+	struct tree_node_t *parent, const wchar_t *title);
+/**
+ * Find a node by a path of titles separated by '/', like L"Projects/2026/Notes",
+ * starting from the children of `node' (of the root if NULL). Empty
+ * components are skipped. Returns NULL if there's no such node.
+ */
+LIBGUIDEAPI struct tree_node_t *guide_find_by_path(struct guide_t *guide, struct tree_node_t *node,
+	const wchar_t *path);
+
 // note: uid will be >0.
 LIBGUIDEAPI struct tree_node_t *guide_get_node_by_uid(struct guide_t *guide, uint32 uid);
 
@@ -19,6 +19,7 @@
 #ifndef LUT_H
 #define LUT_H
 
+#include <stddef.h>
 #include <libguide/config.h>
 
 #ifdef __cplusplus
@@ -32,6 +33,11 @@ LIBGUIDEAPI void lut_free(struct lut_t *lut);
 
 LIBGUIDEAPI void lut_set(struct lut_t *lut, void *lhs, void *rhs);
 LIBGUIDEAPI int  lut_get(struct lut_t *lut, void *lhs, void **rhs);
+LIBGUIDEAPI int  lut_remove(struct lut_t *lut, void *lhs);
+/** Make room for `n' more entries, so that setting them won't rehash. */
+LIBGUIDEAPI void lut_reserve(struct lut_t *lut, unsigned n);
+/** Bytes of memory held by the table; `count', if not NULL, gets the number of entries. */
+LIBGUIDEAPI size_t lut_memory_usage(struct lut_t *lut, unsigned *count);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,80 @@
+/* 
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <libguide/config.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Phases of loading and storing a guide, timed by the statistics. They
+ * nest: GP_UTF8 is also counted in GP_DECODE and GP_STORE, and GP_UIDS in
+ * GP_LINK.
+ */
+enum guide_stats_phase_e
+{
+	GP_MAP		= 0,	/**< opening and mapping the file */
+	GP_HEADER,			/**< parsing the file header */
+	GP_DECODE,			/**< decoding the node records */
+	GP_UTF8,			/**< converting titles from and to UTF-8 */
+	GP_LINK,			/**< linking the nodes into a tree */
+	GP_UIDS,			/**< registering the uids of the nodes */
+	GP_STORE,			/**< writing a guide out with guide_store() */
+	GP_COUNT
+};
+
+/**
+ * Process-wide statistics, collected only if the library was built with
+ * GUIDE_STATS defined (make STATS=1); otherwise the hooks compile to
+ * nothing, and guide_get_stats() returns all zeros.
+ */
+struct guide_stats_t
+{
+	/** Time spent in each phase, in nanoseconds, see guide_stats_phase_e. */
+	uint64_t phase_ns[GP_COUNT];
+	/** Slots looked at by lut_get(), lut_set() and lut_remove(). */
+	uint64_t lut_probes;
+	/** Calls to guide_malloc(), guide_calloc() and guide_realloc(). */
+	uint64_t allocs;
+	/** Bytes of .gde files and blob stores read and written. */
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	/** Nodes loaded or stored. */
+	uint64_t nodes;
+};
+
+/**
+ * Copy the statistics collected since the start, or the last
+ * guide_reset_stats(), into `stats'. Returns -1 if the library was built
+ * without them.
+ */
+LIBGUIDEAPI int guide_get_stats(struct guide_stats_t *stats);
+LIBGUIDEAPI void guide_reset_stats();
+/** The name of a phase, for printing. */
+LIBGUIDEAPI const char *guide_stats_phase_name(int phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STATS_H
@@ -19,6 +19,7 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stddef.h>
 #include <libguide/config.h>
 
 #ifdef __cplusplus
@@ -27,11 +28,80 @@ extern "C" {
 
 struct tree_node_t;
 struct tree_t;
+struct tree_snapshot_t;
+struct tree_arena_t;
 
 typedef void (*tree_node_cleanup_fn_t)(struct tree_node_t *, void *);
 typedef int (*tree_traverser_fn_t)(struct tree_node_t *, void *);
 typedef int (*tree_traverser_wd_fn_t)(struct tree_node_t *, int depth);
 typedef int (*tree_traverser_fn2_t)(struct tree_node_t *, void *, int);
+/* node, cargo, depth (0 for the node the traversal starts at), index among
+   siblings, TREE_ITER_ENTER or TREE_ITER_LEAVE */
+typedef int (*tree_traverser_ex_fn_t)(struct tree_node_t *, void *, int, int, int);
+
+/** Values for the second argument of tree_change_fn_t. */
+enum tree_change_e
+{
+	TREE_CHANGE_LINKED,		/**< the node was just linked under its parent */
+	TREE_CHANGE_UNLINKING	/**< the node is about to be unlinked from its parent */
+};
+
+/* node, TREE_CHANGE_LINKED or TREE_CHANGE_UNLINKING, cargo */
+typedef void (*tree_change_fn_t)(struct tree_node_t *, int, void *);
+/* old node, new node, cargo */
+typedef void (*tree_relocate_fn_t)(struct tree_node_t *, struct tree_node_t *, void *);
+
+/**
+ * Orders in which a tree_iter_t can walk a subtree.
+ */
+enum tree_iter_order_e
+{
+	TREE_ITER_PREORDER,		/**< visit a node, then its children */
+	TREE_ITER_POSTORDER,	/**< visit the children of a node, then the node */
+	TREE_ITER_EVENTS		/**< visit a node on entry and again on leave */
+};
+
+/** Values of tree_iter_t::event. */
+enum tree_iter_event_e
+{
+	TREE_ITER_ENTER	= 0,	/**< node is visited before its children */
+	TREE_ITER_LEAVE	= 1		/**< node is visited after its children */
+};
+
+/**
+ * A cursor over a subtree. It walks using the parent and sibling links of
+ * the nodes, so it needs no allocation and no stack, and can be stopped and
+ * resumed at any time (it's a plain struct, and can be copied).
+ *
+ *	struct tree_iter_t it;
+ *	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+ *	while (tree_iter_next(&it))
+ *		... it.node, it.depth ...
+ *
+ * In preorder and events order, the next node is found only when
+ * tree_iter_next() is called, so the children of the current node may be
+ * changed in between. In postorder, the next node is found before the
+ * current one is returned, so the current node may be deleted.
+ */
+struct tree_iter_t
+{
+	/** The current node, NULL before the first and after the last step. */
+	struct tree_node_t *node;
+	/** Depth of the current node, the starting node being at depth 0. */
+	int depth;
+	/** TREE_ITER_ENTER or TREE_ITER_LEAVE (always ENTER in preorder, LEAVE in postorder). */
+	int event;
+
+	/* internal */
+	struct tree_node_t *_root;
+	struct tree_node_t *_next;
+	int _next_depth;
+	int _order;
+	int _started;
+};
+
+LIBGUIDEAPI void tree_iter_init(struct tree_iter_t *it, struct tree_node_t *node, int order);
+LIBGUIDEAPI struct tree_node_t *tree_iter_next(struct tree_iter_t *it);
 
 LIBGUIDEAPI struct tree_node_t *tree_get_root(struct tree_t *tree);
 LIBGUIDEAPI struct tree_node_t *tree_get_first_child(struct tree_node_t *parent);
@@ -39,17 +109,179 @@ LIBGUIDEAPI struct tree_node_t *tree_get_next_sibling(struct tree_node_t *node);
 LIBGUIDEAPI struct tree_node_t *tree_get_prev_sibling(struct tree_node_t *node);
 LIBGUIDEAPI struct tree_node_t *tree_get_parent(struct tree_node_t *node);
 LIBGUIDEAPI void *tree_get_data(struct tree_node_t *node);
+/** Number of nodes in the subtree at `node', including `node'. O(1). */
+LIBGUIDEAPI uint32 tree_get_subtree_size(struct tree_node_t *node);
+/** Number of nodes in the tree. O(1). */
+LIBGUIDEAPI uint32 tree_get_node_count(struct tree_t *tree);
+/** The n-th (from 0) node of the subtree at `node' in preorder, or NULL. */
+LIBGUIDEAPI struct tree_node_t *tree_get_nth_preorder(struct tree_node_t *node, uint32 n);
+/** Position (from 0) of `node' in the preorder sequence of its tree. */
+LIBGUIDEAPI uint32 tree_get_preorder_rank(struct tree_node_t *node);
 LIBGUIDEAPI void tree_set_data(struct tree_node_t *node, void *data);
+/**
+ * Bytes of memory held by `node' itself: the node, the index of its
+ * children if it has one, and the tree if it's a root. The data and the
+ * states kept for snapshots are not counted.
+ */
+LIBGUIDEAPI size_t tree_node_memory(struct tree_node_t *node);
+
+/*
+ * Positional access to children. Parents with many children get an index
+ * of them on first use, after which these take O(log k) time for k
+ * children; for other parents they walk the sibling list.
+ */
+
+/** Number of children of `parent'. */
+LIBGUIDEAPI uint32 tree_get_child_count(struct tree_node_t *parent);
+/** The n-th (from 0) child of `parent', or NULL. */
+LIBGUIDEAPI struct tree_node_t *tree_get_nth_child(struct tree_node_t *parent, uint32 n);
+/** Position (from 0) of `node' among its siblings. */
+LIBGUIDEAPI uint32 tree_child_index(struct tree_node_t *node);
+/** Add a child at position `index' of `parent' (at the end, if past it). */
+LIBGUIDEAPI struct tree_node_t *tree_insert_child_at(struct tree_node_t *parent, void *data,
+		uint32 index);
+
+/**
+ * Turn the preorder index of `tree' on or off. While on, every node knows its
+ * preorder rank, which makes tree_is_ancestor() and tree_get_subtree_range()
+ * O(1). Changes to the tree only mark the ranks after the changed spot as
+ * stale. Queries walk the tree as if unindexed until they have taken as many
+ * steps as renumbering the stale ranks would, and then renumber them: O(1)
+ * while the tree is only queried, never more than about twice the walk
+ * otherwise.
+ */
+LIBGUIDEAPI void tree_set_indexed(struct tree_t *tree, int indexed);
+/**
+ * Have `fn' called whenever a subtree is linked under a parent in `tree', or
+ * unlinked from it: adds, deletes, moves, splits and merges. The new tree of
+ * a split has no change function. Pass NULL to stop.
+ */
+LIBGUIDEAPI void tree_set_change_fn(struct tree_t *tree, tree_change_fn_t fn, void *cargo);
+/**
+ * Let `tree' be read from several threads at once, while no thread changes
+ * it (as under a reader-writer lock). Queries that update an index as they
+ * go (children index, preorder index) then serialize those updates with a
+ * mutex of the tree. Returns 0, or -1 on failure.
+ */
+LIBGUIDEAPI int tree_set_shared(struct tree_t *tree, int shared);
+/** Is `anc' the same as `node' or one of its ancestors? */
+LIBGUIDEAPI int tree_is_ancestor(struct tree_t *tree, struct tree_node_t *anc,
+		struct tree_node_t *node);
+/** Preorder ranks of the first (`node' itself) and last node of its subtree. */
+LIBGUIDEAPI void tree_get_subtree_range(struct tree_t *tree, struct tree_node_t *node,
+		uint32 *first, uint32 *last);
+
+/*
+ * Snapshots. A snapshot is a read-only view of a tree as it was when the
+ * snapshot was taken, which stays the same while the tree is changed.
+ * Taking one is O(1); after that, each node changed for the first time
+ * keeps its old links and data pointer for the snapshot, and deleted
+ * subtrees are freed only once no snapshot can reach them.
+ *
+ * Snapshots are taken and the tree is changed by one thread (the writer),
+ * but snapshots can be read and released from any thread, without locks.
+ * The tree split off a tree with snapshots is kept for them too. A tree
+ * with snapshots may be deleted (its nodes are then freed, with the cleanup
+ * function, by the last release), but not merged into another tree.
+ *
+ * Only the data pointer is versioned, not what it points to. A writer that
+ * changes data in place calls tree_snapshot_keep_data() first, and frees
+ * what it replaces with tree_snapshot_defer_free().
+ */
+
+/** Take a snapshot of `tree'. Writer only. */
+LIBGUIDEAPI struct tree_snapshot_t *tree_snapshot_create(struct tree_t *tree);
+/** Done reading `snapshot'. Any thread; `snapshot' can't be used after. */
+LIBGUIDEAPI void tree_snapshot_release(struct tree_snapshot_t *snapshot);
+/** Does `tree' have snapshots not released yet? Writer only. */
+LIBGUIDEAPI int tree_has_snapshots(struct tree_t *tree);
+
+LIBGUIDEAPI struct tree_node_t *tree_snapshot_get_root(const struct tree_snapshot_t *snapshot);
+LIBGUIDEAPI struct tree_node_t *tree_snapshot_get_first_child(
+		const struct tree_snapshot_t *snapshot, struct tree_node_t *parent);
+LIBGUIDEAPI struct tree_node_t *tree_snapshot_get_next_sibling(
+		const struct tree_snapshot_t *snapshot, struct tree_node_t *node);
+LIBGUIDEAPI struct tree_node_t *tree_snapshot_get_prev_sibling(
+		const struct tree_snapshot_t *snapshot, struct tree_node_t *node);
+LIBGUIDEAPI struct tree_node_t *tree_snapshot_get_parent(
+		const struct tree_snapshot_t *snapshot, struct tree_node_t *node);
+LIBGUIDEAPI void *tree_snapshot_get_data(const struct tree_snapshot_t *snapshot,
+		struct tree_node_t *node);
+/** Visit the nodes of `snapshot' in preorder, like tree_traverse_preorder(). */
+LIBGUIDEAPI int tree_snapshot_traverse_preorder(const struct tree_snapshot_t *snapshot,
+		tree_traverser_fn_t tvr, void *cargo);
+
+/**
+ * The data of `node' is about to be changed in place. If a snapshot sees
+ * the current contents, it gets a copy made by `copy_fn', which is freed by
+ * `free_fn' when no longer needed. Returns nonzero if the tree of `node'
+ * has snapshots, in which case readers may still be looking at the old
+ * contents for a moment: free them with tree_snapshot_defer_free().
+ */
+LIBGUIDEAPI int tree_snapshot_keep_data(struct tree_node_t *node, void *(*copy_fn)(void *),
+		void (*free_fn)(void *));
+/** Call `free_fn(p)' once no snapshot of the tree of `node' can use `p'. */
+LIBGUIDEAPI void tree_snapshot_defer_free(struct tree_node_t *node, void *p,
+		void (*free_fn)(void *));
+
+/**
+ * Batches. Between tree_begin_batch() and tree_end_batch(), nodes added
+ * with tree_batch_add_child() are linked in constant time (appending too,
+ * if after the node last added): the sizes of their ancestors are updated
+ * in one pass for the whole batch, when the tree is next changed in some
+ * other way, or its sizes or ranks are needed. Batches nest.
+ */
+LIBGUIDEAPI void tree_begin_batch(struct tree_t *tree);
+LIBGUIDEAPI void tree_end_batch(struct tree_t *tree);
+/** Like tree_add_child(), as part of the batch of `tree' (if none, just that). */
+LIBGUIDEAPI struct tree_node_t *tree_batch_add_child(struct tree_t *tree,
+		struct tree_node_t *parent, void *data, struct tree_node_t *after);
+
+/**
+ * Node arenas. While a thread uses an arena, the nodes it creates are carved
+ * out of blocks of `block_nodes' nodes instead of being allocated one by
+ * one. They are freed as usual, but the memory of a block only goes with
+ * the last of its nodes. Nodes outlive the arena they came from; an arena
+ * must not be destroyed while a thread uses it.
+ */
+LIBGUIDEAPI struct tree_arena_t *tree_arena_create(uint32 block_nodes);
+LIBGUIDEAPI void tree_arena_destroy(struct tree_arena_t *arena);
+/** Use `arena' (NULL: none) for the calling thread. Returns the previous one. */
+LIBGUIDEAPI struct tree_arena_t *tree_arena_use(struct tree_arena_t *arena);
 
 LIBGUIDEAPI struct tree_t *tree_create();
 LIBGUIDEAPI struct tree_t *tree_create_with_root(void *root_data);
+/**
+ * Build a whole tree from arrays of `n' node ids, parent ids and data, with
+ * the root first and each node after its parent (file order, usually
+ * preorder). The parent id of the root is ignored. All nodes are allocated
+ * in one block. If `fn' is given, it is called for each node as it is
+ * created; a nonzero return stops the build. Returns NULL if a parent id
+ * is not found, or on failure.
+ */
+LIBGUIDEAPI struct tree_t *tree_build_from_parent_array(uint32 n, const uint32 *ids,
+		const uint32 *parent_ids, void **data, tree_traverser_fn_t fn, void *cargo);
+/**
+ * Move all nodes of `tree' into one block, in preorder, so that a preorder
+ * walk touches memory sequentially. Data and children indexes move along.
+ * `fn', if given, is called for each node with its old and new address,
+ * in preorder, once the new tree is linked up; the old node is freed right
+ * after. Invalidates all node pointers. Returns -1 if the tree has
+ * snapshots, or on failure (the tree is then unchanged).
+ */
+LIBGUIDEAPI int tree_compact_layout(struct tree_t *tree, tree_relocate_fn_t fn, void *cargo);
 LIBGUIDEAPI void tree_delete_subtree(struct tree_node_t *node, tree_node_cleanup_fn_t cleanup_fn,
 		void *cargo);
 LIBGUIDEAPI void tree_delete_tree(struct tree_t *tree, tree_node_cleanup_fn_t cleanup_fn,
 		void *cargo);
 
+/**
+ * Make the root of `tree' the first child of `node', and free `tree'. No node
+ * is copied: O(d) for the depth d of `node', to update the subtree sizes.
+ */
 LIBGUIDEAPI void tree_merge_tree(struct tree_node_t *node, struct tree_t* tree);
 
+/** Detach the subtree at `node' (not a root) into a new tree. O(d) likewise. */
 LIBGUIDEAPI struct tree_t *tree_split_subtree(struct tree_node_t *node);
 
 LIBGUIDEAPI struct tree_node_t *tree_move_subtree_after(struct tree_node_t *src_node,
@@ -59,6 +291,10 @@ LIBGUIDEAPI struct tree_node_t *tree_move_subtree_before(struct tree_node_t *src
 LIBGUIDEAPI struct tree_node_t *tree_move_subtree_as_child(struct tree_node_t *src_node,
 		struct tree_node_t *dst_node/*, struct tree_node_t *after*/);
 
+/*
+ * Adds, like deletes and moves, update the subtree sizes of the ancestors:
+ * O(d) for a parent at depth d, outside of a batch (tree_begin_batch()).
+ */
 LIBGUIDEAPI struct tree_node_t *tree_add_root(struct tree_t *tree, void *data);
 LIBGUIDEAPI struct tree_node_t *tree_add_child(struct tree_node_t *parent, void *data, 
 		struct tree_node_t *after);
@@ -68,10 +304,12 @@ LIBGUIDEAPI struct tree_node_t *tree_add_sibling_before(struct tree_node_t *node
 LIBGUIDEAPI int tree_traverse_preorder(struct tree_t *tree, tree_traverser_fn_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_preorder2(struct tree_t *tree, tree_traverser_fn2_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_preorder_wd(struct tree_t *tree, tree_traverser_wd_fn_t tvr);
+LIBGUIDEAPI int tree_traverse_preorder_ex(struct tree_t *tree, tree_traverser_ex_fn_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_postorder(struct tree_t *tree, tree_traverser_fn_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_subtree_preorder(struct tree_node_t *node, tree_traverser_fn_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_subtree_preorder2(struct tree_node_t *node, tree_traverser_fn2_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_subtree_preorder_wd(struct tree_node_t *node, tree_traverser_wd_fn_t tvr, int depth);
+LIBGUIDEAPI int tree_traverse_subtree_preorder_ex(struct tree_node_t *node, tree_traverser_ex_fn_t tvr, void *cargo);
 LIBGUIDEAPI int tree_traverse_subtree_postorder(struct tree_node_t *node, tree_traverser_fn_t tvr, void *cargo);
 
 #ifdef __cplusplus
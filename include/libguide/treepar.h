@@ -0,0 +1,82 @@
+/*
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TREEPAR_H_
+#define _TREEPAR_H_
+
+#include <stddef.h>
+#include <libguide/config.h>
+#include <libguide/tree.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Per-task output buffer, see tree_parallel_write(). */
+struct tree_parallel_out_t;
+
+/* node, cargo, output buffer (NULL if no sink was given) */
+typedef int (*tree_parallel_fn_t)(struct tree_node_t *, void *, struct tree_parallel_out_t *);
+/* buffer, length, sink_cargo */
+typedef void (*tree_parallel_sink_fn_t)(const void *, size_t, void *);
+
+/**
+ * Options for tree_parallel_for_each(). A NULL options pointer, or a zero
+ * member, selects the default.
+ */
+struct tree_parallel_opts_t
+{
+	/** Number of threads, including the calling one. Default: one per CPU. */
+	unsigned n_threads;
+
+	/**
+	 * Minimum number of nodes a task visits before it offers the rest of
+	 * its subtree to other threads. Larger values mean fewer, bigger tasks.
+	 */
+	uint32 grain;
+
+	/**
+	 * If set, whatever the callback writes with tree_parallel_write() is
+	 * passed to the sink after the traversal, in the preorder sequence of
+	 * the nodes that wrote it.
+	 */
+	tree_parallel_sink_fn_t sink;
+	void *sink_cargo;
+};
+
+/**
+ * Call `fn' once for every node of the subtree at `node', from several
+ * threads. The subtree is cut into subtree tasks as the walk proceeds, and
+ * idle threads steal them from busy ones. The tree must not be changed
+ * while this runs, and `fn' must be safe to call concurrently.
+ *
+ * If `fn' returns nonzero, no more nodes are visited and that value is
+ * returned (when several threads stop at once, any one of the values).
+ */
+LIBGUIDEAPI int tree_parallel_for_each(struct tree_node_t *node, tree_parallel_fn_t fn,
+		void *cargo, const struct tree_parallel_opts_t *opts);
+
+/** Append to the output of the current task. Does nothing if `out' is NULL. */
+LIBGUIDEAPI void tree_parallel_write(struct tree_parallel_out_t *out, const void *buf,
+		size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TREEPAR_H_ */
@@ -21,6 +21,14 @@
 
 typedef void *(*tree_copy_data_fn_t)(void *src, void *cargo);
 
+/**
+ * Copy the subtree at `src_node' into a new tree, in O(n). If `node_fn' is
+ * given, it is called with each new node as it is added. `cargo' is passed
+ * to both callbacks.
+ */
+LIBGUIDEAPI struct tree_t *tree_copy_subtree(struct tree_node_t *src_node,
+		tree_copy_data_fn_t copy_fn, tree_traverser_fn_t node_fn, void *cargo);
+
 LIBGUIDEAPI struct tree_node_t *tree_copy_subtree_after(struct tree_node_t *src_node,
 		struct tree_node_t *dst_node, tree_copy_data_fn_t copy_fn, void *cargo);
 LIBGUIDEAPI struct tree_node_t *tree_copy_subtree_before(struct tree_node_t *src_node,
@@ -0,0 +1,115 @@
+/* 
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <libguide/alloc.h>
+#include "stats.h"
+
+static const struct guide_allocator_t *_guide_default_alloc;
+
+/* see guide_use_allocator() */
+static _Thread_local const struct guide_allocator_t *_guide_thread_alloc;
+
+void guide_set_default_allocator(const struct guide_allocator_t *alloc)
+{
+	_guide_default_alloc = alloc;
+}
+
+const struct guide_allocator_t *guide_use_allocator(const struct guide_allocator_t *alloc)
+{
+	const struct guide_allocator_t *prev = _guide_thread_alloc;
+
+	_guide_thread_alloc = alloc;
+	return prev;
+}
+
+const struct guide_allocator_t *guide_current_allocator()
+{
+	return _guide_thread_alloc;
+}
+
+static const struct guide_allocator_t *_guide_alloc_in_use()
+{
+	return _guide_thread_alloc ? _guide_thread_alloc : _guide_default_alloc;
+}
+
+void *guide_malloc(size_t size)
+{
+	const struct guide_allocator_t *a = _guide_alloc_in_use();
+
+	GUIDE_STATS_ADD(_GS_ALLOCS, 1);
+	return a ? a->malloc_fn(size, a->cargo) : malloc(size);
+}
+
+void *guide_calloc(size_t n, size_t size)
+{
+	const struct guide_allocator_t *a = _guide_alloc_in_use();
+	void *p;
+
+	GUIDE_STATS_ADD(_GS_ALLOCS, 1);
+
+	if (!a)
+		return calloc(n, size);
+	if (size && n > (size_t)-1 / size)
+		return NULL;
+	if ((p = a->malloc_fn(n * size, a->cargo)))
+		memset(p, 0, n * size);
+	return p;
+}
+
+void *guide_realloc(void *p, size_t size)
+{
+	const struct guide_allocator_t *a = _guide_alloc_in_use();
+
+	GUIDE_STATS_ADD(_GS_ALLOCS, 1);
+	return a ? a->realloc_fn(p, size, a->cargo) : realloc(p, size);
+}
+
+void guide_free(void *p)
+{
+	const struct guide_allocator_t *a = _guide_alloc_in_use();
+
+	if (!p)
+		return;
+	if (a)
+		a->free_fn(p, a->cargo);
+	else
+		free(p);
+}
+
+char *guide_strdup(const char *s)
+{
+	size_t size = strlen(s) + 1;
+	char *p = (char *)guide_malloc(size);
+
+	if (p)
+		memcpy(p, s, size);
+	return p;
+}
+
+wchar_t *guide_wcsdup(const wchar_t *s)
+{
+	size_t size = (wcslen(s) + 1) * sizeof(wchar_t);
+	wchar_t *p = (wchar_t *)guide_malloc(size);
+
+	if (p)
+		memcpy(p, s, size);
+	return p;
+}
@@ -0,0 +1,474 @@
+/*
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <libguide/alloc.h>
+#include <libguide/ctree.h>
+
+#define _CTREE_INITIAL_SIZE		(64)
+
+/* value of parent[] for slots on the free list */
+#define _CTREE_FREE				((uint32)-2)
+
+struct ctree_t
+{
+	uint32 *parent;
+	uint32 *first_child;
+	uint32 *next;
+	uint32 *prev;
+	void **data;
+
+	uint32 root;
+	uint32 n;			/* slots used so far (live + free) */
+	uint32 alloc;		/* slots allocated */
+	uint32 count;		/* live nodes */
+	uint32 free_list;	/* free slots, chained through next[] */
+
+	/* nonzero if slots [0, n) hold exactly the live nodes, in preorder */
+	int preorder;
+};
+
+static void _ctree_reserve(struct ctree_t *tree, uint32 alloc)
+{
+	if (alloc <= tree->alloc)
+		return;
+
+	tree->parent      = (uint32 *)guide_realloc(tree->parent, alloc * sizeof(uint32));
+	tree->first_child = (uint32 *)guide_realloc(tree->first_child, alloc * sizeof(uint32));
+	tree->next        = (uint32 *)guide_realloc(tree->next, alloc * sizeof(uint32));
+	tree->prev        = (uint32 *)guide_realloc(tree->prev, alloc * sizeof(uint32));
+	tree->data        = (void **)guide_realloc(tree->data, alloc * sizeof(void *));
+	assert(tree->parent && tree->first_child && tree->next && tree->prev && tree->data);
+	tree->alloc = alloc;
+}
+
+/* get a slot for a new node, links are set to CTREE_NONE */
+static uint32 _ctree_alloc_node(struct ctree_t *tree, void *data)
+{
+	uint32 i;
+
+	if (tree->free_list != CTREE_NONE) {
+		i = tree->free_list;
+		tree->free_list = tree->next[i];
+	} else {
+		if (tree->n >= tree->alloc)
+			_ctree_reserve(tree, tree->alloc ? tree->alloc * 2 : _CTREE_INITIAL_SIZE);
+		i = tree->n++;
+	}
+
+	tree->parent[i] = tree->first_child[i] = tree->next[i] = tree->prev[i] = CTREE_NONE;
+	tree->data[i] = data;
+	++(tree->count);
+
+	return i;
+}
+
+static void _ctree_free_node(struct ctree_t *tree, uint32 i)
+{
+	tree->parent[i] = _CTREE_FREE;
+	tree->data[i] = NULL;
+	tree->next[i] = tree->free_list;
+	tree->free_list = i;
+	--(tree->count);
+}
+
+/* is `node' the last node of the tree in preorder? */
+static int _ctree_is_preorder_last(struct ctree_t *tree, uint32 node)
+{
+	while (node != CTREE_NONE) {
+		if (tree->next[node] != CTREE_NONE)
+			return 0;
+		node = tree->parent[node];
+	}
+	return 1;
+}
+
+/* a node was just linked in at slot `i': see if the preorder layout survived */
+static void _ctree_check_preorder(struct ctree_t *tree, uint32 i)
+{
+	if (tree->preorder &&
+		!(i == tree->n - 1 && tree->count == tree->n && _ctree_is_preorder_last(tree, i)))
+		tree->preorder = 0;
+}
+
+struct ctree_t *ctree_create(uint32 capacity)
+{
+	struct ctree_t *t = (struct ctree_t *)guide_malloc(sizeof(struct ctree_t));
+	assert(t);
+	if (!t) return NULL;
+
+	t->parent = t->first_child = t->next = t->prev = NULL;
+	t->data = NULL;
+	t->root = CTREE_NONE;
+	t->n = t->alloc = t->count = 0;
+	t->free_list = CTREE_NONE;
+	t->preorder = 1;
+
+	_ctree_reserve(t, capacity ? capacity : _CTREE_INITIAL_SIZE);
+
+	return t;
+}
+
+/* Copy the tree_t subtree at `src' into `dst', which must be empty. Nodes
+ * are allocated in preorder, and neither a stack nor a lookup table is
+ * needed: the walk only uses parent links. */
+static void _ctree_copy_from_tree(struct ctree_t *dst, struct tree_node_t *src)
+{
+	struct tree_node_t *s = src, *t;
+	uint32 cur, i;
+
+	cur = dst->root = _ctree_alloc_node(dst, tree_get_data(s));
+
+	for (;;) {
+		if ((t = tree_get_first_child(s))) {
+			s = t;
+			i = _ctree_alloc_node(dst, tree_get_data(s));
+			dst->parent[i] = cur;
+			dst->first_child[cur] = i;
+			cur = i;
+			continue;
+		}
+
+		/* no children: climb up till a node with a next sibling is found */
+		while (s != src && !tree_get_next_sibling(s)) {
+			s = tree_get_parent(s);
+			cur = dst->parent[cur];
+		}
+		if (s == src)
+			break;
+
+		s = tree_get_next_sibling(s);
+		i = _ctree_alloc_node(dst, tree_get_data(s));
+		dst->parent[i] = dst->parent[cur];
+		dst->prev[i] = cur;
+		dst->next[cur] = i;
+		cur = i;
+	}
+}
+
+/* Same as above, with another ctree as the source. */
+static void _ctree_copy_from_ctree(struct ctree_t *dst, struct ctree_t *src)
+{
+	uint32 s = src->root, cur, i;
+
+	cur = dst->root = _ctree_alloc_node(dst, src->data[s]);
+
+	for (;;) {
+		if (src->first_child[s] != CTREE_NONE) {
+			s = src->first_child[s];
+			i = _ctree_alloc_node(dst, src->data[s]);
+			dst->parent[i] = cur;
+			dst->first_child[cur] = i;
+			cur = i;
+			continue;
+		}
+
+		while (s != src->root && src->next[s] == CTREE_NONE) {
+			s = src->parent[s];
+			cur = dst->parent[cur];
+		}
+		if (s == src->root)
+			break;
+
+		s = src->next[s];
+		i = _ctree_alloc_node(dst, src->data[s]);
+		dst->parent[i] = dst->parent[cur];
+		dst->prev[i] = cur;
+		dst->next[cur] = i;
+		cur = i;
+	}
+}
+
+struct ctree_t *ctree_create_from_tree(struct tree_t *tree)
+{
+	struct ctree_t *t;
+	assert(tree);
+
+	t = ctree_create(0);
+	if (t && tree_get_root(tree))
+		_ctree_copy_from_tree(t, tree_get_root(tree));
+
+	return t;
+}
+
+static void _ctree_free_arrays(struct ctree_t *tree)
+{
+	guide_free(tree->parent);
+	guide_free(tree->first_child);
+	guide_free(tree->next);
+	guide_free(tree->prev);
+	guide_free(tree->data);
+}
+
+void ctree_delete_tree(struct ctree_t *tree, ctree_node_cleanup_fn_t cleanup_fn, void *cargo)
+{
+	uint32 i;
+	assert(tree);
+
+	/* order does not matter here, since nothing is unlinked */
+	if (cleanup_fn) {
+		for (i=0; i<tree->n; ++i)
+			if (tree->parent[i] != _CTREE_FREE)
+				cleanup_fn(tree, i, cargo);
+	}
+
+	_ctree_free_arrays(tree);
+	guide_free(tree);
+}
+
+uint32 ctree_get_root(struct ctree_t *tree)
+{
+	assert(tree);
+	return tree->root;
+}
+
+uint32 ctree_get_first_child(struct ctree_t *tree, uint32 parent)
+{
+	assert(tree);
+	assert(parent < tree->n);
+	return tree->first_child[parent];
+}
+
+uint32 ctree_get_next_sibling(struct ctree_t *tree, uint32 node)
+{
+	assert(tree);
+	assert(node < tree->n);
+	return tree->next[node];
+}
+
+uint32 ctree_get_prev_sibling(struct ctree_t *tree, uint32 node)
+{
+	assert(tree);
+	assert(node < tree->n);
+	return tree->prev[node];
+}
+
+uint32 ctree_get_parent(struct ctree_t *tree, uint32 node)
+{
+	assert(tree);
+	assert(node < tree->n);
+	return tree->parent[node];
+}
+
+void *ctree_get_data(struct ctree_t *tree, uint32 node)
+{
+	assert(tree);
+	assert(node < tree->n);
+	return tree->data[node];
+}
+
+void ctree_set_data(struct ctree_t *tree, uint32 node, void *data)
+{
+	assert(tree);
+	assert(node < tree->n);
+	tree->data[node] = data;
+}
+
+uint32 ctree_get_count(struct ctree_t *tree)
+{
+	assert(tree);
+	return tree->count;
+}
+
+uint32 ctree_add_root(struct ctree_t *tree, void *data)
+{
+	assert(tree);
+	assert(tree->root == CTREE_NONE);
+
+	if (tree->root != CTREE_NONE) return CTREE_NONE;
+
+	tree->root = _ctree_alloc_node(tree, data);
+	_ctree_check_preorder(tree, tree->root);
+	return tree->root;
+}
+
+/* same semantics as tree_add_child(): `after' == CTREE_NONE inserts the
+ * new node as the first child */
+uint32 ctree_add_child(struct ctree_t *tree, uint32 parent, void *data, uint32 after)
+{
+	uint32 i;
+
+	assert(tree);
+	assert(parent < tree->n);
+	assert(after == CTREE_NONE || tree->parent[after] == parent);
+
+	i = _ctree_alloc_node(tree, data);
+	tree->parent[i] = parent;
+
+	if (after != CTREE_NONE) {
+		tree->prev[i] = after;
+		tree->next[i] = tree->next[after];
+		if (tree->next[after] != CTREE_NONE)
+			tree->prev[tree->next[after]] = i;
+		tree->next[after] = i;
+	} else {
+		tree->next[i] = tree->first_child[parent];
+		if (tree->first_child[parent] != CTREE_NONE)
+			tree->prev[tree->first_child[parent]] = i;
+		tree->first_child[parent] = i;
+	}
+
+	_ctree_check_preorder(tree, i);
+	return i;
+}
+
+uint32 ctree_add_sibling_after(struct ctree_t *tree, uint32 node, void *data)
+{
+	assert(tree);
+	assert(node < tree->n);
+	assert(tree->parent[node] != CTREE_NONE);
+
+	if (tree->parent[node] == CTREE_NONE) return CTREE_NONE; /* don't add roots */
+
+	return ctree_add_child(tree, tree->parent[node], data, node);
+}
+
+uint32 ctree_add_sibling_before(struct ctree_t *tree, uint32 node, void *data)
+{
+	assert(tree);
+	assert(node < tree->n);
+	assert(tree->parent[node] != CTREE_NONE);
+
+	if (tree->parent[node] == CTREE_NONE) return CTREE_NONE; /* don't add roots */
+
+	return ctree_add_child(tree, tree->parent[node], data, tree->prev[node]);
+}
+
+void ctree_delete_subtree(struct ctree_t *tree, uint32 node, ctree_node_cleanup_fn_t cleanup_fn,
+	void *cargo)
+{
+	uint32 parent, prev, next, curr;
+
+	assert(tree);
+	assert(node < tree->n);
+
+	/* remember links */
+	parent = tree->parent[node];
+	prev = tree->prev[node];
+	next = tree->next[node];
+
+	/* free self and children, in postorder: the successor of each node is
+	 * found before the node is freed */
+	curr = node;
+	while (tree->first_child[curr] != CTREE_NONE)
+		curr = tree->first_child[curr];
+	for (;;) {
+		uint32 succ = CTREE_NONE;
+		if (curr != node) {
+			if (tree->next[curr] != CTREE_NONE) {
+				succ = tree->next[curr];
+				while (tree->first_child[succ] != CTREE_NONE)
+					succ = tree->first_child[succ];
+			} else {
+				succ = tree->parent[curr];
+			}
+		}
+
+		if (cleanup_fn)
+			cleanup_fn(tree, curr, cargo);
+		_ctree_free_node(tree, curr);
+
+		if (succ == CTREE_NONE)
+			break;
+		curr = succ;
+	}
+
+	/* fixup links */
+	if (parent == CTREE_NONE)
+		tree->root = CTREE_NONE;
+	else if (tree->first_child[parent] == node)
+		tree->first_child[parent] = next;
+	if (prev != CTREE_NONE) tree->next[prev] = next;
+	if (next != CTREE_NONE) tree->prev[next] = prev;
+
+	tree->preorder = 0;
+}
+
+void ctree_compact(struct ctree_t *tree)
+{
+	struct ctree_t tmp;
+
+	assert(tree);
+
+	tmp.parent = tmp.first_child = tmp.next = tmp.prev = NULL;
+	tmp.data = NULL;
+	tmp.root = CTREE_NONE;
+	tmp.n = tmp.alloc = tmp.count = 0;
+	tmp.free_list = CTREE_NONE;
+	tmp.preorder = 1;
+
+	if (tree->count) {
+		_ctree_reserve(&tmp, tree->count);
+		_ctree_copy_from_ctree(&tmp, tree);
+	}
+
+	_ctree_free_arrays(tree);
+	*tree = tmp;
+}
+
+int ctree_traverse_preorder(struct ctree_t *tree, ctree_traverser_fn_t tvr, void *cargo)
+{
+	assert(tree);
+	assert(tvr);
+
+	/* fast path: the slots are the preorder sequence */
+	if (tree->preorder) {
+		uint32 i, n = tree->n;
+		int ret;
+		for (i=0; i<n; ++i) {
+			ret = tvr(tree, i, cargo);
+			if (ret) return ret;
+		}
+		return 0;
+	}
+
+	if (tree->root != CTREE_NONE)
+		return ctree_traverse_subtree_preorder(tree, tree->root, tvr, cargo);
+	return 0;
+}
+
+int ctree_traverse_subtree_preorder(struct ctree_t *tree, uint32 node, ctree_traverser_fn_t tvr,
+	void *cargo)
+{
+	int ret;
+	uint32 curr = node;
+
+	assert(tree);
+	assert(node < tree->n);
+	assert(tvr);
+
+	for (;;) {
+		/* process self, then visit all children */
+		ret = tvr(tree, curr, cargo);
+		if (ret) return ret;
+
+		if (tree->first_child[curr] != CTREE_NONE) {
+			curr = tree->first_child[curr];
+			continue;
+		}
+
+		while (curr != node && tree->next[curr] == CTREE_NONE)
+			curr = tree->parent[curr];
+		if (curr == node)
+			break;
+		curr = tree->next[curr];
+	}
+
+	return 0;
+}
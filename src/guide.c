@@ -27,15 +27,438 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include <libguide/alloc.h>
 #include <libguide/tree.h>
+#include <libguide/treeutil.h>
 #include <libguide/lut.h>
 #include <libguide/guide.h>
-
-#define guide_get_next_uid(gde)			(++((gde)->_counter))
+#include "stats.h"
+
+/* uids are given out atomically: in concurrent mode, node data may be
+   created on any thread, without the lock. guide_t::_counter is a plain
+   uint32, so that guide.h stays usable from C++, and is only read and
+   changed with the __atomic builtins while the guide may be shared */
+#define guide_get_next_uid(gde)			\
+	__atomic_add_fetch(&(gde)->_counter, 1, __ATOMIC_RELAXED)
 #define guide_set_next_uid(gde, uid)	(gde)->_counter = ((uid)-1)
 
 static unsigned char *convert_to_utf8(const wchar_t *s);
+static struct tree_node_t *_guide_get_linked_node(struct guide_nodedata_t *data);
+static void _guide_title_index_link(struct guide_t *guide, struct tree_node_t *node);
+static void _guide_title_index_unlink(struct guide_t *guide, struct tree_node_t *node);
+static struct tree_node_t *_guide_snapshot_keep(struct guide_nodedata_t *data);
+static void _guide_snapshot_free_string(struct tree_node_t *node, void *p);
+
+/* deltas of the undo journal */
+#define _GUIDE_OP_LINK		(0)	/* a node was linked */
+#define _GUIDE_OP_UNLINK	(1)	/* a node was unlinked (and maybe taken out) */
+#define _GUIDE_OP_MOVE		(2)	/* a node was moved */
+#define _GUIDE_OP_TITLE		(3)	/* a title was replaced */
+#define _GUIDE_OP_TEXT		(4)	/* a text was replaced */
+
+static int _guide_journal_keep(struct guide_nodedata_t *data, int type, void *old);
+static void _guide_journal_note(struct guide_t *guide, struct tree_node_t *node, int change);
+static int _guide_journal_recording(struct guide_t *guide);
+static void _guide_journal_detach(struct guide_t *guide, struct tree_node_t *node);
+static void _guide_journal_clear(struct guide_t *guide);
+static void _guide_journal_free(struct guide_t *guide);
+
+static void _guide_batch_register(struct guide_t *guide);
+static void _guide_batch_add(struct guide_t *guide, struct tree_node_t *node);
+static void _guide_batch_free(struct guide_t *guide);
+
+static struct _guide_blob_store_t *_guide_blob_store_for(struct guide_t *guide, size_t len);
+static struct _guide_blob_t *_guide_blob_write(struct _guide_blob_store_t *store,
+	const char *text, size_t len);
+static struct _guide_blob_t *_guide_blob_share(struct _guide_blob_t *blob);
+static char *_guide_blob_load(struct _guide_blob_t *blob);
+static int _guide_blob_copy_to(struct _guide_blob_t *blob, FILE *fp);
+static void _guide_blob_free(struct _guide_blob_t *blob);
+static struct _guide_blob_store_t *_guide_blob_store_hold(struct _guide_blob_store_t *store);
+static void _guide_blob_store_put(struct _guide_blob_store_t *store);
+static void _guide_nodedata_spill(struct guide_nodedata_t *data, struct tree_node_t *snode);
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* The functions of a guide allocate through its allocator, whichever
+ * thread calls them (guide_set_allocator()): they make it the one of the
+ * thread on entry, and put the previous one back on return. Node data of
+ * no guide uses the allocator of the thread. */
+static const struct guide_allocator_t *_guide_alloc_enter(struct guide_t *guide)
+{
+	return guide ? guide_use_allocator(guide->_alloc) : guide_current_allocator();
+}
+
+static void _guide_alloc_leave(const struct guide_allocator_t *prev)
+{
+	guide_use_allocator(prev);
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Concurrent mode (guide_set_concurrent()). Functions that change the guide
+ * take the write lock, lookups take the read lock. The lock prefers
+ * writers, so that a steady stream of lookups can't hold off changes; as
+ * a waiting writer also blocks new read locks, a thread that already has
+ * one only counts the nesting, and so does the thread holding the write
+ * lock, whichever way it locks again. Title indexes are built by lookups,
+ * so readers build them under a lock of their own. */
+
+struct _guide_sync_t
+{
+	pthread_rwlock_t lock;
+	pthread_rwlock_t index_lock;	/* the title indexes, among readers */
+	_Atomic(pthread_t) writer;
+	atomic_uint depth;				/* nesting of the write lock held by `writer' */
+};
+
+/* the guide the calling thread holds a read lock on (one is tracked at a
+ * time), and how many times over */
+static _Thread_local struct guide_t *_guide_reading;
+static _Thread_local unsigned _guide_read_depth;
+
+/* does the calling thread hold the write lock? */
+static int _guide_is_writer(struct _guide_sync_t *sync)
+{
+	return atomic_load_explicit(&sync->depth, memory_order_relaxed) != 0 &&
+		pthread_equal(atomic_load_explicit(&sync->writer, memory_order_relaxed), pthread_self());
+}
+
+int guide_set_concurrent(struct guide_t *guide, int concurrent)
+{
+	struct _guide_sync_t *sync;
+	pthread_rwlockattr_t attr;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	if (concurrent && !guide->_sync) {
+		sync = (struct _guide_sync_t *)guide_malloc(sizeof(struct _guide_sync_t));
+		assert(sync);
+		if (!sync) {
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+		if (guide->tree && tree_set_shared(guide->tree, 1) < 0) {
+			guide_free(sync);
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&sync->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+		pthread_rwlock_init(&sync->index_lock, NULL);
+		atomic_init(&sync->depth, 0);
+		guide->_sync = sync;
+	} else if (!concurrent && guide->_sync) {
+		sync = guide->_sync;
+		pthread_rwlock_destroy(&sync->lock);
+		pthread_rwlock_destroy(&sync->index_lock);
+		guide_free(sync);
+		guide->_sync = NULL;
+		if (guide->tree)
+			tree_set_shared(guide->tree, 0);
+	}
+	_guide_alloc_leave(prev);
+	return 0;
+}
+
+void guide_lock_read(struct guide_t *guide)
+{
+	struct _guide_sync_t *sync = guide->_sync;
+
+	if (!sync)
+		return;
+	if (_guide_is_writer(sync)) {
+		atomic_fetch_add_explicit(&sync->depth, 1, memory_order_relaxed);
+	} else if (_guide_reading == guide) {
+		++_guide_read_depth;
+	} else {
+		pthread_rwlock_rdlock(&sync->lock);
+		if (!_guide_reading) {
+			_guide_reading = guide;
+			_guide_read_depth = 1;
+		}
+	}
+}
+
+void guide_lock_write(struct guide_t *guide)
+{
+	struct _guide_sync_t *sync = guide->_sync;
+
+	if (!sync)
+		return;
+	if (_guide_is_writer(sync)) {
+		atomic_fetch_add_explicit(&sync->depth, 1, memory_order_relaxed);
+		return;
+	}
+	pthread_rwlock_wrlock(&sync->lock);
+	atomic_store_explicit(&sync->writer, pthread_self(), memory_order_relaxed);
+	atomic_store_explicit(&sync->depth, 1, memory_order_relaxed);
+}
+
+void guide_unlock(struct guide_t *guide)
+{
+	struct _guide_sync_t *sync = guide->_sync;
+
+	if (!sync)
+		return;
+	if (_guide_is_writer(sync)) {
+		if (atomic_fetch_sub_explicit(&sync->depth, 1, memory_order_relaxed) != 1)
+			return;
+	} else if (_guide_reading == guide) {
+		if (--_guide_read_depth != 0)
+			return;
+		_guide_reading = NULL;
+	}
+	pthread_rwlock_unlock(&sync->lock);
+}
+
+/* Lock the title indexes for a lookup, unless the caller is the writer,
+ * who has them to itself anyway. Returns whether it did. */
+static int _guide_index_lock(struct guide_t *guide, int exclusive)
+{
+	struct _guide_sync_t *sync = guide->_sync;
+
+	if (!sync || _guide_is_writer(sync))
+		return 0;
+	if (exclusive)
+		pthread_rwlock_wrlock(&sync->index_lock);
+	else
+		pthread_rwlock_rdlock(&sync->index_lock);
+	return 1;
+}
+
+static void _guide_index_unlock(struct guide_t *guide, int locked)
+{
+	if (locked)
+		pthread_rwlock_unlock(&guide->_sync->index_lock);
+}
+
+/* make sure uids up to `uid' are not given out again */
+static void _guide_reserve_uids(struct guide_t *guide, uint32 uid)
+{
+	uint32 counter = __atomic_load_n(&guide->_counter, __ATOMIC_RELAXED);
+
+	while (counter < uid && !__atomic_compare_exchange_n(&guide->_counter, &counter, uid,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* guide_nodedata_t::_flags */
+#define _GUIDE_DATA_IN_SLAB			(1)	/* the node data is in a slab */
+#define _GUIDE_DATA_INLINE_TITLE	(2)	/* its title follows it, not malloc'd */
+#define _GUIDE_DATA_INLINE_TEXT		(4)	/* so does its text */
+/* the rest is the size of the memory holding the node data: its
+   allocation, or its piece of a slab (see guide_memory_usage()), which
+   must fit in the 24 bits left */
+#define _GUIDE_DATA_SIZE_SHIFT		(8)
+#define _GUIDE_DATA_SIZE(size)		\
+	(assert((size_t)(size) < (1u << 24)), (uint32)(size) << _GUIDE_DATA_SIZE_SHIFT)
+
+/* titles shorter than this (in characters) are kept inline */
+#define _GUIDE_INLINE_TITLE			(24)
+
+/* Memory of a builder (guide_builder_create()), out of which node data is
+ * carved along with its strings. Each piece is preceded by a pointer to
+ * its slab, and the slab is freed with the last of its node data, and once
+ * the builder is done with it. */
+struct _guide_slab_t
+{
+	atomic_uint refs;
+	_Alignas(8) char mem[];	/* pieces are 8-byte aligned within it */
+};
+
+static void _guide_slab_put(struct _guide_slab_t *slab)
+{
+	if (atomic_fetch_sub(&slab->refs, 1) == 1)
+		guide_free(slab);
+}
+
+/* `data' replaced its title or text (`flag') with another: free the old one
+ * `p', unless it's inline, in which case it goes with the node data */
+static void _guide_nodedata_drop_string(struct guide_nodedata_t *data, uint32 flag,
+	struct tree_node_t *snode, void *p)
+{
+	if (data->_flags & flag)
+		data->_flags &= ~flag;
+	else
+		_guide_snapshot_free_string(snode, p);
+}
+
+/* Attributes (guide_nodedata_get_attr()). Most are at their default, and
+ * only the others are stored, in a block of their own: a mask of their
+ * ids, and their values in the order of the ids. */
+struct _guide_attrs_t
+{
+	uint32 mask;
+	uint32 values[];
+};
+
+#define _GUIDE_ATTR_MAX			(NA_TC_STATE)
+#define _GUIDE_ATTR_VALID(attr)	((attr) > 0 && (attr) <= _GUIDE_ATTR_MAX && (attr) != 6)
+
+static uint32 _guide_attr_default(int attr)
+{
+	return attr == NA_COLOR || attr == NA_BGCOLOR ? (uint32)-1 : 0;
+}
+
+/* the block for the attributes `values' (by id), NULL if all are default */
+static struct _guide_attrs_t *_guide_attrs_pack(const uint32 *values)
+{
+	struct _guide_attrs_t *a;
+	uint32 mask = 0, n = 0;
+	int i;
+
+	for (i = 1; i <= _GUIDE_ATTR_MAX; ++i)
+		if (_GUIDE_ATTR_VALID(i) && values[i] != _guide_attr_default(i)) {
+			mask |= 1u << i;
+			++n;
+		}
+	if (!mask)
+		return NULL;
+
+	a = (struct _guide_attrs_t *)guide_malloc(sizeof(struct _guide_attrs_t) + n * sizeof(uint32));
+	assert(a);
+	if (!a)
+		return NULL;
+	a->mask = mask;
+	for (n = 0, i = 1; i <= _GUIDE_ATTR_MAX; ++i)
+		if (mask & (1u << i))
+			a->values[n++] = values[i];
+	return a;
+}
+
+/* the memory taken by the block `a' */
+static size_t _guide_attrs_size(const struct _guide_attrs_t *a)
+{
+	size_t size = 0;
+	uint32 mask;
+
+	if (!a)
+		return 0;
+	for (mask = a->mask; mask; mask &= mask - 1)
+		size += sizeof(uint32);
+	return sizeof(struct _guide_attrs_t) + size;
+}
+
+/* all attributes of `data', by id */
+static void _guide_attrs_unpack(const struct guide_nodedata_t *data, uint32 *values)
+{
+	int i;
+
+	for (i = 1; i <= _GUIDE_ATTR_MAX; ++i)
+		values[i] = _GUIDE_ATTR_VALID(i) ? guide_nodedata_get_attr(data, i) : 0;
+}
+
+static struct _guide_attrs_t *_guide_attrs_dup(const struct _guide_attrs_t *a)
+{
+	struct _guide_attrs_t *copy;
+	size_t size;
+
+	if (!a)
+		return NULL;
+	size = sizeof(struct _guide_attrs_t) + __builtin_popcount(a->mask) * sizeof(uint32);
+	copy = (struct _guide_attrs_t *)guide_malloc(size);
+	assert(copy);
+	if (copy)
+		memcpy(copy, a, size);
+	return copy;
+}
+
+uint32 guide_nodedata_get_attr(const struct guide_nodedata_t *data, int attr)
+{
+	const struct _guide_attrs_t *a;
+	uint32 bit;
+
+	assert(data);
+	assert(_GUIDE_ATTR_VALID(attr));
+
+	bit = 1u << attr;
+	if (!(a = data->_attrs) || !(a->mask & bit))
+		return _guide_attr_default(attr);
+	return a->values[__builtin_popcount(a->mask & (bit - 1))];
+}
+
+void guide_nodedata_set_attr(struct guide_nodedata_t *data, int attr, uint32 value)
+{
+	uint32 values[_GUIDE_ATTR_MAX + 1];
+	struct _guide_attrs_t *old;
+	struct tree_node_t *snode;
+	const struct guide_allocator_t *prev;
+
+	assert(data);
+	assert(_GUIDE_ATTR_VALID(attr));
+	if (!_GUIDE_ATTR_VALID(attr) || guide_nodedata_get_attr(data, attr) == value)
+		return;
+
+	prev = _guide_alloc_enter(data->_guide);
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+
+	/* a new block, so that snapshots can keep reading the old one */
+	snode = _guide_snapshot_keep(data);
+	_guide_attrs_unpack(data, values);
+	values[attr] = value;
+	old = data->_attrs;
+	data->_attrs = _guide_attrs_pack(values);
+	if (old)
+		_guide_snapshot_free_string(snode, old);
+
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
+}
+
+/* Allocate node data with a copy of `title', inline if it's short. Only
+ * the title and flags are set. */
+static struct guide_nodedata_t *_guide_nodedata_alloc(const wchar_t *title)
+{
+	struct guide_nodedata_t *data;
+	size_t size = (wcslen(title) + 1) * sizeof(wchar_t);
+
+	if (size > _GUIDE_INLINE_TITLE * sizeof(wchar_t)) {
+		data = (struct guide_nodedata_t *)guide_malloc(sizeof(struct guide_nodedata_t));
+		assert(data);
+		if (!data) return NULL;
+		data->title = guide_wcsdup(title);
+		data->_flags = _GUIDE_DATA_SIZE(sizeof(struct guide_nodedata_t));
+		return data;
+	}
+
+	data = (struct guide_nodedata_t *)guide_malloc(sizeof(struct guide_nodedata_t) + size);
+	assert(data);
+	if (!data) return NULL;
+	data->title = (wchar_t *)(data + 1);
+	memcpy(data->title, title, size);
+	data->_flags = _GUIDE_DATA_INLINE_TITLE |
+		_GUIDE_DATA_SIZE(sizeof(struct guide_nodedata_t) + size);
+	return data;
+}
+
+/* set up the rest of node data made by _guide_nodedata_alloc() */
+static struct guide_nodedata_t *_guide_nodedata_init(struct guide_nodedata_t *data,
+	struct guide_t *guide, char *text)
+{
+	data->_text  = text ? text : guide_strdup("");
+	data->uid = guide_get_next_uid(guide);
+	data->_guide = guide;
+	data->_blob = NULL;
+	data->_attrs = NULL;
+
+	assert(data->title);
+	assert(data->_text);
+
+	if (guide && guide->_blobs)
+		_guide_nodedata_spill(data, NULL);
+
+	return data;
+}
 
 struct guide_nodedata_t *guide_nodedata_create(struct guide_t *guide)
 {
@@ -45,781 +468,3667 @@ struct guide_nodedata_t *guide_nodedata_create(struct guide_t *guide)
 struct guide_nodedata_t *guide_nodedata_create_with_data(struct guide_t *guide,
 	const wchar_t *title, const char *text)
 {
-	struct guide_nodedata_t *data = 
-		(struct guide_nodedata_t *)malloc(sizeof(struct guide_nodedata_t));
-	assert(data);
-	if (!data) return data;
-
-	data->title = _wcsdup(title ? title : L"");
-	data->text  = strdup(text ? text : "");
-	data->state = 0;
-	data->icon	= 0;
-	data->first_line = 0;
-	data->color = (uint32)-1;
-	data->bgcolor = (uint32)-1;
-	data->uid = guide_get_next_uid(guide);
-	data->tc_state = 0;
+	const struct guide_allocator_t *prev = _guide_alloc_enter(guide);
+	struct guide_nodedata_t *data = _guide_nodedata_alloc(title ? title : L"");
 
-	assert(data->title);
-	assert(data->text);
+	if (data)
+		data = _guide_nodedata_init(data, guide, guide_strdup(text ? text : ""));
+	_guide_alloc_leave(prev);
+	return data;
+}
+
+struct guide_nodedata_t *guide_nodedata_create_take(struct guide_t *guide,
+	wchar_t *title, char *text)
+{
+	const struct guide_allocator_t *prev = _guide_alloc_enter(guide);
+	struct guide_nodedata_t *data;
 
+	/* an empty title costs nothing inline */
+	if (!title || !title[0]) {
+		guide_free(title);
+		title = NULL;
+		data = _guide_nodedata_alloc(L"");
+	} else if ((data = (struct guide_nodedata_t *)guide_malloc(sizeof(struct guide_nodedata_t)))) {
+		data->title = title;
+		data->_flags = _GUIDE_DATA_SIZE(sizeof(struct guide_nodedata_t));
+	}
+	assert(data);
+	if (!data) {
+		guide_free(title);
+		guide_free(text);
+	} else {
+		data = _guide_nodedata_init(data, guide, text);
+	}
+	_guide_alloc_leave(prev);
 	return data;
 }
 
+const wchar_t *guide_nodedata_get_title(struct guide_nodedata_t *data)
+{
+	assert(data);
+	return data->title;
+}
+
 /* "copy ctor" for a guide_nodedata_t */
 struct guide_nodedata_t *guide_nodedata_clone(struct guide_nodedata_t *src, struct guide_t *guide)
 {
 	struct guide_nodedata_t *old_data = (struct guide_nodedata_t *)src;
 	struct guide_nodedata_t *data;
+	const struct guide_allocator_t *prev;
 
 	/* assert valid input */
 	assert(old_data);
 
-	/* allocate a new node data */
-	data =  (struct guide_nodedata_t *)malloc(sizeof(struct guide_nodedata_t));
-	assert(data);
-	if (!data) return data;
-
-	data->title = _wcsdup(old_data->title);
-	data->text  = strdup(old_data->text);
-	data->color = old_data->color;
-	data->bgcolor = old_data->bgcolor;
-	data->first_line = old_data->first_line;
-	data->icon = old_data->icon;
-	data->state = old_data->state;
+	/* allocate a new node data, with the title */
+	prev = _guide_alloc_enter(guide);
+	data = _guide_nodedata_alloc(old_data->title);
+	if (!data) {
+		_guide_alloc_leave(prev);
+		return data;
+	}
+
+	/* a text in the blob store is shared: it's never changed there */
+	data->_blob = old_data->_blob ? _guide_blob_share(old_data->_blob) : NULL;
+	data->_text  = data->_blob ? NULL : guide_strdup(old_data->_text);
+	data->_attrs = _guide_attrs_dup(old_data->_attrs);
 	data->uid = guide_get_next_uid(guide);
-	data->tc_state = old_data->tc_state;
+	data->_guide = guide;
+	_guide_alloc_leave(prev);
 
 	assert(data->title);
-	assert(data->text);
+	assert(data->_text || data->_blob);
 
 	return data;
 }
 
+/* Put the new title `title' into `data'. The old one goes to the undo
+ * journal, or is freed. The caller has the guide locked. */
+static void _guide_nodedata_put_title(struct guide_nodedata_t *data, wchar_t *title)
+{
+	struct tree_node_t *node, *snode;
+	wchar_t *old;
+
+	/* the node may be in the title index of its parent */
+	node = _guide_get_linked_node(data);
+	if (node)
+		_guide_title_index_unlink(data->_guide, node);
+
+	snode = _guide_snapshot_keep(data);
+	old = data->title;
+	data->title = title;
+	if (!_guide_journal_keep(data, _GUIDE_OP_TITLE, old))
+		_guide_nodedata_drop_string(data, _GUIDE_DATA_INLINE_TITLE, snode, old);
+
+	if (node)
+		_guide_title_index_link(data->_guide, node);
+}
+
+/* likewise for the text */
+static void _guide_nodedata_put_text(struct guide_nodedata_t *data, char *text)
+{
+	struct tree_node_t *snode;
+	char *old;
+
+	snode = _guide_snapshot_keep(data);
+	old = data->_text;
+	if (data->_blob) {
+		/* the journal needs the old text in memory, nothing else does */
+		old = data->_guide && _guide_journal_recording(data->_guide) ?
+			_guide_blob_load(data->_blob) : NULL;
+		_guide_blob_free(data->_blob);
+		data->_blob = NULL;
+	}
+	data->_text = text;
+	if (old && !_guide_journal_keep(data, _GUIDE_OP_TEXT, old))
+		_guide_nodedata_drop_string(data, _GUIDE_DATA_INLINE_TEXT, snode, old);
+
+	if (data->_guide && data->_guide->_blobs)
+		_guide_nodedata_spill(data, NULL);
+}
+
 void guide_nodedata_set_title(struct guide_nodedata_t *data, const wchar_t *title)
 {
+	wchar_t *p;
+	const struct guide_allocator_t *prev;
+
 	assert(data);
 	assert(data->title);
 
-	free(data->title);
-	data->title = _wcsdup(title ? title : L"");
+	prev = _guide_alloc_enter(data->_guide);
+	p = guide_wcsdup(title ? title : L"");
+	assert(p);
+	if (!p) {
+		_guide_alloc_leave(prev);
+		return;
+	}
+
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+	_guide_nodedata_put_title(data, p);
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
+}
+
+void guide_nodedata_set_title_take(struct guide_nodedata_t *data, wchar_t *title)
+{
+	const struct guide_allocator_t *prev;
 
+	assert(data);
 	assert(data->title);
+
+	prev = _guide_alloc_enter(data->_guide);
+	if (!title) {
+		title = guide_wcsdup(L"");
+		assert(title);
+		if (!title) {
+			_guide_alloc_leave(prev);
+			return;
+		}
+	}
+
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+	_guide_nodedata_put_title(data, title);
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
 }
 
 void guide_nodedata_set_text(struct guide_nodedata_t *data, const char *text)
 {
 	char *p;
+	const struct guide_allocator_t *prev;
 
 	assert(data);
-	assert(data->text);
+	assert(data->_text || data->_blob);
 
-	p = strdup(text ? text : "");
+	prev = _guide_alloc_enter(data->_guide);
+	p = guide_strdup(text ? text : "");
 	assert(p);
-	if (!p) return;
+	if (!p) {
+		_guide_alloc_leave(prev);
+		return;
+	}
 
-	free(data->text);
-	data->text = p;
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+	_guide_nodedata_put_text(data, p);
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
 }
 
 void guide_nodedata_set_textn(struct guide_nodedata_t *data, const char *text, size_t n)
 {
 	char *p;
+	const struct guide_allocator_t *prev;
 
 	assert(data);
-	assert(data->text);
+	assert(data->_text || data->_blob);
 	assert(text);
 	assert(n > 0);
 
-	p = (char *)malloc(n+1);
+	prev = _guide_alloc_enter(data->_guide);
+	p = (char *)guide_malloc(n+1);
 	assert(p);
-	if (!p) return;
+	if (!p) {
+		_guide_alloc_leave(prev);
+		return;
+	}
 	memcpy(p, text, n);
 	p[n] = 0;
 
-	free(data->text);
-	data->text = p;
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+	_guide_nodedata_put_text(data, p);
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
 }
 
-void guide_nodedata_destroy(struct guide_nodedata_t *data)
+void guide_nodedata_set_text_take(struct guide_nodedata_t *data, char *text)
+{
+	const struct guide_allocator_t *prev;
+
+	assert(data);
+	assert(data->_text || data->_blob);
+
+	prev = _guide_alloc_enter(data->_guide);
+	if (!text) {
+		text = guide_strdup("");
+		assert(text);
+		if (!text) {
+			_guide_alloc_leave(prev);
+			return;
+		}
+	}
+
+	if (data->_guide)
+		guide_lock_write(data->_guide);
+	_guide_nodedata_put_text(data, text);
+	if (data->_guide)
+		guide_unlock(data->_guide);
+	_guide_alloc_leave(prev);
+}
+
+/* free `data' through the allocator in use, without looking at its guide */
+static void _guide_nodedata_free(struct guide_nodedata_t *data)
 {
 	assert(data);
 	assert(data->title);
-	assert(data->text);
+	assert(data->_text || data->_blob);
+
+	if (!(data->_flags & _GUIDE_DATA_INLINE_TITLE))
+		guide_free(data->title);
+	if (!(data->_flags & _GUIDE_DATA_INLINE_TEXT))
+		guide_free(data->_text);
+	if (data->_blob)
+		_guide_blob_free(data->_blob);
+	guide_free(data->_attrs);
+	if (data->_flags & _GUIDE_DATA_IN_SLAB)
+		_guide_slab_put(((struct _guide_slab_t **)data)[-1]);
+	else
+		guide_free(data);
+}
+
+void guide_nodedata_destroy(struct guide_nodedata_t *data)
+{
+	const struct guide_allocator_t *prev;
+
+	assert(data);
 
-	free(data->title);
-	free(data->text);
-	free(data);
+	prev = _guide_alloc_enter(data->_guide);
+	_guide_nodedata_free(data);
+	_guide_alloc_leave(prev);
 }
 
 /*----------------------------------------------------------------------------------------------------*/
 
-struct _guide_mappedfile_t
+/* Title indexes. For parents with many children, guide_find_child_by_title()
+ * builds a hash table from titles to the first child with that title. The
+ * tables are kept in guide_t::_titleidx by the uid of the parent, and kept
+ * up to date by the tree change function of the guide and by
+ * guide_nodedata_set_title(). */
+
+/* parents with fewer children than this are just scanned */
+#define _GUIDE_TITLE_INDEX_MIN		(32)
+
+struct _guide_title_slot_t
 {
-	int h_file;
-	unsigned int size;
-	void *data;
+	uint32 hash;
+	struct tree_node_t *node;	/* NULL if the slot is empty */
 };
 
-static struct _guide_mappedfile_t *_guide_map_file(const wchar_t *filename, unsigned *os_errcode)
+struct _guide_title_index_t
 {
-	struct _guide_mappedfile_t *m = (struct _guide_mappedfile_t *)
-			malloc(sizeof(struct _guide_mappedfile_t));
-	assert(m);
-	*os_errcode = 1;
-	if (!m) return m;
-
-	/* open file */
-	char* utf8_filename =(char *)convert_to_utf8(filename);
-	
-	m->h_file = open(utf8_filename, O_RDONLY);
-	if (m->h_file == -1) {
-		*os_errcode = errno;	
-		free(utf8_filename);	
-		free(m);
-		return NULL;
-	}	
-	free(utf8_filename);
-
-	/* get size of mapping (= file size) */
-	struct stat st;	
-	fstat(m->h_file, &st);
-	m->size = (unsigned)(st.st_size);
+	struct _guide_title_slot_t *slots;
+	uint32 mask;	/* number of slots - 1 */
+	uint32 count;
+	int dups;		/* some title is shared by more than one child */
+};
 
-	/* create mapping */
-	m->data = mmap( NULL, m->size, PROT_READ, MAP_FILE| MAP_PRIVATE, m->h_file, 0 );
-	if(m->data == MAP_FAILED){		
-		*os_errcode = errno;
-		close(m->h_file);
-		free(m);
-		return NULL;
-	}	
+/* FNV-1a over the first `len' characters of `s' */
+static uint32 _guide_title_hash(const wchar_t *s, size_t len)
+{
+	uint32 h = 2166136261u;
+	size_t i;
 
-	*os_errcode = 0;
-	return m;
+	for (i = 0; i < len; ++i) {
+		h ^= (uint32)s[i];
+		h *= 16777619u;
+	}
+	return h;
 }
 
-static void _guide_unmap_file(struct _guide_mappedfile_t *m)
-{	
-	munmap(m->data, m->size);
-	close(m->h_file);
-	free(m);
+static const wchar_t *_guide_title_of(struct tree_node_t *node)
+{
+	return ((struct guide_nodedata_t *)tree_get_data(node))->title;
 }
 
-static unsigned _guide_get_filelength(const wchar_t *filename, unsigned *os_errcode)
+/* compare a title with the first `len' characters of `s' */
+static int _guide_title_equals(const wchar_t *title, const wchar_t *s, size_t len)
 {
-	struct stat st;
-	char* utf8_filename =(char *)convert_to_utf8(filename);
-	if (stat(utf8_filename, &st) == -1) {
-		*os_errcode = errno;
-		free(utf8_filename);
-		return -1;
-	}
-	free(utf8_filename);
-	return (unsigned)(st.st_size);
+	return wcsncmp(title, s, len) == 0 && title[len] == 0;
 }
 
-static void _guide_write_attr_count(uint32 count, FILE *fp)
+/* find the slot of the title `s' (of `len' characters), or the empty slot
+ * where it would go */
+static struct _guide_title_slot_t *_guide_title_index_probe(struct _guide_title_index_t *ti,
+	const wchar_t *s, size_t len, uint32 hash)
 {
-	fwrite(&count, 1, 4 /*bytes*/, fp);
+	struct _guide_title_slot_t *slot;
+	uint32 i;
+
+	for (i = hash & ti->mask; ; i = (i + 1) & ti->mask) {
+		slot = ti->slots + i;
+		if (!slot->node)
+			return slot;
+		if (slot->hash == hash && _guide_title_equals(_guide_title_of(slot->node), s, len))
+			return slot;
+	}
 }
 
-static void _guide_write_uint32_attr(uint32 attr_id, uint32 *attr_p, FILE *fp)
+static int _guide_title_index_resize(struct _guide_title_index_t *ti, uint32 n_slots)
 {
-	static const uint32 attr_val_len = sizeof(uint32);
+	struct _guide_title_slot_t *old = ti->slots;
+	uint32 i, j, old_n = old ? ti->mask + 1 : 0;
 
-	fwrite(&attr_id,	  1, 4 /*bytes*/, fp);
-	fwrite(&attr_val_len, 1, 4 /*bytes*/, fp);
-	fwrite(attr_p,		  1, 4 /*bytes*/, fp);
+	ti->slots = (struct _guide_title_slot_t *)guide_calloc(n_slots, sizeof(struct _guide_title_slot_t));
+	assert(ti->slots);
+	if (!ti->slots) {
+		ti->slots = old;
+		return -1;
+	}
+	ti->mask = n_slots - 1;
+
+	/* titles are unique in the table, so no need to compare them */
+	for (i = 0; i < old_n; ++i) {
+		if (!old[i].node)
+			continue;
+		for (j = old[i].hash & ti->mask; ti->slots[j].node; j = (j + 1) & ti->mask)
+			;
+		ti->slots[j] = old[i];
+	}
+
+	guide_free(old);
+	return 0;
 }
 
-static void _guide_write_node_attrs(struct guide_nodedata_t *data, FILE *fp)
+/* Add `node' unless a child with the same title is there already. Returns
+ * nonzero if it was added. */
+static int _guide_title_index_add(struct _guide_title_index_t *ti, struct tree_node_t *node)
 {
-	// number of attrs = 7
-	_guide_write_attr_count(7, fp);
+	const wchar_t *title = _guide_title_of(node);
+	size_t len = wcslen(title);
+	uint32 hash = _guide_title_hash(title, len);
+	struct _guide_title_slot_t *slot;
+
+	/* keep the load at 1/2 at most */
+	if (2 * (ti->count + 1) > ti->mask + 1)
+		if (_guide_title_index_resize(ti, 2 * (ti->mask + 1)) < 0)
+			return 0;
+
+	slot = _guide_title_index_probe(ti, title, len, hash);
+	if (slot->node) {
+		ti->dups = 1;
+		return 0;
+	}
 
-	// 1: state
-	_guide_write_uint32_attr(1, &(data->state), fp);
-	// 2: icon
-	_guide_write_uint32_attr(2, &(data->icon), fp);
-	// 3: first_line
-	_guide_write_uint32_attr(3, &(data->first_line), fp);
-	// 4: color
-	_guide_write_uint32_attr(4, &(data->color), fp);
-	// 5: bgcolor
-	_guide_write_uint32_attr(5, &(data->bgcolor), fp);
-	// 6: uid
-	_guide_write_uint32_attr(6, &(data->uid), fp);
-	// 7: state
-	_guide_write_uint32_attr(7, &(data->tc_state), fp);
+	slot->hash = hash;
+	slot->node = node;
+	++ti->count;
+	return 1;
 }
 
-static unsigned char *convert_to_utf8(const wchar_t *s)
+/* empty `slot', shifting back the entries of the run after it */
+static void _guide_title_index_clear_slot(struct _guide_title_index_t *ti,
+	struct _guide_title_slot_t *slot)
 {
-	int r;
-	unsigned char *utf8;
+	uint32 i = (uint32)(slot - ti->slots), j = i, home;
 
-	/* check for s == NULL */
-	assert(s);
-	if (!s) return NULL;
+	for (;;) {
+		j = (j + 1) & ti->mask;
+		if (!ti->slots[j].node)
+			break;
+		/* the entry at j can fill the hole at i unless its home slot is
+		 * cyclically within (i, j] */
+		home = ti->slots[j].hash & ti->mask;
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			ti->slots[i] = ti->slots[j];
+			i = j;
+		}
+	}
 
-	/* check for s == L"" */
-	if (s[0] == 0)
-		return (unsigned char *)strdup("");
+	ti->slots[i].node = NULL;
+	--ti->count;
+}
 
-	/* find out the number of bytes required for the utf-8 string:
-	  wcstombs with NULL as the destination will return the 
-	  number of bytes that would have been required. */
-	r = wcstombs(NULL, s, 0);	
-	if (r <= 0) /* some error occured */
-	{
-		return NULL;
-	}	
+static void _guide_title_index_free(struct _guide_title_index_t *ti)
+{
+	guide_free(ti->slots);
+	guide_free(ti);
+}
 
-	/* allocate memory to hold the utf-8 string */
-	utf8 = (unsigned char *)malloc(r + 1);
-	if (!utf8)
-		return NULL; /* out of memory */
+static struct _guide_title_index_t *_guide_title_index_get(struct guide_t *guide,
+	struct tree_node_t *parent)
+{
+	struct _guide_title_index_t *ti = NULL;
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(parent);
 
-	/* actually convert to utf-8 */
-	r= wcstombs((char*)utf8, s, r+1);	
-	if (r == 0) /* some error occured */
-	{
-		free(utf8);
+	if (guide->_titleidx)
+		lut_get(guide->_titleidx, (void *)(uintptr_t)(data->uid), (void **)&ti);
+	return ti;
+}
+
+static struct _guide_title_index_t *_guide_title_index_create(struct guide_t *guide,
+	struct tree_node_t *parent)
+{
+	struct _guide_title_index_t *ti;
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(parent);
+	struct tree_node_t *child;
+
+	if (!guide->_titleidx) {
+		guide->_titleidx = lut_create();
+		assert(guide->_titleidx);
+		if (!guide->_titleidx)
+			return NULL;
+	}
+
+	ti = (struct _guide_title_index_t *)guide_malloc(sizeof(struct _guide_title_index_t));
+	assert(ti);
+	if (!ti)
+		return NULL;
+	ti->slots = NULL;
+	ti->count = 0;
+	ti->dups = 0;
+	if (_guide_title_index_resize(ti, 4 * _GUIDE_TITLE_INDEX_MIN) < 0) {
+		guide_free(ti);
 		return NULL;
 	}
 
-	/* ensure null-terminator */
-	utf8[r] = 0;
+	/* in sibling order, so that the first of equal titles wins */
+	for (child = tree_get_first_child(parent); child; child = tree_get_next_sibling(child))
+		_guide_title_index_add(ti, child);
 
-	/* return the utf8 string */
-	return utf8;
+	lut_set(guide->_titleidx, (void *)(uintptr_t)(data->uid), ti);
+	return ti;
 }
 
-static wchar_t *convert_to_unicode_from_utf8(const char *s, size_t len)
+/* drop the title index of the node with uid `uid', if any */
+static void _guide_title_index_drop(struct guide_t *guide, uint32 uid)
 {
-	/* Note: input string is not null terminated */
-	int n;
-	wchar_t *uni;
-
-	/* allocate enough memory */
-	uni = (wchar_t *)malloc((len+1) * sizeof(wchar_t));
-	if (!uni)
-		return NULL; /* out of memory */
+	struct _guide_title_index_t *ti = NULL;
 
-	/* convert */
-	n = mbsrtowcs(uni, &s, len, NULL);
-	if (n <=0){
-		free(uni);
-		return NULL;
+	if (guide->_titleidx && lut_get(guide->_titleidx, (void *)(uintptr_t)uid, (void **)&ti) == 0) {
+		lut_remove(guide->_titleidx, (void *)(uintptr_t)uid);
+		_guide_title_index_free(ti);
 	}
+}
 
-	/* terminate string */
-	uni[n] = L'\0';
+/* drop all the title indexes of parents in the subtree at `node' */
+static void _guide_title_index_drop_subtree(struct guide_t *guide, struct tree_node_t *node)
+{
+	struct tree_iter_t it;
 
-	/* success */
-	return uni;
+	if (!guide->_titleidx)
+		return;
+
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it))
+		if (tree_get_first_child(it.node))
+			_guide_title_index_drop(guide,
+				((struct guide_nodedata_t *)tree_get_data(it.node))->uid);
 }
 
-static int _guide_write_node_title(struct guide_nodedata_t *data, FILE *fp)
+/* `node' has just been linked under its parent */
+static void _guide_title_index_link(struct guide_t *guide, struct tree_node_t *node)
 {
-	char *utf8 = (char*)convert_to_utf8(data->title);
-	if (utf8 == NULL) { /* utf8 conversion error */
-		utf8 = "<utf8 error>";
-	}
-	uint32 len = (uint32) strlen(utf8);
+	struct tree_node_t *parent = tree_get_parent(node);
+	struct _guide_title_index_t *ti;
 
-	fwrite(&len, 1, sizeof(len), fp);
-	fwrite(utf8, 1, len, fp);
-	return 0;
+	if (!parent || !(ti = _guide_title_index_get(guide, parent)))
+		return;
+
+	/* if the title is taken, `node' may or may not be the first one with
+	 * it; finding out means walking the siblings, so just rebuild later */
+	if (!_guide_title_index_add(ti, node))
+		_guide_title_index_drop(guide, ((struct guide_nodedata_t *)tree_get_data(parent))->uid);
 }
 
-static int _guide_write_node_text(struct guide_nodedata_t *data, FILE *fp)
+/* `node' is about to be unlinked from its parent */
+static void _guide_title_index_unlink(struct guide_t *guide, struct tree_node_t *node)
 {
-	uint32 len = (uint32) strlen(data->text);
-	fwrite(&len, 1, sizeof(len), fp);
-	fwrite(data->text, 1, len, fp);
-	return 0;
+	struct tree_node_t *parent = tree_get_parent(node);
+	struct _guide_title_index_t *ti;
+	struct _guide_title_slot_t *slot;
+	const wchar_t *title;
+	size_t len;
+
+	if (!parent || !(ti = _guide_title_index_get(guide, parent)))
+		return;
+
+	title = _guide_title_of(node);
+	len = wcslen(title);
+	slot = _guide_title_index_probe(ti, title, len, _guide_title_hash(title, len));
+	if (slot->node != node)
+		return;		/* a later child with a title that is taken */
+
+	/* the next child with the same title, if any, should take its place */
+	if (ti->dups)
+		_guide_title_index_drop(guide, ((struct guide_nodedata_t *)tree_get_data(parent))->uid);
+	else
+		_guide_title_index_clear_slot(ti, slot);
 }
 
-static int _guide_storer_fn(struct tree_node_t *node, void *cargo)
+/* the node of `data', if it is linked into its guide */
+static struct tree_node_t *_guide_get_linked_node(struct guide_nodedata_t *data)
 {
-	int ret;
-	struct tree_node_t *parent = tree_get_parent(node);
-	struct guide_nodedata_t *data = 
-		(struct guide_nodedata_t *)tree_get_data(node);
-	FILE *fp = (FILE *)cargo;
+	struct tree_node_t *node;
 
-	assert(node);
-	assert(data);
-	assert(fp);
+	if (!data->_guide || !data->_guide->_titleidx)
+		return NULL;
 
-	// <node_id> <parent_node_id> <node_attrs> <title_len> <title> <text_len> <text>
-	// attrs := <n_attrs> [ <attr_id> <attr_val_len> <attr_val> ]{n_attrs}
+	node = guide_get_node_by_uid(data->_guide, data->uid);
+	if (!node || tree_get_data(node) != data)
+		return NULL;
+	return node;
+}
 
-	// Note (gerwert):
-	// Because pointer values are used as node IDs (why!?), 
-	// reading a file causes issues between different architectures, with diffrent pointer sizes.
-	// For example reading file created on win32 on a arm64 Mac.
-	//
-	// Fix: changed original code to always write 4 byte values (uint32).
-	// @TODO: check if this always yields unique ids on 64 bits systems
+static void _guide_tree_changed(struct tree_node_t *node, int change, void *cargo)
+{
+	struct guide_t *guide = (struct guide_t *)cargo;
 
-	fwrite(&node, 1, sizeof(uint32), fp);
-	// parent_node_id
-	fwrite(&parent, 1, sizeof(uint32), fp);
+	if (change == TREE_CHANGE_LINKED)
+		_guide_title_index_link(guide, node);
+	else
+		_guide_title_index_unlink(guide, node);
 
-	// node_attrs
-	_guide_write_node_attrs(data, fp);
-	// title
-	ret = _guide_write_node_title(data, fp);
-	if (ret < 0) {
+	if (guide->_journal)
+		_guide_journal_note(guide, node, change);
+}
 
+static struct tree_node_t *_guide_find_child(struct guide_t *guide, struct tree_node_t *parent,
+	const wchar_t *s, size_t len)
+{
+	struct _guide_title_index_t *ti;
+	struct tree_node_t *child;
+	uint32 n = 0;
+	int locked;
+
+	locked = _guide_index_lock(guide, 0);
+	ti = _guide_title_index_get(guide, parent);
+	child = ti ? _guide_title_index_probe(ti, s, len, _guide_title_hash(s, len))->node : NULL;
+	_guide_index_unlock(guide, locked);
+	if (ti)
+		return child;
+
+	/* look through the first few children, and index the rest */
+	for (child = tree_get_first_child(parent); child; child = tree_get_next_sibling(child)) {
+		if (_guide_title_equals(_guide_title_of(child), s, len))
+			return child;
+		if (++n == _GUIDE_TITLE_INDEX_MIN)
+			break;
 	}
-	// text
-	_guide_write_node_text(data, fp); /* TODO: check ret val */
+	if (!child)
+		return NULL;
 
-	return 0;
+	/* another reader may have built it meanwhile */
+	locked = _guide_index_lock(guide, 1);
+	if (!(ti = _guide_title_index_get(guide, parent)))
+		ti = _guide_title_index_create(guide, parent);
+	if (ti) {
+		child = _guide_title_index_probe(ti, s, len, _guide_title_hash(s, len))->node;
+	} else {
+		/* no memory for an index, keep scanning */
+		while ((child = tree_get_next_sibling(child)))
+			if (_guide_title_equals(_guide_title_of(child), s, len))
+				break;
+	}
+	_guide_index_unlock(guide, locked);
+
+	return child;
 }
 
-int guide_store(const wchar_t *filename, struct guide_t *guide)
+struct tree_node_t *guide_find_child_by_title(struct guide_t *guide, struct tree_node_t *parent,
+	const wchar_t *title)
 {
-	uint32 i;
-	char* utf8_filename =(char *)convert_to_utf8(filename);
-	FILE *fp = fopen(utf8_filename, "wb");
-	free(utf8_filename);
-	if (!fp) return -1;
-
-	/* write file header */
-	// 'GDE' <file_format_version_number> <file_attrs>
-	fwrite("GDE", 1, 3, fp);			 /* signature */
-	i = 2; fwrite(&i, 1, sizeof(i), fp); /* format version = 2 */
+	struct tree_node_t *node;
+	const struct guide_allocator_t *prev;
 
-	/* number of attributes = 2 */
-	_guide_write_attr_count(2, fp);
+	assert(guide);
+	assert(parent);
+	assert(title);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_read(guide);
+	node = _guide_find_child(guide, parent, title, wcslen(title));
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return node;
+}
 
-	/* attributes: */
-	/* 1: _counter */
-	_guide_write_uint32_attr(1, &(guide->_counter), fp);
-	/* 2: sel_node */
-	i = (uint32)(size_t)guide->sel_node; /* not 64-bit safe */
-	_guide_write_uint32_attr(2, &i, fp);
+struct tree_node_t *guide_find_by_path(struct guide_t *guide, struct tree_node_t *node,
+	const wchar_t *path)
+{
+	const wchar_t *end;
+	const struct guide_allocator_t *prev;
 
-	/* write each node */
-	tree_traverse_preorder(guide->tree, _guide_storer_fn, fp);
+	assert(guide);
+	assert(path);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_read(guide);
+	if (!node)
+		node = tree_get_root(guide->tree);
+
+	while (node && *path) {
+		for (end = path; *end && *end != L'/'; ++end)
+			;
+		if (end != path)
+			node = _guide_find_child(guide, node, path, end - path);
+		path = *end ? end + 1 : end;
+	}
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
 
-	fclose(fp);
-	return 0;
+	return node;
 }
 
-static struct guide_nodedata_t *_guide_get_dummy_data(struct guide_t *guide)
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Snapshots (see tree_snapshot_create()). Titles, texts and attributes are
+ * changed in place, so a snapshot that sees the node data gets a copy of it
+ * first, and the replaced string is freed once no snapshot can be reading
+ * it. Other fields of the node data are not kept. */
+
+static void *_guide_snapshot_copy(void *p)
 {
-	return guide_nodedata_create_with_data(guide, L"dummy", "dummy");
+	struct guide_nodedata_t *src = (struct guide_nodedata_t *)p;
+	struct guide_nodedata_t *data;
+
+	data = (struct guide_nodedata_t *)guide_malloc(sizeof(struct guide_nodedata_t));
+	assert(data);
+	if (!data) return NULL;
+
+	*data = *src;
+	data->_flags = _GUIDE_DATA_SIZE(sizeof(struct guide_nodedata_t));
+	data->title = guide_wcsdup(src->title);
+	data->_blob = src->_blob ? _guide_blob_share(src->_blob) : NULL;
+	data->_text = data->_blob ? NULL : guide_strdup(src->_text);
+	data->_attrs = _guide_attrs_dup(src->_attrs);
+	assert(data->title);
+	assert(data->_text || data->_blob);
+
+	return data;
 }
 
-static struct tree_node_t *_guide_get_last_child(struct tree_node_t *par)
+/* The copies, and the nodes deleted while snapshots saw them, are freed
+ * when the last snapshot that sees them goes, which may be after the guide:
+ * the tree has the allocator of the guide in use then. */
+static void _guide_snapshot_free(void *p)
 {
-	struct tree_node_t *t, *last = tree_get_first_child(par);
-	if (!last)
-		return NULL;
-	while ((t = tree_get_next_sibling(last)))
-		last = t;
-	return last;
+	_guide_nodedata_free((struct guide_nodedata_t *)p);
 }
 
-struct guide_t *guide_create()
+/* `data' is about to get a new title or text: if it's in a guide with
+ * snapshots, have them keep the old one, and return the node */
+static struct tree_node_t *_guide_snapshot_keep(struct guide_nodedata_t *data)
 {
-	/* create a guide struct */
-	struct guide_t *guide = (struct guide_t *)malloc(sizeof(struct guide_t));
-	assert(guide);
-	if (!guide)
+	struct tree_node_t *node;
+
+	if (!data->_guide || !data->_guide->tree || !tree_has_snapshots(data->_guide->tree))
 		return NULL;
 
-	/* init counter to 0 */
-	guide->_counter = 0;
+	node = guide_get_node_by_uid(data->_guide, data->uid);
+	if (!node || tree_get_data(node) != data)
+		return NULL;
+	return tree_snapshot_keep_data(node, _guide_snapshot_copy, _guide_snapshot_free) ?
+		node : NULL;
+}
 
-	/* create the uid->node* lookup table */
-	guide->_uidtbl = lut_create();
-	assert(guide->_uidtbl);
+/* free a string replaced in the data of `node' (NULL if no snapshot may see it) */
+static void _guide_snapshot_free_string(struct tree_node_t *node, void *p)
+{
+	if (node)
+		tree_snapshot_defer_free(node, p, guide_free);
+	else
+		guide_free(p);
+}
 
-	/* NOTE: the counter and uid table has to be created before the tree,
-	   because the root node needs a uid and it's pointer has to be entered
-	   in the table. */
+/* Cleanup function for nodes that snapshots kept after their deletion: the
+ * guide was done with them then, and may be gone. */
+static void _guide_snapshot_deleter(struct tree_node_t *node, void *cargo)
+{
+	(void)cargo;
+	_guide_nodedata_free((struct guide_nodedata_t *)tree_get_data(node));
+}
 
-	/* create tree with dummy data */
-	guide->tree = guide_create_with_root(guide, _guide_get_dummy_data(guide));
+struct tree_snapshot_t *guide_snapshot(struct guide_t *guide)
+{
+	struct tree_snapshot_t *snapshot;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
 	assert(guide->tree);
 	if (!guide->tree)
-	{
-		free(guide);
 		return NULL;
-	}
-
-	/* don't select anything (will be set/changed by app) */
-	guide->sel_node = 0;
 
-	return guide;
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	snapshot = tree_snapshot_create(guide->tree);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return snapshot;
 }
 
-static char *_guide_read_header(struct guide_t *guide, char *begin)
+void guide_snapshot_release(struct tree_snapshot_t *snapshot)
 {
-	uint32 fmt;
-	uint32 i, attr_count;
-	assert(begin);
+	tree_snapshot_release(snapshot);
+}
 
-	/* first 3 bytes == 'GDE' */
-	if (memcmp(begin, "GDE", 3) != 0)
-		return NULL;
-	begin += 3;
+/*----------------------------------------------------------------------------------------------------*/
 
-	/* next 4 bytes is version number */
-	fmt = *(uint32 *)begin;
-	if (fmt != 2)
-		return NULL;
-	begin += 4;
-	
-	/* next 4 bytes is attr_count */
-	attr_count = *(uint32 *)begin;
-	begin += 4;
+/* Blob store (guide_set_blob_store()). Large texts are appended to a file
+ * and the node data keeps a blob, the offset and length of its text there.
+ * What's in the file is never changed: a changed text is appended anew, and
+ * copies of the node data (clones, snapshots) share the offset. Blobs read
+ * back are cached, in a list most recently used first, and texts are
+ * dropped from its end to keep the cache within the budget.
+ *
+ * Node data may outlive its guide, or move to another (split, merge), so
+ * each blob holds a reference to its store, and the file is closed with
+ * the last one. The blobs and the cache use the allocator of the guide
+ * that made the store, whoever reads them.
+ *
+ * A text handed out by guide_nodedata_acquire_text() may be dropped from
+ * the cache, by another thread or by the caller reading more texts, while
+ * the caller still reads it, so cached texts are counted: the blob holds
+ * one reference while the text is cached, and each caller one until it
+ * releases the text. */
+
+/* a text read back from the file */
+struct _guide_blob_text_t
+{
+	atomic_uint refs;
+	const struct guide_allocator_t *alloc;
+	char text[];
+};
 
-	/* for each attr */
-	for (i=0; i<attr_count; ++i)
-	{
-		uint32 attr_id, attr_val_len;
+struct _guide_blob_store_t
+{
+	atomic_uint refs;				/* the guide, and each blob */
+	pthread_mutex_t lock;			/* for the cache and the end offset */
+	FILE *fp;
+	off_t end;
+	size_t threshold;
+	size_t budget;
+	size_t cached;					/* bytes of texts in the cache */
+	struct _guide_blob_t *mru;		/* the cache, most recently used first */
+	struct _guide_blob_t *lru;
+	const struct guide_allocator_t *alloc;
+};
 
-		/* read attr id */
-		attr_id = *(uint32 *)begin;
-		begin += 4;
-		/* read attr len */
-		attr_val_len = *(uint32 *)begin;
-		begin += 4;
+struct _guide_blob_t
+{
+	struct _guide_blob_store_t *store;
+	off_t offset;
+	size_t len;
+	struct _guide_blob_text_t *cached;	/* if cached */
+	struct _guide_blob_t *newer;
+	struct _guide_blob_t *older;
+};
 
-		/* id=1, value=_counter */
-		if (attr_id == 1)
-			guide->_counter = *(uint32 *)begin;
-		/* id=2, value=sel_node */
-		else if (attr_id == 2) {
-			//uint32 ptr_value = *(uint32 *)begin;
-			//guide->sel_node = (struct tree_node_t *)ptr_value;
-			guide->sel_node = *(uint32 *)begin;
-		}
+static struct _guide_blob_store_t *_guide_blob_store_hold(struct _guide_blob_store_t *store)
+{
+	atomic_fetch_add(&store->refs, 1);
+	return store;
+}
 
-		/* move onto the next attr start */
-		begin += attr_val_len;
-	}
+static void _guide_blob_store_put(struct _guide_blob_store_t *store)
+{
+	const struct guide_allocator_t *prev;
+
+	if (atomic_fetch_sub(&store->refs, 1) != 1)
+		return;
+	assert(!store->mru);
+	fclose(store->fp);
+	pthread_mutex_destroy(&store->lock);
+	prev = guide_use_allocator(store->alloc);
+	guide_free(store);
+	guide_use_allocator(prev);
+}
 
-	/* done */
-	return begin;
+/* the store of `guide', if a text of `len' bytes should go there */
+static struct _guide_blob_store_t *_guide_blob_store_for(struct guide_t *guide, size_t len)
+{
+	struct _guide_blob_store_t *store = guide ? guide->_blobs : NULL;
+	return store && len >= store->threshold ? store : NULL;
 }
 
-static struct guide_nodedata_t *_guide_read_node_v2(char **pp,
-	struct tree_node_t **fake_node_ptr, struct tree_node_t **fake_parent_ptr,
-	struct guide_t *guide, uint32 *maxuid)
+static void _guide_blob_unlink(struct _guide_blob_store_t *store, struct _guide_blob_t *blob)
 {
-	char *p;
-	wchar_t *uni_title;
-	struct guide_nodedata_t *node_data;
-	uint32 n_attrs, i, title_len, text_len;
+	if (blob->newer) blob->newer->older = blob->older;
+	else store->mru = blob->older;
+	if (blob->older) blob->older->newer = blob->newer;
+	else store->lru = blob->newer;
+	blob->newer = blob->older = NULL;
+}
 
-	/* assert valid input */
-	assert(pp);
-	assert(*pp);
-	assert(fake_node_ptr);
-	assert(fake_parent_ptr);
-	assert(maxuid);
+static void _guide_blob_push(struct _guide_blob_store_t *store, struct _guide_blob_t *blob)
+{
+	blob->newer = NULL;
+	blob->older = store->mru;
+	if (store->mru) store->mru->newer = blob;
+	else store->lru = blob;
+	store->mru = blob;
+}
 
-	/* read node ptr and parent ptr */
+/* append `text' to the file of `store' */
+static struct _guide_blob_t *_guide_blob_write(struct _guide_blob_store_t *store,
+	const char *text, size_t len)
+{
+	const struct guide_allocator_t *prev;
+	struct _guide_blob_t *blob;
+	off_t offset;
+
+	prev = guide_use_allocator(store->alloc);
+	blob = (struct _guide_blob_t *)guide_calloc(1, sizeof(struct _guide_blob_t));
+	guide_use_allocator(prev);
+	assert(blob);
+	if (!blob)
+		return NULL;
 
-	p = *pp;
+	pthread_mutex_lock(&store->lock);
+	offset = store->end;
+	if (pwrite(fileno(store->fp), text, len, offset) != (ssize_t)len) {
+		pthread_mutex_unlock(&store->lock);
+		prev = guide_use_allocator(store->alloc);
+		guide_free(blob);
+		guide_use_allocator(prev);
+		return NULL;
+	}
+	store->end += len;
+	GUIDE_STATS_ADD(_GS_BYTES_WRITTEN, len);
+	pthread_mutex_unlock(&store->lock);
+
+	blob->store = _guide_blob_store_hold(store);
+	blob->offset = offset;
+	blob->len = len;
+	return blob;
+}
 
-	// Fix: for reading gde files stored by 32 bits Windows version on a 64 bit machine:
-	// Because of different pointer sizes (4 bytes on win32, 8 bytes on 64bit machines), 
-	// the original code reads to many bytes.
+static struct _guide_blob_t *_guide_blob_share(struct _guide_blob_t *blob)
+{
+	const struct guide_allocator_t *prev;
+	struct _guide_blob_t *copy;
+
+	prev = guide_use_allocator(blob->store->alloc);
+	copy = (struct _guide_blob_t *)guide_calloc(1, sizeof(struct _guide_blob_t));
+	guide_use_allocator(prev);
+	assert(copy);
+	if (!copy)
+		return NULL;
+	copy->store = _guide_blob_store_hold(blob->store);
+	copy->offset = blob->offset;
+	copy->len = blob->len;
+	return copy;
+}
 
-	uint32 p1 = *(uint32 *)p; p+= 4; 
-	uint32 p2 = *(uint32 *)p; p+= 4;
-	
-	// "fake pointer" here means: store a number in a pointer variable; 
-	// altough pointer syntax is used, it does not really point to anyting.		
+/* read the text of `blob' into a new string; the caller has the lock of
+ * the store, or doesn't need it */
+static char *_guide_blob_read(struct _guide_blob_t *blob)
+{
+	char *text = (char *)guide_malloc(blob->len + 1);
+
+	assert(text);
+	if (!text)
+		return NULL;
+	if (pread(fileno(blob->store->fp), text, blob->len, blob->offset) != (ssize_t)blob->len) {
+		guide_free(text);
+		return NULL;
+	}
+	GUIDE_STATS_ADD(_GS_BYTES_READ, blob->len);
+	text[blob->len] = 0;
+	return text;
+}
+
+/* a copy of the text of `blob', for the caller to keep */
+static char *_guide_blob_load(struct _guide_blob_t *blob)
+{
+	struct _guide_blob_store_t *store = blob->store;
+	char *text;
+
+	pthread_mutex_lock(&store->lock);
+	if (blob->cached && (text = (char *)guide_malloc(blob->len + 1)))
+		memcpy(text, blob->cached->text, blob->len + 1);
+	else
+		text = _guide_blob_read(blob);
+	pthread_mutex_unlock(&store->lock);
+	return text;
+}
+
+/* read the text of `blob' for the cache, with the lock of the store and its
+ * allocator in use */
+static struct _guide_blob_text_t *_guide_blob_text_read(struct _guide_blob_t *blob)
+{
+	struct _guide_blob_text_t *t;
+
+	t = (struct _guide_blob_text_t *)guide_malloc(sizeof(struct _guide_blob_text_t) +
+		blob->len + 1);
+	assert(t);
+	if (!t)
+		return NULL;
+	if (pread(fileno(blob->store->fp), t->text, blob->len, blob->offset) != (ssize_t)blob->len) {
+		guide_free(t);
+		return NULL;
+	}
+	GUIDE_STATS_ADD(_GS_BYTES_READ, blob->len);
+	t->text[blob->len] = 0;
+	atomic_init(&t->refs, 1);
+	t->alloc = blob->store->alloc;
+	return t;
+}
+
+static void _guide_blob_text_put(struct _guide_blob_text_t *t)
+{
+	const struct guide_allocator_t *prev;
+
+	if (!t || atomic_fetch_sub(&t->refs, 1) != 1)
+		return;
+	prev = guide_use_allocator(t->alloc);
+	guide_free(t);
+	guide_use_allocator(prev);
+}
+
+/* the text of `blob', from the cache, with a reference for the caller;
+ * NULL if it can't be read */
+static struct _guide_blob_text_t *_guide_blob_get(struct _guide_blob_t *blob)
+{
+	struct _guide_blob_store_t *store = blob->store;
+	const struct guide_allocator_t *prev;
+	struct _guide_blob_t *old;
+	struct _guide_blob_text_t *t;
+
+	pthread_mutex_lock(&store->lock);
+	prev = guide_use_allocator(store->alloc);
+	if (blob->cached) {
+		_guide_blob_unlink(store, blob);
+		_guide_blob_push(store, blob);
+	} else if ((blob->cached = _guide_blob_text_read(blob))) {
+		_guide_blob_push(store, blob);
+		store->cached += blob->len;
+
+		/* make room, but keep the one just asked for */
+		while (store->cached > store->budget && (old = store->lru) != blob) {
+			_guide_blob_unlink(store, old);
+			store->cached -= old->len;
+			_guide_blob_text_put(old->cached);
+			old->cached = NULL;
+		}
+	}
+	if ((t = blob->cached))
+		atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+	guide_use_allocator(prev);
+	pthread_mutex_unlock(&store->lock);
+	return t;
+}
+
+const char *guide_nodedata_acquire_text(struct guide_nodedata_t *data, struct guide_text_t *t)
+{
+	struct _guide_blob_text_t *held;
+
+	assert(data);
+	assert(t);
+
+	if (!data->_blob) {
+		t->_held = NULL;
+		return t->text = data->_text;
+	}
+	held = _guide_blob_get(data->_blob);
+	t->_held = held;
+	return t->text = held ? held->text : NULL;
+}
+
+void guide_nodedata_release_text(struct guide_text_t *t)
+{
+	assert(t);
+	_guide_blob_text_put((struct _guide_blob_text_t *)t->_held);
+	t->_held = NULL;
+	t->text = NULL;
+}
+
+/* write the text of `blob' as _guide_write_node_text() does; nothing is
+ * written if it can't be read */
+static int _guide_blob_copy_to(struct _guide_blob_t *blob, FILE *fp)
+{
+	uint32 len = (uint32)blob->len;
+	char *text = _guide_blob_load(blob);
+
+	if (!text)
+		return -1;
+	fwrite(&len, 1, sizeof(len), fp);
+	fwrite(text, 1, len, fp);
+	guide_free(text);
+	return 0;
+}
+
+static void _guide_blob_free(struct _guide_blob_t *blob)
+{
+	struct _guide_blob_store_t *store = blob->store;
+	const struct guide_allocator_t *prev;
+	struct _guide_blob_text_t *t;
+
+	pthread_mutex_lock(&store->lock);
+	if ((t = blob->cached)) {
+		_guide_blob_unlink(store, blob);
+		store->cached -= blob->len;
+		blob->cached = NULL;
+	}
+	pthread_mutex_unlock(&store->lock);
+	_guide_blob_text_put(t);
+	prev = guide_use_allocator(store->alloc);
+	guide_free(blob);
+	guide_use_allocator(prev);
+	_guide_blob_store_put(store);
+}
+
+/* Move the text of `data' to the blob store of its guide, if it's large
+ * enough. `snode' is as for _guide_snapshot_free_string(). */
+static void _guide_nodedata_spill(struct guide_nodedata_t *data, struct tree_node_t *snode)
+{
+	struct _guide_blob_store_t *store;
+	size_t len;
+
+	if (data->_blob)
+		return;
+	len = strlen(data->_text);
+	if (!(store = _guide_blob_store_for(data->_guide, len)))
+		return;
+	if (!(data->_blob = _guide_blob_write(store, data->_text, len)))
+		return;
+	_guide_nodedata_drop_string(data, _GUIDE_DATA_INLINE_TEXT, snode, data->_text);
+	data->_text = NULL;
+}
+
+/* bring the text of `data' back from the blob store; snapshots must have
+ * been given their copy first */
+static void _guide_nodedata_unspill(struct guide_nodedata_t *data)
+{
+	char *text;
+
+	if (!data->_blob || !(text = _guide_blob_load(data->_blob)))
+		return;
+	_guide_blob_free(data->_blob);
+	data->_blob = NULL;
+	data->_text = text;
+}
+
+int guide_set_blob_store(struct guide_t *guide, const char *path, size_t threshold,
+	size_t budget)
+{
+	struct _guide_blob_store_t *store = NULL;
+	struct guide_nodedata_t *data;
+	struct tree_iter_t it;
+	struct tree_node_t *root, *snode;
+	const struct guide_allocator_t *prev;
+	int fd;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	if (threshold) {
+		store = (struct _guide_blob_store_t *)guide_calloc(1, sizeof(struct _guide_blob_store_t));
+		assert(store);
+		if (!store) {
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+		/* never truncate an existing file */
+		if (path) {
+			fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd >= 0 && !(store->fp = fdopen(fd, "w+b")))
+				close(fd);
+		} else {
+			store->fp = tmpfile();
+		}
+		if (!store->fp) {
+			guide_free(store);
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+		atomic_init(&store->refs, 1);
+		pthread_mutex_init(&store->lock, NULL);
+		store->threshold = threshold;
+		store->budget = budget;
+		store->alloc = guide->_alloc;
+	}
+
+	guide_lock_write(guide);
+	if (guide->_blobs)
+		_guide_blob_store_put(guide->_blobs);
+	guide->_blobs = store;
+
+	/* move the texts over to the new store, or back */
+	root = guide->tree ? tree_get_root(guide->tree) : NULL;
+	if (root) {
+		tree_iter_init(&it, root, TREE_ITER_PREORDER);
+		while (tree_iter_next(&it)) {
+			data = (struct guide_nodedata_t *)tree_get_data(it.node);
+			if (data->_blob ? data->_blob->store == store :
+					!_guide_blob_store_for(guide, strlen(data->_text)))
+				continue;
+			snode = _guide_snapshot_keep(data);
+			_guide_nodedata_unspill(data);
+			_guide_nodedata_spill(data, snode);
+		}
+	}
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return 0;
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+struct _guide_mappedfile_t
+{
+	int h_file;
+	unsigned int size;
+	void *data;
+};
+
+static struct _guide_mappedfile_t *_guide_map_file(const wchar_t *filename, unsigned *os_errcode)
+{
+	struct _guide_mappedfile_t *m = (struct _guide_mappedfile_t *)
+			guide_malloc(sizeof(struct _guide_mappedfile_t));
+	assert(m);
+	*os_errcode = 1;
+	if (!m) return m;
+
+	/* open file */
+	char* utf8_filename =(char *)convert_to_utf8(filename);
+	
+	m->h_file = open(utf8_filename, O_RDONLY);
+	if (m->h_file == -1) {
+		*os_errcode = errno;	
+		guide_free(utf8_filename);	
+		guide_free(m);
+		return NULL;
+	}	
+	guide_free(utf8_filename);
+
+	/* get size of mapping (= file size) */
+	struct stat st;	
+	fstat(m->h_file, &st);
+	m->size = (unsigned)(st.st_size);
+
+	/* create mapping */
+	m->data = mmap( NULL, m->size, PROT_READ, MAP_FILE| MAP_PRIVATE, m->h_file, 0 );
+	if(m->data == MAP_FAILED){		
+		*os_errcode = errno;
+		close(m->h_file);
+		guide_free(m);
+		return NULL;
+	}	
+
+	*os_errcode = 0;
+	return m;
+}
+
+static void _guide_unmap_file(struct _guide_mappedfile_t *m)
+{	
+	munmap(m->data, m->size);
+	close(m->h_file);
+	guide_free(m);
+}
+
+static unsigned _guide_get_filelength(const wchar_t *filename, unsigned *os_errcode)
+{
+	struct stat st;
+	char* utf8_filename =(char *)convert_to_utf8(filename);
+	if (stat(utf8_filename, &st) == -1) {
+		*os_errcode = errno;
+		guide_free(utf8_filename);
+		return -1;
+	}
+	guide_free(utf8_filename);
+	return (unsigned)(st.st_size);
+}
+
+static void _guide_write_attr_count(uint32 count, FILE *fp)
+{
+	fwrite(&count, 1, 4 /*bytes*/, fp);
+}
+
+static void _guide_write_uint32_attr(uint32 attr_id, uint32 *attr_p, FILE *fp)
+{
+	static const uint32 attr_val_len = sizeof(uint32);
+
+	fwrite(&attr_id,	  1, 4 /*bytes*/, fp);
+	fwrite(&attr_val_len, 1, 4 /*bytes*/, fp);
+	fwrite(attr_p,		  1, 4 /*bytes*/, fp);
+}
+
+static void _guide_write_node_attrs(struct guide_nodedata_t *data, FILE *fp)
+{
+	uint32 values[_GUIDE_ATTR_MAX + 1];
+
+	/* all of them are written, defaults too */
+	_guide_attrs_unpack(data, values);
+
+	// number of attrs = 7
+	_guide_write_attr_count(7, fp);
+
+	// 1: state
+	_guide_write_uint32_attr(1, &values[NA_STATE], fp);
+	// 2: icon
+	_guide_write_uint32_attr(2, &values[NA_ICON], fp);
+	// 3: first_line
+	_guide_write_uint32_attr(3, &values[NA_FIRST_LINE], fp);
+	// 4: color
+	_guide_write_uint32_attr(4, &values[NA_COLOR], fp);
+	// 5: bgcolor
+	_guide_write_uint32_attr(5, &values[NA_BGCOLOR], fp);
+	// 6: uid
+	_guide_write_uint32_attr(6, &(data->uid), fp);
+	// 7: state
+	_guide_write_uint32_attr(7, &values[NA_TC_STATE], fp);
+}
+
+static unsigned char *convert_to_utf8(const wchar_t *s)
+{
+	int r;
+	unsigned char *utf8;
+
+	/* check for s == NULL */
+	assert(s);
+	if (!s) return NULL;
+
+	/* check for s == L"" */
+	if (s[0] == 0)
+		return (unsigned char *)guide_strdup("");
+
+	/* find out the number of bytes required for the utf-8 string:
+	  wcstombs with NULL as the destination will return the 
+	  number of bytes that would have been required. */
+	r = wcstombs(NULL, s, 0);	
+	if (r <= 0) /* some error occured */
+	{
+		return NULL;
+	}	
+
+	/* allocate memory to hold the utf-8 string */
+	utf8 = (unsigned char *)guide_malloc(r + 1);
+	if (!utf8)
+		return NULL; /* out of memory */
+
+	/* actually convert to utf-8 */
+	r= wcstombs((char*)utf8, s, r+1);	
+	if (r == 0) /* some error occured */
+	{
+		guide_free(utf8);
+		return NULL;
+	}
+
+	/* ensure null-terminator */
+	utf8[r] = 0;
+
+	/* return the utf8 string */
+	return utf8;
+}
+
+/* convert the `len' bytes at `s' into `uni', which has room for `len'+1
+ * characters; returns the length, or <= 0 on error */
+static int convert_to_unicode_into(const char *s, size_t len, wchar_t *uni)
+{
+	/* Note: input string is not null terminated, so the conversion has to
+	   stop at `len' bytes: mbsrtowcs() would only stop at `len' characters,
+	   reading past the end when some take more than one byte */
+	mbstate_t state;
+	size_t r;
+	int n = 0;
+
+	memset(&state, 0, sizeof(state));
+	while (len > 0) {
+		if ((unsigned char)*s < 0x80) {
+			if (!*s)
+				break;
+			uni[n++] = (wchar_t)*s++;
+			--len;
+			continue;
+		}
+		r = mbrtowc(uni + n, s, len, &state);
+		if (r == (size_t)-1 || r == (size_t)-2 || r == 0)
+			return -1;
+		s += r;
+		len -= r;
+		++n;
+	}
+
+	/* terminate string */
+	uni[n] = L'\0';
+	return n;
+}
+
+static wchar_t *convert_to_unicode_from_utf8(const char *s, size_t len)
+{
+	wchar_t *uni;
+
+	/* allocate enough memory */
+	uni = (wchar_t *)guide_malloc((len+1) * sizeof(wchar_t));
+	if (!uni)
+		return NULL; /* out of memory */
+
+	if (convert_to_unicode_into(s, len, uni) <= 0) {
+		guide_free(uni);
+		return NULL;
+	}
+
+	/* success */
+	return uni;
+}
+
+static int _guide_write_node_title(struct guide_nodedata_t *data, FILE *fp)
+{
+	GUIDE_STATS_START(t);
+	char *utf8 = (char*)convert_to_utf8(data->title);
+	GUIDE_STATS_STOP(GP_UTF8, t);
+	const char *out = utf8 ? utf8 : "<utf8 error>"; /* utf8 conversion error */
+	uint32 len = (uint32) strlen(out);
+
+	fwrite(&len, 1, sizeof(len), fp);
+	fwrite(out, 1, len, fp);
+	guide_free(utf8);
+	return 0;
+}
+
+static int _guide_write_node_text(struct guide_nodedata_t *data, FILE *fp)
+{
+	uint32 len;
+
+	/* copied straight over, without going through the cache */
+	if (data->_blob)
+		return _guide_blob_copy_to(data->_blob, fp);
+
+	len = (uint32) strlen(data->_text);
+	fwrite(&len, 1, sizeof(len), fp);
+	fwrite(data->_text, 1, len, fp);
+	return 0;
+}
+
+static int _guide_storer_fn(struct tree_node_t *node, void *cargo)
+{
+	int ret;
+	struct tree_node_t *parent = tree_get_parent(node);
+	struct guide_nodedata_t *data = 
+		(struct guide_nodedata_t *)tree_get_data(node);
+	FILE *fp = (FILE *)cargo;
+
+	assert(node);
+	assert(data);
+	assert(fp);
+
+	// <node_id> <parent_node_id> <node_attrs> <title_len> <title> <text_len> <text>
+	// attrs := <n_attrs> [ <attr_id> <attr_val_len> <attr_val> ]{n_attrs}
+
+	// Note (gerwert):
+	// Because pointer values are used as node IDs (why!?), 
+	// reading a file causes issues between different architectures, with diffrent pointer sizes.
+	// For example reading file created on win32 on a arm64 Mac.
+	//
+	// Fix: changed original code to always write 4 byte values (uint32).
+	// @TODO: check if this always yields unique ids on 64 bits systems
+
+	fwrite(&node, 1, sizeof(uint32), fp);
+	// parent_node_id
+	fwrite(&parent, 1, sizeof(uint32), fp);
+
+	// node_attrs
+	_guide_write_node_attrs(data, fp);
+	// title
+	ret = _guide_write_node_title(data, fp);
+	if (ret < 0) {
+
+	}
+	// text
+	if (_guide_write_node_text(data, fp) < 0)
+		return -1; /* stops the traversal */
+
+	GUIDE_STATS_ADD(_GS_NODES, 1);
+	return 0;
+}
+
+int guide_store(const wchar_t *filename, struct guide_t *guide)
+{
+	uint32 i;
+	int ret;
+	const struct guide_allocator_t *prev = _guide_alloc_enter(guide);
+	char* utf8_filename =(char *)convert_to_utf8(filename);
+	FILE *fp = fopen(utf8_filename, "wb");
+	guide_free(utf8_filename);
+	if (!fp) {
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+	GUIDE_STATS_START(t);
+
+	guide_lock_read(guide);
+
+	/* write file header */
+	// 'GDE' <file_format_version_number> <file_attrs>
+	fwrite("GDE", 1, 3, fp);			 /* signature */
+	i = 2; fwrite(&i, 1, sizeof(i), fp); /* format version = 2 */
+
+	/* number of attributes = 2 */
+	_guide_write_attr_count(2, fp);
+
+	/* attributes: */
+	/* 1: _counter, which builders may be taking uids from */
+	i = __atomic_load_n(&guide->_counter, __ATOMIC_RELAXED);
+	_guide_write_uint32_attr(1, &i, fp);
+	/* 2: sel_node */
+	i = (uint32)(size_t)guide->sel_node; /* not 64-bit safe */
+	_guide_write_uint32_attr(2, &i, fp);
+
+	/* write each node */
+	ret = tree_traverse_preorder(guide->tree, _guide_storer_fn, fp);
+
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	GUIDE_STATS_ADD(_GS_BYTES_WRITTEN, ftell(fp));
+	if (ferror(fp))
+		ret = -1;
+	if (fclose(fp) != 0)
+		ret = -1;
+	GUIDE_STATS_STOP(GP_STORE, t);
+	return ret ? -1 : 0;
+}
+
+static struct guide_nodedata_t *_guide_get_dummy_data(struct guide_t *guide)
+{
+	return guide_nodedata_create_with_data(guide, L"dummy", "dummy");
+}
+
+/* allocate a guide without a tree, for the allocator in use; the guide_t
+ * itself comes from the default one */
+static struct guide_t *_guide_alloc()
+{
+	const struct guide_allocator_t *alloc = guide_use_allocator(NULL);
+	struct guide_t *guide = (struct guide_t *)guide_malloc(sizeof(struct guide_t));
+
+	guide_use_allocator(alloc);
+	assert(guide);
+	if (!guide)
+		return NULL;
+
+	guide->_alloc = alloc;
+	guide->tree = NULL;
+	guide->_counter = 0;
+	guide->_uidtbl = lut_create();
+	assert(guide->_uidtbl);
+	guide->sel_node = NULL;
+	guide->_titleidx = NULL;
+	guide->_sync = NULL;
+	guide->_journal = NULL;
+	guide->_batch = NULL;
+	guide->_blobs = NULL;
+
+	return guide;
+}
+
+/* free the guide_t itself */
+static void _guide_dealloc(struct guide_t *guide)
+{
+	const struct guide_allocator_t *prev = guide_use_allocator(NULL);
+
+	guide_free(guide);
+	guide_use_allocator(prev);
+}
+
+struct guide_t *guide_create()
+{
+	/* create a guide struct, with the counter at 0 and an empty
+	   uid->node* lookup table */
+	struct guide_t *guide = _guide_alloc();
+	if (!guide)
+		return NULL;
+
+	/* NOTE: the counter and uid table has to be created before the tree,
+	   because the root node needs a uid and it's pointer has to be entered
+	   in the table. */
+
+	/* create tree with dummy data */
+	guide->tree = guide_create_with_root(guide, _guide_get_dummy_data(guide));
+	assert(guide->tree);
+	if (!guide->tree)
+	{
+		_guide_dealloc(guide);
+		return NULL;
+	}
+
+	/* don't select anything (will be set/changed by app) */
+	guide->sel_node = 0;
+
+	return guide;
+}
+
+static char *_guide_read_header(struct guide_t *guide, char *begin)
+{
+	uint32 fmt;
+	uint32 i, attr_count;
+	assert(begin);
+
+	/* first 3 bytes == 'GDE' */
+	if (memcmp(begin, "GDE", 3) != 0)
+		return NULL;
+	begin += 3;
+
+	/* next 4 bytes is version number */
+	fmt = *(uint32 *)begin;
+	if (fmt != 2)
+		return NULL;
+	begin += 4;
+	
+	/* next 4 bytes is attr_count */
+	attr_count = *(uint32 *)begin;
+	begin += 4;
+
+	/* for each attr */
+	for (i=0; i<attr_count; ++i)
+	{
+		uint32 attr_id, attr_val_len;
+
+		/* read attr id */
+		attr_id = *(uint32 *)begin;
+		begin += 4;
+		/* read attr len */
+		attr_val_len = *(uint32 *)begin;
+		begin += 4;
+
+		/* id=1, value=_counter */
+		if (attr_id == 1)
+			guide->_counter = *(uint32 *)begin;
+		/* id=2, value=sel_node */
+		else if (attr_id == 2) {
+			//uint32 ptr_value = *(uint32 *)begin;
+			//guide->sel_node = (struct tree_node_t *)ptr_value;
+			guide->sel_node = *(uint32 *)begin;
+		}
+
+		/* move onto the next attr start */
+		begin += attr_val_len;
+	}
+
+	/* done */
+	return begin;
+}
+
+static struct guide_nodedata_t *_guide_read_node_v2(char **pp,
+	struct tree_node_t **fake_node_ptr, struct tree_node_t **fake_parent_ptr,
+	struct guide_t *guide, uint32 *maxuid)
+{
+	char *p, *q, *text;
+	wchar_t *uni_title, short_title[_GUIDE_INLINE_TITLE];
+	struct guide_nodedata_t *node_data;
+	uint32 n_attrs, i, title_len, text_len;
+	uint32 values[_GUIDE_ATTR_MAX + 1];
+
+	/* assert valid input */
+	assert(pp);
+	assert(*pp);
+	assert(fake_node_ptr);
+	assert(fake_parent_ptr);
+	assert(maxuid);
+
+	/* read node ptr and parent ptr */
+
+	p = *pp;
+
+	// Fix: for reading gde files stored by 32 bits Windows version on a 64 bit machine:
+	// Because of different pointer sizes (4 bytes on win32, 8 bytes on 64bit machines), 
+	// the original code reads to many bytes.
+
+	uint32 p1 = *(uint32 *)p; p+= 4; 
+	uint32 p2 = *(uint32 *)p; p+= 4;
+	
+	// "fake pointer" here means: store a number in a pointer variable; 
+	// altough pointer syntax is used, it does not really point to anyting.		
 	*fake_node_ptr = p1;
 	*fake_parent_ptr = p2;
 
-	// Original code, for reference:	
-	/*
-	*fake_node_ptr   =  ((struct tree_node_t **)p)[0]; 
-	*fake_parent_ptr = ((struct tree_node_t **)p)[1];
-	p += 2 * sizeof(struct tree_node_t *);
-	*/
+	// Original code, for reference:	
+	/*
+	*fake_node_ptr   =  ((struct tree_node_t **)p)[0]; 
+	*fake_parent_ptr = ((struct tree_node_t **)p)[1];
+	p += 2 * sizeof(struct tree_node_t *);
+	*/
+
+	/* the title and text come after the attrs: convert them first, and
+	   hand them to the node data */
+	n_attrs = *(uint32 *)p; p += 4;
+	for (q = p, i = 0; i < n_attrs; ++i)
+		q += 8 + ((uint32 *)q)[1];
+
+	/* a short title goes inline, without a temporary copy */
+	title_len = *(uint32 *)q; q += 4;
+	GUIDE_STATS_START(t);
+	if (title_len < _GUIDE_INLINE_TITLE) {
+		if (convert_to_unicode_into((const char *)q, title_len, short_title) <= 0)
+			short_title[0] = L'\0';
+		uni_title = NULL;
+	} else {
+		uni_title = convert_to_unicode_from_utf8((const char *)q, title_len);
+		short_title[0] = L'\0';
+	}
+	GUIDE_STATS_STOP(GP_UTF8, t);
+	q += title_len;
+
+	text_len = *(uint32 *)q; q += 4;
+	text = (char *)guide_malloc(text_len + 1);
+	assert(text);
+	if (text) {
+		memcpy(text, q, text_len);
+		text[text_len] = 0;
+	}
+	q += text_len;
+
+	if (uni_title) {
+		node_data = guide_nodedata_create_take(guide, uni_title, text);
+	} else if ((node_data = _guide_nodedata_alloc(short_title))) {
+		_guide_nodedata_init(node_data, guide, text);
+	} else {
+		guide_free(text);
+	}
+	assert(node_data);
+	if (!node_data)
+		return NULL;
+
+	/* read the attrs, and keep those not at their default */
+	for (i = 1; i <= _GUIDE_ATTR_MAX; ++i)
+		values[i] = _guide_attr_default(i);
+	for (i=0; i<n_attrs; ++i)
+	{
+		uint32 attr_id, attr_val_len;
+		attr_id = *(uint32 *)p; // segfault
+		p += 4;				
+		attr_val_len = *(uint32 *)p; 		
+		p += 4;
+		switch (attr_id)
+		{
+		case 1: case 2: case 3: case 4: case 5: case 7:
+			values[attr_id] = *(uint32 *)p; break;
+		case 6: node_data->uid    	  = *(uint32 *)p; break;
+		default:
+			/* must ignore unknown attrs */
+			break;
+		}
+
+		/* position iterator to start of next attribute */
+		p += attr_val_len;
+	}
+	node_data->_attrs = _guide_attrs_pack(values);
+
+	/* collect the largest uid value */
+	if (node_data->uid > *maxuid)
+		*maxuid = node_data->uid;
+
+	/* bump the iterator past the strings */
+	*pp = q;
+
+	/* return the newly created node */
+	return node_data;
+}
+
+/* grow the node arrays of the loader */
+static int _guide_load_grow(uint32 **ids, uint32 **parent_ids,
+	struct guide_nodedata_t ***datas, uint32 *alloc)
+{
+	uint32 n = *alloc ? 2 * *alloc : 1024;
+	uint32 *i = (uint32 *)guide_realloc(*ids, n * sizeof(uint32));
+	uint32 *pi = i ? (uint32 *)guide_realloc(*parent_ids, n * sizeof(uint32)) : NULL;
+	struct guide_nodedata_t **d = pi ? (struct guide_nodedata_t **)guide_realloc(*datas,
+		n * sizeof(struct guide_nodedata_t *)) : NULL;
+
+	if (i) *ids = i;
+	if (pi) *parent_ids = pi;
+	if (d) *datas = d;
+	if (!d)
+		return -1;
+
+	*alloc = n;
+	return 0;
+}
+
+static struct guide_t *guide_load_v2(struct _guide_mappedfile_t *m, unsigned len, unsigned *os_errcode)
+{
+	char *begin, *end, *p;
+	struct guide_t *guide;
+	struct tree_node_t *node, *parent;
+	uint32 maxuid, sel, i, n = 0, alloc = 0;
+	uint32 *ids = NULL, *parent_ids = NULL;
+	struct guide_nodedata_t **datas = NULL;
+	int ret = 0;
+
+	/* reset os error code */
+	assert(os_errcode);
+	*os_errcode = 0;
+
+	/* create a new guide; _counter and sel_node are filled in by
+	   _guide_read_header */
+	guide = _guide_alloc();
+	if (!guide)
+		return NULL;
+
+	/* first and last bytes of valid data */
+	begin = (char *)(m->data);
+	end   = (char *)(m->data) + len;
+
+	/* read header */
+	GUIDE_STATS_START(t);
+	p = begin = _guide_read_header(guide, begin);
+	GUIDE_STATS_STOP(GP_HEADER, t);
+	assert(begin);
+	if (!begin)
+	{
+		/* file format error */
+		lut_free(guide->_uidtbl);
+		_guide_dealloc(guide);
+		return NULL;
+	}
+
+	/* collect the biggest uid */
+	maxuid = guide->_counter;
+
+	/* read the nodes one by one, the root first, and remember their
+	   (file) ids and parent ids */
+	GUIDE_STATS_START(td);
+	do
+	{
+		if (n == alloc && (ret = _guide_load_grow(&ids, &parent_ids, &datas, &alloc)) < 0)
+			break;
+
+		datas[n] = _guide_read_node_v2(&p, &node, &parent, guide, &maxuid);
+		assert(datas[n]);
+		if (!datas[n]) {
+			ret = -1;
+			break;
+		}
+		ids[n] = (uint32)(uintptr_t)node;
+		parent_ids[n] = (uint32)(uintptr_t)parent;
+		++n;
+	} while (p < end);
+	GUIDE_STATS_STOP(GP_DECODE, td);
+	GUIDE_STATS_ADD(_GS_NODES, n);
+
+	/* build the tree and the uid table in one go */
+	if (ret == 0)
+		ret = guide_build_bulk(guide, n, ids, parent_ids, datas);
+
+	if (ret < 0)
+	{
+		/* out of memory, a bad node, or a node with no parent */
+		for (i = 0; i < n; ++i)
+			guide_nodedata_destroy(datas[i]);
+		guide->sel_node = NULL;
+		guide_destroy(guide);
+		guide = NULL;
+	}
+	/* translate the selected node */
+	else if (guide->sel_node)
+	{
+		sel = (uint32)(uintptr_t)guide->sel_node;
+		guide->sel_node = NULL;
+		for (i = 0; i < n; ++i)
+			if (ids[i] == sel) {
+				guide->sel_node = guide_get_node_by_uid(guide, datas[i]->uid);
+				break;
+			}
+	}
+
+	guide_free(ids);
+	guide_free(parent_ids);
+	guide_free(datas);
+
+	/* set the guide uid to the max uid */
+	if (guide)
+		guide->_counter = maxuid;
+
+	return guide;
+}
+
+/* Loads a .gde file, of any file format. It detects the file format
+ * and then behaves appropriately. 
+ */
+struct guide_t *guide_load(const wchar_t *filename, unsigned *os_errcode, uint32 *format)
+{
+	unsigned len;
+	struct _guide_mappedfile_t *m;
+	struct guide_t *gde;
+
+	/* assert valid input param */
+	assert(filename);
+	assert(*filename);
+	assert(format);
+
+	/* reset os error code */
+	assert(os_errcode);
+	*os_errcode = 0;
+	
+	/* get file length */
+	GUIDE_STATS_START(t);
+	len = _guide_get_filelength(filename, os_errcode);
+	if (len == -1) {
+		return NULL;
+	}
+
+	/* The file has to be at least 20 bytes long. This is the size of
+	 * a format 1 .gde file, with no nodes. This check was added in v1.6. */
+	if (len < 20) /* *os_errcode = 0; */ return NULL;
+
+	/* map the file */
+	m = _guide_map_file(filename, os_errcode);
+	if (!m) return NULL;
+	GUIDE_STATS_STOP(GP_MAP, t);
+	GUIDE_STATS_ADD(_GS_BYTES_READ, len);
+
+	if (memcmp((char *)(m->data), "GDE\x02\0\0\0", 7) == 0)
+	{		
+		*format = 2;
+		gde = guide_load_v2(m, len, os_errcode);	
+	}
+	/* not a .gde file */
+	else
+	{
+		*os_errcode = 0;
+		gde = NULL;
+	}
+
+	/* unmap the file */
+	_guide_unmap_file(m);
+
+	/* return the newly loaded guide */
+	return gde;
+}
+
+/* callback function to cleanup a single node */
+static void _guide_deleter(struct tree_node_t *node, void *cargo)
+{
+	struct guide_nodedata_t *data = 
+		(struct guide_nodedata_t *)tree_get_data(node);
+	struct guide_t *guide = 
+		(struct guide_t *)cargo;
+
+	assert(data);
+	assert(guide);
+
+	/* remove from the map */
+	lut_remove(guide->_uidtbl, (void *)(uintptr_t)(data->uid));
+	_guide_title_index_drop(guide, data->uid);
+
+	guide_nodedata_destroy(data);
+}
+
+/* Delete the tree of `guide'. If it has snapshots, the nodes outlive the
+ * guide, so they are taken out of it now and freed with the last snapshot. */
+static void _guide_delete_tree(struct guide_t *guide)
+{
+	struct tree_node_t *root;
+
+	if (!tree_has_snapshots(guide->tree)) {
+		tree_delete_tree(guide->tree, _guide_deleter, guide);
+		return;
+	}
+
+	if ((root = tree_get_root(guide->tree)))
+		_guide_title_index_drop_subtree(guide, root);
+	tree_delete_tree(guide->tree, _guide_snapshot_deleter, NULL);
+}
+
+void guide_destroy(struct guide_t *guide)
+{
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	if (guide->_batch)
+		_guide_batch_free(guide);
+	if (guide->_journal)
+		_guide_journal_free(guide);
+	if (guide->tree)
+		_guide_delete_tree(guide);
+	guide->tree = NULL;
+
+	assert(guide->_uidtbl);
+	lut_free(guide->_uidtbl);
+	guide->_uidtbl = NULL;
+
+	/* the title indexes went with their nodes */
+	if (guide->_titleidx)
+		lut_free(guide->_titleidx);
+	guide->_titleidx = NULL;
+
+	if (guide->_blobs)
+		_guide_blob_store_put(guide->_blobs);
+	guide->_blobs = NULL;
+
+	guide_set_concurrent(guide, 0);
+	_guide_alloc_leave(prev);
+
+	_guide_dealloc(guide);
+}
+
+int guide_set_allocator(struct guide_t *guide, const struct guide_allocator_t *alloc)
+{
+	const struct guide_allocator_t *prev;
+	struct tree_node_t *root;
+
+	if (!guide) {
+		guide_set_default_allocator(alloc);
+		return 0;
+	}
+
+	/* a new guide holds a root with dummy data and the uid table: make
+	   them again from the new allocator */
+	root = guide->tree ? tree_get_root(guide->tree) : NULL;
+	if (root && tree_get_first_child(root))
+		return -1;
+	if (guide->_journal || guide->_batch || guide->_blobs || guide->_sync ||
+			(guide->tree && tree_has_snapshots(guide->tree)))
+		return -1;
+
+	prev = _guide_alloc_enter(guide);
+	if (guide->tree)
+		tree_delete_tree(guide->tree, _guide_deleter, guide);
+	lut_free(guide->_uidtbl);
+	if (guide->_titleidx)
+		lut_free(guide->_titleidx);
+	guide->_titleidx = NULL;
+
+	guide->_alloc = alloc;
+	guide_use_allocator(alloc);
+	guide->_uidtbl = lut_create();
+	assert(guide->_uidtbl);
+	guide->tree = NULL;
+	guide->sel_node = NULL;
+	if (root) {
+		guide->_counter = 0;
+		guide->tree = guide_create_with_root(guide, _guide_get_dummy_data(guide));
+		assert(guide->tree);
+	}
+	_guide_alloc_leave(prev);
+
+	return guide->_uidtbl && (!root || guide->tree) ? 0 : -1;
+}
+
+/* Background reclaimer for guide_destroy_async(): a ring of guides waiting
+ * to be destroyed, and a thread that destroys them one by one. The thread
+ * is started on first use, and stopped by guide_reclaimer_drain(). */
+#define _GUIDE_RECLAIM_QUEUE_SIZE	(16)
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct guide_t *queue[_GUIDE_RECLAIM_QUEUE_SIZE];
+	unsigned head;
+	unsigned count;
+	int running;	/* the thread was started and not joined yet */
+	int stopping;	/* guide_reclaimer_drain() is waiting for the thread */
+	pthread_t thread;
+} _guide_reclaimer = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static void *_guide_reclaimer_main(void *arg)
+{
+	struct guide_t *guide;
+
+	(void)arg;
+	pthread_mutex_lock(&_guide_reclaimer.lock);
+	for (;;) {
+		while (_guide_reclaimer.count == 0 && !_guide_reclaimer.stopping)
+			pthread_cond_wait(&_guide_reclaimer.not_empty, &_guide_reclaimer.lock);
+		/* when stopping, finish the queue first */
+		if (_guide_reclaimer.count == 0)
+			break;
+
+		guide = _guide_reclaimer.queue[_guide_reclaimer.head];
+		_guide_reclaimer.head = (_guide_reclaimer.head + 1) % _GUIDE_RECLAIM_QUEUE_SIZE;
+		--_guide_reclaimer.count;
+		pthread_cond_signal(&_guide_reclaimer.not_full);
+
+		pthread_mutex_unlock(&_guide_reclaimer.lock);
+		guide_destroy(guide);
+		pthread_mutex_lock(&_guide_reclaimer.lock);
+	}
+	pthread_mutex_unlock(&_guide_reclaimer.lock);
+
+	return NULL;
+}
+
+void guide_destroy_async(struct guide_t *guide)
+{
+	assert(guide);
+
+	pthread_mutex_lock(&_guide_reclaimer.lock);
+
+	/* no new work while draining; same if the thread can't be started */
+	if (_guide_reclaimer.stopping)
+		goto sync;
+	if (!_guide_reclaimer.running) {
+		if (pthread_create(&_guide_reclaimer.thread, NULL, _guide_reclaimer_main, NULL) != 0)
+			goto sync;
+		_guide_reclaimer.running = 1;
+	}
+
+	/* the queue is bounded: wait for room */
+	while (_guide_reclaimer.count == _GUIDE_RECLAIM_QUEUE_SIZE)
+		pthread_cond_wait(&_guide_reclaimer.not_full, &_guide_reclaimer.lock);
+
+	_guide_reclaimer.queue[(_guide_reclaimer.head + _guide_reclaimer.count) %
+		_GUIDE_RECLAIM_QUEUE_SIZE] = guide;
+	++_guide_reclaimer.count;
+	pthread_cond_signal(&_guide_reclaimer.not_empty);
+
+	pthread_mutex_unlock(&_guide_reclaimer.lock);
+	return;
+
+sync:
+	pthread_mutex_unlock(&_guide_reclaimer.lock);
+	guide_destroy(guide);
+}
+
+void guide_reclaimer_drain()
+{
+	pthread_mutex_lock(&_guide_reclaimer.lock);
+	if (!_guide_reclaimer.running || _guide_reclaimer.stopping) {
+		pthread_mutex_unlock(&_guide_reclaimer.lock);
+		return;
+	}
+	_guide_reclaimer.stopping = 1;
+	pthread_cond_signal(&_guide_reclaimer.not_empty);
+	pthread_mutex_unlock(&_guide_reclaimer.lock);
+
+	pthread_join(_guide_reclaimer.thread, NULL);
+
+	pthread_mutex_lock(&_guide_reclaimer.lock);
+	_guide_reclaimer.running = 0;
+	_guide_reclaimer.stopping = 0;
+	pthread_mutex_unlock(&_guide_reclaimer.lock);
+}
+
+void guide_delete_subtree(struct guide_t *guide, struct tree_node_t *node)
+{
+	struct tree_iter_t it;
+	struct guide_nodedata_t *data;
+	const struct guide_allocator_t *prev;
+
+	assert(node);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	_guide_batch_register(guide);
+	if (_guide_journal_recording(guide)) {
+		/* kept in the journal, for undoing */
+		_guide_journal_detach(guide, node);
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return;
+	}
+	if (!tree_has_snapshots(guide->tree)) {
+		tree_delete_subtree(node, _guide_deleter, guide);
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return;
+	}
+
+	/* snapshots keep the nodes for a while, but they leave the guide now */
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it)) {
+		data = (struct guide_nodedata_t *)tree_get_data(it.node);
+		lut_remove(guide->_uidtbl, (void *)(uintptr_t)(data->uid));
+		_guide_title_index_drop(guide, data->uid);
+	}
+	tree_delete_subtree(node, _guide_snapshot_deleter, NULL);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+}
+
+/* the build only fills in a uid table of its own: the guide is not
+   touched until the tree is known to be good */
+struct _guide_bulk_cargo_t
+{
+	struct lut_t *uidtbl;
+	uint32 maxuid;
+};
+
+static int _guide_bulk_register(struct tree_node_t *node, void *cargo)
+{
+	struct _guide_bulk_cargo_t *c = (struct _guide_bulk_cargo_t *)cargo;
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
+
+	assert(data);
+	GUIDE_STATS_START(t);
+	lut_set(c->uidtbl, (void *)(uintptr_t)(data->uid), node);
+	if (data->uid > c->maxuid)
+		c->maxuid = data->uid;
+	GUIDE_STATS_STOP(GP_UIDS, t);
+	return 0;
+}
+
+static void _guide_bulk_unlink(struct tree_node_t *node, void *cargo)
+{
+	/* the node data stays with the caller */
+}
+
+int guide_build_bulk(struct guide_t *guide, uint32 n, const uint32 *ids,
+	const uint32 *parent_ids, struct guide_nodedata_t **data)
+{
+	struct _guide_bulk_cargo_t c;
+	struct tree_t *tree;
+	const struct guide_allocator_t *prev;
+	uint32 i;
+
+	assert(guide);
+	if (n == 0)
+		return -1;
+
+	/* the new uids go into a table of their own, so that the old tree can
+	   still be deleted if all goes well */
+	prev = _guide_alloc_enter(guide);
+	c.maxuid = 0;
+	c.uidtbl = lut_create();
+	assert(c.uidtbl);
+	if (!c.uidtbl) {
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+
+	GUIDE_STATS_START(t);
+	tree = tree_build_from_parent_array(n, ids, parent_ids, (void **)data,
+		_guide_bulk_register, &c);
+	GUIDE_STATS_STOP(GP_LINK, t);
+	if (!tree) {
+		lut_free(c.uidtbl);
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+
+	guide_lock_write(guide);
+	if (guide->_batch) {
+		/* the tree cannot be replaced under a batch */
+		guide_unlock(guide);
+		tree_delete_tree(tree, _guide_bulk_unlink, NULL);
+		lut_free(c.uidtbl);
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+	for (i = 0; i < n; ++i)
+		data[i]->_guide = guide;
+	_guide_reserve_uids(guide, c.maxuid);
+	if (guide->_journal)
+		_guide_journal_clear(guide);
+	if (guide->tree) {
+		_guide_delete_tree(guide);
+		guide->sel_node = NULL;
+	}
+	lut_free(guide->_uidtbl);
+	guide->_uidtbl = c.uidtbl;
+	guide->tree = tree;
+	tree_set_change_fn(tree, _guide_tree_changed, guide);
+	if (guide->_sync)
+		tree_set_shared(tree, 1);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+
+	return 0;
+}
 
-	/* create a blank node data object */
-	node_data = guide_nodedata_create(guide);
-	assert(node_data);
+/* Register the uids of the subtree at `node' in the table of `to', taking
+ * them out of the table of `from' if given. Nodes whose uid is taken in
+ * `to' get a new one. The selection of `from' moves along. */
+static void _guide_register_subtree(struct guide_t *to, struct guide_t *from,
+	struct tree_node_t *node)
+{
+	struct tree_iter_t it;
+	struct guide_nodedata_t *data;
+	void *other;
+
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it)) {
+		data = (struct guide_nodedata_t *)tree_get_data(it.node);
+		assert(data);
+
+		data->_guide = to;
+		if (from) {
+			lut_remove(from->_uidtbl, (void *)(uintptr_t)(data->uid));
+			_guide_title_index_drop(from, data->uid);
+			if (from->sel_node == it.node) {
+				from->sel_node = NULL;
+				to->sel_node = it.node;
+			}
+		}
 
-	/* read the attrs */
-	n_attrs = *(uint32 *)p; p += 4;
-	for (i=0; i<n_attrs; ++i)
-	{
-		uint32 attr_id, attr_val_len;
-		attr_id = *(uint32 *)p; // segfault
-		p += 4;				
-		attr_val_len = *(uint32 *)p; 		
-		p += 4;
-		switch (attr_id)
-		{
-		case 1: node_data->state	  = *(uint32 *)p; break;
-		case 2: node_data->icon       = *(uint32 *)p; break;
-		case 3: node_data->first_line = *(uint32 *)p; break;
-		case 4: node_data->color	  = *(uint32 *)p; break;
-		case 5: node_data->bgcolor	  = *(uint32 *)p; break;
-		case 6: node_data->uid    	  = *(uint32 *)p; break;
-		case 7: node_data->tc_state   = *(uint32 *)p; break;
-		default:
-			/* must ignore unknown attrs */
+		if (lut_get(to->_uidtbl, (void *)(uintptr_t)(data->uid), &other) == 0)
+			data->uid = guide_get_next_uid(to);
+		lut_set(to->_uidtbl, (void *)(uintptr_t)(data->uid), it.node);
+	}
+}
+
+struct guide_t *guide_split_subtree(struct guide_t *guide, struct tree_node_t *node)
+{
+	struct guide_t *new_guide;
+	struct tree_t *tree;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+	assert(node);
+
+	/* the new guide holds memory of the allocator of this one */
+	prev = _guide_alloc_enter(guide);
+	new_guide = _guide_alloc();
+	if (!new_guide) {
+		_guide_alloc_leave(prev);
+		return NULL;
+	}
+
+	guide_lock_write(guide);
+	_guide_batch_register(guide);
+	tree = tree_split_subtree(node);
+	if (!tree) {
+		guide_unlock(guide);
+		lut_free(new_guide->_uidtbl);
+		_guide_alloc_leave(prev);
+		_guide_dealloc(new_guide);
+		return NULL;
+	}
+
+	/* uids stay unique if the new guide continues from the same counter */
+	new_guide->tree = tree;
+	new_guide->_counter = __atomic_load_n(&guide->_counter, __ATOMIC_RELAXED);
+	new_guide->_blobs = guide->_blobs ? _guide_blob_store_hold(guide->_blobs) : NULL;
+	tree_set_change_fn(tree, _guide_tree_changed, new_guide);
+
+	_guide_register_subtree(new_guide, guide, node);
+
+	/* the journal can't bring the subtree back */
+	if (guide->_journal)
+		_guide_journal_clear(guide);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+
+	return new_guide;
+}
+
+void guide_merge_guide(struct guide_t *guide, struct tree_node_t *node, struct guide_t *other)
+{
+	struct tree_node_t *root;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+	assert(node);
+	assert(other);
+	assert(other != guide);
+	assert(other->_alloc == guide->_alloc);
+
+	/* `other' goes away: commit its batches, and their locks with them */
+	while (other->_batch)
+		guide_commit_batch(other);
+
+	prev = _guide_alloc_enter(guide);
+	if (other->_journal)
+		_guide_journal_free(other);
+
+	guide_lock_write(guide);
+	_guide_batch_register(guide);
+
+	/* new uids given out to colliding nodes must not collide with the
+	   ones still to come from `other' */
+	_guide_reserve_uids(guide, other->_counter);
+
+	root = tree_get_root(other->tree);
+
+	/* the title indexes of `other' are kept by its uids */
+	if (other->_titleidx) {
+		if (root)
+			_guide_title_index_drop_subtree(other, root);
+		lut_free(other->_titleidx);
+	}
+
+	tree_merge_tree(node, other->tree);
+	other->tree = NULL;
+	if (root)
+		_guide_register_subtree(guide, NULL, root);
+	guide_unlock(guide);
+
+	lut_free(other->_uidtbl);
+	if (other->_blobs)
+		_guide_blob_store_put(other->_blobs);
+	guide_set_concurrent(other, 0);
+	_guide_alloc_leave(prev);
+	_guide_dealloc(other);
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Builders. The subtrees being built hang off the dataless root of a tree
+ * of their own, the staging tree, whose nodes come from the arena of the
+ * builder. */
+
+/* uids reserved at a time */
+#define _GUIDE_BUILDER_UIDS			(4096)
+/* nodes per block of the arena */
+#define _GUIDE_BUILDER_BLOCK_NODES	(1024)
+/* size of a slab, and of the largest node data carved from one with its
+ * strings; the strings of larger ones are allocated separately */
+#define _GUIDE_SLAB_SIZE			(64 * 1024)
+#define _GUIDE_SLAB_MAX_PIECE		(4 * 1024)
+
+struct guide_builder_t
+{
+	struct guide_t *guide;
+	uint32 next_uid;	/* reserved uids not given out yet: [next_uid, end_uid) */
+	uint32 end_uid;
+	struct tree_t *stage;
+	struct tree_arena_t *arena;
+	struct _guide_slab_t *slab;
+	size_t slab_used;
+};
+
+struct guide_builder_t *guide_builder_create(struct guide_t *guide)
+{
+	struct guide_builder_t *b;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	b = (struct guide_builder_t *)guide_malloc(sizeof(struct guide_builder_t));
+	assert(b);
+	if (!b) {
+		_guide_alloc_leave(prev);
+		return NULL;
+	}
+
+	b->guide = guide;
+	b->next_uid = b->end_uid = 0;
+	b->stage = tree_create_with_root(NULL);
+	b->arena = tree_arena_create(_GUIDE_BUILDER_BLOCK_NODES);
+	b->slab = NULL;
+	b->slab_used = 0;
+	assert(b->stage);
+	assert(b->arena);
+	if (!b->stage || !b->arena) {
+		guide_builder_destroy(b);
+		b = NULL;
+	}
+	_guide_alloc_leave(prev);
+
+	return b;
+}
+
+static void _guide_builder_deleter(struct tree_node_t *node, void *cargo)
+{
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
+
+	(void)cargo;
+	if (data)
+		guide_nodedata_destroy(data);
+}
+
+void guide_builder_destroy(struct guide_builder_t *b)
+{
+	const struct guide_allocator_t *prev;
+
+	assert(b);
+
+	prev = _guide_alloc_enter(b->guide);
+	if (b->stage)
+		tree_delete_tree(b->stage, _guide_builder_deleter, NULL);
+	if (b->arena)
+		tree_arena_destroy(b->arena);
+	if (b->slab)
+		_guide_slab_put(b->slab);
+	guide_free(b);
+	_guide_alloc_leave(prev);
+}
+
+/* size of the piece for `size' bytes: preceded by the slab pointer, and
+ * 8-byte aligned */
+#define _GUIDE_SLAB_PIECE(size)		((sizeof(struct _guide_slab_t *) + (size) + 7) & ~(size_t)7)
+
+/* carve `size' bytes, preceded by the slab pointer, out of the slab */
+static void *_guide_builder_carve(struct guide_builder_t *b, size_t size)
+{
+	struct _guide_slab_t *slab = b->slab;
+	char *p;
+
+	size = _GUIDE_SLAB_PIECE(size);
+	if (!slab || b->slab_used + size > _GUIDE_SLAB_SIZE) {
+		slab = (struct _guide_slab_t *)guide_malloc(sizeof(struct _guide_slab_t) + _GUIDE_SLAB_SIZE);
+		assert(slab);
+		if (!slab) return NULL;
+		atomic_init(&slab->refs, 1);
+		if (b->slab)
+			_guide_slab_put(b->slab);
+		b->slab = slab;
+		b->slab_used = 0;
+	}
+
+	atomic_fetch_add_explicit(&slab->refs, 1, memory_order_relaxed);
+	p = slab->mem + b->slab_used;
+	b->slab_used += size;
+	*(struct _guide_slab_t **)p = slab;
+	return p + sizeof(struct _guide_slab_t *);
+}
+
+static struct guide_nodedata_t *_guide_builder_nodedata(struct guide_builder_t *b,
+	const wchar_t *title, const char *text)
+{
+	struct guide_nodedata_t *data;
+	struct _guide_blob_store_t *store;
+	size_t title_size, text_size;
+	uint32 flags = _GUIDE_DATA_IN_SLAB;
+
+	assert(b);
+
+	/* a single atomic add on the counter of the guide reserves the next
+	   few thousand uids */
+	if (b->next_uid == b->end_uid) {
+		b->next_uid = __atomic_fetch_add(&b->guide->_counter, _GUIDE_BUILDER_UIDS,
+			__ATOMIC_RELAXED) + 1;
+		b->end_uid = b->next_uid + _GUIDE_BUILDER_UIDS;
+	}
+
+	if (!title) title = L"";
+	if (!text) text = "";
+	title_size = (wcslen(title) + 1) * sizeof(wchar_t);
+	text_size = strlen(text) + 1;
+
+	if (sizeof(struct guide_nodedata_t) + title_size + text_size <= _GUIDE_SLAB_MAX_PIECE) {
+		data = (struct guide_nodedata_t *)_guide_builder_carve(b,
+			sizeof(struct guide_nodedata_t) + title_size + text_size);
+		if (!data) return NULL;
+		data->title = (wchar_t *)(data + 1);
+		data->_text = (char *)data->title + title_size;
+		memcpy(data->title, title, title_size);
+		memcpy(data->_text, text, text_size);
+		data->_blob = NULL;
+		flags |= _GUIDE_DATA_INLINE_TITLE | _GUIDE_DATA_INLINE_TEXT |
+			_GUIDE_DATA_SIZE(_GUIDE_SLAB_PIECE(sizeof(struct guide_nodedata_t) +
+				title_size + text_size));
+	} else {
+		data = (struct guide_nodedata_t *)_guide_builder_carve(b,
+			sizeof(struct guide_nodedata_t));
+		if (!data) return NULL;
+		flags |= _GUIDE_DATA_SIZE(_GUIDE_SLAB_PIECE(sizeof(struct guide_nodedata_t)));
+		data->title = guide_wcsdup(title);
+		data->_blob = NULL;
+		if ((store = _guide_blob_store_for(b->guide, text_size - 1)))
+			data->_blob = _guide_blob_write(store, text, text_size - 1);
+		data->_text = data->_blob ? NULL : guide_strdup(text);
+		assert(data->title);
+		assert(data->_text || data->_blob);
+	}
+
+	data->uid = b->next_uid++;
+	data->_flags = flags;
+	data->_attrs = NULL;
+	data->_guide = NULL;
+
+	return data;
+}
+
+struct guide_nodedata_t *guide_builder_nodedata(struct guide_builder_t *b,
+	const wchar_t *title, const char *text)
+{
+	const struct guide_allocator_t *prev;
+	struct guide_nodedata_t *data;
+
+	assert(b);
+
+	prev = _guide_alloc_enter(b->guide);
+	data = _guide_builder_nodedata(b, title, text);
+	_guide_alloc_leave(prev);
+	return data;
+}
+
+struct tree_node_t *guide_builder_add_child(struct guide_builder_t *b,
+	struct tree_node_t *parent, struct guide_nodedata_t *data, struct tree_node_t *after)
+{
+	struct tree_arena_t *prev;
+	const struct guide_allocator_t *prev_alloc;
+	struct tree_node_t *node;
+
+	assert(b);
+	assert(data);
+
+	prev_alloc = _guide_alloc_enter(b->guide);
+	prev = tree_arena_use(b->arena);
+	node = tree_add_child(parent ? parent : tree_get_root(b->stage), data, after);
+	tree_arena_use(prev);
+	_guide_alloc_leave(prev_alloc);
+	return node;
+}
+
+int guide_builder_publish(struct guide_builder_t *b, struct tree_node_t *parent,
+	struct tree_node_t *after)
+{
+	struct guide_t *guide;
+	struct tree_node_t *node, *next;
+	struct tree_t *tree;
+	const struct guide_allocator_t *prev;
+	int ret = 0;
+
+	assert(b);
+	assert(parent);
+
+	guide = b->guide;
+	prev = _guide_alloc_enter(guide);
+	guide_begin_transaction(guide);
+	for (node = tree_get_first_child(tree_get_root(b->stage)); node; node = next) {
+		next = tree_get_next_sibling(node);
+		tree = tree_split_subtree(node);
+		assert(tree);
+		if (!tree) {
+			ret = -1;
 			break;
 		}
 
-		/* position iterator to start of next attribute */
-		p += attr_val_len;
-	}
+		tree_merge_tree(parent, tree);
+		if (after)
+			tree_move_subtree_after(node, after);
+		_guide_register_subtree(guide, NULL, node);
+		after = node;
+	}
+	guide_end_transaction(guide);
+	_guide_alloc_leave(prev);
+
+	return ret;
+}
+
+struct tree_t *guide_create_with_root(struct guide_t *guide, struct guide_nodedata_t *data)
+{
+	const struct guide_allocator_t *prev = _guide_alloc_enter(guide);
+	struct tree_t *p = tree_create_with_root(data);
+	if (p) {
+		guide_lock_write(guide);
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), tree_get_root(p));
+		guide_unlock(guide);
+		tree_set_change_fn(p, _guide_tree_changed, guide);
+	}
+	_guide_alloc_leave(prev);
+	return p;
+}
+
+struct tree_node_t *guide_add_child(struct guide_t *guide, struct tree_node_t *parent,
+	struct guide_nodedata_t *data, struct tree_node_t *after)
+{
+	struct tree_node_t *p;
+	const struct guide_allocator_t *prev;
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	if (guide->_batch) {
+		if ((p = tree_batch_add_child(guide->tree, parent, data, after)))
+			_guide_batch_add(guide, p);
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return p;
+	}
+	p = tree_add_child(parent, data, after);
+	if (p)
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return p;
+}
+
+struct tree_node_t *guide_insert_child_at(struct guide_t *guide,
+	struct tree_node_t *parent, struct guide_nodedata_t *data, uint32 index)
+{
+	struct tree_node_t *p;
+	const struct guide_allocator_t *prev;
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	p = tree_insert_child_at(parent, data, index);
+	if (p)
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return p;
+}
+
+struct tree_node_t *guide_add_sibling_after(struct guide_t *guide, 
+	struct tree_node_t *node, struct guide_nodedata_t *data)
+{
+	struct tree_node_t *p;
+	const struct guide_allocator_t *prev;
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	if (guide->_batch && tree_get_parent(node)) {
+		if ((p = tree_batch_add_child(guide->tree, tree_get_parent(node), data, node)))
+			_guide_batch_add(guide, p);
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return p;
+	}
+	p = tree_add_sibling_after(node, data);
+	if (p)
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return p;
+}
+
+struct tree_node_t *guide_add_sibling_before(struct guide_t *guide, 
+	struct tree_node_t *node, struct guide_nodedata_t *data)
+{
+	struct tree_node_t *p;
+	const struct guide_allocator_t *prev;
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	if (guide->_batch && tree_get_parent(node)) {
+		if ((p = tree_batch_add_child(guide->tree, tree_get_parent(node), data,
+				tree_get_prev_sibling(node))))
+			_guide_batch_add(guide, p);
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return p;
+	}
+	p = tree_add_sibling_before(node, data);
+	if (p)
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return p;
+}
+
+static void *_guide_copy_data(void *src, void *cargo)
+{
+	return guide_nodedata_clone((struct guide_nodedata_t *)src, (struct guide_t *)cargo);
+}
+
+static int _guide_copy_register(struct tree_node_t *node, void *cargo)
+{
+	struct guide_t *guide = (struct guide_t *)cargo;
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
+
+	lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), node);
+	return 0;
+}
+
+struct tree_node_t *guide_copy_subtree(struct guide_t *guide, struct tree_node_t *src_node,
+	struct tree_node_t *parent, struct tree_node_t *after)
+{
+	struct tree_t *copy;
+	struct tree_node_t *copy_root;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+	assert(src_node);
+	assert(parent);
+
+	/* clone the data with new uids, and register them as the nodes are made */
+	prev = _guide_alloc_enter(guide);
+	guide_begin_transaction(guide);
+	copy = tree_copy_subtree(src_node, _guide_copy_data, _guide_copy_register, guide);
+	assert(copy);
+	if (!copy) {
+		guide_end_transaction(guide);
+		_guide_alloc_leave(prev);
+		return NULL;
+	}
+
+	copy_root = tree_get_root(copy);
+	tree_merge_tree(parent, copy);
+	if (after)
+		tree_move_subtree_after(copy_root, after);
+	guide_end_transaction(guide);
+	_guide_alloc_leave(prev);
+	return copy_root;
+}
+
+int guide_parallel_for_each(struct guide_t *guide, tree_parallel_fn_t fn, void *cargo,
+	const struct tree_parallel_opts_t *opts)
+{
+	struct tree_node_t *root;
+	int ret;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+	assert(guide->tree);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_read(guide);
+	root = tree_get_root(guide->tree);
+	ret = root ? tree_parallel_for_each(root, fn, cargo, opts) : 0;
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return ret;
+}
+
+struct tree_node_t *guide_get_node_by_uid(struct guide_t *guide, uint32 uid)
+{
+	struct tree_node_t *node = NULL;
+	const struct guide_allocator_t *prev;
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_read(guide);
+	_guide_batch_register(guide);
+	lut_get(guide->_uidtbl, (void *)(uintptr_t)uid, (void **)&node);
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return node;
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Batches (guide_begin_batch()). The tree takes care of the sizes; here,
+ * the nodes added are kept in a list, and their uids put in the table all
+ * at once, before anything that looks them up or takes them out. */
+
+struct _guide_batch_t
+{
+	unsigned depth;
+	struct tree_node_t **nodes;
+	uint32 n;
+	uint32 alloc;
+};
+
+static void _guide_batch_add(struct guide_t *guide, struct tree_node_t *node)
+{
+	struct _guide_batch_t *b = guide->_batch;
+	struct tree_node_t **nodes;
+	struct guide_nodedata_t *data;
+
+	if (b->n == b->alloc) {
+		nodes = (struct tree_node_t **)guide_realloc(b->nodes,
+			(b->alloc ? 2 * b->alloc : 1024) * sizeof(struct tree_node_t *));
+		assert(nodes);
+		if (!nodes) {
+			/* register it right away then */
+			data = (struct guide_nodedata_t *)tree_get_data(node);
+			lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), node);
+			return;
+		}
+		b->nodes = nodes;
+		b->alloc = b->alloc ? 2 * b->alloc : 1024;
+	}
+	b->nodes[b->n++] = node;
+}
+
+static void _guide_batch_register(struct guide_t *guide)
+{
+	struct _guide_batch_t *b = guide->_batch;
+	struct guide_nodedata_t *data;
+	uint32 i;
+
+	if (!b || !b->n)
+		return;
+
+	lut_reserve(guide->_uidtbl, b->n);
+	for (i = 0; i < b->n; ++i) {
+		data = (struct guide_nodedata_t *)tree_get_data(b->nodes[i]);
+		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), b->nodes[i]);
+	}
+	b->n = 0;
+}
+
+static void _guide_batch_free(struct guide_t *guide)
+{
+	guide_free(guide->_batch->nodes);
+	guide_free(guide->_batch);
+	guide->_batch = NULL;
+}
+
+void guide_begin_batch(struct guide_t *guide)
+{
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+	assert(guide->tree);
+
+	guide_lock_write(guide);
+	prev = _guide_alloc_enter(guide);
+	if (!guide->_batch) {
+		guide->_batch = (struct _guide_batch_t *)guide_calloc(1, sizeof(struct _guide_batch_t));
+		assert(guide->_batch);
+		if (!guide->_batch) {
+			_guide_alloc_leave(prev);
+			return;
+		}
+	}
+	if (guide->_batch->depth++ == 0)
+		tree_begin_batch(guide->tree);
+	_guide_alloc_leave(prev);
+}
+
+void guide_commit_batch(struct guide_t *guide)
+{
+	struct _guide_batch_t *b;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	if ((b = guide->_batch)) {
+		_guide_batch_register(guide);
+		if (--b->depth == 0) {
+			tree_end_batch(guide->tree);
+			_guide_batch_free(guide);
+		}
+	}
+	_guide_alloc_leave(prev);
+	guide_unlock(guide);
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Undo journal (guide_set_journal()). Each change is recorded as the delta
+ * that undoes it, and deltas are grouped in transactions. Undoing one
+ * applies its deltas newest first; the changes that makes are recorded the
+ * same way, as the transaction that redoes it, and vice versa.
+ *
+ * Changes to the tree are seen by the tree change function: a node linked,
+ * or unlinked from a given place, the two of them in a row for a move.
+ * Subtrees taken out of the guide, by guide_delete_subtree() or by undoing
+ * their insertion, are detached and kept as they are by the delta of their
+ * unlinking, so memory goes with the size of the changes only. */
+
+/* memory accounted to a node kept in the journal: the tree node, the node
+   data with what it holds inline, and its other strings and attributes */
+static size_t _guide_journal_node_bytes(struct tree_node_t *node)
+{
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
+	size_t bytes;
+
+	bytes = tree_node_memory(node) + (data->_flags >> _GUIDE_DATA_SIZE_SHIFT) +
+		_guide_attrs_size(data->_attrs);
+	if (!(data->_flags & _GUIDE_DATA_INLINE_TITLE))
+		bytes += (wcslen(data->title) + 1) * sizeof(wchar_t);
+	if (data->_blob)
+		bytes += sizeof(struct _guide_blob_t);
+	else if (!(data->_flags & _GUIDE_DATA_INLINE_TEXT))
+		bytes += strlen(data->_text) + 1;
+	return bytes;
+}
+
+struct _guide_op_t
+{
+	struct _guide_op_t *next;		/* the op recorded before this one */
+	int type;						/* _GUIDE_OP_* */
+	size_t bytes;					/* memory accounted to the op */
+	struct tree_node_t *node;		/* LINK, UNLINK, MOVE */
+	struct tree_node_t *parent;		/* UNLINK, MOVE: where `node' was */
+	struct tree_node_t *prev;
+	struct tree_t *detached;		/* UNLINK: the subtree, if taken out */
+	struct guide_nodedata_t *data;	/* TITLE, TEXT */
+	void *str;						/* TITLE, TEXT: the string to put back */
+};
+
+struct _guide_txn_t
+{
+	struct _guide_txn_t *older;
+	struct _guide_txn_t *newer;
+	struct _guide_op_t *ops;		/* newest first */
+	size_t bytes;
+};
+
+struct _guide_journal_t
+{
+	struct _guide_txn_t *oldest;	/* what can be undone, oldest first */
+	struct _guide_txn_t *newest;
+	struct _guide_txn_t *redo;		/* what can be redone, linked by `older' */
+	struct _guide_txn_t *open;		/* the transaction begun, if any */
+	unsigned depth;					/* of guide_begin_transaction() calls */
+	struct _guide_txn_t *replay;	/* records the undoing or redoing */
+	struct _guide_op_t *pending;	/* an UNLINK just recorded */
+	struct _guide_txn_t *pending_txn;
+	unsigned paused;
+	size_t bytes;
+	size_t max_bytes;
+};
+
+static int _guide_journal_recording(struct guide_t *guide)
+{
+	return guide->_journal && !guide->_journal->paused;
+}
+
+/* free a string dropped from the journal: it may have been read off the
+ * node data by a snapshot reader */
+static void _guide_journal_free_string(struct guide_t *guide, void *p)
+{
+	struct tree_node_t *root;
 
-	/* collect the largest uid value */
-	if (node_data->uid > *maxuid)
-		*maxuid = node_data->uid;
+	if (guide->tree && (root = tree_get_root(guide->tree)) && tree_has_snapshots(guide->tree))
+		tree_snapshot_defer_free(root, p, guide_free);
+	else
+		guide_free(p);
+}
+
+static void _guide_op_free(struct guide_t *guide, struct _guide_op_t *op)
+{
+	if (op->detached)
+		tree_delete_tree(op->detached, _guide_snapshot_deleter, NULL);
+	if (op->str)
+		_guide_journal_free_string(guide, op->str);
+	guide_free(op);
+}
 
-	/* read title */	
-	title_len = *(uint32 *)p; p += 4;	
-	uni_title = convert_to_unicode_from_utf8((const char *)p, title_len);
-	guide_nodedata_set_title(node_data, uni_title);
-	p += title_len;
+static void _guide_txn_free(struct guide_t *guide, struct _guide_txn_t *txn)
+{
+	struct _guide_op_t *op, *next;
 
-	/* read text */
-	text_len = *(uint32 *)p; p += 4;
+	for (op = txn->ops; op; op = next) {
+		next = op->next;
+		_guide_op_free(guide, op);
+	}
+	guide_free(txn);
+}
 
-	guide_nodedata_set_textn(node_data, p, text_len);
-	p += text_len;
+static void _guide_journal_push(struct _guide_journal_t *j, struct _guide_txn_t *txn)
+{
+	txn->older = j->newest;
+	txn->newer = NULL;
+	if (j->newest)
+		j->newest->newer = txn;
+	else
+		j->oldest = txn;
+	j->newest = txn;
+}
 
-	/* free temporary strings */
-	free(uni_title);
+static struct _guide_txn_t *_guide_journal_pop(struct _guide_journal_t *j)
+{
+	struct _guide_txn_t *txn = j->newest;
+
+	if (txn) {
+		j->newest = txn->older;
+		if (j->newest)
+			j->newest->newer = NULL;
+		else
+			j->oldest = NULL;
+		j->bytes -= txn->bytes;
+	}
+	return txn;
+}
 
-	/* bump the iterator */
-	*pp = p;
+static void _guide_journal_drop_redo(struct guide_t *guide)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *txn;
 
-	/* return the newly created node */
-	return node_data;
+	while ((txn = j->redo)) {
+		j->redo = txn->older;
+		j->bytes -= txn->bytes;
+		_guide_txn_free(guide, txn);
+	}
 }
 
-static struct guide_t *guide_load_v2(struct _guide_mappedfile_t *m, unsigned len, unsigned *os_errcode)
+/* Keep to the memory cap by dropping the oldest transactions, then what
+ * can be redone. The newest transaction stays, however big. */
+static void _guide_journal_trim(struct guide_t *guide)
 {
-	char *begin, *end, *p;
-	struct guide_t *guide;
-	struct lut_t *lm;
-	struct guide_nodedata_t *node_data;
-	struct tree_node_t *node, *parent;
-	uint32 maxuid;
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *txn;
+
+	if (!j->max_bytes)
+		return;
+	while (j->bytes > j->max_bytes && (txn = j->oldest) && txn != j->newest) {
+		j->oldest = txn->newer;
+		j->oldest->older = NULL;
+		j->bytes -= txn->bytes;
+		_guide_txn_free(guide, txn);
+	}
+	if (j->bytes > j->max_bytes)
+		_guide_journal_drop_redo(guide);
+}
 
-	/* reset os error code */
-	assert(os_errcode);
-	*os_errcode = 0;
+/* the transaction to record into, or NULL if not recording */
+static struct _guide_txn_t *_guide_journal_txn(struct guide_t *guide)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *txn;
 
-	/* create a new guide */
-	guide = (struct guide_t *)malloc(sizeof(struct guide_t));
-	assert(guide);
-	if (!guide)
+	if (!j || j->paused)
 		return NULL;
+	if (j->replay)
+		return j->replay;
+	if (j->open)
+		return j->open;
+
+	/* the first change of a transaction, or one of its own: what was
+	   undone can't be redone any more */
+	txn = (struct _guide_txn_t *)guide_calloc(1, sizeof(struct _guide_txn_t));
+	assert(txn);
+	if (!txn)
+		return NULL;
+	_guide_journal_drop_redo(guide);
+	_guide_journal_push(j, txn);
+	if (j->depth)
+		j->open = txn;
+	return txn;
+}
 
-	guide->_counter = 0; /* filled in by _guide_read_header */
-	guide->_uidtbl = lut_create();
-	guide->sel_node = 0; /* filled in by _guide_read_header */
-
-	/* create lut for mapping parents */
-	lm = lut_create();
+static void _guide_journal_account(struct _guide_journal_t *j, struct _guide_txn_t *txn,
+	struct _guide_op_t *op, size_t bytes)
+{
+	op->bytes += bytes;
+	txn->bytes += bytes;
+	j->bytes += bytes;
+}
 
-	/* first and last bytes of valid data */
-	begin = (char *)(m->data);
-	end   = (char *)(m->data) + len;
+/* record a delta of `type', with `bytes' of memory besides itself */
+static struct _guide_op_t *_guide_journal_add(struct guide_t *guide, int type, size_t bytes,
+	struct _guide_txn_t **ptxn)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *txn;
+	struct _guide_op_t *op;
 
-	/* read header */
-	p = begin = _guide_read_header(guide, begin);
-	assert(begin);
-	if (!begin)
-	{
-		/* file format error */
-		lut_free(lm);
+	if (!(txn = _guide_journal_txn(guide)))
+		return NULL;
+	op = (struct _guide_op_t *)guide_calloc(1, sizeof(struct _guide_op_t));
+	assert(op);
+	if (!op)
 		return NULL;
-	}
-
-	/* collect the biggest uid */
-	maxuid = guide->_counter;
 
-	/* process the root node: */
-	/*	-> first read it */
-	node_data = _guide_read_node_v2(&p, &node, &parent, guide, &maxuid);
+	op->type = type;
+	op->next = txn->ops;
+	txn->ops = op;
+	_guide_journal_account(j, txn, op, sizeof(struct _guide_op_t) + bytes);
 
-	/*  -> create new tree (with the root node data) */
-	guide->tree = guide_create_with_root(guide, node_data);
-	/*	-> add to the lookup table */
-	lut_set(lm, node, tree_get_root(guide->tree));
+	if (ptxn)
+		*ptxn = txn;
+	else if (!j->replay && !j->open)
+		_guide_journal_trim(guide);
+	return op;
+}
 
-	/* iterate through nodes one by one */
-	while (p < end)
-	{
-		struct tree_node_t *new_node, *real_parent;
+static void _guide_journal_note(struct guide_t *guide, struct tree_node_t *node, int change)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_op_t *op;
 
-		/* read a node */
-		node_data = _guide_read_node_v2(&p, &node, &parent, guide, &maxuid);
+	if (j->paused)
+		return;
 
-		/* add node to tree */
-		/* lookup parent */
-		lut_get(lm, parent, (void**)&real_parent);
-		new_node = guide_add_child(guide, real_parent, node_data, 
-						_guide_get_last_child(real_parent));
+	/* unlinked and linked again: moved */
+	if (change == TREE_CHANGE_LINKED && j->pending && j->pending->node == node) {
+		j->pending->type = _GUIDE_OP_MOVE;
+		j->pending = NULL;
+		return;
+	}
+	j->pending = NULL;
+
+	if (change == TREE_CHANGE_LINKED) {
+		if ((op = _guide_journal_add(guide, _GUIDE_OP_LINK, 0, NULL)))
+			op->node = node;
+	} else {
+		if ((op = _guide_journal_add(guide, _GUIDE_OP_UNLINK, 0, &j->pending_txn))) {
+			op->node = node;
+			op->parent = tree_get_parent(node);
+			op->prev = tree_get_prev_sibling(node);
+			j->pending = op;
+		}
+	}
+}
 
-		/* remember node */
-		lut_set(lm, node, new_node);
+/* Record the replacement of a string of `data' with the delta that puts
+ * `old' back. Returns nonzero if the journal took `old'. */
+static int _guide_journal_keep(struct guide_nodedata_t *data, int type, void *old)
+{
+	struct guide_t *guide = data->_guide;
+	uint32 flag = type == _GUIDE_OP_TITLE ? _GUIDE_DATA_INLINE_TITLE : _GUIDE_DATA_INLINE_TEXT;
+	struct tree_node_t *node;
+	struct _guide_op_t *op;
+	size_t size;
+	void *p = NULL;
+
+	/* only the data of nodes in the guide: any other may be gone by the
+	   time the delta is applied */
+	if (guide)
+		_guide_batch_register(guide);
+	if (!guide || !_guide_journal_recording(guide) ||
+			lut_get(guide->_uidtbl, (void *)(uintptr_t)(data->uid), (void **)&node) != 0 ||
+			tree_get_data(node) != data)
+		return 0;
+
+	size = type == _GUIDE_OP_TITLE ?
+		(wcslen((wchar_t *)old) + 1) * sizeof(wchar_t) : strlen((char *)old) + 1;
+
+	/* an inline string goes with the node data, the journal needs its own */
+	if (data->_flags & flag) {
+		data->_flags &= ~flag;
+		p = guide_malloc(size);
+		assert(p);
+		if (!p)
+			return 1;
+		memcpy(p, old, size);
+		old = p;
 	}
 
-	/* translate the selected node */
-	if (guide->sel_node)
-	{
-		node = 0;
-		lut_get(lm, guide->sel_node, (void**)&node);
-		guide->sel_node = node;
+	op = _guide_journal_add(guide, type, size, NULL);
+	if (!op) {
+		if (old != p)
+			return 0;
+		guide_free(old);
+		return 1;
 	}
+	op->data = data;
+	op->str = old;
+	return 1;
+}
 
-	/* free the lut */
-	lut_free(lm);
+/* Take the subtree at `node' out of the guide and keep it, detached, with
+ * the delta recorded for its unlinking. */
+static void _guide_journal_detach(struct guide_t *guide, struct tree_node_t *node)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct guide_nodedata_t *data;
+	struct tree_iter_t it;
+	struct tree_t *tree;
+	struct _guide_op_t *op;
+	size_t bytes = 0;
+
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it)) {
+		data = (struct guide_nodedata_t *)tree_get_data(it.node);
+		lut_remove(guide->_uidtbl, (void *)(uintptr_t)(data->uid));
+		_guide_title_index_drop(guide, data->uid);
+		bytes += _guide_journal_node_bytes(it.node);
+	}
 
-	/* set the guide uid to the max uid */
-	guide->_counter = maxuid;
+	tree = tree_split_subtree(node);
+	assert(tree);
+	if (!tree)
+		return;
+
+	op = j->pending;
+	j->pending = NULL;
+	if (!op || op->node != node) {
+		/* not recorded after all */
+		tree_delete_tree(tree, _guide_snapshot_deleter, NULL);
+		return;
+	}
+	op->detached = tree;
+	_guide_journal_account(j, j->pending_txn, op, bytes);
+	if (!j->replay && !j->open)
+		_guide_journal_trim(guide);
+}
 
-	return guide;
+/* put the subtree kept by `op' back where it was */
+static void _guide_journal_relink(struct guide_t *guide, struct _guide_op_t *op)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_op_t *link;
+
+	++j->paused;
+	tree_merge_tree(op->parent, op->detached);
+	op->detached = NULL;
+	if (op->prev)
+		tree_move_subtree_after(op->node, op->prev);
+	--j->paused;
+
+	_guide_register_subtree(guide, NULL, op->node);
+	j->pending = NULL;
+	if ((link = _guide_journal_add(guide, _GUIDE_OP_LINK, 0, NULL)))
+		link->node = op->node;
 }
 
-/* Loads a .gde file, of any file format. It detects the file format
- * and then behaves appropriately. 
- */
-struct guide_t *guide_load(const wchar_t *filename, unsigned *os_errcode, uint32 *format)
+/* move `node' back after `prev' under `parent' (first if NULL) */
+static void _guide_journal_place(struct tree_node_t *node, struct tree_node_t *parent,
+	struct tree_node_t *prev)
 {
-	unsigned len;
-	struct _guide_mappedfile_t *m;
-	struct guide_t *gde;
+	struct tree_node_t *first = tree_get_first_child(parent);
+
+	if (prev)
+		tree_move_subtree_after(node, prev);
+	else if (!first)
+		tree_move_subtree_as_child(node, parent);
+	else if (first != node)
+		tree_move_subtree_before(node, first);
+}
 
-	/* assert valid input param */
-	assert(filename);
-	assert(*filename);
-	assert(format);
+/* apply the deltas of `txn', and free it */
+static void _guide_journal_apply(struct guide_t *guide, struct _guide_txn_t *txn)
+{
+	struct _guide_op_t *op, *next;
 
-	/* reset os error code */
-	assert(os_errcode);
-	*os_errcode = 0;
-	
-	/* get file length */
-	len = _guide_get_filelength(filename, os_errcode);
-	if (len == -1) {
-		return NULL;
+	for (op = txn->ops; op; op = next) {
+		next = op->next;
+		switch (op->type) {
+		case _GUIDE_OP_LINK:
+			_guide_journal_detach(guide, op->node);
+			break;
+		case _GUIDE_OP_UNLINK:
+			assert(op->detached);
+			if (op->detached)
+				_guide_journal_relink(guide, op);
+			break;
+		case _GUIDE_OP_MOVE:
+			_guide_journal_place(op->node, op->parent, op->prev);
+			break;
+		case _GUIDE_OP_TITLE:
+			_guide_nodedata_put_title(op->data, (wchar_t *)op->str);
+			op->str = NULL;
+			break;
+		case _GUIDE_OP_TEXT:
+			_guide_nodedata_put_text(op->data, (char *)op->str);
+			op->str = NULL;
+			break;
+		}
+		_guide_op_free(guide, op);
 	}
+	guide_free(txn);
+}
 
-	/* The file has to be at least 20 bytes long. This is the size of
-	 * a format 1 .gde file, with no nodes. This check was added in v1.6. */
-	if (len < 20) /* *os_errcode = 0; */ return NULL;
+/* drop all transactions */
+static void _guide_journal_clear(struct guide_t *guide)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *txn;
+
+	_guide_journal_drop_redo(guide);
+	while ((txn = _guide_journal_pop(j)))
+		_guide_txn_free(guide, txn);
+	j->open = NULL;
+	j->pending = NULL;
+}
 
-	/* map the file */
-	m = _guide_map_file(filename, os_errcode);
-	if (!m) return NULL;
+static void _guide_journal_free(struct guide_t *guide)
+{
+	_guide_journal_clear(guide);
+	guide_free(guide->_journal);
+	guide->_journal = NULL;
+}
 
-	if (memcmp((char *)(m->data), "GDE\x02\0\0\0", 7) == 0)
-	{		
-		*format = 2;
-		gde = guide_load_v2(m, len, os_errcode);	
+int guide_set_journal(struct guide_t *guide, int journal, size_t max_bytes)
+{
+	struct _guide_journal_t *j;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	if (journal && !guide->_journal) {
+		j = (struct _guide_journal_t *)guide_calloc(1, sizeof(struct _guide_journal_t));
+		assert(j);
+		if (!j) {
+			guide_unlock(guide);
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+		guide->_journal = j;
+	} else if (!journal && guide->_journal) {
+		_guide_journal_free(guide);
 	}
-	/* not a .gde file */
-	else
-	{
-		*os_errcode = 0;
-		gde = NULL;
+
+	if (guide->_journal) {
+		guide->_journal->max_bytes = max_bytes;
+		_guide_journal_trim(guide);
 	}
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return 0;
+}
 
-	/* unmap the file */
-	_guide_unmap_file(m);
+void guide_begin_transaction(struct guide_t *guide)
+{
+	assert(guide);
 
-	/* return the newly loaded guide */
-	return gde;
+	guide_lock_write(guide);
+	if (guide->_journal)
+		++guide->_journal->depth;
 }
 
-/* callback function to cleanup a single node */
-static void _guide_deleter(struct tree_node_t *node, void *cargo)
+void guide_end_transaction(struct guide_t *guide)
 {
-	struct guide_nodedata_t *data = 
-		(struct guide_nodedata_t *)tree_get_data(node);
-	struct guide_t *guide = 
-		(struct guide_t *)cargo;
+	struct _guide_journal_t *j;
+	const struct guide_allocator_t *prev;
 
-	assert(data);
 	assert(guide);
 
-	/* "remove" from the map */
-	lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), NULL);
+	if ((j = guide->_journal) && j->depth && --j->depth == 0 && j->open) {
+		j->open = NULL;
+		prev = _guide_alloc_enter(guide);
+		_guide_journal_trim(guide);
+		_guide_alloc_leave(prev);
+	}
+	guide_unlock(guide);
+}
 
-	guide_nodedata_destroy(data);
+/* undo (or redo) the transaction `txn', recording the changes as the
+ * transaction that redoes (or undoes) it */
+static struct _guide_txn_t *_guide_journal_replay(struct guide_t *guide,
+	struct _guide_txn_t *txn)
+{
+	struct _guide_journal_t *j = guide->_journal;
+	struct _guide_txn_t *inverse;
+
+	inverse = (struct _guide_txn_t *)guide_calloc(1, sizeof(struct _guide_txn_t));
+	assert(inverse);
+	if (!inverse)
+		return NULL;
+
+	j->replay = inverse;
+	j->pending = NULL;
+	_guide_journal_apply(guide, txn);
+	j->replay = NULL;
+	j->pending = NULL;
+	return inverse;
 }
 
-void guide_destroy(struct guide_t *guide)
+int guide_undo(struct guide_t *guide)
 {
+	struct _guide_journal_t *j;
+	struct _guide_txn_t *txn, *inverse;
+	const struct guide_allocator_t *prev;
+
 	assert(guide);
 
-	assert(guide->tree);
-	tree_delete_tree(guide->tree, _guide_deleter, guide);
-	guide->tree = NULL;
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	_guide_batch_register(guide);
+	j = guide->_journal;
+	if (!j || j->depth || !j->newest) {
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return -1;
+	}
 
-	assert(guide->_uidtbl);
-	lut_free(guide->_uidtbl);
-	guide->_uidtbl = NULL;
+	txn = _guide_journal_pop(j);
+	if ((inverse = _guide_journal_replay(guide, txn))) {
+		inverse->older = j->redo;
+		j->redo = inverse;
+		_guide_journal_trim(guide);
+	} else {
+		/* no memory to record the redoing: undo anyway */
+		++j->paused;
+		_guide_journal_apply(guide, txn);
+		--j->paused;
+	}
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return 0;
 }
 
-void guide_delete_subtree(struct guide_t *guide, struct tree_node_t *node)
+int guide_redo(struct guide_t *guide)
 {
-	assert(node);
-	tree_delete_subtree(node, _guide_deleter, guide);
+	struct _guide_journal_t *j;
+	struct _guide_txn_t *txn, *inverse;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	_guide_batch_register(guide);
+	j = guide->_journal;
+	if (!j || j->depth || !j->redo) {
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+
+	txn = j->redo;
+	j->redo = txn->older;
+	j->bytes -= txn->bytes;
+	if ((inverse = _guide_journal_replay(guide, txn))) {
+		_guide_journal_push(j, inverse);
+		_guide_journal_trim(guide);
+	} else {
+		++j->paused;
+		_guide_journal_apply(guide, txn);
+		--j->paused;
+	}
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return 0;
 }
 
-struct tree_t *guide_create_with_root(struct guide_t *guide, struct guide_nodedata_t *data)
+int guide_can_undo(struct guide_t *guide)
 {
-	struct tree_t *p = tree_create_with_root(data);
-	if (p)
-		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
-	return p;
+	assert(guide);
+	return guide->_journal && guide->_journal->newest;
 }
 
-struct tree_node_t *guide_add_child(struct guide_t *guide, struct tree_node_t *parent,
-	struct guide_nodedata_t *data, struct tree_node_t *after)
+int guide_can_redo(struct guide_t *guide)
 {
-	struct tree_node_t *p = tree_add_child(parent, data, after);
-	if (p)
-		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
-	return p;
+	assert(guide);
+	return guide->_journal && guide->_journal->redo;
 }
 
-struct tree_node_t *guide_add_sibling_after(struct guide_t *guide, 
-	struct tree_node_t *node, struct guide_nodedata_t *data)
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Layout (guide_compact_layout()). The tree moves its nodes into a block in
+ * preorder, and tells us of each move in that order; the node data follows
+ * into slabs, in the same order, so that a walk reading the titles moves
+ * forward through memory too. Whatever else points to nodes or node data
+ * is brought up to date: the uid table, the selected node and the journal. */
+
+struct _guide_layout_t
 {
-	struct tree_node_t *p = tree_add_sibling_after(node, data);
-	if (p)
-		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
-	return p;
+	struct guide_t *guide;
+	struct guide_builder_t b;	/* only its slab is used */
+	struct lut_t *nodes;		/* old -> new, if the journal needs them */
+	struct lut_t *datas;
+};
+
+/* a copy of `old' carved from the slab of `b', with as much of its strings
+ * as fits in a piece; the strings that don't are handed over */
+static struct guide_nodedata_t *_guide_nodedata_relocate(struct guide_builder_t *b,
+	struct guide_nodedata_t *old)
+{
+	struct guide_nodedata_t *data;
+	size_t title_size, text_size, size;
+	uint32 flags = _GUIDE_DATA_IN_SLAB;
+
+	title_size = (wcslen(old->title) + 1) * sizeof(wchar_t);
+	text_size = old->_text ? strlen(old->_text) + 1 : 0;
+
+	size = sizeof(struct guide_nodedata_t);
+	if (size + title_size <= _GUIDE_SLAB_MAX_PIECE) {
+		flags |= _GUIDE_DATA_INLINE_TITLE;
+		size += title_size;
+		if (text_size && size + text_size <= _GUIDE_SLAB_MAX_PIECE) {
+			flags |= _GUIDE_DATA_INLINE_TEXT;
+			size += text_size;
+		}
+	}
+
+	/* strings inline in `old' fit in a piece of their own, so they are
+	   copied, never handed over */
+	assert((flags & _GUIDE_DATA_INLINE_TITLE) || !(old->_flags & _GUIDE_DATA_INLINE_TITLE));
+	assert((flags & _GUIDE_DATA_INLINE_TEXT) || !(old->_flags & _GUIDE_DATA_INLINE_TEXT));
+
+	data = (struct guide_nodedata_t *)_guide_builder_carve(b, size);
+	if (!data) return NULL;
+	flags |= _GUIDE_DATA_SIZE(_GUIDE_SLAB_PIECE(size));
+
+	if (flags & _GUIDE_DATA_INLINE_TITLE) {
+		data->title = (wchar_t *)(data + 1);
+		memcpy(data->title, old->title, title_size);
+		if (!(old->_flags & _GUIDE_DATA_INLINE_TITLE))
+			guide_free(old->title);
+	} else {
+		data->title = old->title;
+	}
+	if (flags & _GUIDE_DATA_INLINE_TEXT) {
+		data->_text = (char *)data->title + title_size;
+		memcpy(data->_text, old->_text, text_size);
+		if (!(old->_flags & _GUIDE_DATA_INLINE_TEXT))
+			guide_free(old->_text);
+	} else {
+		data->_text = old->_text;
+	}
+
+	data->uid = old->uid;
+	data->_flags = flags;
+	data->_guide = old->_guide;
+	data->_blob = old->_blob;
+	data->_attrs = old->_attrs;
+
+	if (old->_flags & _GUIDE_DATA_IN_SLAB)
+		_guide_slab_put(((struct _guide_slab_t **)old)[-1]);
+	else
+		guide_free(old);
+	return data;
 }
 
-struct tree_node_t *guide_add_sibling_before(struct guide_t *guide, 
-	struct tree_node_t *node, struct guide_nodedata_t *data)
+static void _guide_layout_relocate(struct tree_node_t *old, struct tree_node_t *node,
+	void *cargo)
 {
-	struct tree_node_t *p = tree_add_sibling_before(node, data);
-	if (p)
-		lut_set(guide->_uidtbl, (void *)(uintptr_t)(data->uid), p);
-	return p;
+	struct _guide_layout_t *l = (struct _guide_layout_t *)cargo;
+	struct guide_nodedata_t *old_data, *data;
+
+	if (l->guide->sel_node == old)
+		l->guide->sel_node = node;
+	if (l->nodes)
+		lut_set(l->nodes, old, node);
+
+	if (!(old_data = (struct guide_nodedata_t *)tree_get_data(node)))
+		return;
+	lut_set(l->guide->_uidtbl, (void *)(uintptr_t)(old_data->uid), node);
+
+	/* if there's no memory for a copy, the node data stays where it is */
+	if (!(data = _guide_nodedata_relocate(&l->b, old_data)))
+		return;
+	tree_set_data(node, data);
+	if (l->datas)
+		lut_set(l->datas, old_data, data);
 }
 
-struct tree_node_t *guide_get_node_by_uid(struct guide_t *guide, uint32 uid)
+/* point the deltas of `txn' to where their nodes and node data are now */
+static void _guide_layout_fix_txn(struct _guide_layout_t *l, struct _guide_txn_t *txn)
 {
-	struct tree_node_t *node = NULL;
-	lut_get(guide->_uidtbl, (void *)(uintptr_t)uid, (void **)&node);
-	return node;
+	struct _guide_op_t *op;
+
+	for (op = txn->ops; op; op = op->next) {
+		if (op->node)
+			lut_get(l->nodes, op->node, (void **)&op->node);
+		if (op->parent)
+			lut_get(l->nodes, op->parent, (void **)&op->parent);
+		if (op->prev)
+			lut_get(l->nodes, op->prev, (void **)&op->prev);
+		if (op->data)
+			lut_get(l->datas, op->data, (void **)&op->data);
+	}
+}
+
+int guide_compact_layout(struct guide_t *guide)
+{
+	struct _guide_layout_t l;
+	struct _guide_journal_t *j;
+	struct _guide_txn_t *txn;
+	struct tree_node_t *root;
+	int ret;
+	const struct guide_allocator_t *prev;
+
+	assert(guide);
+
+	prev = _guide_alloc_enter(guide);
+	guide_lock_write(guide);
+	if (!(root = tree_get_root(guide->tree))) {
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return 0;
+	}
+	if (tree_has_snapshots(guide->tree)) {
+		guide_unlock(guide);
+		_guide_alloc_leave(prev);
+		return -1;
+	}
+	_guide_batch_register(guide);
+
+	memset(&l, 0, sizeof(l));
+	l.guide = guide;
+	j = guide->_journal;
+	if (j && (j->oldest || j->redo)) {
+		l.nodes = lut_create();
+		l.datas = lut_create();
+		assert(l.nodes && l.datas);
+		if (!l.nodes || !l.datas) {
+			if (l.nodes)
+				lut_free(l.nodes);
+			if (l.datas)
+				lut_free(l.datas);
+			guide_unlock(guide);
+			_guide_alloc_leave(prev);
+			return -1;
+		}
+	}
+
+	/* the title indexes point to nodes; they are built again as needed */
+	if (guide->_titleidx)
+		_guide_title_index_drop_subtree(guide, root);
+
+	ret = tree_compact_layout(guide->tree, _guide_layout_relocate, &l);
+
+	if (l.nodes) {
+		if (ret == 0) {
+			for (txn = j->oldest; txn; txn = txn->newer)
+				_guide_layout_fix_txn(&l, txn);
+			for (txn = j->redo; txn; txn = txn->older)
+				_guide_layout_fix_txn(&l, txn);
+		}
+		lut_free(l.nodes);
+		lut_free(l.datas);
+	}
+	if (l.b.slab)
+		_guide_slab_put(l.b.slab);
+
+	guide_unlock(guide);
+	_guide_alloc_leave(prev);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+/* Memory usage (guide_memory_usage()). The node data knows the size of the
+ * memory it was allocated in (see _GUIDE_DATA_SIZE()); its strings are
+ * charged to titles and texts whether inline or not, and the rest to the
+ * node data. */
+
+static void _guide_memory_add_node(struct guide_t *guide, struct tree_node_t *node,
+	struct guide_memory_t *usage)
+{
+	struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(node);
+	struct _guide_title_index_t *ti;
+	size_t size, title_size, text_size;
+
+	usage->tree_nodes += tree_node_memory(node);
+	if ((ti = _guide_title_index_get(guide, node)))
+		usage->luts += sizeof(struct _guide_title_index_t) +
+			(ti->mask + 1) * sizeof(struct _guide_title_slot_t);
+
+	title_size = (wcslen(data->title) + 1) * sizeof(wchar_t);
+	text_size = data->_blob ? sizeof(struct _guide_blob_t) : strlen(data->_text) + 1;
+	usage->titles += title_size;
+	usage->texts += text_size;
+
+	size = data->_flags >> _GUIDE_DATA_SIZE_SHIFT;
+	if (data->_flags & _GUIDE_DATA_INLINE_TITLE)
+		size -= title_size;
+	if (data->_flags & _GUIDE_DATA_INLINE_TEXT)
+		size -= text_size;
+	usage->nodedata += size + _guide_attrs_size(data->_attrs);
+}
+
+int guide_memory_usage(struct guide_t *guide, struct tree_node_t *node,
+	struct guide_memory_t *usage)
+{
+	struct tree_iter_t it;
+
+	assert(guide);
+	assert(usage);
+	if (!guide || !usage)
+		return -1;
+
+	memset(usage, 0, sizeof(*usage));
+	guide_lock_read(guide);
+	if (!node)
+		node = tree_get_root(guide->tree);
+
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it))
+		_guide_memory_add_node(guide, it.node, usage);
+
+	/* the tables are shared by all the nodes: the whole guide only */
+	if (node == tree_get_root(guide->tree)) {
+		usage->luts += lut_memory_usage(guide->_uidtbl, NULL);
+		if (guide->_titleidx)
+			usage->luts += lut_memory_usage(guide->_titleidx, NULL);
+	}
+	guide_unlock(guide);
+
+	usage->total = usage->tree_nodes + usage->nodedata + usage->titles +
+		usage->texts + usage->luts;
+	return 0;
 }
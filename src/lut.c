@@ -17,11 +17,13 @@
  */
 
 #include <stdlib.h>
-#include <string.h>		/* memmove() */
+#include <stdint.h>
+#include <libguide/alloc.h>
 #include <libguide/lut.h>
+#include "stats.h"
 
-#define _LUT_INITIAL_SIZE		(512)
-#define _LUT_GROW_SIZE			(512)
+#define _LUT_INITIAL_SIZE		(512)	/* must be a power of 2 */
+#define _LUT_MAX_LOAD(alloc)	((alloc) / 4 * 3)
 
 struct _lut_entry_t
 {
@@ -30,70 +32,131 @@ struct _lut_entry_t
 };
 
 /**
- * lut stands for Lookup Table 
+ * lut stands for Lookup Table. It's an open addressing hash table with
+ * linear probing; an entry with lhs == NULL is empty, so the NULL key is
+ * kept aside.
  */
 struct lut_t
 {
 	struct _lut_entry_t *entries;
 	unsigned n;
 	unsigned alloc;
+
+	int has_null;
+	void *null_rhs;
 };
 
+static unsigned _lut_hash(struct lut_t *lut, void *lhs)
+{
+	/* Fibonacci hashing: keys are pointers (aligned) or small integers
+	   (uids), both of which need their bits mixed */
+	uint64_t h = (uint64_t)(uintptr_t)lhs * 0x9E3779B97F4A7C15ull;
+	return (unsigned)(h >> 32) & (lut->alloc - 1);
+}
+
 struct lut_t *lut_create()
 {
-	struct lut_t *lut = (struct lut_t *)malloc(sizeof(struct lut_t));
+	struct lut_t *lut = (struct lut_t *)guide_malloc(sizeof(struct lut_t));
 	lut->entries = 
-		(struct _lut_entry_t *)malloc(
-			_LUT_INITIAL_SIZE * sizeof(struct _lut_entry_t));
+		(struct _lut_entry_t *)guide_calloc(_LUT_INITIAL_SIZE, sizeof(struct _lut_entry_t));
 	lut->n = 0;
 	lut->alloc = _LUT_INITIAL_SIZE;
+	lut->has_null = 0;
+	lut->null_rhs = NULL;
 	return lut;
 }
 
 void lut_free(struct lut_t *lut)
 {
-	free(lut->entries);
+	guide_free(lut->entries);
 	lut->entries = 0;
 	lut->n = lut->alloc = 0;
-	free(lut);
+	guide_free(lut);
 }
 
 static int _lut_get_index(struct lut_t *lut, void *lhs)
 {
-	int i;
-	for (i=0; i<(int)lut->n; ++i) {
-		if (lut->entries[i].lhs == lhs)
-			return i;
-	}
-	return -1;
+	unsigned h = _lut_hash(lut, lhs), i = h, mask = lut->alloc - 1;
+	while (lut->entries[i].lhs && lut->entries[i].lhs != lhs)
+		i = (i + 1) & mask;
+	GUIDE_STATS_ADD(_GS_LUT_PROBES, ((i - h) & mask) + 1);
+	return lut->entries[i].lhs ? (int)i : -1;
+}
+
+static void _lut_insert(struct lut_t *lut, void *lhs, void *rhs)
+{
+	unsigned h = _lut_hash(lut, lhs), i = h, mask = lut->alloc - 1;
+	while (lut->entries[i].lhs)
+		i = (i + 1) & mask;
+	GUIDE_STATS_ADD(_GS_LUT_PROBES, ((i - h) & mask) + 1);
+	lut->entries[i].lhs = lhs;
+	lut->entries[i].rhs = rhs;
+}
+
+static void _lut_resize(struct lut_t *lut, unsigned alloc)
+{
+	struct _lut_entry_t *old = lut->entries;
+	unsigned i, old_alloc = lut->alloc;
+
+	lut->alloc = alloc;
+	lut->entries = 
+		(struct _lut_entry_t *)guide_calloc(lut->alloc, sizeof(struct _lut_entry_t));
+	for (i=0; i<old_alloc; ++i)
+		if (old[i].lhs)
+			_lut_insert(lut, old[i].lhs, old[i].rhs);
+	guide_free(old);
 }
 
 void lut_set(struct lut_t *lut, void *lhs, void *rhs)
 {
-	struct _lut_entry_t *e = lut->entries;
-	unsigned old_idx = _lut_get_index(lut, lhs);
-	unsigned n = lut->n;
+	int old_idx;
+
+	if (!lhs) {
+		lut->has_null = 1;
+		lut->null_rhs = rhs;
+		return;
+	}
 
+	old_idx = _lut_get_index(lut, lhs);
 	if (old_idx != -1) {
-		e[old_idx].lhs = rhs;
+		lut->entries[old_idx].rhs = rhs;
 	} else {
-		if (n >= lut->alloc) {
-			lut->entries = (struct _lut_entry_t *)realloc(
-								lut->entries,
-								(lut->alloc + _LUT_GROW_SIZE) *
-								 	sizeof(struct _lut_entry_t));
-			lut->alloc += _LUT_GROW_SIZE;
-		}
-
-		lut->entries[n].lhs = lhs;
-		lut->entries[n].rhs = rhs;
+		if (lut->n + 1 > _LUT_MAX_LOAD(lut->alloc))
+			_lut_resize(lut, lut->alloc * 2);
+		_lut_insert(lut, lhs, rhs);
 		++(lut->n);
 	}
 }
 
+void lut_reserve(struct lut_t *lut, unsigned n)
+{
+	unsigned alloc = lut->alloc;
+
+	while (lut->n + n > _LUT_MAX_LOAD(alloc))
+		alloc *= 2;
+	if (alloc != lut->alloc)
+		_lut_resize(lut, alloc);
+}
+
+size_t lut_memory_usage(struct lut_t *lut, unsigned *count)
+{
+	if (count)
+		*count = lut->n + (lut->has_null ? 1 : 0);
+	return sizeof(struct lut_t) + lut->alloc * sizeof(struct _lut_entry_t);
+}
+
 int lut_get(struct lut_t *lut, void *lhs, void **rhsp)
 {
-	unsigned idx = _lut_get_index(lut, lhs);
+	int idx;
+
+	if (!lhs) {
+		if (!lut->has_null)
+			return -1;
+		*rhsp = lut->null_rhs;
+		return 0;
+	}
+
+	idx = _lut_get_index(lut, lhs);
 	if (idx != -1) {
 		void *rhs = lut->entries[idx].rhs;
 		*((int **)rhsp) = (int *) rhs;
@@ -102,3 +165,42 @@ int lut_get(struct lut_t *lut, void *lhs, void **rhsp)
 		return -1;
 	}
 }
+
+int lut_remove(struct lut_t *lut, void *lhs)
+{
+	unsigned i, j, k, mask = lut->alloc - 1;
+	int idx;
+
+	if (!lhs) {
+		if (!lut->has_null)
+			return -1;
+		lut->has_null = 0;
+		lut->null_rhs = NULL;
+		return 0;
+	}
+
+	idx = _lut_get_index(lut, lhs);
+	if (idx == -1)
+		return -1;
+
+	/* backward shift deletion: move up entries of the probe sequence that
+	   would no longer be found past the hole */
+	i = (unsigned)idx;
+	j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!lut->entries[j].lhs)
+			break;
+		k = _lut_hash(lut, lut->entries[j].lhs);
+		/* skip if k lies cyclically in (i, j] */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		lut->entries[i] = lut->entries[j];
+		i = j;
+	}
+	lut->entries[i].lhs = NULL;
+	lut->entries[i].rhs = NULL;
+	--(lut->n);
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+/* 
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "stats.h"
+
+#ifdef GUIDE_STATS
+_Atomic uint64_t _guide_stats[_GS_COUNT];
+#endif
+
+int guide_get_stats(struct guide_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifdef GUIDE_STATS
+	int i;
+
+	for (i = 0; i < GP_COUNT; ++i)
+		stats->phase_ns[i] = atomic_load_explicit(&_guide_stats[i], memory_order_relaxed);
+	stats->lut_probes = atomic_load_explicit(&_guide_stats[_GS_LUT_PROBES], memory_order_relaxed);
+	stats->allocs = atomic_load_explicit(&_guide_stats[_GS_ALLOCS], memory_order_relaxed);
+	stats->bytes_read = atomic_load_explicit(&_guide_stats[_GS_BYTES_READ], memory_order_relaxed);
+	stats->bytes_written = atomic_load_explicit(&_guide_stats[_GS_BYTES_WRITTEN],
+		memory_order_relaxed);
+	stats->nodes = atomic_load_explicit(&_guide_stats[_GS_NODES], memory_order_relaxed);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void guide_reset_stats()
+{
+#ifdef GUIDE_STATS
+	int i;
+
+	for (i = 0; i < _GS_COUNT; ++i)
+		atomic_store_explicit(&_guide_stats[i], 0, memory_order_relaxed);
+#endif
+}
+
+const char *guide_stats_phase_name(int phase)
+{
+	static const char *names[GP_COUNT] = {
+		"map", "header", "decode", "utf8", "link", "uids", "store"
+	};
+
+	return phase >= 0 && phase < GP_COUNT ? names[phase] : NULL;
+}
@@ -0,0 +1,71 @@
+/* 
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Hooks for the statistics of stats.h, private to the library. They
+ * compile to nothing unless GUIDE_STATS is defined. */
+
+#ifndef _GUIDE_STATS_H_
+#define _GUIDE_STATS_H_
+
+#include <libguide/stats.h>
+
+/* the counters come after the phase timers */
+enum
+{
+	_GS_LUT_PROBES = GP_COUNT,
+	_GS_ALLOCS,
+	_GS_BYTES_READ,
+	_GS_BYTES_WRITTEN,
+	_GS_NODES,
+	_GS_COUNT
+};
+
+#ifdef GUIDE_STATS
+
+#include <stdatomic.h>
+#include <time.h>
+
+extern _Atomic uint64_t _guide_stats[_GS_COUNT];
+
+static inline void _guide_stats_add(int counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(&_guide_stats[counter], n, memory_order_relaxed);
+}
+
+static inline uint64_t _guide_stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#define GUIDE_STATS_ADD(counter, n)	_guide_stats_add((counter), (n))
+/* declare `t' and start timing with it */
+#define GUIDE_STATS_START(t)		uint64_t t = _guide_stats_now()
+#define GUIDE_STATS_STOP(phase, t)	_guide_stats_add((phase), _guide_stats_now() - (t))
+
+#else
+
+#define GUIDE_STATS_ADD(counter, n)	((void)0)
+#define GUIDE_STATS_START(t)		((void)0)
+#define GUIDE_STATS_STOP(phase, t)	((void)0)
+
+#endif
+
+#endif // _GUIDE_STATS_H_
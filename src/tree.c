@@ -17,93 +17,1887 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libguide/alloc.h>
 #include <libguide/tree.h>
+#include <libguide/lut.h>
+
+/* value of tree_node_t::enter for nodes that were never numbered */
+#define _TREE_NO_ENTER		((uint32)-1)
+
+/* parents with at least this many children get a children index */
+#define _TREE_CHILDREN_INDEX_MIN	(64)
+/* maximum number of children in one chunk of a children index */
+#define _TREE_CHUNK_SIZE			(64)
+
+/* A run of consecutive children of an indexed parent. */
+struct _tree_chunk_t
+{
+	uint32 ordinal;		/* position in _tree_children_t::chunks */
+	uint32 count;
+	struct tree_node_t *nodes[_TREE_CHUNK_SIZE];
+};
+
+/* Children index: the children of a wide parent, in order, in a list of
+ * chunks. A Fenwick tree over the chunk sizes finds the chunk holding a
+ * given position, and the position of a given chunk, in O(log k). */
+struct _tree_children_t
+{
+	struct _tree_chunk_t **chunks;
+	uint32 *fenwick;	/* 1-based, n_chunks entries */
+	uint32 n_chunks;
+	uint32 alloc;
+	uint32 count;
+};
+
+/* Per-node data that only a few nodes need, kept out of tree_node_t. */
+struct _tree_node_aux_t
+{
+	struct tree_t *tree;	/* roots only: the tree the node is the root of */
+	struct _tree_children_t *children;	/* wide parents only */
+	struct _tree_chunk_t *chunk;	/* children of wide parents only */
+	_Atomic(struct _tree_history_t *) hist;	/* old states kept for snapshots */
+};
 
 struct tree_node_t
 {
-	void *data;
-	struct tree_node_t *prev;
-	struct tree_node_t *next;
-	struct tree_node_t *parent;
-	struct tree_node_t *first_child;
-};
+	void *data;
+	struct tree_node_t *prev;
+	struct tree_node_t *next;
+	struct tree_node_t *parent;
+	struct tree_node_t *first_child;
+	uint32 size;	/* number of nodes in the subtree, including this one */
+	uint32 enter;	/* preorder rank, if the tree is indexed (see tree_t) */
+	struct _tree_node_aux_t *aux;
+	struct _tree_block_t *block;	/* if allocated as part of a block */
+};
+
+/* Nodes allocated together, by tree_build_from_parent_array() or from an
+ * arena (tree_arena_create()). The block is freed with the last of its
+ * nodes, and, for an arena, once the arena is done with it. Nodes of a
+ * block may end up in different trees (by splitting), freed on different
+ * threads (guide_destroy_async()), hence the atomic counter. */
+struct _tree_block_t
+{
+	atomic_uint refs;	/* number of nodes not freed yet */
+	struct tree_node_t nodes[];
+};
+
+/* see tree_arena_create(): carves nodes out of `block', on which it holds
+ * a reference of its own */
+struct tree_arena_t
+{
+	uint32 block_nodes;
+	uint32 used;	/* nodes carved out of `block' so far */
+	struct _tree_block_t *block;
+};
+
+/* the arena of the calling thread, see tree_arena_use() */
+static _Thread_local struct tree_arena_t *_tree_thread_arena;
+
+struct tree_t
+{
+	struct tree_node_t *root;
+
+	/* If `indexed', the `enter' numbers of the nodes are the preorder
+	 * ranks, but only ranks below `index_valid' are known to be correct:
+	 * mutations lower it to the first rank they affect, and queries
+	 * renumber from there on once `index_credit' covers it: until then they
+	 * walk the tree instead, and add the steps they take to the credit. */
+	int indexed;
+	uint32 index_valid;
+	size_t index_credit;
+
+	/* see tree_set_change_fn() */
+	tree_change_fn_t change_fn;
+	void *change_cargo;
+
+	/* snapshot state, created with the first snapshot and shared with the
+	 * trees split from this one */
+	struct _tree_snapshots_t *snap;
+
+	/* see tree_set_shared(): serializes the index updates done by queries */
+	pthread_mutex_t *lock;
+
+	/* see tree_begin_batch() */
+	struct _tree_batch_t *batch;
+};
+
+static struct _tree_snapshots_t *_tree_snap_get(struct tree_node_t *node);
+static void _tree_snap_touch(struct _tree_snapshots_t *snap, struct tree_node_t *node);
+static void _tree_batch_check(struct tree_node_t *node);
+static void _tree_batch_check_tree(struct tree_t *tree);
+
+struct tree_node_t *tree_get_root(struct tree_t *tree)
+{
+	assert(tree);
+	return tree->root;
+}
+
+struct tree_node_t *tree_get_first_child(struct tree_node_t *parent)
+{
+	assert(parent);
+	return parent->first_child;
+}
+
+struct tree_node_t *tree_get_next_sibling(struct tree_node_t *node)
+{
+	assert(node);
+	return node->next;
+}
+
+struct tree_node_t *tree_get_prev_sibling(struct tree_node_t *node)
+{
+	assert(node);
+	return node->prev;
+}
+
+struct tree_node_t *tree_get_parent(struct tree_node_t *node)
+{
+	assert(node);
+	return node->parent;
+}
+
+void *tree_get_data(struct tree_node_t *node)
+{
+	assert(node);
+	return node->data;
+}
+
+void tree_set_data(struct tree_node_t *node, void *data)
+{
+	assert(node);
+	_tree_snap_touch(_tree_snap_get(node), node);
+	node->data = data;
+}
+
+size_t tree_node_memory(struct tree_node_t *node)
+{
+	struct _tree_children_t *ch;
+	size_t size = sizeof(struct tree_node_t);
+
+	assert(node);
+
+	if (!node->aux)
+		return size;
+	size += sizeof(struct _tree_node_aux_t);
+	if (node->aux->tree)
+		size += sizeof(struct tree_t);
+	if ((ch = node->aux->children))
+		size += sizeof(struct _tree_children_t) +
+			ch->alloc * sizeof(struct _tree_chunk_t *) +
+			(ch->alloc ? (ch->alloc + 1) * sizeof(uint32) : 0) +
+			ch->n_chunks * sizeof(struct _tree_chunk_t);
+	return size;
+}
+
+static void _tree_block_put(struct _tree_block_t *block)
+{
+	if (atomic_fetch_sub(&block->refs, 1) == 1)
+		guide_free(block);
+}
+
+struct tree_arena_t *tree_arena_create(uint32 block_nodes)
+{
+	struct tree_arena_t *arena;
+
+	assert(block_nodes > 0);
+
+	arena = (struct tree_arena_t *)guide_malloc(sizeof(struct tree_arena_t));
+	assert(arena);
+	if (!arena) return NULL;
+
+	arena->block_nodes = block_nodes;
+	arena->used = 0;
+	arena->block = NULL;
+	return arena;
+}
+
+void tree_arena_destroy(struct tree_arena_t *arena)
+{
+	assert(arena);
+	assert(_tree_thread_arena != arena);
+
+	if (arena->block)
+		_tree_block_put(arena->block);
+	guide_free(arena);
+}
+
+struct tree_arena_t *tree_arena_use(struct tree_arena_t *arena)
+{
+	struct tree_arena_t *prev = _tree_thread_arena;
+
+	_tree_thread_arena = arena;
+	return prev;
+}
+
+/* carve a node out of the block of `arena', starting a new one if full */
+static struct tree_node_t *_tree_arena_alloc(struct tree_arena_t *arena)
+{
+	struct _tree_block_t *block = arena->block;
+	struct tree_node_t *node;
+
+	if (!block || arena->used == arena->block_nodes) {
+		block = (struct _tree_block_t *)guide_malloc(sizeof(struct _tree_block_t) +
+			arena->block_nodes * sizeof(struct tree_node_t));
+		assert(block);
+		if (!block) return NULL;
+		atomic_init(&block->refs, 1);
+		if (arena->block)
+			_tree_block_put(arena->block);
+		arena->block = block;
+		arena->used = 0;
+	}
+
+	atomic_fetch_add_explicit(&block->refs, 1, memory_order_relaxed);
+	node = block->nodes + arena->used++;
+	node->block = block;
+	return node;
+}
+
+static struct tree_node_t *_tree_node_create(void *data)
+{
+	struct tree_node_t *node;
+
+	if (_tree_thread_arena) {
+		node = _tree_arena_alloc(_tree_thread_arena);
+	} else {
+		node = (struct tree_node_t *)guide_malloc(sizeof(struct tree_node_t));
+		if (node)
+			node->block = NULL;
+	}
+	assert(node);
+	if (!node) return NULL;
+
+	node->data = data;
+	node->prev = node->next = node->parent = node->first_child = NULL;
+	node->size = 1;
+	node->enter = _TREE_NO_ENTER;
+	node->aux = NULL;
+
+	return node;
+}
+
+static void _tree_node_free(struct tree_node_t *node);
+
+static struct _tree_node_aux_t *_tree_get_aux(struct tree_node_t *node)
+{
+	struct _tree_node_aux_t *aux;
+
+	/* readers of a shared tree may be looking: fill in, then publish */
+	if (!node->aux) {
+		aux = (struct _tree_node_aux_t *)guide_malloc(sizeof(struct _tree_node_aux_t));
+		assert(aux);
+		aux->tree = NULL;
+		aux->children = NULL;
+		aux->chunk = NULL;
+		atomic_init(&aux->hist, NULL);
+		atomic_thread_fence(memory_order_release);
+		node->aux = aux;
+	}
+	return node->aux;
+}
+
+/* the chunk of `node', if its parent has a children index */
+static struct _tree_chunk_t *_tree_chunk_of(struct tree_node_t *node)
+{
+	return node->aux ? node->aux->chunk : NULL;
+}
+
+/* the history of `node', if snapshots keep any */
+static struct _tree_history_t *_tree_hist_of(struct tree_node_t *node, memory_order order)
+{
+	struct _tree_node_aux_t *aux = node->aux;
+
+	return aux ? atomic_load_explicit(&aux->hist, order) : NULL;
+}
+
+/* free the aux data of `node' if nothing is left in it */
+static void _tree_put_aux(struct tree_node_t *node)
+{
+	if (node->aux && !node->aux->tree && !node->aux->children && !node->aux->chunk &&
+			!atomic_load_explicit(&node->aux->hist, memory_order_relaxed)) {
+		guide_free(node->aux);
+		node->aux = NULL;
+	}
+}
+
+/* recompute the Fenwick tree and the chunk ordinals */
+static void _tree_children_reindex(struct _tree_children_t *ch)
+{
+	uint32 i, j;
+
+	for (i = 1; i <= ch->n_chunks; ++i) {
+		ch->chunks[i - 1]->ordinal = i - 1;
+		ch->fenwick[i] = ch->chunks[i - 1]->count;
+	}
+	for (i = 1; i <= ch->n_chunks; ++i) {
+		j = i + (i & -i);
+		if (j <= ch->n_chunks)
+			ch->fenwick[j] += ch->fenwick[i];
+	}
+}
+
+static void _tree_children_adjust(struct _tree_children_t *ch, uint32 ordinal, int delta)
+{
+	uint32 i;
+
+	for (i = ordinal + 1; i <= ch->n_chunks; i += i & -i)
+		ch->fenwick[i] += delta;
+	ch->count += delta;
+}
+
+/* position of the first child in chunk `ordinal' */
+static uint32 _tree_children_offset(struct _tree_children_t *ch, uint32 ordinal)
+{
+	uint32 i, n = 0;
+
+	for (i = ordinal; i > 0; i -= i & -i)
+		n += ch->fenwick[i];
+	return n;
+}
+
+/* find the chunk with the child at position `n' (< count), and make `n'
+ * the position within that chunk */
+static struct _tree_chunk_t *_tree_children_find(struct _tree_children_t *ch, uint32 *n)
+{
+	uint32 pos = 0, step;
+
+	for (step = 1; step * 2 <= ch->n_chunks; step *= 2)
+		;
+	for (; step; step /= 2) {
+		if (pos + step <= ch->n_chunks && ch->fenwick[pos + step] <= *n) {
+			pos += step;
+			*n -= ch->fenwick[pos];
+		}
+	}
+	return ch->chunks[pos];
+}
+
+/* insert an empty chunk at `ordinal' */
+static struct _tree_chunk_t *_tree_children_new_chunk(struct _tree_children_t *ch, uint32 ordinal)
+{
+	struct _tree_chunk_t *c;
+
+	if (ch->n_chunks == ch->alloc) {
+		uint32 alloc = ch->alloc ? 2 * ch->alloc : 16;
+		struct _tree_chunk_t **chunks = (struct _tree_chunk_t **)guide_realloc(ch->chunks,
+			alloc * sizeof(struct _tree_chunk_t *));
+		uint32 *fenwick = (uint32 *)guide_realloc(ch->fenwick, (alloc + 1) * sizeof(uint32));
+		assert(chunks);
+		assert(fenwick);
+		if (chunks) ch->chunks = chunks;
+		if (fenwick) ch->fenwick = fenwick;
+		if (!chunks || !fenwick) return NULL;
+		ch->alloc = alloc;
+	}
+
+	c = (struct _tree_chunk_t *)guide_malloc(sizeof(struct _tree_chunk_t));
+	assert(c);
+	if (!c) return NULL;
+	c->count = 0;
+
+	memmove(ch->chunks + ordinal + 1, ch->chunks + ordinal,
+		(ch->n_chunks - ordinal) * sizeof(struct _tree_chunk_t *));
+	ch->chunks[ordinal] = c;
+	++ch->n_chunks;
+
+	return c;
+}
+
+static void _tree_children_free(struct _tree_children_t *ch)
+{
+	uint32 i;
+
+	for (i = 0; i < ch->n_chunks; ++i)
+		guide_free(ch->chunks[i]);
+	guide_free(ch->chunks);
+	guide_free(ch->fenwick);
+	guide_free(ch);
+}
+
+/* index the children of `parent'; chunks are filled to 3/4, to leave room
+ * for inserts */
+static struct _tree_children_t *_tree_children_build(struct tree_node_t *parent)
+{
+	struct _tree_children_t *ch;
+	struct _tree_chunk_t *c = NULL;
+	struct tree_node_t *node;
+
+	ch = (struct _tree_children_t *)guide_malloc(sizeof(struct _tree_children_t));
+	assert(ch);
+	if (!ch) return NULL;
+	ch->chunks = NULL;
+	ch->fenwick = NULL;
+	ch->n_chunks = ch->alloc = ch->count = 0;
+
+	for (node = parent->first_child; node; node = node->next) {
+		if (!c || c->count == _TREE_CHUNK_SIZE * 3 / 4) {
+			c = _tree_children_new_chunk(ch, ch->n_chunks);
+			if (!c) {
+				for (node = parent->first_child; node; node = node->next)
+					if (node->aux)
+						node->aux->chunk = NULL;
+				_tree_children_free(ch);
+				return NULL;
+			}
+		}
+		c->nodes[c->count++] = node;
+		_tree_get_aux(node)->chunk = c;
+		++ch->count;
+	}
+
+	_tree_children_reindex(ch);
+	atomic_thread_fence(memory_order_release);
+	_tree_get_aux(parent)->children = ch;
+	return ch;
+}
+
+static pthread_mutex_t *_tree_lock_of(struct tree_node_t *node);
+
+/* The children index of `parent', built now if the parent is wide enough
+ * to need one. NULL if it doesn't. */
+static struct _tree_children_t *_tree_children_get(struct tree_node_t *parent)
+{
+	struct _tree_children_t *ch;
+	struct tree_node_t *node;
+	pthread_mutex_t *lock;
+	uint32 n = 0;
+
+	if (parent->aux && parent->aux->children)
+		return parent->aux->children;
+
+	for (node = parent->first_child; node && n < _TREE_CHILDREN_INDEX_MIN; node = node->next)
+		++n;
+	if (n < _TREE_CHILDREN_INDEX_MIN)
+		return NULL;
+
+	/* queries on a shared tree may race to build it */
+	if (!(lock = _tree_lock_of(parent)))
+		return _tree_children_build(parent);
+	pthread_mutex_lock(lock);
+	ch = parent->aux ? parent->aux->children : NULL;
+	if (!ch)
+		ch = _tree_children_build(parent);
+	pthread_mutex_unlock(lock);
+	return ch;
+}
+
+/* position of an indexed child among its siblings */
+static uint32 _tree_children_index_of(struct tree_node_t *node)
+{
+	struct _tree_children_t *ch = node->parent->aux->children;
+	struct _tree_chunk_t *c = node->aux->chunk;
+	uint32 i;
+
+	for (i = 0; c->nodes[i] != node; ++i)
+		;
+	return _tree_children_offset(ch, c->ordinal) + i;
+}
+
+/* `node' was just linked under its parent, which has a children index */
+static void _tree_children_insert(struct _tree_children_t *ch, struct tree_node_t *node)
+{
+	struct _tree_chunk_t *c, *c2;
+	uint32 i, n = node->prev ? _tree_children_index_of(node->prev) + 1 : 0;
+
+	if (ch->n_chunks == 0) {
+		c = _tree_children_new_chunk(ch, 0);
+		_tree_children_reindex(ch);
+	} else if (n == ch->count) {
+		c = ch->chunks[ch->n_chunks - 1];
+		n = c->count;
+	} else {
+		c = _tree_children_find(ch, &n);
+	}
+	assert(c);
+
+	/* split a full chunk in halves */
+	if (c->count == _TREE_CHUNK_SIZE) {
+		c2 = _tree_children_new_chunk(ch, c->ordinal + 1);
+		assert(c2);
+		c2->count = c->count / 2;
+		c->count -= c2->count;
+		memcpy(c2->nodes, c->nodes + c->count, c2->count * sizeof(struct tree_node_t *));
+		for (i = 0; i < c2->count; ++i)
+			c2->nodes[i]->aux->chunk = c2;
+		_tree_children_reindex(ch);
+		if (n > c->count) {
+			n -= c->count;
+			c = c2;
+		}
+	}
+
+	memmove(c->nodes + n + 1, c->nodes + n, (c->count - n) * sizeof(struct tree_node_t *));
+	c->nodes[n] = node;
+	++c->count;
+	_tree_get_aux(node)->chunk = c;
+	_tree_children_adjust(ch, c->ordinal, 1);
+}
+
+/* `node' is about to be unlinked from its parent, which has a children index */
+static void _tree_children_remove(struct _tree_children_t *ch, struct tree_node_t *node)
+{
+	struct _tree_chunk_t *c = node->aux->chunk;
+	uint32 i;
+
+	for (i = 0; c->nodes[i] != node; ++i)
+		;
+	memmove(c->nodes + i, c->nodes + i + 1, (c->count - i - 1) * sizeof(struct tree_node_t *));
+	--c->count;
+	node->aux->chunk = NULL;
+	_tree_children_adjust(ch, c->ordinal, -1);
+
+	if (c->count == 0) {
+		memmove(ch->chunks + c->ordinal, ch->chunks + c->ordinal + 1,
+			(ch->n_chunks - c->ordinal - 1) * sizeof(struct _tree_chunk_t *));
+		--ch->n_chunks;
+		guide_free(c);
+		_tree_children_reindex(ch);
+	}
+}
+
+static void _tree_history_free(struct _tree_history_t *h);
+
+static void _tree_node_free(struct tree_node_t *node)
+{
+	struct _tree_history_t *h = _tree_hist_of(node, memory_order_relaxed);
+
+	if (h)
+		_tree_history_free(h);
+	if (node->aux && node->aux->children)
+		_tree_children_free(node->aux->children);
+	guide_free(node->aux);
+
+	if (!node->block)
+		guide_free(node);
+	else
+		_tree_block_put(node->block);
+}
+
+/* create a tree_t for `root' (which may be NULL) */
+static struct tree_t *_tree_create_for(struct tree_node_t *root)
+{
+	struct tree_t *t = (struct tree_t *)guide_malloc(sizeof(struct tree_t));
+	assert(t);
+	if (!t) return NULL;
+
+	t->root = root;
+	t->indexed = 0;
+	t->index_valid = 0;
+	t->index_credit = 0;
+	t->change_fn = NULL;
+	t->change_cargo = NULL;
+	t->snap = NULL;
+	t->lock = NULL;
+	t->batch = NULL;
+	if (root)
+		_tree_get_aux(root)->tree = t;
+
+	return t;
+}
+
+/* get the tree of a root node */
+static struct tree_t *_tree_of(struct tree_node_t *root)
+{
+	return root->aux ? root->aux->tree : NULL;
+}
+
+/* the lock of the tree of `node', if it's shared */
+static pthread_mutex_t *_tree_lock_of(struct tree_node_t *node)
+{
+	struct tree_t *tree;
+
+	while (node->parent)
+		node = node->parent;
+	tree = _tree_of(node);
+	return tree ? tree->lock : NULL;
+}
+
+/* add `n' to the subtree size of `node' and all of its ancestors, and
+ * return the root */
+static struct tree_node_t *_tree_grow_size(struct tree_node_t *node, uint32 n)
+{
+	struct tree_node_t *root = node;
+	for (; node; node = node->parent) {
+		node->size += n;
+		root = node;
+	}
+	return root;
+}
+
+/* subtract `n' from the subtree size of `node' and all of its ancestors,
+ * and return the root */
+static struct tree_node_t *_tree_shrink_size(struct tree_node_t *node, uint32 n)
+{
+	struct tree_node_t *root = node;
+	for (; node; node = node->parent) {
+		node->size -= n;
+		root = node;
+	}
+	return root;
+}
+
+/* `node' is about to be unlinked from its parent in the tree at `root'.
+ *
+ * Its preorder rank and all the later ones become stale. If `node' is stale
+ * itself, its `enter' is either past the valid mark, or it is below the
+ * real rank; either way lowering the mark to it is safe. */
+static void _tree_note_unlink(struct tree_node_t *root, struct tree_node_t *node)
+{
+	struct tree_t *tree = _tree_of(root);
+
+	if (_tree_chunk_of(node))
+		_tree_children_remove(node->parent->aux->children, node);
+
+	if (!tree)
+		return;
+	if (tree->change_fn)
+		tree->change_fn(node, TREE_CHANGE_UNLINKING, tree->change_cargo);
+	if (tree->indexed && node->enter < tree->index_valid)
+		tree->index_valid = node->enter;
+}
+
+/* `node' was just linked under its parent in the tree at `root'.
+ *
+ * Its preorder rank, which comes right after the subtree of its previous
+ * sibling or right after its parent, and all the later ones become stale. */
+static void _tree_note_link(struct tree_node_t *root, struct tree_node_t *node)
+{
+	struct tree_t *tree = _tree_of(root);
+	struct tree_node_t *ref;
+	uint32 rank;
+
+	if (node->parent->aux && node->parent->aux->children)
+		_tree_children_insert(node->parent->aux->children, node);
+
+	if (!tree)
+		return;
+	if (tree->change_fn)
+		tree->change_fn(node, TREE_CHANGE_LINKED, tree->change_cargo);
+	if (!tree->indexed)
+		return;
+
+	if ((ref = node->prev))
+		rank = ref->enter + ref->size;
+	else
+		rank = (ref = node->parent)->enter + 1;
+
+	/* a stale `ref' past the mark means the mark is already before `node' */
+	if (ref->enter < tree->index_valid && rank < tree->index_valid)
+		tree->index_valid = rank;
+}
+
+/* renumber the nodes from the valid mark till the end of the tree */
+static void _tree_index_update(struct tree_t *tree)
+{
+	struct tree_node_t *node;
+	uint32 rank = tree->index_valid;
+
+	if (!tree->root || rank >= tree->root->size)
+		return;
+
+	node = tree_get_nth_preorder(tree->root, rank);
+	while (node) {
+		node->enter = rank++;
+		if (node->first_child) {
+			node = node->first_child;
+			continue;
+		}
+		while (node->parent && !node->next)
+			node = node->parent;
+		node = node->next;
+	}
+
+	tree->index_valid = rank;
+}
+
+/* Walk up from `node', counting each ancestor and the subtrees of the
+ * siblings before each node on the way. `steps' is as for
+ * _tree_is_within_steps(). */
+static uint32 _tree_preorder_rank(struct tree_node_t *node, size_t *steps)
+{
+	struct tree_node_t *prev;
+	uint32 rank = 0;
+	size_t n = 1;
+
+	for (; node->parent; node = node->parent) {
+		for (prev = node->prev; prev; prev = prev->prev, ++n)
+			rank += prev->size;
+		++rank;
+		++n;
+	}
+	if (steps)
+		*steps += n;
+	return rank;
+}
+
+/* Is the preorder index of `tree' up to date? Renumbering the stale ranks
+ * waits until the queries that went without the index have walked as many
+ * steps as it takes, so that a query costs at most about twice the walk,
+ * however changes and queries are mixed. */
+static int _tree_index_ready(struct tree_t *tree)
+{
+	if (tree->root && tree->index_valid < tree->root->size) {
+		if (tree->index_credit < tree->root->size - tree->index_valid)
+			return 0;
+		_tree_index_update(tree);
+	}
+	tree->index_credit = 0;
+	return 1;
+}
+
+/* is `node' in the subtree at `anc'? `steps', if not NULL, is increased by
+ * the number of nodes walked */
+static int _tree_is_within_steps(struct tree_node_t *node, struct tree_node_t *anc,
+		size_t *steps)
+{
+	size_t n = 1;
+	int ret = 0;
+
+	for (; node; node = node->parent, ++n)
+		if (node == anc) {
+			ret = 1;
+			break;
+		}
+	if (steps)
+		*steps += n;
+	return ret;
+}
+
+static int _tree_is_within(struct tree_node_t *node, struct tree_node_t *anc)
+{
+	return _tree_is_within_steps(node, anc, NULL);
+}
+
+struct _tree_deleter_cargo_t
+{
+	void *original_cargo;
+	tree_node_cleanup_fn_t cleanup_fn;
+};
+
+static int _tree_delete_traverser(struct tree_node_t *node, void *cargo)
+{
+	struct _tree_deleter_cargo_t *c = (struct _tree_deleter_cargo_t *)cargo;
+	assert(c);
+	if (c->cleanup_fn)
+		c->cleanup_fn(node, c->original_cargo);
+	_tree_node_free(node);
+	return 0;
+}
+
+/*
+ * Snapshots. Nodes are versioned: every snapshot has a version number, and
+ * changes made after it carry a higher one. The first time a node is
+ * changed in a version, if some live snapshot still sees its current state,
+ * that state (links and data pointer) is pushed onto the history of the
+ * node, tagged with the new version. A snapshot reads a node from the
+ * oldest history entry newer than itself, or from the node itself if there
+ * is none. Taking a snapshot is O(1), and only changed nodes are copied.
+ *
+ * Snapshots are read from any thread, without locks, while the tree is
+ * changed by a single writer. The writer publishes a history entry before
+ * it changes the node; a reader that reads the node itself checks the
+ * history again afterwards, and retries if an entry was pushed meanwhile.
+ *
+ * Memory that snapshots may still read (old history entries, deleted
+ * subtrees, strings replaced in data) is freed by the writer once no
+ * snapshot older than the change is live. A snapshot release only marks
+ * the snapshot; the writer notices on its next change.
+ */
+
+/* The state of a node as seen by a snapshot. */
+struct _tree_state_t
+{
+	struct tree_node_t *prev;
+	struct tree_node_t *next;
+	struct tree_node_t *parent;
+	struct tree_node_t *first_child;
+	void *data;
+};
+
+/* An old state of a node, valid before `version'. */
+struct _tree_version_t
+{
+	uint32 version;			/* the version whose change replaced this state */
+	uint32 older_version;	/* `older->version', or 0; readers test this, not `older' */
+	struct _tree_version_t *older;
+	struct _tree_state_t state;
+	void (*free_fn)(void *);	/* set if `state.data' is a copy (tree_snapshot_keep_data()) */
+};
+
+/* The history of one node, newest entry first. */
+struct _tree_history_t
+{
+	_Atomic(struct _tree_version_t *) head;
+	struct tree_node_t *node;
+	struct _tree_snapshots_t *snap;
+	struct _tree_history_t *prev_dirty;
+	struct _tree_history_t *next_dirty;
+};
+
+/* Memory to free once no snapshot older than `version' is live: either a
+ * detached subtree, or a single pointer. */
+struct _tree_deferred_t
+{
+	uint32 version;
+	struct tree_node_t *node;
+	tree_node_cleanup_fn_t cleanup_fn;
+	void *cargo;
+	void *p;
+	void (*free_fn)(void *);
+	struct _tree_deferred_t *next;
+};
+
+struct tree_snapshot_t
+{
+	struct _tree_snapshots_t *snap;
+	struct tree_node_t *root;
+	uint32 version;
+	atomic_int released;
+	struct tree_snapshot_t *next;
+};
+
+/* Snapshot state of a tree and the trees split from it. */
+struct _tree_snapshots_t
+{
+	atomic_uint refs;		/* trees, and snapshots not released */
+	atomic_int pending;		/* a snapshot was released since the last prune */
+	uint32 version;			/* version of the changes being made now */
+
+	/* as of the last prune or snapshot; releases since then are not
+	 * counted, which only keeps more history than needed */
+	struct tree_snapshot_t *snaps;
+	uint32 n_live;
+	uint32 min_live;
+	uint32 max_live;
+
+	struct _tree_history_t *dirty;	/* nodes with a history */
+	struct _tree_deferred_t *deferred;
+
+	/* the allocator in use when it was created, for whichever owner goes
+	 * last to free everything with */
+	const struct guide_allocator_t *alloc;
+};
+
+/* Number of snapshot objects not freed yet, in all trees. While it's zero,
+ * changes don't even look for the snapshot state of their tree. */
+static atomic_uint _tree_snapshot_count;
+
+static void _tree_version_free_chain(struct _tree_version_t *v)
+{
+	struct _tree_version_t *older;
+
+	for (; v; v = older) {
+		older = v->older;
+		if (v->free_fn)
+			v->free_fn(v->state.data);
+		guide_free(v);
+	}
+}
+
+static void _tree_history_free(struct _tree_history_t *h)
+{
+	struct _tree_snapshots_t *snap = h->snap;
+
+	if (h->prev_dirty)
+		h->prev_dirty->next_dirty = h->next_dirty;
+	else
+		snap->dirty = h->next_dirty;
+	if (h->next_dirty)
+		h->next_dirty->prev_dirty = h->prev_dirty;
+
+	_tree_version_free_chain(atomic_load_explicit(&h->head, memory_order_relaxed));
+	atomic_store_explicit(&h->node->aux->hist, NULL, memory_order_relaxed);
+	guide_free(h);
+}
+
+static void _tree_deferred_run(struct _tree_deferred_t *d)
+{
+	struct _tree_deleter_cargo_t c = { d->cargo, d->cleanup_fn };
+
+	if (d->node)
+		tree_traverse_subtree_postorder(d->node, _tree_delete_traverser, (void *)&c);
+	else
+		d->free_fn(d->p);
+	guide_free(d);
+}
+
+/* Forget released snapshots, and free what only they could see. Writer
+ * only, or the last owner of `snap'. */
+static void _tree_snap_prune(struct _tree_snapshots_t *snap)
+{
+	struct tree_snapshot_t **ps, *s;
+	struct _tree_history_t *h, *hn;
+	struct _tree_version_t *v;
+	struct _tree_deferred_t **pd, *d;
+
+	atomic_store(&snap->pending, 0);
+
+	snap->n_live = 0;
+	for (ps = &snap->snaps; (s = *ps); ) {
+		if (atomic_load_explicit(&s->released, memory_order_acquire)) {
+			*ps = s->next;
+			guide_free(s);
+			atomic_fetch_sub(&_tree_snapshot_count, 1);
+			continue;
+		}
+		if (snap->n_live == 0 || s->version < snap->min_live)
+			snap->min_live = s->version;
+		if (snap->n_live == 0 || s->version > snap->max_live)
+			snap->max_live = s->version;
+		++snap->n_live;
+		ps = &s->next;
+	}
+
+	/* with no reader left, all history goes; otherwise an entry is kept
+	 * while some snapshot may go on from it to the older ones, and the
+	 * newest entry is kept anyway, as readers look at it */
+	for (h = snap->dirty; h; h = hn) {
+		hn = h->next_dirty;
+		if (!snap->n_live) {
+			_tree_history_free(h);
+			continue;
+		}
+		v = atomic_load_explicit(&h->head, memory_order_relaxed);
+		while (v->older_version > snap->min_live)
+			v = v->older;
+		_tree_version_free_chain(v->older);
+		v->older = NULL;
+	}
+
+	for (pd = &snap->deferred; (d = *pd); ) {
+		if (snap->n_live && d->version > snap->min_live) {
+			pd = &d->next;
+			continue;
+		}
+		*pd = d->next;
+		_tree_deferred_run(d);
+	}
+}
+
+static void _tree_snap_put(struct _tree_snapshots_t *snap)
+{
+	const struct guide_allocator_t *prev;
+
+	if (atomic_fetch_sub(&snap->refs, 1) != 1)
+		return;
+
+	/* no tree and no snapshot left: everything goes */
+	prev = guide_use_allocator(snap->alloc);
+	_tree_snap_prune(snap);
+	assert(!snap->snaps);
+	guide_free(snap);
+	guide_use_allocator(prev);
+}
+
+/* The snapshot state of the tree of `node', if it may need attention:
+ * live snapshots, or released ones to prune. Walks up to the root, but
+ * only while some snapshot exists anywhere. */
+static struct _tree_snapshots_t *_tree_snap_get(struct tree_node_t *node)
+{
+	struct tree_t *tree;
+
+	if (atomic_load_explicit(&_tree_snapshot_count, memory_order_relaxed) == 0)
+		return NULL;
+
+	while (node->parent)
+		node = node->parent;
+	tree = _tree_of(node);
+	if (!tree || !tree->snap)
+		return NULL;
+	if (atomic_load_explicit(&tree->snap->pending, memory_order_relaxed))
+		_tree_snap_prune(tree->snap);
+	return tree->snap->n_live ? tree->snap : NULL;
+}
+
+/* `node' is about to change: save its state if a live snapshot sees it */
+static void _tree_snap_touch(struct _tree_snapshots_t *snap, struct tree_node_t *node)
+{
+	struct _tree_history_t *h;
+	struct _tree_version_t *head, *v;
+
+	if (!snap || !node)
+		return;
+
+	h = _tree_hist_of(node, memory_order_relaxed);
+	head = h ? atomic_load_explicit(&h->head, memory_order_relaxed) : NULL;
+	if (head && head->version == snap->version)
+		return;		/* saved by an earlier change in this version */
+	if (head && head->version > snap->max_live)
+		return;		/* all live snapshots read the history */
+
+	v = (struct _tree_version_t *)guide_malloc(sizeof(struct _tree_version_t));
+	assert(v);
+	if (!v) return;
+	v->version = snap->version;
+	v->older = head;
+	v->older_version = head ? head->version : 0;
+	v->state.prev = node->prev;
+	v->state.next = node->next;
+	v->state.parent = node->parent;
+	v->state.first_child = node->first_child;
+	v->state.data = node->data;
+	v->free_fn = NULL;
+
+	if (!h) {
+		h = (struct _tree_history_t *)guide_malloc(sizeof(struct _tree_history_t));
+		assert(h);
+		if (!h) {
+			guide_free(v);
+			return;
+		}
+		atomic_init(&h->head, NULL);
+		h->node = node;
+		h->snap = snap;
+		h->prev_dirty = NULL;
+		h->next_dirty = snap->dirty;
+		if (snap->dirty)
+			snap->dirty->prev_dirty = h;
+		snap->dirty = h;
+		atomic_store_explicit(&_tree_get_aux(node)->hist, h, memory_order_release);
+	}
+	atomic_store_explicit(&h->head, v, memory_order_release);
+
+	/* the entry must be visible before any change to the node is */
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* touch the nodes whose links change when `node' is unlinked */
+static void _tree_snap_touch_unlink(struct _tree_snapshots_t *snap, struct tree_node_t *node)
+{
+	if (!snap)
+		return;
+	_tree_snap_touch(snap, node);
+	_tree_snap_touch(snap, node->prev);
+	_tree_snap_touch(snap, node->next);
+	if (node->parent && node->parent->first_child == node)
+		_tree_snap_touch(snap, node->parent);
+}
+
+static void _tree_snap_defer(struct _tree_snapshots_t *snap, struct _tree_deferred_t *d)
+{
+	d->version = snap->version;
+	d->next = snap->deferred;
+	snap->deferred = d;
+}
+
+/* the state of `node' as seen by `ss' */
+static void _tree_snap_read(const struct tree_snapshot_t *ss, struct tree_node_t *node,
+		struct _tree_state_t *st)
+{
+	struct _tree_history_t *h;
+	struct _tree_version_t *v;
+
+	for (;;) {
+		h = _tree_hist_of(node, memory_order_acquire);
+		v = h ? atomic_load_explicit(&h->head, memory_order_acquire) : NULL;
+		if (v && v->version > ss->version) {
+			while (v->older_version > ss->version)
+				v = v->older;
+			*st = v->state;
+			return;
+		}
+
+		st->prev = node->prev;
+		st->next = node->next;
+		st->parent = node->parent;
+		st->first_child = node->first_child;
+		st->data = node->data;
+
+		/* unchanged if no entry was pushed while reading */
+		atomic_thread_fence(memory_order_acquire);
+		if (h == _tree_hist_of(node, memory_order_relaxed) &&
+				(!h || v == atomic_load_explicit(&h->head, memory_order_relaxed)))
+			return;
+	}
+}
+
+struct tree_snapshot_t *tree_snapshot_create(struct tree_t *tree)
+{
+	struct tree_snapshot_t *ss;
+	struct _tree_snapshots_t *snap;
+
+	assert(tree);
+
+	if (!tree->snap) {
+		snap = (struct _tree_snapshots_t *)guide_malloc(sizeof(struct _tree_snapshots_t));
+		assert(snap);
+		if (!snap) return NULL;
+		atomic_init(&snap->refs, 1);
+		atomic_init(&snap->pending, 0);
+		snap->version = 1;
+		snap->snaps = NULL;
+		snap->n_live = snap->min_live = snap->max_live = 0;
+		snap->dirty = NULL;
+		snap->deferred = NULL;
+		snap->alloc = guide_current_allocator();
+		tree->snap = snap;
+	}
+	snap = tree->snap;
+	_tree_snap_prune(snap);
+
+	ss = (struct tree_snapshot_t *)guide_malloc(sizeof(struct tree_snapshot_t));
+	assert(ss);
+	if (!ss) return NULL;
+	ss->snap = snap;
+	ss->root = tree->root;
+	atomic_init(&ss->released, 0);
+
+	/* the snapshot sees everything up to now; later changes are newer */
+	ss->version = snap->version++;
+	ss->next = snap->snaps;
+	snap->snaps = ss;
+	if (snap->n_live++ == 0)
+		snap->min_live = ss->version;
+	snap->max_live = ss->version;
+
+	atomic_fetch_add(&snap->refs, 1);
+	atomic_fetch_add(&_tree_snapshot_count, 1);
+	return ss;
+}
+
+void tree_snapshot_release(struct tree_snapshot_t *ss)
+{
+	struct _tree_snapshots_t *snap;
+
+	assert(ss);
+	snap = ss->snap;
+	atomic_store_explicit(&ss->released, 1, memory_order_release);
+	atomic_store(&snap->pending, 1);
+	_tree_snap_put(snap);
+}
+
+int tree_has_snapshots(struct tree_t *tree)
+{
+	assert(tree);
+	if (!tree->snap)
+		return 0;
+	if (atomic_load_explicit(&tree->snap->pending, memory_order_relaxed))
+		_tree_snap_prune(tree->snap);
+	return tree->snap->n_live != 0;
+}
+
+struct tree_node_t *tree_snapshot_get_root(const struct tree_snapshot_t *ss)
+{
+	assert(ss);
+	return ss->root;
+}
+
+struct tree_node_t *tree_snapshot_get_first_child(const struct tree_snapshot_t *ss,
+		struct tree_node_t *parent)
+{
+	struct _tree_state_t st;
+	assert(ss);
+	assert(parent);
+	_tree_snap_read(ss, parent, &st);
+	return st.first_child;
+}
+
+struct tree_node_t *tree_snapshot_get_next_sibling(const struct tree_snapshot_t *ss,
+		struct tree_node_t *node)
+{
+	struct _tree_state_t st;
+	assert(ss);
+	assert(node);
+	_tree_snap_read(ss, node, &st);
+	return st.next;
+}
+
+struct tree_node_t *tree_snapshot_get_prev_sibling(const struct tree_snapshot_t *ss,
+		struct tree_node_t *node)
+{
+	struct _tree_state_t st;
+	assert(ss);
+	assert(node);
+	_tree_snap_read(ss, node, &st);
+	return st.prev;
+}
+
+struct tree_node_t *tree_snapshot_get_parent(const struct tree_snapshot_t *ss,
+		struct tree_node_t *node)
+{
+	struct _tree_state_t st;
+	assert(ss);
+	assert(node);
+	_tree_snap_read(ss, node, &st);
+	return st.parent;
+}
+
+void *tree_snapshot_get_data(const struct tree_snapshot_t *ss, struct tree_node_t *node)
+{
+	struct _tree_state_t st;
+	assert(ss);
+	assert(node);
+	_tree_snap_read(ss, node, &st);
+	return st.data;
+}
+
+int tree_snapshot_traverse_preorder(const struct tree_snapshot_t *ss,
+		tree_traverser_fn_t tvr, void *cargo)
+{
+	struct tree_node_t *node;
+	struct _tree_state_t st;
+	int ret;
+
+	assert(ss);
+	assert(tvr);
+
+	node = ss->root;
+	while (node) {
+		if ((ret = tvr(node, cargo)) != 0)
+			return ret;
+		_tree_snap_read(ss, node, &st);
+		if (st.first_child) {
+			node = st.first_child;
+			continue;
+		}
+		/* up to the first ancestor (or self) with a next sibling */
+		for (;;) {
+			if (node == ss->root)
+				return 0;
+			_tree_snap_read(ss, node, &st);
+			if (st.next) {
+				node = st.next;
+				break;
+			}
+			node = st.parent;
+		}
+	}
+	return 0;
+}
+
+int tree_snapshot_keep_data(struct tree_node_t *node, void *(*copy_fn)(void *),
+		void (*free_fn)(void *))
+{
+	struct _tree_snapshots_t *snap;
+	struct _tree_history_t *h;
+	struct _tree_version_t *v;
+	void *copy;
+
+	assert(node);
+	assert(copy_fn);
+	assert(free_fn);
+
+	if (!(snap = _tree_snap_get(node)))
+		return 0;
+
+	/* All entries since the last change of the data in place point to the
+	 * data itself; they get one copy, owned by the newest (which is freed
+	 * last). Readers of an entry may still get the original for a moment,
+	 * which is why the caller has to defer its frees. */
+	_tree_snap_touch(snap, node);
+	h = _tree_hist_of(node, memory_order_relaxed);
+	v = h ? atomic_load_explicit(&h->head, memory_order_relaxed) : NULL;
+	for (copy = NULL; v && !v->free_fn && v->state.data == node->data; v = v->older) {
+		if (!copy) {
+			if (!(copy = copy_fn(node->data)))
+				break;
+			v->free_fn = free_fn;
+		}
+		v->state.data = copy;
+	}
+	return 1;
+}
+
+void tree_snapshot_defer_free(struct tree_node_t *node, void *p, void (*free_fn)(void *))
+{
+	struct _tree_snapshots_t *snap;
+	struct _tree_deferred_t *d;
+
+	assert(node);
+	assert(free_fn);
+
+	if (!(snap = _tree_snap_get(node)) ||
+			!(d = (struct _tree_deferred_t *)guide_malloc(sizeof(struct _tree_deferred_t)))) {
+		free_fn(p);
+		return;
+	}
+	d->node = NULL;
+	d->p = p;
+	d->free_fn = free_fn;
+	_tree_snap_defer(snap, d);
+}
+
+uint32 tree_get_child_count(struct tree_node_t *parent)
+{
+	struct _tree_children_t *ch;
+	struct tree_node_t *node;
+	uint32 n = 0;
+
+	assert(parent);
+
+	if ((ch = _tree_children_get(parent)))
+		return ch->count;
+	for (node = parent->first_child; node; node = node->next)
+		++n;
+	return n;
+}
+
+struct tree_node_t *tree_get_nth_child(struct tree_node_t *parent, uint32 n)
+{
+	struct _tree_children_t *ch;
+	struct _tree_chunk_t *c;
+	struct tree_node_t *node;
+
+	assert(parent);
+
+	if ((ch = _tree_children_get(parent))) {
+		if (n >= ch->count)
+			return NULL;
+		c = _tree_children_find(ch, &n);
+		return c->nodes[n];
+	}
+
+	for (node = parent->first_child; node && n; node = node->next)
+		--n;
+	return node;
+}
+
+uint32 tree_child_index(struct tree_node_t *node)
+{
+	struct tree_node_t *p;
+	uint32 n = 0;
+
+	assert(node);
+
+	if (!node->parent)
+		return 0;
+	if (_tree_chunk_of(node) || _tree_children_get(node->parent))
+		return _tree_children_index_of(node);
+
+	for (p = node->prev; p; p = p->prev)
+		++n;
+	return n;
+}
+
+struct tree_node_t *tree_insert_child_at(struct tree_node_t *parent, void *data, uint32 index)
+{
+	struct tree_node_t *after = NULL;
 
-struct tree_t
+	assert(parent);
+
+	if (index > 0) {
+		uint32 n = tree_get_child_count(parent);
+		after = tree_get_nth_child(parent, (index < n ? index : n) - 1);
+	}
+	return tree_add_child(parent, data, after);
+}
+
+void tree_set_change_fn(struct tree_t *tree, tree_change_fn_t fn, void *cargo)
 {
-	struct tree_node_t *root;
-};
+	assert(tree);
+	tree->change_fn = fn;
+	tree->change_cargo = cargo;
+}
 
-struct tree_node_t *tree_get_root(struct tree_t *tree)
+int tree_set_shared(struct tree_t *tree, int shared)
 {
 	assert(tree);
-	return tree->root;
+
+	if (shared && !tree->lock) {
+		tree->lock = (pthread_mutex_t *)guide_malloc(sizeof(pthread_mutex_t));
+		assert(tree->lock);
+		if (!tree->lock)
+			return -1;
+		pthread_mutex_init(tree->lock, NULL);
+	} else if (!shared && tree->lock) {
+		pthread_mutex_destroy(tree->lock);
+		guide_free(tree->lock);
+		tree->lock = NULL;
+	}
+	return 0;
 }
 
-struct tree_node_t *tree_get_first_child(struct tree_node_t *parent)
+void tree_set_indexed(struct tree_t *tree, int indexed)
 {
-	assert(parent);
-	return parent->first_child;
+	assert(tree);
+	tree->indexed = indexed ? 1 : 0;
+	tree->index_valid = 0;
+	tree->index_credit = 0;
 }
 
-struct tree_node_t *tree_get_next_sibling(struct tree_node_t *node)
+int tree_is_ancestor(struct tree_t *tree, struct tree_node_t *anc, struct tree_node_t *node)
 {
+	int ret;
+
+	assert(tree);
+	assert(anc);
 	assert(node);
-	return node->next;
+
+	if (!tree->indexed)
+		return _tree_is_within(node, anc);
+
+	_tree_batch_check_tree(tree);
+	if (tree->lock)
+		pthread_mutex_lock(tree->lock);
+	if (_tree_index_ready(tree))
+		ret = anc->enter <= node->enter && node->enter - anc->enter < anc->size;
+	else
+		ret = _tree_is_within_steps(node, anc, &tree->index_credit);
+	if (tree->lock)
+		pthread_mutex_unlock(tree->lock);
+	return ret;
 }
 
-struct tree_node_t *tree_get_prev_sibling(struct tree_node_t *node)
+void tree_get_subtree_range(struct tree_t *tree, struct tree_node_t *node,
+		uint32 *first, uint32 *last)
 {
+	assert(tree);
 	assert(node);
-	return node->prev;
+	assert(first);
+	assert(last);
+
+	_tree_batch_check_tree(tree);
+	if (tree->indexed) {
+		if (tree->lock)
+			pthread_mutex_lock(tree->lock);
+		if (_tree_index_ready(tree))
+			*first = node->enter;
+		else
+			*first = _tree_preorder_rank(node, &tree->index_credit);
+		if (tree->lock)
+			pthread_mutex_unlock(tree->lock);
+	} else {
+		*first = _tree_preorder_rank(node, NULL);
+	}
+	*last = *first + node->size - 1;
 }
 
-struct tree_node_t *tree_get_parent(struct tree_node_t *node)
+uint32 tree_get_subtree_size(struct tree_node_t *node)
 {
 	assert(node);
-	return node->parent;
+	_tree_batch_check(node);
+	return node->size;
 }
 
-void *tree_get_data(struct tree_node_t *node)
+uint32 tree_get_node_count(struct tree_t *tree)
+{
+	assert(tree);
+	_tree_batch_check_tree(tree);
+	return tree->root ? tree->root->size : 0;
+}
+
+/* Walk down from `node', skipping whole child subtrees by their size. */
+struct tree_node_t *tree_get_nth_preorder(struct tree_node_t *node, uint32 n)
 {
+	struct tree_node_t *child;
 	assert(node);
-	return node->data;
+
+	_tree_batch_check(node);
+	if (n >= node->size)
+		return NULL;
+
+	while (n > 0) {
+		/* skip `node' itself, then the children that end before n */
+		--n;
+		child = node->first_child;
+		while (n >= child->size) {
+			n -= child->size;
+			child = child->next;
+		}
+		node = child;
+	}
+
+	return node;
 }
 
-void tree_set_data(struct tree_node_t *node, void *data)
+uint32 tree_get_preorder_rank(struct tree_node_t *node)
 {
 	assert(node);
-	node->data = data;
+
+	_tree_batch_check(node);
+	return _tree_preorder_rank(node, NULL);
 }
 
-struct tree_t *tree_create()
+/*
+ * Batches. A node added by tree_batch_add_child() is linked, and counted
+ * in the children index of its parent, but its ancestors are not told
+ * about it: it is put in the list of the batch instead, with a pending
+ * mark in its size, and its size collects those of the nodes added under
+ * it. Flushing the batch walks the list backwards, so children come before
+ * their parents, adding up sizes; the first node not from the batch up
+ * from a node passes the total on to its ancestors, once per run of nodes
+ * under it. Anything else that changes the tree, or looks at sizes or
+ * ranks, flushes first.
+ */
+
+/* in tree_node_t::size, for nodes added by a batch not flushed yet */
+#define _TREE_SIZE_PENDING		((uint32)1 << 31)
+
+struct _tree_batch_t
 {
-	struct tree_t *t;
+	unsigned depth;				/* of tree_begin_batch() calls */
+	struct tree_node_t **nodes;	/* added, in order */
+	uint32 n;
+	uint32 alloc;
+	struct tree_node_t *tail;	/* last child of its parent, if known */
+};
 
-	t = (struct tree_t *)malloc(sizeof(struct tree_t));
-	assert(t);
-	if (!t) return NULL;
-	t->root = NULL;
+/* number of trees with a batch open, to skip the checks if none */
+static atomic_uint _tree_batch_count;
 
-	return t;
+static void _tree_batch_flush(struct tree_t *tree)
+{
+	struct _tree_batch_t *b = tree->batch;
+	struct tree_node_t *node, *parent, *run = NULL;
+	uint32 i, total = 0;
+
+	for (i = b->n; i-- > 0; ) {
+		node = b->nodes[i];
+		node->size &= ~_TREE_SIZE_PENDING;
+		parent = node->parent;
+		if (parent->size & _TREE_SIZE_PENDING) {
+			parent->size += node->size;
+		} else if (parent == run) {
+			total += node->size;
+		} else {
+			if (run)
+				_tree_grow_size(run, total);
+			run = parent;
+			total = node->size;
+		}
+	}
+	if (run)
+		_tree_grow_size(run, total);
+
+	b->n = 0;
+	b->tail = NULL;
+}
+
+static void _tree_batch_check_tree(struct tree_t *tree)
+{
+	if (tree->batch && tree->batch->n)
+		_tree_batch_flush(tree);
+}
+
+/* flush the batch of the tree of `node', if any */
+static void _tree_batch_check(struct tree_node_t *node)
+{
+	struct tree_t *tree;
+
+	if (atomic_load_explicit(&_tree_batch_count, memory_order_relaxed) == 0)
+		return;
+
+	while (node->parent)
+		node = node->parent;
+	if ((tree = _tree_of(node)))
+		_tree_batch_check_tree(tree);
+}
+
+void tree_begin_batch(struct tree_t *tree)
+{
+	assert(tree);
+
+	if (!tree->batch) {
+		tree->batch = (struct _tree_batch_t *)guide_calloc(1, sizeof(struct _tree_batch_t));
+		assert(tree->batch);
+		if (!tree->batch)
+			return;
+		atomic_fetch_add(&_tree_batch_count, 1);
+	}
+	++tree->batch->depth;
+}
+
+void tree_end_batch(struct tree_t *tree)
+{
+	struct _tree_batch_t *b;
+
+	assert(tree);
+
+	if (!(b = tree->batch) || --b->depth > 0)
+		return;
+
+	_tree_batch_flush(tree);
+	guide_free(b->nodes);
+	guide_free(b);
+	tree->batch = NULL;
+	atomic_fetch_sub(&_tree_batch_count, 1);
+}
+
+struct tree_node_t *tree_batch_add_child(struct tree_t *tree, struct tree_node_t *parent,
+		void *data, struct tree_node_t *after)
+{
+	struct _tree_batch_t *b;
+	struct _tree_snapshots_t *snap;
+	struct tree_node_t *node, *last;
+	struct tree_node_t **nodes;
+
+	assert(tree);
+	assert(parent);
+
+	if (!(b = tree->batch))
+		return tree_add_child(parent, data, after);
+
+	if (b->n == b->alloc) {
+		nodes = (struct tree_node_t **)guide_realloc(b->nodes,
+			(b->alloc ? 2 * b->alloc : 1024) * sizeof(struct tree_node_t *));
+		assert(nodes);
+		if (!nodes) return NULL;
+		b->nodes = nodes;
+		b->alloc = b->alloc ? 2 * b->alloc : 1024;
+	}
+
+	/* where it goes: first, after `after', or last as in tree_add_child() */
+	last = NULL;
+	if (after) {
+		if (after->parent == parent)
+			last = after;
+		else if (b->tail && b->tail->parent == parent && !b->tail->next)
+			last = b->tail;
+		else if ((last = parent->first_child))
+			while (last->next)
+				last = last->next;
+	}
+
+	node = _tree_node_create(data);
+	assert(node);
+	if (!node) return NULL;
+	node->parent = parent;
+	node->size = 1 | _TREE_SIZE_PENDING;
+
+	snap = _tree_snap_get(parent);
+	if (last) {
+		_tree_snap_touch(snap, last);
+		_tree_snap_touch(snap, last->next);
+		node->prev = last;
+		node->next = last->next;
+		if (last->next)
+			last->next->prev = node;
+		last->next = node;
+	} else {
+		_tree_snap_touch(snap, parent);
+		_tree_snap_touch(snap, parent->first_child);
+		node->next = parent->first_child;
+		if (parent->first_child)
+			parent->first_child->prev = node;
+		parent->first_child = node;
+	}
+	if (!node->next)
+		b->tail = node;
+	b->nodes[b->n++] = node;
+
+	/* ranks are renumbered from scratch after the batch */
+	if (parent->aux && parent->aux->children)
+		_tree_children_insert(parent->aux->children, node);
+	if (tree->change_fn)
+		tree->change_fn(node, TREE_CHANGE_LINKED, tree->change_cargo);
+	tree->index_valid = 0;
+
+	return node;
+}
+
+struct tree_t *tree_create()
+{
+	return _tree_create_for(NULL);
 }
 
 struct tree_t *tree_create_with_root(void *root_data)
 {
-	struct tree_t *t;
 	struct tree_node_t *r;
 
-	t = (struct tree_t *)malloc(sizeof(struct tree_t));
-	r = (struct tree_node_t *)malloc(sizeof(struct tree_node_t));
-	assert(t);
+	r = _tree_node_create(root_data);
 	assert(r);
 
-	r->data = root_data;
-	r->prev = r->next = r->parent = r->first_child = NULL;
+	return _tree_create_for(r);
+}
+
+/* Build a tree in one pass over the arrays, with all nodes in a single
+ * block. Parents are found by walking up from the previous node, which is
+ * O(1) amortized for input in preorder; for other input, a lookup table of
+ * ids is built on the first miss. While building, the `prev' of each first
+ * child points to the last child, so appends are O(1) too. */
+struct tree_t *tree_build_from_parent_array(uint32 n, const uint32 *ids,
+		const uint32 *parent_ids, void **data, tree_traverser_fn_t fn, void *cargo)
+{
+	struct _tree_block_t *block;
+	struct tree_node_t *nodes, *node, *parent, *last;
+	struct lut_t *map = NULL;
+	struct tree_t *tree;
+	uint32 i, j;
+
+	if (n == 0)
+		return tree_create();
+
+	assert(ids);
+	assert(parent_ids);
+	assert(data);
+
+	block = (struct _tree_block_t *)guide_malloc(sizeof(struct _tree_block_t) +
+		n * sizeof(struct tree_node_t));
+	assert(block);
+	if (!block) return NULL;
+	atomic_init(&block->refs, n);
+	nodes = block->nodes;
+
+	for (i = 0; i < n; ++i) {
+		node = nodes + i;
+		node->data = data[i];
+		node->next = node->first_child = NULL;
+		node->size = 1;
+		node->enter = _TREE_NO_ENTER;
+		node->aux = NULL;
+		node->block = block;
+
+		if (i == 0) {
+			node->prev = node->parent = NULL;
+		} else {
+			for (parent = node - 1; parent && ids[parent - nodes] != parent_ids[i];
+					parent = parent->parent)
+				;
+			if (!parent) {
+				if (!map) {
+					map = lut_create();
+					assert(map);
+					if (!map) goto fail;
+					for (j = 0; j < i; ++j)
+						lut_set(map, (void *)(uintptr_t)ids[j], nodes + j);
+				}
+				if (lut_get(map, (void *)(uintptr_t)parent_ids[i], (void **)&parent) != 0)
+					goto fail; /* no such parent (yet) */
+			}
+
+			node->parent = parent;
+			if (parent->first_child) {
+				last = parent->first_child->prev;
+				last->next = node;
+				node->prev = last;
+				parent->first_child->prev = node;
+			} else {
+				parent->first_child = node;
+				node->prev = node;
+			}
+		}
 
-	t->root = r;
+		if (map)
+			lut_set(map, (void *)(uintptr_t)ids[i], node);
+		if (fn && fn(node, cargo))
+			goto fail;
+	}
 
-	return t;
+	/* children come after their parents, so a backward pass can total up
+	 * the subtree sizes */
+	for (i = n; i-- > 0; ) {
+		node = nodes + i;
+		if (node->first_child)
+			node->first_child->prev = NULL;
+		if (node->parent)
+			node->parent->size += node->size;
+	}
+
+	if (map)
+		lut_free(map);
+
+	tree = _tree_create_for(nodes);
+	assert(tree);
+	return tree;
+
+fail:
+	if (map)
+		lut_free(map);
+	guide_free(block);
+	return NULL;
+}
+
+/* Copy the nodes into a new block in preorder, then link the copies up:
+ * the first child of a copy is the next copy, and its next sibling is
+ * `size' copies on, so each copy can be linked from the old node alone. */
+int tree_compact_layout(struct tree_t *tree, tree_relocate_fn_t fn, void *cargo)
+{
+	struct _tree_block_t *block;
+	struct tree_node_t **olds, *nodes, *node, *old, *child;
+	struct _tree_children_t *ch;
+	struct _tree_history_t *h;
+	uint32 n, i, j, k;
+
+	assert(tree);
+
+	if (tree_has_snapshots(tree))
+		return -1;
+	_tree_batch_check_tree(tree);
+	if (!tree->root)
+		return 0;
+
+	n = tree->root->size;
+	block = (struct _tree_block_t *)guide_malloc(sizeof(struct _tree_block_t) +
+		n * sizeof(struct tree_node_t));
+	olds = (struct tree_node_t **)guide_malloc(n * sizeof(struct tree_node_t *));
+	assert(block && olds);
+	if (!block || !olds) {
+		guide_free(block);
+		guide_free(olds);
+		return -1;
+	}
+	atomic_init(&block->refs, n);
+	nodes = block->nodes;
+
+	for (old = tree->root, i = 0; old; ++i) {
+		node = nodes + i;
+		olds[i] = old;
+		node->data = old->data;
+		node->size = old->size;
+		node->enter = i;
+		node->aux = old->aux;
+		node->block = block;
+
+		if (old->first_child) {
+			old = old->first_child;
+		} else {
+			while (old && !old->next)
+				old = old->parent;
+			if (old)
+				old = old->next;
+		}
+	}
+	assert(i == n);
+
+	nodes->parent = nodes->prev = NULL;
+	for (i = 0; i < n; ++i) {
+		node = nodes + i;
+		old = olds[i];
+		node->first_child = old->first_child ? node + 1 : NULL;
+		node->next = old->next ? node + old->size : NULL;
+		if (node->first_child) {
+			node->first_child->parent = node;
+			node->first_child->prev = NULL;
+		}
+		if (node->next) {
+			node->next->parent = node->parent;
+			node->next->prev = node;
+		}
+	}
+
+	/* the children indexes list the children in order */
+	for (i = 0; i < n; ++i) {
+		node = nodes + i;
+		if (!node->aux || !(ch = node->aux->children))
+			continue;
+		child = node->first_child;
+		for (j = 0; j < ch->n_chunks; ++j)
+			for (k = 0; k < ch->chunks[j]->count; ++k, child = child->next)
+				ch->chunks[j]->nodes[k] = child;
+	}
+
+	tree->root = nodes;
+	tree->index_valid = tree->indexed ? n : 0;
+
+	for (i = 0; i < n; ++i) {
+		old = olds[i];
+		if (fn)
+			fn(old, nodes + i, cargo);
+		if ((h = _tree_hist_of(old, memory_order_relaxed)))
+			_tree_history_free(h);
+		if (!old->block)
+			guide_free(old);
+		else
+			_tree_block_put(old->block);
+	}
+	guide_free(olds);
+
+	return 0;
 }
 
 struct tree_node_t *tree_add_root(struct tree_t *tree, void *data)
@@ -114,11 +1908,11 @@ struct tree_node_t *tree_add_root(struct tree_t *tree, void *data)
 
 	if (tree->root) return NULL;
 
-	root = (struct tree_node_t *)malloc(sizeof(struct tree_node_t));
+	root = _tree_node_create(data);
 	assert(root);
-	root->data = data;
-	root->prev = root->next = root->parent = root->first_child = NULL;
 	tree->root = root;
+	_tree_get_aux(root)->tree = tree;
+	tree->index_valid = 0;
 
 	return root;
 }
@@ -132,22 +1926,30 @@ struct tree_node_t *tree_add_child(struct tree_node_t *parent, void *data,
 {
 	struct tree_node_t *last;
 	struct tree_node_t *new_child;
+	struct _tree_snapshots_t *snap;
 
 	assert(parent);
 
-	new_child = (struct tree_node_t *)malloc(sizeof(struct tree_node_t));
+	_tree_batch_check(parent);
+	snap = _tree_snap_get(parent);
+	new_child = _tree_node_create(data);
 	assert(new_child);
-	new_child->data = data;
 	new_child->parent = parent;
-	new_child->first_child = NULL;
 
 	/* BUG FIX v1.0+: the `after' flag, when passed as NULL, should
 	 * have created a new node as the *first* child */
 	if (after) {
 		last = parent->first_child;
-		if (last) {
-			while (last != after && last->next)
+		if (after->parent == parent)
+			last = after;
+		else if (last) {
+			/* `after' is not a child: append */
+			while (last->next)
 				last = last->next;
+		}
+		if (last) {
+			_tree_snap_touch(snap, last);
+			_tree_snap_touch(snap, last->next);
 			new_child->next = last->next;
 			new_child->prev = last;
 			if (last->next) {
@@ -155,11 +1957,14 @@ struct tree_node_t *tree_add_child(struct tree_node_t *parent, void *data,
 			}
 			last->next = new_child;
 		} else {
+			_tree_snap_touch(snap, parent);
 			new_child->prev = new_child->next = NULL;
 			parent->first_child = new_child;
 		}
 	} else {
 		/* `after' was NULL, insert `new_child' as first child of `parent' */
+		_tree_snap_touch(snap, parent);
+		_tree_snap_touch(snap, parent->first_child);
 		new_child->prev = NULL;
 		new_child->next = parent->first_child;
 		if (parent->first_child)
@@ -167,46 +1972,60 @@ struct tree_node_t *tree_add_child(struct tree_node_t *parent, void *data,
 		parent->first_child = new_child;
 	}
 
+	_tree_note_link(_tree_grow_size(parent, 1), new_child);
+
 	return new_child;
 }
 
 struct tree_node_t *tree_add_sibling_after(struct tree_node_t *node, void *data)
 {
 	struct tree_node_t *new_node;
+	struct _tree_snapshots_t *snap;
 	assert(node);
 	assert(node->parent != NULL);
 	
 	if (node->parent == NULL) return NULL; /* don't add roots */
 
-	new_node = (struct tree_node_t *)malloc(sizeof(struct tree_node_t));
+	_tree_batch_check(node);
+	snap = _tree_snap_get(node);
+	_tree_snap_touch(snap, node);
+	_tree_snap_touch(snap, node->next);
+
+	new_node = _tree_node_create(data);
 	assert(new_node);
-	new_node->data = data;
 	new_node->prev = node;
 	new_node->next = node->next;
 	new_node->parent = node->parent;
-	new_node->first_child = NULL;
 	if (node->next)
 		node->next->prev = new_node;
 	node->next = new_node;
 
+	_tree_note_link(_tree_grow_size(node->parent, 1), new_node);
+
 	return new_node;
 }
 
 struct tree_node_t *tree_add_sibling_before(struct tree_node_t *node, void *data)
 {
 	struct tree_node_t *new_node;
+	struct _tree_snapshots_t *snap;
 	assert(node);
 	assert(node->parent != NULL);
 
 	if (node->parent == NULL) return NULL; /* don't add roots */
 
-	new_node = (struct tree_node_t *)malloc(sizeof(struct tree_node_t));
+	_tree_batch_check(node);
+	snap = _tree_snap_get(node);
+	_tree_snap_touch(snap, node);
+	_tree_snap_touch(snap, node->prev);
+	if (node->parent->first_child == node)
+		_tree_snap_touch(snap, node->parent);
+
+	new_node = _tree_node_create(data);
 	assert(new_node);
 	/* BUG FIX v1.0+: `next' and `first_child' of `new_node' was not set
 	 * properly */
 	new_node->parent = node->parent;
-	new_node->first_child = NULL;
-	new_node->data = data;
 	new_node->next = node;
 	new_node->prev = node->prev;
 	if (node->prev)
@@ -215,30 +2034,51 @@ struct tree_node_t *tree_add_sibling_before(struct tree_node_t *node, void *data
 	if (node->parent->first_child == node)
 		node->parent->first_child = new_node;
 
+	_tree_note_link(_tree_grow_size(node->parent, 1), new_node);
+
 	return new_node;
 }
 
+/* Attach the whole of `tree' as the first child of `node' (like
+ * tree_move_subtree_as_child()), and free `tree'. Only links are changed,
+ * besides the subtree sizes above `node', so this takes time in the depth
+ * of `node', whatever the size of `tree'. */
 void tree_merge_tree(struct tree_node_t *node, struct tree_t* tree)
 {
-	(void)node;
-	(void)tree;
-	/* TODO */
-}
+	struct tree_node_t *root;
+	struct _tree_snapshots_t *snap;
 
-struct _tree_deleter_cargo_t
-{
-	void *original_cargo;
-	tree_node_cleanup_fn_t cleanup_fn;
-};
+	assert(node);
+	assert(tree);
 
-static int _tree_delete_traverser(struct tree_node_t *node, void *cargo)
-{
-	struct _tree_deleter_cargo_t *c = (struct _tree_deleter_cargo_t *)cargo;
-	assert(c);
-	if (c->cleanup_fn)
-		c->cleanup_fn(node, c->original_cargo);
-	free(node);
-	return 0;
+	_tree_batch_check(node);
+	while (tree->batch)
+		tree_end_batch(tree);
+	snap = _tree_snap_get(node);
+	/* snapshots of `tree' would stop being kept up */
+	assert(!tree->snap || tree->snap == snap || !tree_has_snapshots(tree));
+	if (tree->snap)
+		_tree_snap_put(tree->snap);
+	tree_set_shared(tree, 0);
+
+	root = tree->root;
+	guide_free(tree);
+	if (!root)
+		return;
+	root->aux->tree = NULL;
+	_tree_put_aux(root);
+
+	_tree_snap_touch(snap, node);
+	_tree_snap_touch(snap, node->first_child);
+
+	root->prev = NULL;
+	root->next = node->first_child;
+	root->parent = node;
+	if (node->first_child)
+		node->first_child->prev = root;
+	node->first_child = root;
+
+	_tree_note_link(_tree_grow_size(node, root->size), root);
 }
 
 void tree_delete_subtree(struct tree_node_t *node, tree_node_cleanup_fn_t cleanup_fn, void *cargo)
@@ -246,9 +2086,36 @@ void tree_delete_subtree(struct tree_node_t *node, tree_node_cleanup_fn_t cleanu
 	struct _tree_deleter_cargo_t c = { cargo, cleanup_fn };
 	/* remember links */
 	struct tree_node_t *parent = node->parent, *prev = node->prev, *next = node->next;
+	struct _tree_snapshots_t *snap;
+	struct _tree_deferred_t *d;
 
 	assert(cleanup_fn);
 
+	_tree_batch_check(node);
+
+	/* snapshots may still read the subtree: detach it now, free it later */
+	if ((snap = _tree_snap_get(node)) &&
+			(d = (struct _tree_deferred_t *)guide_malloc(sizeof(struct _tree_deferred_t)))) {
+		_tree_snap_touch_unlink(snap, node);
+		if (parent) {
+			_tree_note_unlink(_tree_shrink_size(parent, node->size), node);
+			if (parent->first_child == node)
+				parent->first_child = next;
+			if (prev) prev->next = next;
+			if (next) next->prev = prev;
+			node->prev = node->next = node->parent = NULL;
+		}
+		d->node = node;
+		d->cleanup_fn = cleanup_fn;
+		d->cargo = cargo;
+		_tree_snap_defer(snap, d);
+		return;
+	}
+
+	/* the ancestors lose the whole subtree */
+	if (parent)
+		_tree_note_unlink(_tree_shrink_size(parent, node->size), node);
+
 	/* free self and children */
 	tree_traverse_subtree_postorder(node, _tree_delete_traverser, (void *)&c);
 
@@ -266,41 +2133,62 @@ void tree_delete_subtree(struct tree_node_t *node, tree_node_cleanup_fn_t cleanu
 void tree_delete_tree(struct tree_t *tree, tree_node_cleanup_fn_t cleanup_fn, void *cargo)
 {
 	assert(tree);
+	while (tree->batch)
+		tree_end_batch(tree);
 	if (tree->root)
 		tree_delete_subtree(tree->root, cleanup_fn, cargo);
-	free(tree);	
+	if (tree->snap)
+		_tree_snap_put(tree->snap);
+	tree_set_shared(tree, 0);
+	guide_free(tree);	
 }
 
+/* Detach the subtree at `node' into a new tree of its own, in time in the
+ * depth of `node' (the subtree sizes above it shrink), whatever the size of
+ * the subtree. The root of a tree can't be split off. */
 struct tree_t *tree_split_subtree(struct tree_node_t *node)
 {
-/*
-	# The following "old" code creates a new tree with more than
-	# one root, which is disallowed now. Till we fix this, the
-	# code is "disabled".
+	struct tree_t *new_tree;
+	struct _tree_snapshots_t *snap;
+	struct tree_node_t *root;
 
-	struct tree_t *new_tree = 
-		(struct tree_t *)malloc(sizeof(struct tree_t));
-	assert(new_tree);
 	assert(node);
-	new_tree->root = node;
+	assert(node->parent != NULL); /* node cannot be root */
+
+	if (node->parent == NULL)
+		return NULL;
+
+	_tree_batch_check(node);
+	snap = _tree_snap_get(node);
+	_tree_snap_touch_unlink(snap, node);
+
+	/* detach node */
 	if (node->prev)
-		node->prev->next = NULL;
-	node->prev = NULL;
-	if (node->parent && node->parent->first_child == node)
-		node->parent->first_child = NULL;
-	do {
-		node->parent = NULL;
-		node = node->next;
-	} while (node);
+		node->prev->next = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	if (node->parent->first_child == node)
+		node->parent->first_child = node->next;
+	root = _tree_shrink_size(node->parent, node->size);
+	_tree_note_unlink(root, node);
+
+	node->prev = node->next = node->parent = NULL;
+	new_tree = _tree_create_for(node);
+	assert(new_tree);
+
+	/* the subtree stays under the snapshots of the old tree */
+	if (new_tree && _tree_of(root) && (new_tree->snap = _tree_of(root)->snap))
+		atomic_fetch_add(&new_tree->snap->refs, 1);
 
 	return new_tree;
-*/
-	return NULL;
 }
 
 struct tree_node_t *tree_move_subtree_after(struct tree_node_t *src_node,
 	struct tree_node_t *dst_node)
 {
+	struct _tree_snapshots_t *snap;
+	int into_self;
+
 	assert(src_node);
 	assert(dst_node);
 	assert(src_node->parent != NULL); /* src cannot be root */
@@ -309,6 +2197,16 @@ struct tree_node_t *tree_move_subtree_after(struct tree_node_t *src_node,
 	if (src_node->parent == NULL || dst_node->parent == NULL)
 		return NULL; /* src, dst cannot be root */
 
+	_tree_batch_check(src_node);
+	_tree_batch_check(dst_node);
+	into_self = _tree_is_within(dst_node, src_node);
+	assert(!into_self); /* dst cannot be inside src */
+	if (into_self)
+		return NULL;
+
+	snap = _tree_snap_get(src_node);
+	_tree_snap_touch_unlink(snap, src_node);
+
 	/* detach src_node */
 	if (src_node->prev)
 		src_node->prev->next = src_node->next;
@@ -316,6 +2214,10 @@ struct tree_node_t *tree_move_subtree_after(struct tree_node_t *src_node,
 		src_node->next->prev = src_node->prev;
 	if (src_node->parent->first_child == src_node)
 		src_node->parent->first_child = src_node->next;
+	_tree_note_unlink(_tree_shrink_size(src_node->parent, src_node->size), src_node);
+
+	_tree_snap_touch(snap, dst_node);
+	_tree_snap_touch(snap, dst_node->next);
 
 	/* modify src_node's links (prev, next, parent) */
 	src_node->prev = dst_node;
@@ -327,12 +2229,17 @@ struct tree_node_t *tree_move_subtree_after(struct tree_node_t *src_node,
 	/* modify dst_node's links (next) */
 	dst_node->next = src_node;
 
+	_tree_note_link(_tree_grow_size(src_node->parent, src_node->size), src_node);
+
 	return src_node;
 }
 
 struct tree_node_t *tree_move_subtree_before(struct tree_node_t *src_node,
 	struct tree_node_t *dst_node)
 {
+	struct _tree_snapshots_t *snap;
+	int into_self;
+
 	assert(src_node);
 	assert(dst_node);
 	assert(src_node->parent != NULL); /* src cannot be root */
@@ -341,6 +2248,16 @@ struct tree_node_t *tree_move_subtree_before(struct tree_node_t *src_node,
 	if (src_node->parent == NULL || dst_node->parent == NULL)
 		return NULL; /* src, dst cannot be root */
 
+	_tree_batch_check(src_node);
+	_tree_batch_check(dst_node);
+	into_self = _tree_is_within(dst_node, src_node);
+	assert(!into_self); /* dst cannot be inside src */
+	if (into_self)
+		return NULL;
+
+	snap = _tree_snap_get(src_node);
+	_tree_snap_touch_unlink(snap, src_node);
+
 	/* detach src_node */
 	if (src_node->prev)
 		src_node->prev->next = src_node->next;
@@ -348,6 +2265,12 @@ struct tree_node_t *tree_move_subtree_before(struct tree_node_t *src_node,
 		src_node->next->prev = src_node->prev;
 	if (src_node->parent->first_child == src_node)
 		src_node->parent->first_child = src_node->next;
+	_tree_note_unlink(_tree_shrink_size(src_node->parent, src_node->size), src_node);
+
+	_tree_snap_touch(snap, dst_node);
+	_tree_snap_touch(snap, dst_node->prev);
+	if (dst_node->parent->first_child == dst_node)
+		_tree_snap_touch(snap, dst_node->parent);
 
 	/* modify src_node's links (prev, next, parent) */
 	src_node->prev = dst_node->prev;
@@ -362,12 +2285,17 @@ struct tree_node_t *tree_move_subtree_before(struct tree_node_t *src_node,
 	if (dst_node->parent->first_child == dst_node)
 		dst_node->parent->first_child = src_node;
 
+	_tree_note_link(_tree_grow_size(src_node->parent, src_node->size), src_node);
+
 	return src_node;
 }
 
 struct tree_node_t *tree_move_subtree_as_child(struct tree_node_t *src_node,
 	struct tree_node_t *dst_node/*, struct tree_node_t *after*/)
 {
+	struct _tree_snapshots_t *snap;
+	int into_self;
+
 	/* `after' not implemented yet (since we don't use it) */
 	assert(src_node);
 	assert(dst_node);
@@ -377,6 +2305,16 @@ struct tree_node_t *tree_move_subtree_as_child(struct tree_node_t *src_node,
 	if (src_node->parent == NULL || dst_node->parent == NULL)
 		return NULL; /* src, dst cannot be root */
 
+	_tree_batch_check(src_node);
+	_tree_batch_check(dst_node);
+	into_self = _tree_is_within(dst_node, src_node);
+	assert(!into_self); /* dst cannot be inside src */
+	if (into_self)
+		return NULL;
+
+	snap = _tree_snap_get(src_node);
+	_tree_snap_touch_unlink(snap, src_node);
+
 	/* detach src_node */
 	if (src_node->prev)
 		src_node->prev->next = src_node->next;
@@ -384,6 +2322,10 @@ struct tree_node_t *tree_move_subtree_as_child(struct tree_node_t *src_node,
 		src_node->next->prev = src_node->prev;
 	if (src_node->parent->first_child == src_node)
 		src_node->parent->first_child = src_node->next;
+	_tree_note_unlink(_tree_shrink_size(src_node->parent, src_node->size), src_node);
+
+	_tree_snap_touch(snap, dst_node);
+	_tree_snap_touch(snap, dst_node->first_child);
 
 	/* insert `src_node' as first child of `dst_node' */
 	src_node->prev = NULL;
@@ -393,6 +2335,8 @@ struct tree_node_t *tree_move_subtree_as_child(struct tree_node_t *src_node,
 		dst_node->first_child->prev = src_node;
 	dst_node->first_child = src_node;
 
+	_tree_note_link(_tree_grow_size(dst_node, src_node->size), src_node);
+
 	return src_node;
 }
 
@@ -430,6 +2374,15 @@ int tree_traverse_preorder2(struct tree_t *tree, tree_traverser_fn2_t tvr, void
 	return 0;
 }
 
+int tree_traverse_preorder_ex(struct tree_t *tree, tree_traverser_ex_fn_t tvr, void *cargo)
+{
+	assert(tree);
+	assert(tvr);
+	if (tree->root)
+		return tree_traverse_subtree_preorder_ex(tree->root, tvr, cargo);
+	return 0;
+}
+
 int tree_traverse_postorder(struct tree_t *tree, tree_traverser_fn_t tvr, void *cargo)
 {
 	assert(tree);
@@ -443,21 +2396,15 @@ int tree_traverse_subtree_preorder(struct tree_node_t *node, tree_traverser_fn_t
 		void *cargo)
 {
 	int ret;
-	struct tree_node_t *curr;
+	struct tree_iter_t it;
 	assert(node);
 	assert(tvr);
 
 	/* process self, then visit all children */
-	ret = tvr(node, cargo);
-	if (ret) return ret;
-
-	curr = node->first_child;
-	while (curr) {
-		/* for consistency with tree_traverse_subtree_postorder(), remember next node */
-		struct tree_node_t *next = curr->next;
-		ret = tree_traverse_subtree_preorder(curr, tvr, cargo);
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it)) {
+		ret = tvr(it.node, cargo);
 		if (ret) return ret;
-		curr = next;
 	}
 
 	return 0;
@@ -467,21 +2414,15 @@ int tree_traverse_subtree_preorder(struct tree_node_t *node, tree_traverser_fn_t
 int tree_traverse_subtree_preorder_wd(struct tree_node_t *node, tree_traverser_wd_fn_t tvr, int depth)
 {
 	int ret;
-	struct tree_node_t *curr;
+	struct tree_iter_t it;
 	assert(node);
 	assert(tvr);
 
 	/* process self, then visit all children */
-	ret = tvr(node, depth);
-	if (ret) return ret;
-
-	curr = node->first_child;
-	while (curr) {
-		/* for consistency with tree_traverse_subtree_postorder(), remember next node */
-		struct tree_node_t *next = curr->next;
-		ret = tree_traverse_subtree_preorder_wd(curr, tvr, depth + 1);
+	tree_iter_init(&it, node, TREE_ITER_PREORDER);
+	while (tree_iter_next(&it)) {
+		ret = tvr(it.node, depth + it.depth);
 		if (ret) return ret;
-		curr = next;
 	}
 
 	return 0;
@@ -492,50 +2433,191 @@ int tree_traverse_subtree_preorder2(struct tree_node_t *node, tree_traverser_fn2
 		void *cargo)
 {
 	int ret;
-	struct tree_node_t *curr;
+	struct tree_iter_t it;
 	assert(node);
 	assert(tvr);
 
-	/* process self, then visit all children */
-	/* call tvr with '0' before visiting children */
-	ret = tvr(node, cargo, 0);
-	if (ret) return ret;
-
-	curr = node->first_child;
-	while (curr) {
-		/* for consistency with tree_traverse_subtree_postorder(), remember next node */
-		struct tree_node_t *next = curr->next;
-		ret = tree_traverse_subtree_preorder2(curr, tvr, cargo);
+	/* call tvr with '0' before visiting children, and again with '1' after */
+	tree_iter_init(&it, node, TREE_ITER_EVENTS);
+	while (tree_iter_next(&it)) {
+		ret = tvr(it.node, cargo, it.event);
 		if (ret) return ret;
-		curr = next;
 	}
 
-	/* call tvr again, with '1', after visiting children */
-	ret = tvr(node, cargo, 1);
-	if (ret) return ret;
-
 	return 0;
 }
 
+#define _TREE_INDEX_STACK_SIZE		(64)
+
+/* Like tree_traverse_subtree_preorder2(), but also passes the depth and the
+ * sibling index of each node. The iterator keeps track of the depth, which
+ * is counted from `node'; the sibling indices are the real ones, `node'
+ * included. Those of the ancestors are kept in a per-depth array, which only
+ * goes to the heap for guides deeper than _TREE_INDEX_STACK_SIZE. */
+int tree_traverse_subtree_preorder_ex(struct tree_node_t *node, tree_traverser_ex_fn_t tvr,
+		void *cargo)
+{
+	int ret = 0;
+	int local[_TREE_INDEX_STACK_SIZE], *index = local, alloc = _TREE_INDEX_STACK_SIZE;
+	struct tree_iter_t it;
+	assert(node);
+	assert(tvr);
+
+	index[0] = (int)tree_child_index(node);
+	tree_iter_init(&it, node, TREE_ITER_EVENTS);
+	while (tree_iter_next(&it)) {
+		if (it.event == TREE_ITER_ENTER && it.depth > 0) {
+			if (it.depth >= alloc) {
+				int *p = (int *)guide_malloc(2 * alloc * sizeof(int));
+				assert(p);
+				if (!p) { ret = -1; break; }
+				memcpy(p, index, alloc * sizeof(int));
+				if (index != local)
+					guide_free(index);
+				index = p;
+				alloc *= 2;
+			}
+			/* first child starts at 0, a next sibling continues from the last */
+			index[it.depth] = it.node->prev ? index[it.depth] + 1 : 0;
+		}
+
+		ret = tvr(it.node, cargo, it.depth, index[it.depth], it.event);
+		if (ret) break;
+	}
+
+	if (index != local)
+		guide_free(index);
+	return ret;
+}
+
 int tree_traverse_subtree_postorder(struct tree_node_t *node, tree_traverser_fn_t tvr, void *cargo)
 {
 	int ret;
-	struct tree_node_t *curr;
+	struct tree_iter_t it;
 	assert(node);
 	assert(tvr);
 
-	/* visit all children, then process self */
-	curr = node->first_child;
-	while (curr) {
-		/* curr may get deleted within `tvr', so remember the next node */
-		struct tree_node_t *next = curr->next;
-		ret = tree_traverse_subtree_postorder(curr, tvr, cargo);
+	/* visit all children, then process self. The iterator looks ahead, so
+	 * the node may get deleted within `tvr'. */
+	tree_iter_init(&it, node, TREE_ITER_POSTORDER);
+	while (tree_iter_next(&it)) {
+		ret = tvr(it.node, cargo);
 		if (ret) return ret;
-		curr = next;
 	}
 
-	ret = tvr(node, cargo);
-	if (ret) return ret;
-
 	return 0;
 }
+
+void tree_iter_init(struct tree_iter_t *it, struct tree_node_t *node, int order)
+{
+	assert(it);
+	assert(node);
+	assert(order == TREE_ITER_PREORDER || order == TREE_ITER_POSTORDER ||
+		order == TREE_ITER_EVENTS);
+
+	it->node = NULL;
+	it->depth = 0;
+	it->event = (order == TREE_ITER_POSTORDER) ? TREE_ITER_LEAVE : TREE_ITER_ENTER;
+	it->_root = node;
+	it->_next = NULL;
+	it->_next_depth = 0;
+	it->_order = order;
+	it->_started = 0;
+}
+
+/* postorder: find the first node to visit in the subtree at `node', which is
+ * its leftmost leaf */
+static struct tree_node_t *_tree_iter_leftmost_leaf(struct tree_node_t *node, int *depth)
+{
+	while (node->first_child) {
+		node = node->first_child;
+		++(*depth);
+	}
+	return node;
+}
+
+/* postorder: find the node after it->node */
+static void _tree_iter_postorder_lookahead(struct tree_iter_t *it)
+{
+	struct tree_node_t *node = it->node;
+
+	it->_next_depth = it->depth;
+	if (node == it->_root)
+		it->_next = NULL;
+	else if (node->next)
+		it->_next = _tree_iter_leftmost_leaf(node->next, &(it->_next_depth));
+	else {
+		it->_next = node->parent;
+		--(it->_next_depth);
+	}
+}
+
+struct tree_node_t *tree_iter_next(struct tree_iter_t *it)
+{
+	struct tree_node_t *node;
+	assert(it);
+
+	if (!it->_started) {
+		it->_started = 1;
+		it->depth = 0;
+		if (it->_order == TREE_ITER_POSTORDER) {
+			it->node = _tree_iter_leftmost_leaf(it->_root, &(it->depth));
+			_tree_iter_postorder_lookahead(it);
+		} else {
+			it->node = it->_root;
+		}
+		return it->node;
+	}
+
+	node = it->node;
+	if (!node)
+		return NULL;
+
+	switch (it->_order)
+	{
+	case TREE_ITER_PREORDER:
+		if (node->first_child) {
+			node = node->first_child;
+			++(it->depth);
+		} else {
+			/* climb up till a node with a next sibling is found */
+			while (node != it->_root && !node->next) {
+				node = node->parent;
+				--(it->depth);
+			}
+			node = (node == it->_root) ? NULL : node->next;
+		}
+		break;
+
+	case TREE_ITER_POSTORDER:
+		node = it->_next;
+		it->depth = it->_next_depth;
+		if (node) {
+			it->node = node;
+			_tree_iter_postorder_lookahead(it);
+		}
+		break;
+
+	case TREE_ITER_EVENTS:
+		if (it->event == TREE_ITER_ENTER) {
+			if (node->first_child) {
+				node = node->first_child;
+				++(it->depth);
+			} else {
+				it->event = TREE_ITER_LEAVE;
+			}
+		} else if (node == it->_root) {
+			node = NULL;
+		} else if (node->next) {
+			node = node->next;
+			it->event = TREE_ITER_ENTER;
+		} else {
+			node = node->parent;
+			--(it->depth);
+		}
+		break;
+	}
+
+	it->node = node;
+	return node;
+}
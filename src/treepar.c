@@ -0,0 +1,516 @@
+/*
+ * libguide fork by github.com/onderweg, version 2022
+ *
+ * Original code: Copyright 2005-08 Mahadevan R
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libguide/alloc.h>
+#include <libguide/treepar.h>
+
+/*
+ * How it works: a task is a subtree root. A worker runs a task by walking
+ * the subtree in preorder. When the worker has visited at least `grain'
+ * nodes and its own deque is empty (so there is nothing for idle workers to
+ * steal from it), it cuts off the remaining siblings of the current node and
+ * pushes them onto its deque as new tasks; the walk then skips them. Workers
+ * pop tasks from the bottom of their own deque, and steal from the top of
+ * the deques of others when their own is empty.
+ *
+ * For ordered output, the output of a task is a list of chunks: bytes
+ * written by the task itself, and placeholders for the tasks it cut off, at
+ * the position (after the subtree of the node where the cut happened) where
+ * their nodes come in preorder.
+ */
+
+#define _TP_DEFAULT_GRAIN		(256)
+#define _TP_DEQUE_INITIAL_SIZE	(64)
+#define _TP_CUT_STACK_SIZE		(64)
+#define _TP_CHUNK_INITIAL_SIZE	(256)
+
+struct _tp_task_t;
+
+struct _tp_chunk_t
+{
+	struct _tp_chunk_t *next;
+	struct _tp_task_t *task;	/* if not NULL, stands for the output of this task */
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+struct tree_parallel_out_t
+{
+	struct _tp_chunk_t *first;
+	struct _tp_chunk_t *last;
+};
+
+struct _tp_task_t
+{
+	struct tree_node_t *node;
+	struct _tp_task_t *sibling;		/* next task cut off at the same point */
+	struct _tp_task_t *all_next;	/* all tasks created by a worker, for cleanup */
+	struct tree_parallel_out_t out;
+};
+
+struct _tp_deque_t
+{
+	pthread_mutex_t lock;
+	struct _tp_task_t **tasks;
+	unsigned top;		/* thieves take from here */
+	unsigned bottom;	/* the owner pushes and pops here */
+	unsigned alloc;
+};
+
+struct _tp_pool_t;
+
+struct _tp_worker_t
+{
+	struct _tp_pool_t *pool;
+	unsigned id;
+	unsigned seed;
+	pthread_t thread;
+	struct _tp_deque_t dq;
+	struct _tp_task_t *tasks;
+};
+
+struct _tp_pool_t
+{
+	tree_parallel_fn_t fn;
+	void *cargo;
+	int ordered;
+	uint32 grain;
+
+	unsigned n;
+	struct _tp_worker_t *workers;
+
+	atomic_long pending;	/* tasks created and not yet finished */
+	atomic_int stop;
+	atomic_int ret;
+
+	/* the allocator of the calling thread, for the workers to use too */
+	const struct guide_allocator_t *alloc;
+};
+
+/*-----------------------------------------------------------------------------------------------*/
+
+static void _tp_deque_init(struct _tp_deque_t *dq)
+{
+	pthread_mutex_init(&dq->lock, NULL);
+	dq->tasks = (struct _tp_task_t **)guide_malloc(_TP_DEQUE_INITIAL_SIZE * sizeof(struct _tp_task_t *));
+	assert(dq->tasks);
+	dq->top = dq->bottom = 0;
+	dq->alloc = _TP_DEQUE_INITIAL_SIZE;
+}
+
+static void _tp_deque_free(struct _tp_deque_t *dq)
+{
+	pthread_mutex_destroy(&dq->lock);
+	guide_free(dq->tasks);
+}
+
+static int _tp_deque_is_empty(struct _tp_deque_t *dq)
+{
+	int empty;
+	pthread_mutex_lock(&dq->lock);
+	empty = (dq->top == dq->bottom);
+	pthread_mutex_unlock(&dq->lock);
+	return empty;
+}
+
+/* push `count' tasks linked through `sibling', so that `first' is popped first */
+static void _tp_deque_push_list(struct _tp_deque_t *dq, struct _tp_task_t *first, unsigned count)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom + count > dq->alloc) {
+		/* reuse the space freed by thieves, then grow */
+		memmove(dq->tasks, dq->tasks + dq->top, (dq->bottom - dq->top) * sizeof(struct _tp_task_t *));
+		dq->bottom -= dq->top;
+		dq->top = 0;
+		if (dq->bottom + count > dq->alloc) {
+			while (dq->bottom + count > dq->alloc)
+				dq->alloc *= 2;
+			dq->tasks = (struct _tp_task_t **)guide_realloc(dq->tasks,
+							dq->alloc * sizeof(struct _tp_task_t *));
+			assert(dq->tasks);
+		}
+	}
+	for (i=0; i<count; ++i, first = first->sibling)
+		dq->tasks[dq->bottom + count - 1 - i] = first;
+	dq->bottom += count;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static struct _tp_task_t *_tp_deque_pop(struct _tp_deque_t *dq)
+{
+	struct _tp_task_t *task = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->top != dq->bottom)
+		task = dq->tasks[--(dq->bottom)];
+	if (dq->top == dq->bottom)
+		dq->top = dq->bottom = 0;
+	pthread_mutex_unlock(&dq->lock);
+
+	return task;
+}
+
+static struct _tp_task_t *_tp_deque_steal(struct _tp_deque_t *dq)
+{
+	struct _tp_task_t *task = NULL;
+
+	/* don't wait for a busy deque, try another victim instead */
+	if (pthread_mutex_trylock(&dq->lock) != 0)
+		return NULL;
+	if (dq->top != dq->bottom)
+		task = dq->tasks[(dq->top)++];
+	pthread_mutex_unlock(&dq->lock);
+
+	return task;
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+
+static struct _tp_chunk_t *_tp_out_append(struct tree_parallel_out_t *out)
+{
+	struct _tp_chunk_t *c = (struct _tp_chunk_t *)guide_malloc(sizeof(struct _tp_chunk_t));
+	assert(c);
+	c->next = NULL;
+	c->task = NULL;
+	c->buf = NULL;
+	c->len = c->alloc = 0;
+
+	if (out->last)
+		out->last->next = c;
+	else
+		out->first = c;
+	out->last = c;
+
+	return c;
+}
+
+void tree_parallel_write(struct tree_parallel_out_t *out, const void *buf, size_t len)
+{
+	struct _tp_chunk_t *c;
+
+	if (!out || !len)
+		return;
+	assert(buf);
+
+	c = out->last;
+	if (!c || c->task)
+		c = _tp_out_append(out);
+
+	if (c->len + len > c->alloc) {
+		size_t alloc = c->alloc ? c->alloc : _TP_CHUNK_INITIAL_SIZE;
+		while (c->len + len > alloc)
+			alloc *= 2;
+		c->buf = (char *)guide_realloc(c->buf, alloc);
+		assert(c->buf);
+		c->alloc = alloc;
+	}
+	memcpy(c->buf + c->len, buf, len);
+	c->len += len;
+}
+
+/* the tasks cut off from a task go into its output, in order */
+static void _tp_out_add_tasks(struct tree_parallel_out_t *out, struct _tp_task_t *first)
+{
+	for (; first; first = first->sibling)
+		_tp_out_append(out)->task = first;
+}
+
+/* pass the output of `task', including that of the tasks cut off from it,
+ * to `sink'. Nesting can be as deep as the tree, so use a heap stack. */
+static void _tp_out_emit(struct _tp_task_t *task, tree_parallel_sink_fn_t sink, void *cargo)
+{
+	struct _tp_chunk_t **stack, *c;
+	unsigned n = 0, alloc = _TP_CUT_STACK_SIZE;
+
+	stack = (struct _tp_chunk_t **)guide_malloc(alloc * sizeof(struct _tp_chunk_t *));
+	assert(stack);
+
+	c = task->out.first;
+	for (;;) {
+		if (!c) {
+			if (n == 0)
+				break;
+			c = stack[--n];
+			continue;
+		}
+		if (c->task) {
+			/* emit the nested task, then come back for the rest */
+			if (n == alloc) {
+				alloc *= 2;
+				stack = (struct _tp_chunk_t **)guide_realloc(stack, alloc * sizeof(struct _tp_chunk_t *));
+				assert(stack);
+			}
+			stack[n++] = c->next;
+			c = c->task->out.first;
+			continue;
+		}
+		if (c->len)
+			sink(c->buf, c->len, cargo);
+		c = c->next;
+	}
+
+	guide_free(stack);
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+
+static struct _tp_task_t *_tp_task_create(struct _tp_worker_t *w, struct tree_node_t *node)
+{
+	struct _tp_task_t *task = (struct _tp_task_t *)guide_malloc(sizeof(struct _tp_task_t));
+	assert(task);
+	task->node = node;
+	task->sibling = NULL;
+	task->out.first = task->out.last = NULL;
+
+	/* remember for cleanup */
+	task->all_next = w->tasks;
+	w->tasks = task;
+
+	return task;
+}
+
+static void _tp_set_stop(struct _tp_pool_t *pool, int ret)
+{
+	int expected = 0;
+	atomic_compare_exchange_strong(&pool->ret, &expected, ret);
+	atomic_store(&pool->stop, 1);
+}
+
+/* cut off the siblings after `node' into new tasks, and return them */
+static struct _tp_task_t *_tp_spawn_siblings(struct _tp_worker_t *w, struct tree_node_t *node)
+{
+	struct _tp_task_t *first = NULL, *last = NULL, *task;
+	unsigned count = 0;
+
+	while ((node = tree_get_next_sibling(node))) {
+		task = _tp_task_create(w, node);
+		if (last)
+			last->sibling = task;
+		else
+			first = task;
+		last = task;
+		++count;
+	}
+
+	/* count them as pending before anyone can see them */
+	atomic_fetch_add(&w->pool->pending, count);
+	_tp_deque_push_list(&w->dq, first, count);
+
+	return first;
+}
+
+static void _tp_run_task(struct _tp_worker_t *w, struct _tp_task_t *task)
+{
+	struct _tp_pool_t *pool = w->pool;
+	struct tree_node_t *root = task->node, *node = root, *t;
+	struct tree_parallel_out_t *out = pool->ordered ? &task->out : NULL;
+	/* tasks cut off at each depth of the walk (NULL if none) */
+	struct _tp_task_t *local[_TP_CUT_STACK_SIZE], **cut = local;
+	int depth = 0, alloc = _TP_CUT_STACK_SIZE, ret;
+	uint32 since = 0;
+
+	cut[0] = NULL;
+	for (;;) {
+		if (atomic_load_explicit(&pool->stop, memory_order_relaxed))
+			break;
+
+		ret = pool->fn(node, pool->cargo, out);
+		if (ret) {
+			_tp_set_stop(pool, ret);
+			break;
+		}
+		++since;
+
+		/* step to the next node in preorder, skipping cut off siblings */
+		if ((t = tree_get_first_child(node))) {
+			node = t;
+			if (++depth == alloc) {
+				struct _tp_task_t **p = (struct _tp_task_t **)guide_malloc(
+											2 * alloc * sizeof(struct _tp_task_t *));
+				assert(p);
+				memcpy(p, cut, alloc * sizeof(struct _tp_task_t *));
+				if (cut != local)
+					guide_free(cut);
+				cut = p;
+				alloc *= 2;
+			}
+			cut[depth] = NULL;
+		} else {
+			for (;;) {
+				if (node == root) {
+					node = NULL;
+					break;
+				}
+				if (cut[depth]) {
+					/* the cut off tasks come right after this subtree */
+					if (out)
+						_tp_out_add_tasks(out, cut[depth]);
+					cut[depth] = NULL;
+				} else if ((t = tree_get_next_sibling(node))) {
+					node = t;
+					break;
+				}
+				node = tree_get_parent(node);
+				--depth;
+			}
+			if (!node)
+				break;
+		}
+
+		/* offer the rest of this sibling list, if nobody has anything to steal from us */
+		if (pool->n > 1 && since >= pool->grain && node != root && !cut[depth] &&
+			tree_get_next_sibling(node) && _tp_deque_is_empty(&w->dq)) {
+			cut[depth] = _tp_spawn_siblings(w, node);
+			since = 0;
+		}
+	}
+
+	if (cut != local)
+		guide_free(cut);
+}
+
+static struct _tp_task_t *_tp_steal(struct _tp_worker_t *w)
+{
+	struct _tp_pool_t *pool = w->pool;
+	struct _tp_task_t *task;
+	unsigned i, start;
+
+	if (pool->n < 2)
+		return NULL;
+
+	start = (unsigned)rand_r(&w->seed) % pool->n;
+	for (i=0; i<pool->n; ++i) {
+		unsigned victim = (start + i) % pool->n;
+		if (victim == w->id)
+			continue;
+		if ((task = _tp_deque_steal(&pool->workers[victim].dq)))
+			return task;
+	}
+	return NULL;
+}
+
+static void *_tp_worker_main(void *arg)
+{
+	struct _tp_worker_t *w = (struct _tp_worker_t *)arg;
+	struct _tp_pool_t *pool = w->pool;
+	struct _tp_task_t *task;
+
+	if (w->id != 0)
+		guide_use_allocator(pool->alloc);
+	for (;;) {
+		task = _tp_deque_pop(&w->dq);
+		if (!task)
+			task = _tp_steal(w);
+		if (task) {
+			_tp_run_task(w, task);
+			atomic_fetch_sub(&pool->pending, 1);
+			continue;
+		}
+		if (atomic_load(&pool->pending) == 0)
+			break;
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+int tree_parallel_for_each(struct tree_node_t *node, tree_parallel_fn_t fn, void *cargo,
+	const struct tree_parallel_opts_t *opts)
+{
+	struct _tp_pool_t pool;
+	struct _tp_task_t *root_task;
+	unsigned i, started;
+	long ncpu;
+	int ret;
+
+	assert(node);
+	assert(fn);
+
+	pool.fn = fn;
+	pool.cargo = cargo;
+	pool.ordered = (opts && opts->sink);
+	pool.grain = (opts && opts->grain) ? opts->grain : _TP_DEFAULT_GRAIN;
+	if (opts && opts->n_threads)
+		pool.n = opts->n_threads;
+	else {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		pool.n = (ncpu > 0) ? (unsigned)ncpu : 1;
+	}
+	atomic_init(&pool.pending, 1);
+	atomic_init(&pool.stop, 0);
+	atomic_init(&pool.ret, 0);
+	pool.alloc = guide_current_allocator();
+
+	pool.workers = (struct _tp_worker_t *)guide_calloc(pool.n, sizeof(struct _tp_worker_t));
+	assert(pool.workers);
+	if (!pool.workers)
+		return -1;
+	for (i=0; i<pool.n; ++i) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].id = i;
+		pool.workers[i].seed = i + 1;
+		pool.workers[i].tasks = NULL;
+		_tp_deque_init(&(pool.workers[i].dq));
+	}
+
+	/* the whole subtree is the first task, run by the calling thread */
+	root_task = _tp_task_create(&pool.workers[0], node);
+	_tp_deque_push_list(&(pool.workers[0].dq), root_task, 1);
+
+	/* if a thread can't be started, the ones we have will do the work */
+	for (started = 1; started < pool.n; ++started)
+		if (pthread_create(&(pool.workers[started].thread), NULL, _tp_worker_main,
+				&(pool.workers[started])) != 0)
+			break;
+	_tp_worker_main(&(pool.workers[0]));
+	for (i=1; i<started; ++i)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	ret = atomic_load(&pool.ret);
+	if (!ret && pool.ordered)
+		_tp_out_emit(root_task, opts->sink, opts->sink_cargo);
+
+	/* cleanup */
+	for (i=0; i<pool.n; ++i) {
+		struct _tp_task_t *task = pool.workers[i].tasks, *next;
+		for (; task; task = next) {
+			struct _tp_chunk_t *c = task->out.first, *cnext;
+			for (; c; c = cnext) {
+				cnext = c->next;
+				guide_free(c->buf);
+				guide_free(c);
+			}
+			next = task->all_next;
+			guide_free(task);
+		}
+		_tp_deque_free(&(pool.workers[i].dq));
+	}
+	guide_free(pool.workers);
+
+	return ret;
+}
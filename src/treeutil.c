@@ -20,66 +20,58 @@
 #include <assert.h>
 #include <libguide/tree.h>
 #include <libguide/treeutil.h>
-#include <libguide/lut.h>
 
-struct _tree_copy_info
+/* Walk the source subtree and the copy in step: entering a source node adds
+ * its copy after the last copied child of the current copy and goes down
+ * into it, and leaving a source node goes back up. This needs no lookups
+ * and no stack, and each node is added in O(1). The copy is built as a tree
+ * of its own, so that it can't end up inside the subtree being copied. */
+struct tree_t *tree_copy_subtree(struct tree_node_t *src_node, tree_copy_data_fn_t copy_fn,
+		tree_traverser_fn_t node_fn, void *cargo)
 {
-	struct tree_node_t *src_root;
-	struct tree_node_t *dst_root;
-	struct lut_t *lut;
-	tree_copy_data_fn_t copy_fn;
-	void *cargo;
-};
-
-/* TODO: Change tree_add_child() semantics, to take `before' rather than
- * `after'.
- */
-static struct tree_node_t* _tree_get_last_child(struct tree_node_t *parent)
-{
-	struct tree_node_t *t, *last = tree_get_first_child(parent);
-	if (!last)
-		return NULL;
-	while ((t = tree_get_next_sibling(last)))
-		last = t;
-	return last;
-}
-
-static int _tree_copier(struct tree_node_t *node, void *cargo)
-{
-	struct _tree_copy_info *copy_info = (struct _tree_copy_info *)cargo;
-	struct tree_node_t *parent = tree_get_parent(node), *new_parent = NULL, *new_node;
+	struct tree_iter_t it;
+	struct tree_t *copy = NULL;
+	struct tree_node_t *cur = NULL, *last = NULL;
 	void *new_data;
 
-	/* don't try to insert root (it's done by caller) */
-	if (node == copy_info->src_root)
-		return 0;
-
-	/* get new parent */
-	if (parent == copy_info->src_root)
-		new_parent = copy_info->dst_root;
-	else
-		lut_get(copy_info->lut, parent, (void**)&new_parent);
-	assert(new_parent);
-
-	/* get new data */
-	new_data = tree_get_data(node);
-	if (copy_info->copy_fn) 
-		new_data = copy_info->copy_fn(new_data, copy_info->cargo);
-
-	/* insert new node */
-	new_node = 
-		tree_add_child(new_parent, new_data, _tree_get_last_child(new_parent));
+	assert(src_node);
 
-	/* remember: node -> new_node */
-	lut_set(copy_info->lut, node, new_node);
+	tree_iter_init(&it, src_node, TREE_ITER_EVENTS);
+	while (tree_iter_next(&it)) {
+		if (it.event == TREE_ITER_LEAVE) {
+			last = cur;
+			cur = tree_get_parent(cur);
+			continue;
+		}
+
+		/* get new data */
+		new_data = tree_get_data(it.node);
+		if (copy_fn)
+			new_data = copy_fn(new_data, cargo);
+
+		/* insert new node */
+		if (!cur) {
+			copy = tree_create_with_root(new_data);
+			assert(copy);
+			if (!copy) return NULL;
+			cur = tree_get_root(copy);
+		} else {
+			cur = tree_add_child(cur, new_data, last);
+			assert(cur);
+		}
+		last = NULL;
+
+		if (node_fn)
+			node_fn(cur, cargo);
+	}
 
-	return 0;
+	return copy;
 }
 
 struct tree_node_t *tree_copy_subtree_after(struct tree_node_t *src_node,
 		struct tree_node_t *dst_node, tree_copy_data_fn_t copy_fn, void *cargo)
 {
-	void *new_data;
+	struct tree_t *copy;
 	struct tree_node_t *copy_root;
 
 	assert(src_node);
@@ -91,33 +83,20 @@ struct tree_node_t *tree_copy_subtree_after(struct tree_node_t *src_node,
 		!tree_get_parent(src_node) || !tree_get_parent(dst_node))
 		return NULL;
 
-	/* insert src_node copy */
-	new_data = tree_get_data(src_node);
-	if (copy_fn)
-		new_data = copy_fn(new_data, cargo);
-	copy_root = tree_add_sibling_after(dst_node, new_data);
-	assert(copy_root); /* TODO: if this operation fails, we need to cleanup
-					      the newly-created data and then exit */
-
-	/* copy children if present */
-	if (tree_get_first_child(src_node)) {
-		struct lut_t *lut = lut_create();
-		struct _tree_copy_info copy_info = {
-			src_node, copy_root, lut, copy_fn, cargo
-		};
-
-		tree_traverse_subtree_preorder(src_node, _tree_copier, &copy_info);
-		lut_free(lut);
-	}
+	copy = tree_copy_subtree(src_node, copy_fn, NULL, cargo);
+	assert(copy); /* TODO: if this operation fails, we need to cleanup
+				     the newly-created data and then exit */
 
-	return copy_root;
+	/* attach the copy, then move it in place */
+	copy_root = tree_get_root(copy);
+	tree_merge_tree(tree_get_parent(dst_node), copy);
+	return tree_move_subtree_after(copy_root, dst_node);
 }
 
-/* TODO: refactor out common code in below fns. */
 struct tree_node_t *tree_copy_subtree_before(struct tree_node_t *src_node,
 		struct tree_node_t *dst_node, tree_copy_data_fn_t copy_fn, void *cargo)
 {
-	void *new_data;
+	struct tree_t *copy;
 	struct tree_node_t *copy_root;
 
 	assert(src_node);
@@ -129,33 +108,23 @@ struct tree_node_t *tree_copy_subtree_before(struct tree_node_t *src_node,
 		!tree_get_parent(src_node) || !tree_get_parent(dst_node))
 		return NULL;
 
-	/* insert src_node copy */
-	new_data = tree_get_data(src_node);
-	if (copy_fn)
-		new_data = copy_fn(new_data, cargo);
-	copy_root = tree_add_sibling_before(dst_node, new_data);
-	assert(copy_root); /* TODO: if this operation fails, we need to cleanup
-					      the newly-created data and then exit */
-
-	/* copy children if present */
-	if (tree_get_first_child(src_node)) {
-		struct lut_t *lut = lut_create();
-		struct _tree_copy_info copy_info = {
-			src_node, copy_root, lut, copy_fn, cargo
-		};
-
-		tree_traverse_subtree_preorder(src_node, _tree_copier, &copy_info);
-		lut_free(lut);
-	}
+	copy = tree_copy_subtree(src_node, copy_fn, NULL, cargo);
+	assert(copy); /* TODO: if this operation fails, we need to cleanup
+				     the newly-created data and then exit */
 
-	return copy_root;
+	/* attach the copy, then move it in place */
+	copy_root = tree_get_root(copy);
+	tree_merge_tree(tree_get_parent(dst_node), copy);
+	if (tree_get_next_sibling(copy_root) == dst_node)
+		return copy_root;
+	return tree_move_subtree_before(copy_root, dst_node);
 }
 
 struct tree_node_t *tree_copy_subtree_as_child(struct tree_node_t *src_node,
 		struct tree_node_t *dst_node/*, struct tree_node_t *after*/,
 		tree_copy_data_fn_t copy_fn, void *cargo)
 {
-	void *new_data;
+	struct tree_t *copy;
 	struct tree_node_t *copy_root;
 
 	assert(src_node);
@@ -167,25 +136,12 @@ struct tree_node_t *tree_copy_subtree_as_child(struct tree_node_t *src_node,
 		!tree_get_parent(src_node) || !tree_get_parent(dst_node))
 		return NULL;
 
-	/* insert src_node copy */
-	new_data = tree_get_data(src_node);
-	if (copy_fn)
-		new_data = copy_fn(new_data, cargo);
-	copy_root = tree_add_child(dst_node, new_data, NULL);
-	/* TODO: the NULL can be accepted as `after' */
-	assert(copy_root); /* TODO: if this operation fails, we need to cleanup
-					      the newly-created data and then exit */
-
-	/* copy children if present */
-	if (tree_get_first_child(src_node)) {
-		struct lut_t *lut = lut_create();
-		struct _tree_copy_info copy_info = {
-			src_node, copy_root, lut, copy_fn, cargo
-		};
-
-		tree_traverse_subtree_preorder(src_node, _tree_copier, &copy_info);
-		lut_free(lut);
-	}
+	copy = tree_copy_subtree(src_node, copy_fn, NULL, cargo);
+	assert(copy); /* TODO: if this operation fails, we need to cleanup
+				     the newly-created data and then exit */
 
+	/* the root of a merged tree becomes the first child */
+	copy_root = tree_get_root(copy);
+	tree_merge_tree(dst_node, copy);
 	return copy_root;
 }
@@ -0,0 +1,308 @@
+/*
+ * guide_set_allocator() and guide_set_default_allocator(), with allocators
+ * that count what they hand out and tag each block with who handed it out:
+ * a guide with its own allocator goes through loads and stores, journal,
+ * blob store, builders on other threads, snapshots, lookups, copies,
+ * batches, compaction, splits and merges, and parallel walks, while the
+ * calling thread uses yet another allocator. Every block must be freed by
+ * the allocator that gave it, that of the guide must get back all it gave,
+ * the default one must only ever hold the guide_t themselves, and the one
+ * of the thread must never be called.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "check.h"
+
+#define HEAD        16
+
+struct counted_t
+{
+    struct guide_allocator_t alloc;
+    _Atomic long live;           /* allocations not freed yet */
+    _Atomic long calls;          /* allocations and reallocations */
+};
+
+static struct counted_t mine, def, other;
+
+static void *tagged(char *base, struct counted_t *c)
+{
+    if (!base)
+        return NULL;
+    *(struct counted_t **)base = c;
+    return base + HEAD;
+}
+
+/* the block `p' comes from, which must have been given by `c' */
+static char *base_of(void *p, struct counted_t *c)
+{
+    char *base = (char *)p - HEAD;
+
+    CHECK(*(struct counted_t **)base == c);
+    return base;
+}
+
+static void *counted_malloc(size_t size, void *cargo)
+{
+    struct counted_t *c = (struct counted_t *)cargo;
+    void *p = tagged((char *)malloc(size + HEAD), c);
+
+    atomic_fetch_add(&c->calls, 1);
+    if (p)
+        atomic_fetch_add(&c->live, 1);
+    return p;
+}
+
+static void *counted_realloc(void *p, size_t size, void *cargo)
+{
+    struct counted_t *c = (struct counted_t *)cargo;
+
+    if (!p)
+        return counted_malloc(size, cargo);
+    atomic_fetch_add(&c->calls, 1);
+    return tagged((char *)realloc(base_of(p, c), size + HEAD), c);
+}
+
+static void counted_free(void *p, void *cargo)
+{
+    struct counted_t *c = (struct counted_t *)cargo;
+    char *base;
+
+    if (!p)
+        return;
+    base = base_of(p, c);
+    *(struct counted_t **)base = NULL;
+    atomic_fetch_sub(&c->live, 1);
+    free(base);
+}
+
+static void counted_init(struct counted_t *c)
+{
+    c->alloc.malloc_fn = counted_malloc;
+    c->alloc.realloc_fn = counted_realloc;
+    c->alloc.free_fn = counted_free;
+    c->alloc.cargo = c;
+}
+
+static void *build(void *arg)
+{
+    struct guide_t *guide = (struct guide_t *)arg;
+    struct guide_builder_t *b;
+    struct tree_node_t *node = NULL;
+    wchar_t title[64];
+    int i;
+
+    b = guide_builder_create(guide);
+    CHECK(b);
+    for (i = 0; i < 500; ++i) {
+        swprintf(title, 64, i % 2 ? L"built %d" : L"a longer title of built node %d", i);
+        node = guide_builder_add_child(b, i % 5 ? node : NULL,
+            guide_builder_nodedata(b, title, i % 50 ? "built" : NULL), NULL);
+        CHECK(node);
+    }
+    CHECK(guide_builder_publish(b, tree_get_root(guide->tree), NULL) == 0);
+    guide_builder_destroy(b);
+    return NULL;
+}
+
+static int visit(struct tree_node_t *node, void *cargo, struct tree_parallel_out_t *out)
+{
+    uint32 uid = ((struct guide_nodedata_t *)tree_get_data(node))->uid;
+
+    tree_parallel_write(out, &uid, sizeof(uid));
+    return 0;
+}
+
+static void sink(const void *buf, size_t len, void *cargo)
+{
+    *(size_t *)cargo += len;
+}
+
+static struct tree_node_t *random_node(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree);
+
+    return tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+}
+
+/* all the guide does, from the allocator of `guide' */
+static struct guide_t *work(struct guide_t *guide)
+{
+    char blobs[] = "/tmp/libguide-alloc-XXXXXX", file[] = "/tmp/libguide-alloc-XXXXXX";
+    struct tree_parallel_opts_t opts;
+    struct guide_memory_t usage;
+    struct tree_snapshot_t *ss;
+    struct tree_node_t *node, *dst;
+    struct guide_t *split, *loaded;
+    const struct guide_allocator_t *prev;
+    pthread_t thread;
+    wchar_t wfile[64];
+    unsigned os_errcode;
+    uint32 format, uid;
+    size_t written = 0;
+    char long_text[2000];
+    int fd, i;
+
+    CHECK(guide_set_concurrent(guide, 1) == 0);
+    CHECK(guide_set_journal(guide, 1, 0) == 0);
+    CHECK((fd = mkstemp(blobs)) >= 0);
+    close(fd);
+    unlink(blobs);
+    CHECK(guide_set_blob_store(guide, blobs, 300, 4096) == 0);
+
+    /* adds, in batches now and then, and changes */
+    check_random_guide(guide, 1000);
+    guide_begin_batch(guide);
+    check_random_guide(guide, 500);
+    guide_commit_batch(guide);
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    for (i = 0; i < 200; ++i) {
+        node = random_node(guide);
+        guide_nodedata_set_text((struct guide_nodedata_t *)tree_get_data(node),
+            i % 2 ? long_text : "short");
+        guide_nodedata_set_title((struct guide_nodedata_t *)tree_get_data(node),
+            i % 3 ? L"renamed" : L"renamed to a title too long to keep inline");
+    }
+
+    /* builders on other threads, which use no allocator of their own */
+    CHECK(pthread_create(&thread, NULL, build, guide) == 0);
+    build(guide);
+    CHECK(pthread_join(thread, NULL) == 0);
+
+    /* undone and redone, and read from a snapshot meanwhile */
+    ss = guide_snapshot(guide);
+    CHECK(ss);
+    for (i = 0; i < 50; ++i)
+        CHECK(guide_undo(guide) == 0);
+    free(check_dump(ss, tree_get_root(guide->tree)));
+    for (i = 0; i < 20; ++i)
+        CHECK(guide_redo(guide) == 0);
+    guide_snapshot_release(ss);
+
+    /* lookups, copies, deletes and moves */
+    for (i = 0; i < 100; ++i) {
+        node = random_node(guide);
+        guide_find_child_by_title(guide, node, L"renamed");
+        guide_find_by_path(guide, NULL, L"renamed/n1/renamed");
+        if (tree_get_subtree_size(node) > 100 || !tree_get_parent(node))
+            continue;
+        dst = random_node(guide);
+        if (i % 3 == 0)
+            CHECK(guide_copy_subtree(guide, node, dst, NULL));
+        else if (i % 3 == 1)
+            guide_delete_subtree(guide, node);
+        else if (tree_get_parent(dst) && !check_is_within(dst, node)) {
+            prev = guide_use_allocator(&mine.alloc);
+            CHECK(tree_move_subtree_as_child(node, dst) == node);
+            guide_use_allocator(prev);
+        }
+    }
+
+    /* split off and merged back */
+    do
+        node = random_node(guide);
+    while (!tree_get_parent(node));
+    split = guide_split_subtree(guide, node);
+    CHECK(split && split->_alloc == &mine.alloc);
+    CHECK(atomic_load(&def.live) == 2);
+    check_random_guide(split, 100);
+    guide_merge_guide(guide, tree_get_root(guide->tree), split);
+    CHECK(atomic_load(&def.live) == 1);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.n_threads = 4;
+    opts.sink = sink;
+    opts.sink_cargo = &written;
+    CHECK(guide_parallel_for_each(guide, visit, NULL, &opts) == 0);
+    CHECK(written == tree_get_node_count(guide->tree) * sizeof(uint32));
+    CHECK(guide_memory_usage(guide, NULL, &usage) == 0);
+    CHECK(usage.total > 0);
+
+    /* compacted */
+    uid = ((struct guide_nodedata_t *)tree_get_data(random_node(guide)))->uid;
+    CHECK(guide_compact_layout(guide) == 0);
+    CHECK(guide_get_node_by_uid(guide, uid));
+    check_uids(guide, tree_get_root(guide->tree));
+
+    /* stored, and loaded by a thread using the allocator */
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+    CHECK(guide_store(wfile, guide) == 0);
+    prev = guide_use_allocator(&mine.alloc);
+    loaded = guide_load(wfile, &os_errcode, &format);
+    guide_use_allocator(prev);
+    CHECK(loaded && loaded->_alloc == &mine.alloc);
+    unlink(file);
+    CHECK(atomic_load(&def.live) == 2);
+    check_random_guide(loaded, 100);
+    for (i = 0; i < 10 && tree_get_first_child(tree_get_root(loaded->tree)); ++i)
+        guide_delete_subtree(loaded, tree_get_first_child(tree_get_root(loaded->tree)));
+
+    guide_destroy(guide);
+    unlink(blobs);
+    CHECK(atomic_load(&def.live) == 1);
+    return loaded;
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_t *guide;
+    const struct guide_allocator_t *prev;
+    int round;
+
+    check_setlocale();
+    srand(48);
+    counted_init(&mine);
+    counted_init(&def);
+    counted_init(&other);
+    guide_set_default_allocator(&def.alloc);
+
+    for (round = 0; round < 2; ++round) {
+        if (round == 0) {
+            /* an allocator set on a new guide */
+            guide = guide_create();
+            CHECK(guide);
+            CHECK(guide->_alloc == NULL);
+            CHECK(guide_set_allocator(guide, &mine.alloc) == 0);
+        } else {
+            /* one in use when the guide is created */
+            prev = guide_use_allocator(&mine.alloc);
+            guide = guide_create();
+            guide_use_allocator(prev);
+            CHECK(guide);
+        }
+        CHECK(guide->_alloc == &mine.alloc);
+        CHECK(atomic_load(&def.live) == 1);
+        CHECK(guide_set_allocator(guide, &mine.alloc) == 0);
+        CHECK(guide_add_child(guide, tree_get_root(guide->tree),
+            check_random_nodedata(guide, 0), NULL));
+        CHECK(guide_set_allocator(guide, &mine.alloc) == -1);
+
+        /* whatever the calling thread uses */
+        prev = guide_use_allocator(&other.alloc);
+        guide = work(guide);
+        guide_destroy(guide);
+        guide_use_allocator(prev);
+
+        CHECK(atomic_load(&mine.live) == 0);
+        CHECK(atomic_load(&def.live) == 0);
+        CHECK(atomic_load(&mine.calls) > 0);
+        CHECK(atomic_load(&other.calls) == 0);
+    }
+
+    /* the default allocator, for guides that have none of their own */
+    guide = guide_create();
+    CHECK(guide && guide->_alloc == NULL);
+    check_random_guide(guide, 1000);
+    CHECK(atomic_load(&def.live) > 1);
+    guide_destroy(guide);
+    CHECK(atomic_load(&def.live) == 0);
+    guide_set_default_allocator(NULL);
+
+    printf("alloc: ok\n");
+    return EXIT_SUCCESS;
+}
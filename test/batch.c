@@ -0,0 +1,167 @@
+/*
+ * Batches against the same changes made without one: two guides get the
+ * same random adds, and now and then a delete or a move, one of them in
+ * nested batches, with queries in between that need the sizes, ranks and
+ * uids the batch has left to bring up to date. Both must answer the same
+ * all along, and dump the same in the end.
+ */
+
+#include "check.h"
+
+#define MAX_NODES   5000
+
+struct side_t
+{
+    struct guide_t *guide;
+    struct tree_node_t *nodes[MAX_NODES];
+};
+
+static struct side_t sides[2];
+static int n_nodes;
+
+static struct guide_nodedata_t *nodedata(struct guide_t *guide, int i)
+{
+    struct guide_nodedata_t *data;
+    wchar_t title[32];
+    char text[32];
+
+    swprintf(title, 32, L"n%d", i % 50);
+    snprintf(text, sizeof(text), "%.*s", i % 20, "text of the node....");
+    data = guide_nodedata_create_with_data(guide, title, text);
+    CHECK(data);
+    if (i % 7 == 0)
+        guide_nodedata_set_attr(data, NA_ICON, i % 5);
+    return data;
+}
+
+/* add node `n_nodes' to both guides, next to or under node `k' */
+static void add(int k, int how)
+{
+    struct side_t *s;
+    struct tree_node_t *node = NULL;
+
+    for (s = sides; s < sides + 2; ++s) {
+        if (how == 0 && tree_get_parent(s->nodes[k]))
+            node = guide_add_sibling_after(s->guide, s->nodes[k], nodedata(s->guide, n_nodes));
+        else if (how == 1 && tree_get_parent(s->nodes[k]))
+            node = guide_add_sibling_before(s->guide, s->nodes[k], nodedata(s->guide, n_nodes));
+        else
+            node = guide_add_child(s->guide, s->nodes[k], nodedata(s->guide, n_nodes),
+                how == 2 ? NULL : tree_get_first_child(s->nodes[k]));
+        CHECK(node);
+        s->nodes[n_nodes] = node;
+    }
+    ++n_nodes;
+}
+
+/* delete the subtree at node `k' from both guides */
+static void delete(int k)
+{
+    struct tree_node_t *top[2] = { sides[0].nodes[k], sides[1].nodes[k] };
+    int i, n;
+
+    /* keep the nodes of which `top' is no ancestor, the others are gone */
+    for (i = n = 0; i < n_nodes; ++i)
+        if (!check_is_within(sides[1].nodes[i], top[1])) {
+            sides[0].nodes[n] = sides[0].nodes[i];
+            sides[1].nodes[n++] = sides[1].nodes[i];
+        }
+    n_nodes = n;
+
+    guide_delete_subtree(sides[0].guide, top[0]);
+    guide_delete_subtree(sides[1].guide, top[1]);
+}
+
+static int rank_of(struct side_t *s, int k)
+{
+    return (int)tree_get_preorder_rank(s->nodes[k]);
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_nodedata_t *data;
+    struct tree_node_t *a, *b;
+    struct side_t *s;
+    int depth = 0, step, k, j;
+    char *dump, *got;
+
+    srand(30);
+    for (s = sides; s < sides + 2; ++s) {
+        s->guide = guide_create();
+        CHECK(s->guide);
+        s->nodes[0] = tree_get_root(s->guide->tree);
+    }
+    n_nodes = 1;
+
+    for (step = 0; step < 20000 && n_nodes < MAX_NODES - 2; ++step) {
+        /* open and commit batches, nested up to three deep */
+        if (depth < 3 && rand() % 50 == 0) {
+            guide_begin_batch(sides[0].guide);
+            ++depth;
+        } else if (depth && rand() % 60 == 0) {
+            guide_commit_batch(sides[0].guide);
+            --depth;
+        }
+
+        k = rand() % n_nodes;
+        j = rand() % n_nodes;
+        switch (rand() % 40) {
+        case 0:
+            /* a delete, with the nodes left to clean up in the batch */
+            if (k)
+                delete(k);
+            break;
+        case 1:
+            /* a move, likewise */
+            a = sides[1].nodes[k];
+            b = sides[1].nodes[j];
+            if (!k || check_is_within(b, a))
+                break;
+            CHECK(tree_move_subtree_as_child(sides[0].nodes[k], sides[0].nodes[j]) ==
+                sides[0].nodes[k]);
+            CHECK(tree_move_subtree_as_child(a, b) == a);
+            break;
+        case 2:
+        case 3:
+            /* queries that need what the batch put off */
+            CHECK(tree_get_subtree_size(sides[0].nodes[0]) == (uint32)n_nodes);
+            CHECK(tree_get_subtree_size(sides[0].nodes[k]) ==
+                tree_get_subtree_size(sides[1].nodes[k]));
+            CHECK(rank_of(sides, k) == rank_of(sides + 1, k));
+            CHECK(tree_get_nth_preorder(sides[0].nodes[0], rank_of(sides + 1, j)) ==
+                sides[0].nodes[j]);
+            CHECK(tree_get_child_count(sides[0].nodes[k]) ==
+                tree_get_child_count(sides[1].nodes[k]));
+            data = (struct guide_nodedata_t *)tree_get_data(sides[0].nodes[j]);
+            CHECK(guide_get_node_by_uid(sides[0].guide, data->uid) == sides[0].nodes[j]);
+            a = guide_find_child_by_title(sides[0].guide, sides[0].nodes[k], L"n7");
+            b = guide_find_child_by_title(sides[1].guide, sides[1].nodes[k], L"n7");
+            CHECK(!a == !b);
+            CHECK(!a || ((struct guide_nodedata_t *)tree_get_data(a))->uid ==
+                ((struct guide_nodedata_t *)tree_get_data(b))->uid);
+            break;
+        default:
+            add(k, rand() % 4);
+            break;
+        }
+    }
+    while (depth--)
+        guide_commit_batch(sides[0].guide);
+
+    dump = check_dump(NULL, sides[1].nodes[0]);
+    got = check_dump(NULL, sides[0].nodes[0]);
+    CHECK(strcmp(dump, got) == 0);
+    for (s = sides; s < sides + 2; ++s) {
+        CHECK(check_count(s->nodes[0]) == (unsigned)n_nodes);
+        CHECK(tree_get_node_count(s->guide->tree) == (uint32)n_nodes);
+        check_uids(s->guide, s->nodes[0]);
+        CHECK(s->guide->_counter == sides[0].guide->_counter);
+    }
+
+    free(got);
+    free(dump);
+    for (s = sides; s < sides + 2; ++s)
+        guide_destroy(s->guide);
+    printf("batch: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/*
+ * The blob store against copies of the texts kept by hand: texts over the
+ * threshold go to the file and come back, whatever was evicted from the
+ * cache in between, as they are read and changed at random, and texts held
+ * at once stay good until released, however many there are. The guide is
+ * then stored and loaded back, a subtree split off keeps reading its texts
+ * from the store after the guide is gone, and a threshold of 0 brings the
+ * texts back into memory. Texts lost from the file read as NULL, and stop
+ * the guide from being stored.
+ */
+
+#include <unistd.h>
+
+#include "check.h"
+
+#define N_NODES     600
+
+static struct tree_node_t *nodes[N_NODES + 1];
+static char *refs[N_NODES + 1];
+
+/* a text of `len' bytes that tells where it came from */
+static char *make_text(int i, int len)
+{
+    char *text = malloc(len + 1);
+    int n = 0;
+
+    CHECK(text);
+    while (n < len)
+        n += snprintf(text + n, len + 1 - n, "<%d:%d>", i, n);
+    text[len] = '\0';
+    return text;
+}
+
+static int random_len(void)
+{
+    return rand() % 3 ? rand() % 2000 : rand() % 64;
+}
+
+static void set_text(struct guide_t *guide, int i, int len)
+{
+    free(refs[i]);
+    refs[i] = make_text(i, len);
+    guide_nodedata_set_text((struct guide_nodedata_t *)tree_get_data(nodes[i]), refs[i]);
+}
+
+static void check_text(int i)
+{
+    struct guide_text_t t;
+
+    CHECK(guide_nodedata_acquire_text((struct guide_nodedata_t *)tree_get_data(nodes[i]), &t));
+    CHECK(strcmp(t.text, refs[i]) == 0);
+    guide_nodedata_release_text(&t);
+}
+
+/* many texts held at once, more than the cache keeps, each still good
+   until it's released, even once it's been changed */
+static void check_held(int n)
+{
+    struct guide_text_t held[64];
+    struct guide_nodedata_t *data;
+    int at[64], changed[64], k;
+
+    CHECK(n <= 64);
+    for (k = 0; k < n; ++k) {
+        at[k] = rand() % (N_NODES + 1);
+        CHECK(guide_nodedata_acquire_text((struct guide_nodedata_t *)tree_get_data(nodes[at[k]]),
+            &held[k]));
+    }
+    for (k = 0; k < n; ++k)
+        CHECK(strcmp(held[k].text, refs[at[k]]) == 0);
+    for (k = 0; k < n; ++k) {
+        data = (struct guide_nodedata_t *)tree_get_data(nodes[at[k]]);
+        if ((changed[k] = data->_blob && rand() % 4 == 0))
+            guide_nodedata_set_text(data, "");
+    }
+    for (k = 0; k < n; ++k) {
+        CHECK(strcmp(held[k].text, refs[at[k]]) == 0);
+        guide_nodedata_release_text(&held[k]);
+    }
+    for (k = 0; k < n; ++k)
+        if (changed[k])
+            set_text(NULL, at[k], random_len());
+}
+
+
+/* a store file cut short: the texts lost with it read as NULL, and the
+   guide can't be stored */
+static void lost_texts(void)
+{
+    char path[] = "/tmp/libguide-blob-XXXXXX", file[] = "/tmp/libguide-blob-XXXXXX";
+    wchar_t wfile[64];
+    struct guide_t *guide;
+    struct guide_nodedata_t *data[4];
+    struct guide_text_t t;
+    char *text;
+    int i, fd;
+
+    guide = guide_create();
+    CHECK(guide);
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+    CHECK(guide_set_blob_store(guide, path, 64, 1) == 0);
+    text = make_text(0, 1000);
+    for (i = 0; i < 4; ++i) {
+        data[i] = check_random_nodedata(guide, i);
+        guide_nodedata_set_text(data[i], text);
+        CHECK(guide_add_child(guide, tree_get_root(guide->tree), data[i], NULL));
+        CHECK(data[i]->_blob);
+    }
+
+    CHECK(truncate(path, 0) == 0);
+    for (i = 0; i < 3; ++i) {
+        CHECK(guide_nodedata_acquire_text(data[i], &t) == NULL);
+        CHECK(t.text == NULL);
+        guide_nodedata_release_text(&t);
+    }
+
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+    CHECK(guide_store(wfile, guide) == -1);
+    unlink(file);
+
+    /* a text set again is good again */
+    guide_nodedata_set_text(data[0], text);
+    CHECK(guide_nodedata_acquire_text(data[0], &t) && strcmp(t.text, text) == 0);
+    guide_nodedata_release_text(&t);
+
+    free(text);
+    guide_destroy(guide);
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/libguide-blob-XXXXXX", file[] = "/tmp/libguide-blob-XXXXXX";
+    wchar_t wfile[64];
+    struct guide_t *guide, *loaded, *other;
+    struct guide_nodedata_t *data;
+    struct tree_node_t *node;
+    struct tree_iter_t it;
+    unsigned os_errcode;
+    uint32 format;
+    char *dump, *got;
+    int i, step, fd;
+
+    check_setlocale();
+    srand(44);
+    guide = guide_create();
+    CHECK(guide);
+    nodes[0] = tree_get_root(guide->tree);
+    set_text(guide, 0, 0);
+    for (i = 1; i <= N_NODES; ++i) {
+        nodes[i] = guide_add_child(guide, nodes[rand() % i], check_random_nodedata(guide, i), NULL);
+        CHECK(nodes[i]);
+        set_text(guide, i, random_len());
+    }
+    dump = check_dump(NULL, nodes[0]);
+
+    /* not over a file that exists */
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    CHECK(guide_set_blob_store(guide, path, 64, 8192) == -1);
+    unlink(path);
+    CHECK(guide_set_blob_store(guide, path, 64, 8192) == 0);
+    for (i = 0; i <= N_NODES; ++i) {
+        data = (struct guide_nodedata_t *)tree_get_data(nodes[i]);
+        CHECK(!data->_blob == (strlen(refs[i]) < 64));
+    }
+    got = check_dump(NULL, nodes[0]);
+    CHECK(strcmp(got, dump) == 0);
+    free(got);
+    free(dump);
+
+    /* reads and changes, with a cache much smaller than the texts */
+    for (step = 0; step < 20000; ++step) {
+        i = rand() % (N_NODES + 1);
+        if (rand() % 10 == 0)
+            set_text(guide, i, random_len());
+        check_text(i);
+        if (step % 1000 == 0)
+            check_held(1 + rand() % 64);
+    }
+    for (i = 0; i <= N_NODES; ++i)
+        check_text(i);
+
+    /* a store and load round trip */
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+    CHECK(guide_store(wfile, guide) == 0);
+    loaded = guide_load(wfile, &os_errcode, &format);
+    CHECK(loaded);
+    dump = check_dump(NULL, nodes[0]);
+    got = check_dump(NULL, tree_get_root(loaded->tree));
+    CHECK(strcmp(got, dump) == 0);
+    free(got);
+    free(dump);
+    guide_destroy(loaded);
+    unlink(file);
+
+    /* a subtree split off keeps its texts in the store, even once the
+       guide is gone */
+    node = tree_get_first_child(nodes[0]);
+    dump = check_dump(NULL, node);
+    other = guide_split_subtree(guide, node);
+    CHECK(other);
+
+    /* the texts back in memory */
+    CHECK(guide_set_blob_store(guide, NULL, 0, 0) == 0);
+    tree_iter_init(&it, nodes[0], TREE_ITER_PREORDER);
+    while (tree_iter_next(&it)) {
+        data = (struct guide_nodedata_t *)tree_get_data(it.node);
+        CHECK(data->_blob == NULL && data->_text);
+    }
+    for (i = 0; i <= N_NODES; ++i)
+        if (!check_is_within(nodes[i], node))
+            check_text(i);
+
+    guide_destroy(guide);
+    got = check_dump(NULL, node);
+    CHECK(strcmp(got, dump) == 0);
+    free(got);
+    free(dump);
+    guide_destroy(other);
+    unlink(path);
+
+    for (i = 0; i <= N_NODES; ++i)
+        free(refs[i]);
+    lost_texts();
+    printf("blob: ok\n");
+    return EXIT_SUCCESS;
+}
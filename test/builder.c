@@ -0,0 +1,198 @@
+/*
+ * Builders on several threads at once: each thread builds subtrees with a
+ * builder of its own while the main thread adds nodes to the guide, and
+ * publishes them under a parent of its own, twice, then destroys the
+ * builder with a subtree it never published. The published subtrees must
+ * be as built, in order, every uid in the guide unique and registered, and
+ * the nodes must stay good once the builders are gone, as they're changed
+ * and deleted.
+ */
+
+#include <pthread.h>
+
+#include "check.h"
+
+#define N_THREADS   4
+#define N_NODES     3000
+
+struct job_t
+{
+    struct guide_t *guide;
+    struct tree_node_t *parent;
+    unsigned seed;
+    char *expect;        /* the dumps of the subtrees, as built */
+};
+
+static struct guide_nodedata_t *nodedata(struct guide_builder_t *b, int i, unsigned *seed)
+{
+    static char long_text[5000];
+    struct guide_nodedata_t *data;
+    wchar_t title[64];
+    char text[64];
+
+    if (!long_text[0])
+        memset(long_text, 'z', sizeof(long_text) - 1);
+    swprintf(title, 64, rand_r(seed) % 4 ? L"b%d" : L"a longer title of built node %d", i);
+    snprintf(text, sizeof(text), "built %d", i);
+    /* now and then, one too big to carve from a slab with its strings */
+    data = guide_builder_nodedata(b, title, rand_r(seed) % 50 ? text : long_text);
+    CHECK(data);
+    CHECK(data->uid);
+    return data;
+}
+
+/* build a few subtrees with `b'; returns the dumps of all it holds, in
+   order */
+static char *build(struct guide_builder_t *b, unsigned *seed)
+{
+    static __thread struct tree_node_t *nodes[N_NODES];
+    struct tree_node_t *stage = NULL, *sub;
+    struct check_buf_t dump = { NULL, 0, 0 };
+    char *s;
+    int i;
+
+    for (i = 0; i < N_NODES; ++i) {
+        nodes[i] = guide_builder_add_child(b, i && rand_r(seed) % 20 ? nodes[rand_r(seed) % i] :
+            NULL, nodedata(b, i, seed), NULL);
+        CHECK(nodes[i]);
+        if (!i)
+            stage = tree_get_parent(nodes[0]);
+    }
+
+    check_putf(&dump, "%s", "");
+    for (sub = tree_get_first_child(stage); sub; sub = tree_get_next_sibling(sub)) {
+        s = check_dump(NULL, sub);
+        check_putf(&dump, "%s", s);
+        free(s);
+    }
+    return dump.p;
+}
+
+static struct tree_node_t *last_child(struct tree_node_t *parent)
+{
+    struct tree_node_t *child = tree_get_first_child(parent);
+
+    while (child && tree_get_next_sibling(child))
+        child = tree_get_next_sibling(child);
+    return child;
+}
+
+static void *run(void *arg)
+{
+    struct job_t *job = (struct job_t *)arg;
+    struct guide_builder_t *b;
+    struct check_buf_t expect = { NULL, 0, 0 };
+    char *dump;
+    int round;
+
+    b = guide_builder_create(job->guide);
+    CHECK(b);
+    check_putf(&expect, "%s", "");
+    for (round = 0; round < 2; ++round) {
+        dump = build(b, &job->seed);
+        check_putf(&expect, "%s", dump);
+        free(dump);
+        CHECK(guide_builder_publish(b, job->parent, last_child(job->parent)) == 0);
+    }
+
+    /* never published */
+    free(build(b, &job->seed));
+    guide_builder_destroy(b);
+    job->expect = expect.p;
+    return NULL;
+}
+
+static int by_uid(const void *a, const void *b)
+{
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    static uint32 uids[N_THREADS * N_NODES * 2 + 1000];
+    struct job_t jobs[N_THREADS];
+    pthread_t threads[N_THREADS];
+    struct check_buf_t got;
+    struct guide_t *guide;
+    struct guide_nodedata_t *data;
+    struct tree_node_t *root, *child, *next;
+    struct tree_iter_t it;
+    char *s;
+    unsigned n;
+    int t, i;
+
+    check_setlocale();
+    srand(40);
+    guide = guide_create();
+    CHECK(guide);
+    CHECK(guide_set_concurrent(guide, 1) == 0);
+    root = tree_get_root(guide->tree);
+    for (t = 0; t < N_THREADS; ++t) {
+        jobs[t].guide = guide;
+        jobs[t].parent = guide_add_child(guide, root, check_random_nodedata(guide, t), NULL);
+        CHECK(jobs[t].parent);
+        jobs[t].seed = 40 + t;
+    }
+
+    /* the guide hands out uids meanwhile */
+    for (t = 0; t < N_THREADS; ++t)
+        CHECK(pthread_create(&threads[t], NULL, run, &jobs[t]) == 0);
+    for (i = 0; i < 500; ++i)
+        CHECK(guide_add_child(guide, root, check_random_nodedata(guide, i), NULL));
+    for (t = 0; t < N_THREADS; ++t)
+        CHECK(pthread_join(threads[t], NULL) == 0);
+
+    /* as built, and in order */
+    for (t = 0; t < N_THREADS; ++t) {
+        memset(&got, 0, sizeof(got));
+        check_putf(&got, "%s", "");
+        for (child = tree_get_first_child(jobs[t].parent); child;
+                child = tree_get_next_sibling(child)) {
+            s = check_dump(NULL, child);
+            check_putf(&got, "%s", s);
+            free(s);
+        }
+        CHECK(strcmp(got.p, jobs[t].expect) == 0);
+        CHECK(tree_get_subtree_size(jobs[t].parent) == 2 * N_NODES + 1);
+        free(got.p);
+        free(jobs[t].expect);
+    }
+
+    /* uids unique, and registered */
+    n = 0;
+    tree_iter_init(&it, root, TREE_ITER_PREORDER);
+    while (tree_iter_next(&it)) {
+        CHECK(n < sizeof(uids) / sizeof(*uids));
+        data = (struct guide_nodedata_t *)tree_get_data(it.node);
+        CHECK(data->uid && data->uid <= guide->_counter);
+        uids[n++] = data->uid;
+    }
+    CHECK(n == tree_get_node_count(guide->tree));
+    qsort(uids, n, sizeof(*uids), by_uid);
+    for (i = 1; i < (int)n; ++i)
+        CHECK(uids[i - 1] < uids[i]);
+    check_uids(guide, root);
+    check_count(root);
+
+    /* the node data outlives the builders it was carved from */
+    for (t = 0; t < N_THREADS; ++t) {
+        for (child = tree_get_first_child(jobs[t].parent), i = 0; child; child = next, ++i) {
+            next = tree_get_next_sibling(child);
+            data = (struct guide_nodedata_t *)tree_get_data(child);
+            if (i % 3 == 0)
+                guide_delete_subtree(guide, child);
+            else if (i % 3 == 1)
+                guide_nodedata_set_title(data, L"a title given after the builder was gone");
+            else
+                guide_nodedata_set_text(data, "a text given after the builder was gone");
+        }
+    }
+    check_uids(guide, root);
+    free(check_dump(NULL, root));
+
+    guide_destroy(guide);
+    printf("builder: ok\n");
+    return EXIT_SUCCESS;
+}
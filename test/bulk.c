@@ -0,0 +1,150 @@
+/*
+ * Save, load and compare: a random guide is stored and loaded back (which
+ * builds the tree in bulk, guide_build_bulk()), and the two must dump the
+ * same, uids and attributes included, and so must the loaded guide once
+ * stored and loaded again. Then guide_build_bulk() itself, against the parent
+ * arrays it's given, and its failures, which must leave the guide as it
+ * was.
+ */
+
+#include <unistd.h>
+
+#include "check.h"
+
+#define N_NODES     3000
+
+static void round_trip(void)
+{
+    char path[] = "/tmp/libguide-bulk-XXXXXX", path2[] = "/tmp/libguide-bulk-XXXXXX";
+    wchar_t wpath[64], wpath2[64];
+    struct guide_t *guide, *loaded, *again;
+    struct guide_nodedata_t *sel;
+    char *dump, *got;
+    unsigned os_errcode;
+    uint32 format;
+    int fd;
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, N_NODES);
+    guide->sel_node = tree_get_nth_preorder(tree_get_root(guide->tree), N_NODES / 2);
+    sel = (struct guide_nodedata_t *)tree_get_data(guide->sel_node);
+
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    CHECK((fd = mkstemp(path2)) >= 0);
+    close(fd);
+    swprintf(wpath, 64, L"%s", path);
+    swprintf(wpath2, 64, L"%s", path2);
+
+    CHECK(guide_store(wpath, guide) == 0);
+    loaded = guide_load(wpath, &os_errcode, &format);
+    CHECK(loaded);
+
+    dump = check_dump(NULL, tree_get_root(guide->tree));
+    got = check_dump(NULL, tree_get_root(loaded->tree));
+    CHECK(strcmp(dump, got) == 0);
+    CHECK(check_count(tree_get_root(loaded->tree)) == N_NODES + 1);
+    check_uids(loaded, tree_get_root(loaded->tree));
+    CHECK(loaded->sel_node);
+    CHECK(((struct guide_nodedata_t *)tree_get_data(loaded->sel_node))->uid == sel->uid);
+    CHECK(loaded->_counter >= guide->_counter);
+    free(got);
+
+    /* the loaded guide stores the same (node ids in the file are not
+       kept: they are the addresses of the nodes) */
+    CHECK(guide_store(wpath2, loaded) == 0);
+    again = guide_load(wpath2, &os_errcode, &format);
+    CHECK(again);
+    got = check_dump(NULL, tree_get_root(again->tree));
+    CHECK(strcmp(dump, got) == 0);
+    guide_destroy(again);
+
+    /* new nodes of the loaded guide don't reuse uids */
+    check_random_guide(loaded, 100);
+    check_uids(loaded, tree_get_root(loaded->tree));
+    CHECK(check_count(tree_get_root(loaded->tree)) == N_NODES + 101);
+
+    free(dump);
+    free(got);
+    unlink(path);
+    unlink(path2);
+    guide_destroy(loaded);
+    guide_destroy(guide);
+}
+
+static void build(void)
+{
+    uint32 ids[N_NODES], parent_ids[N_NODES];
+    struct guide_nodedata_t *datas[N_NODES];
+    struct guide_nodedata_t *data, *parent;
+    struct guide_t *guide;
+    struct tree_node_t *node;
+    uint32 counter, i;
+    char *dump, *got;
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 20);
+
+    /* ids in file order, each parent before its children; the uids of the
+       node data are ids + 1000 */
+    for (i = 0; i < N_NODES; ++i) {
+        ids[i] = 7 * i + 3;
+        parent_ids[i] = i ? ids[rand() % i] : 0;
+        datas[i] = check_random_nodedata(guide, i);
+        datas[i]->uid = ids[i] + 1000;
+    }
+
+    /* failures leave the guide and the node data as they were */
+    dump = check_dump(NULL, tree_get_root(guide->tree));
+    counter = guide->_counter;
+    parent_ids[N_NODES / 2] = 1;
+    CHECK(guide_build_bulk(guide, N_NODES, ids, parent_ids, datas) == -1);
+    parent_ids[N_NODES / 2] = ids[N_NODES / 3];
+    guide_begin_batch(guide);
+    CHECK(guide_build_bulk(guide, N_NODES, ids, parent_ids, datas) == -1);
+    guide_commit_batch(guide);
+    CHECK(guide_build_bulk(guide, 0, ids, parent_ids, datas) == -1);
+    got = check_dump(NULL, tree_get_root(guide->tree));
+    CHECK(strcmp(dump, got) == 0);
+    CHECK(guide->_counter == counter);
+    check_uids(guide, tree_get_root(guide->tree));
+    free(got);
+    free(dump);
+
+    /* the tree is the one of the parent arrays */
+    CHECK(guide_build_bulk(guide, N_NODES, ids, parent_ids, datas) == 0);
+    CHECK(check_count(tree_get_root(guide->tree)) == N_NODES);
+    CHECK(tree_get_data(tree_get_root(guide->tree)) == datas[0]);
+    for (i = 0; i < N_NODES; ++i) {
+        node = guide_get_node_by_uid(guide, ids[i] + 1000);
+        CHECK(node && tree_get_data(node) == datas[i]);
+        if (i) {
+            parent = (struct guide_nodedata_t *)tree_get_data(tree_get_parent(node));
+            CHECK(parent->uid == parent_ids[i] + 1000);
+        }
+    }
+    CHECK(guide->_counter >= 7 * (N_NODES - 1) + 3 + 1000);
+
+    /* siblings keep their file order */
+    for (i = 1; i < N_NODES; ++i) {
+        node = guide_get_node_by_uid(guide, ids[i] + 1000);
+        if (tree_get_next_sibling(node)) {
+            data = (struct guide_nodedata_t *)tree_get_data(tree_get_next_sibling(node));
+            CHECK(data->uid > ids[i] + 1000);
+        }
+    }
+
+    guide_destroy(guide);
+}
+
+int main(int argc, char *argv[])
+{
+    check_setlocale();
+    srand(35);
+    round_trip();
+    build();
+    printf("bulk: ok\n");
+    return EXIT_SUCCESS;
+}
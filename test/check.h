@@ -0,0 +1,222 @@
+/*
+ * Helpers shared by the behaviour tests: a CHECK macro that fails the test
+ * program, and a dump of a (sub)tree to a string, made by walking the links
+ * of the nodes one by one, to compare the trees the library builds against.
+ */
+
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+#include <locale.h>
+
+#include <libguide/guide.h>
+#include <libguide/tree.h>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/* nonzero if check_setlocale() found a UTF-8 locale */
+static int check_utf8;
+
+/* titles are stored in UTF-8 through the C library, as per the locale */
+static inline void check_setlocale(void)
+{
+    setlocale(LC_ALL, "");
+    if (MB_CUR_MAX == 1)
+        setlocale(LC_ALL, "C.UTF-8");
+    check_utf8 = MB_CUR_MAX > 1;
+}
+
+struct check_buf_t
+{
+    char *p;
+    size_t n;
+    size_t alloc;
+};
+
+static inline void check_putf(struct check_buf_t *b, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    CHECK(len >= 0);
+    if (b->n + len + 1 > b->alloc) {
+        b->alloc = (b->n + len + 1) * 2;
+        b->p = (char *)realloc(b->p, b->alloc);
+        CHECK(b->p);
+    }
+    va_start(ap, fmt);
+    vsnprintf(b->p + b->n, len + 1, fmt, ap);
+    va_end(ap);
+    b->n += len;
+}
+
+/* `title' in ASCII, whatever the locale */
+static inline void check_put_title(struct check_buf_t *b, const wchar_t *title)
+{
+    for (; *title; ++title)
+        if (*title < 128 && *title != '\\')
+            check_putf(b, "%c", (char)*title);
+        else
+            check_putf(b, "\\%x;", (unsigned)*title);
+}
+
+/* the subtree at `node' as "(uid title|text|attrs children...)"; with a
+   snapshot, as the snapshot sees it, without the attributes (which are
+   not kept for snapshots) */
+static inline void check_dump_node(struct check_buf_t *b, const struct tree_snapshot_t *ss,
+    struct tree_node_t *node)
+{
+    struct guide_nodedata_t *data;
+    struct tree_node_t *child;
+    struct guide_text_t t;
+    int attr;
+
+    if (ss) {
+        data = (struct guide_nodedata_t *)tree_snapshot_get_data(ss, node);
+        check_putf(b, "(%u ", data->uid);
+        check_put_title(b, data->title);
+        CHECK(guide_nodedata_acquire_text(data, &t));
+        check_putf(b, "|%s", t.text);
+        guide_nodedata_release_text(&t);
+        child = tree_snapshot_get_first_child(ss, node);
+    } else {
+        data = (struct guide_nodedata_t *)tree_get_data(node);
+        check_putf(b, "(%u ", data->uid);
+        check_put_title(b, data->title);
+        CHECK(guide_nodedata_acquire_text(data, &t));
+        check_putf(b, "|%s|", t.text);
+        guide_nodedata_release_text(&t);
+        for (attr = NA_STATE; attr <= NA_TC_STATE; ++attr)
+            if (attr != 6)
+                check_putf(b, "%x,", guide_nodedata_get_attr(data, attr));
+        child = tree_get_first_child(node);
+    }
+    for (; child; child = ss ? tree_snapshot_get_next_sibling(ss, child) :
+            tree_get_next_sibling(child)) {
+        CHECK((ss ? tree_snapshot_get_parent(ss, child) : tree_get_parent(child)) == node);
+        check_dump_node(b, ss, child);
+    }
+    check_putf(b, ")");
+}
+
+/* the dump of the subtree at `node', to be freed by the caller */
+static inline char *check_dump(const struct tree_snapshot_t *ss, struct tree_node_t *node)
+{
+    struct check_buf_t b = { NULL, 0, 0 };
+
+    check_putf(&b, "%s", "");
+    check_dump_node(&b, ss, node);
+    return b.p;
+}
+
+/* number of nodes of the subtree at `node', counted one by one; also
+   checks the subtree size the library keeps for each node on the way */
+static inline unsigned check_count(struct tree_node_t *node)
+{
+    struct tree_node_t *child;
+    unsigned n = 1;
+
+    for (child = tree_get_first_child(node); child; child = tree_get_next_sibling(child))
+        n += check_count(child);
+    CHECK(tree_get_subtree_size(node) == n);
+    return n;
+}
+
+/* is `anc' the same as `node' or one of its ancestors? */
+static inline int check_is_within(struct tree_node_t *node, struct tree_node_t *anc)
+{
+    for (; node; node = tree_get_parent(node))
+        if (node == anc)
+            return 1;
+    return 0;
+}
+
+/* the nodes of the subtree at `node' in preorder, into `nodes' */
+static inline unsigned check_preorder(struct tree_node_t *node, struct tree_node_t **nodes)
+{
+    struct tree_node_t *child;
+    unsigned n = 1;
+
+    nodes[0] = node;
+    for (child = tree_get_first_child(node); child; child = tree_get_next_sibling(child))
+        n += check_preorder(child, nodes + n);
+    return n;
+}
+
+/* node data with a title and text of varied lengths (some long enough not
+   to be kept inline, and not in ASCII with a UTF-8 locale), and some of the
+   attributes set */
+static inline struct guide_nodedata_t *check_random_nodedata(struct guide_t *guide, int i)
+{
+    struct guide_nodedata_t *data;
+    wchar_t title[64];
+    char text[300];
+    int len;
+
+    if (rand() % 4 == 0)
+        swprintf(title, 64, check_utf8 ? L"a rather longer title of node number %d \u00e9\u4e2d" :
+            L"a rather longer title of node number %d", i);
+    else
+        swprintf(title, 64, L"n%d", i);
+    len = rand() % 4 == 0 ? rand() % 280 : rand() % 8;
+    memset(text, 'a' + i % 26, len);
+    text[len] = '\0';
+
+    data = guide_nodedata_create_with_data(guide, title, text);
+    CHECK(data);
+    if (rand() % 3 == 0)
+        guide_nodedata_set_attr(data, NA_ICON, rand() % 10);
+    if (rand() % 3 == 0)
+        guide_nodedata_set_attr(data, NA_COLOR, rand() % 0x1000000);
+    if (rand() % 3 == 0)
+        guide_nodedata_set_expanded(data, 1);
+    return data;
+}
+
+/* add `n' nodes to `guide', each under a random node so far */
+static inline void check_random_guide(struct guide_t *guide, int n)
+{
+    struct tree_node_t **nodes;
+    struct tree_node_t *parent;
+    int i, count = 1;
+
+    nodes = (struct tree_node_t **)malloc((n + 1) * sizeof(*nodes));
+    CHECK(nodes);
+    nodes[0] = tree_get_root(guide->tree);
+    for (i = 0; i < n; ++i) {
+        parent = nodes[rand() % count];
+        nodes[count++] = guide_add_child(guide, parent, check_random_nodedata(guide, i),
+            rand() % 2 ? NULL : tree_get_first_child(parent));
+        CHECK(nodes[count - 1]);
+    }
+    free(nodes);
+}
+
+/* every node of the subtree at `node' is found by its uid */
+static inline void check_uids(struct guide_t *guide, struct tree_node_t *node)
+{
+    struct tree_iter_t it;
+    struct guide_nodedata_t *data;
+
+    tree_iter_init(&it, node, TREE_ITER_PREORDER);
+    while (tree_iter_next(&it)) {
+        data = (struct guide_nodedata_t *)tree_get_data(it.node);
+        CHECK(guide_get_node_by_uid(guide, data->uid) == it.node);
+    }
+}
+
+#endif // _CHECK_H_
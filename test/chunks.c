@@ -0,0 +1,160 @@
+/*
+ * Positional access to the children of wide parents, which keep an index
+ * of their children in chunks, against an array of the children kept by
+ * hand: inserts at a position, adds after a sibling, deletes, and moves
+ * within a parent and between two of them. After each change, the array
+ * is checked against the sibling list, and tree_get_nth_child(),
+ * tree_child_index() and tree_get_child_count() against the array.
+ */
+
+#include <stdint.h>
+
+#include "check.h"
+
+#define MAX_CHILDREN    6000
+
+struct ref_t
+{
+    struct tree_node_t *parent;
+    struct tree_node_t *children[MAX_CHILDREN];
+    uint32 n;
+};
+
+static void cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+static void ref_insert(struct ref_t *ref, uint32 i, struct tree_node_t *node)
+{
+    CHECK(ref->n < MAX_CHILDREN);
+    memmove(ref->children + i + 1, ref->children + i, (ref->n - i) * sizeof(*ref->children));
+    ref->children[i] = node;
+    ++ref->n;
+}
+
+static void ref_remove(struct ref_t *ref, uint32 i)
+{
+    memmove(ref->children + i, ref->children + i + 1, (ref->n - i - 1) * sizeof(*ref->children));
+    --ref->n;
+}
+
+static void ref_check(struct ref_t *ref, int probes)
+{
+    struct tree_node_t *child;
+    uint32 i;
+
+    for (i = 0, child = tree_get_first_child(ref->parent); child;
+            child = tree_get_next_sibling(child), ++i)
+        CHECK(i < ref->n && ref->children[i] == child);
+    CHECK(i == ref->n);
+    CHECK(tree_get_child_count(ref->parent) == ref->n);
+    CHECK(tree_get_nth_child(ref->parent, ref->n) == NULL);
+
+    while (ref->n && probes--) {
+        i = rand() % ref->n;
+        CHECK(tree_get_nth_child(ref->parent, i) == ref->children[i]);
+        CHECK(tree_child_index(ref->children[i]) == i);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static struct ref_t refs[2];
+    struct ref_t *ref, *other;
+    struct tree_t *tree;
+    struct tree_node_t *node;
+    uintptr_t id = 0;
+    uint32 i, j;
+    int step;
+
+    srand(34);
+    tree = tree_create_with_root(NULL);
+    CHECK(tree);
+    refs[0].parent = tree_add_child(tree_get_root(tree), NULL, NULL);
+    refs[1].parent = tree_add_child(tree_get_root(tree), NULL, NULL);
+
+    /* wide enough for a children index from the start */
+    for (i = 0; i < 500; ++i)
+        ref_insert(&refs[0], i, tree_insert_child_at(refs[0].parent, (void *)++id, i));
+    ref_check(&refs[0], 100);
+
+    for (step = 0; step < 30000; ++step) {
+        ref = &refs[rand() % 2];
+        other = ref == refs ? refs + 1 : refs;
+
+        switch (rand() % 6) {
+        case 0:
+            /* insert at a position, or past the end */
+            i = rand() % (ref->n + 2);
+            node = tree_insert_child_at(ref->parent, (void *)++id, i);
+            CHECK(node);
+            ref_insert(ref, i < ref->n ? i : ref->n, node);
+            break;
+        case 1:
+            /* add after a sibling, or first */
+            i = ref->n ? rand() % (ref->n + 1) : 0;
+            node = tree_add_child(ref->parent, (void *)++id, i ? ref->children[i - 1] : NULL);
+            CHECK(node);
+            ref_insert(ref, i, node);
+            break;
+        case 2:
+            if (ref->n < 200)
+                break;
+            i = rand() % ref->n;
+            tree_delete_subtree(ref->children[i], cleanup, NULL);
+            ref_remove(ref, i);
+            break;
+        case 3:
+            /* move within the parent */
+            if (ref->n < 2)
+                break;
+            i = rand() % ref->n;
+            j = rand() % ref->n;
+            if (i == j)
+                break;
+            node = ref->children[i];
+            if (rand() % 2) {
+                CHECK(tree_move_subtree_after(node, ref->children[j]) == node);
+                ref_remove(ref, i);
+                ref_insert(ref, j > i ? j : j + 1, node);
+            } else {
+                CHECK(tree_move_subtree_before(node, ref->children[j]) == node);
+                ref_remove(ref, i);
+                ref_insert(ref, j > i ? j - 1 : j, node);
+            }
+            break;
+        case 4:
+            /* move to the other parent, first */
+            if (!ref->n)
+                break;
+            i = rand() % ref->n;
+            node = ref->children[i];
+            CHECK(tree_move_subtree_as_child(node, other->parent) == node);
+            ref_remove(ref, i);
+            ref_insert(other, 0, node);
+            break;
+        case 5:
+            /* move to the other parent, next to one of its children */
+            if (!ref->n || !other->n)
+                break;
+            i = rand() % ref->n;
+            j = rand() % other->n;
+            node = ref->children[i];
+            CHECK(tree_move_subtree_after(node, other->children[j]) == node);
+            ref_remove(ref, i);
+            ref_insert(other, j + 1, node);
+            break;
+        }
+
+        ref_check(ref, 4);
+        ref_check(other, 4);
+    }
+
+    ref_check(&refs[0], 1000);
+    ref_check(&refs[1], 1000);
+    CHECK(check_count(tree_get_root(tree)) == 3 + refs[0].n + refs[1].n);
+
+    tree_delete_tree(tree, cleanup, NULL);
+    printf("chunks: ok\n");
+    return EXIT_SUCCESS;
+}
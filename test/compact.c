@@ -0,0 +1,218 @@
+/*
+ * Compaction (guide_compact_layout(), tree_compact_layout()) keeps the tree
+ * as it was, dump for dump, with the nodes laid out in preorder: uids, the
+ * selection, title indexes and the undo journal are brought along, and the
+ * guide goes on being edited, and compacted again. A tree compacted by
+ * itself reports each node moved, in preorder. Neither happens while the
+ * tree has snapshots.
+ */
+
+#include <stdint.h>
+
+#include "check.h"
+
+#define N_NODES     2000
+#define N_TRANS     100
+
+static struct tree_node_t *nodes[N_NODES * 2];
+static char *states[N_TRANS + 1];
+
+static struct tree_node_t *pick(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree);
+
+    return tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+}
+
+/* one change to the guide, recorded by the journal */
+static void change(struct guide_t *guide, int i)
+{
+    struct tree_node_t *a, *b, *root = tree_get_root(guide->tree);
+    wchar_t title[32];
+
+    for (;;) {
+        a = pick(guide);
+        b = pick(guide);
+        switch (rand() % 4) {
+        case 0:
+            CHECK(guide_add_child(guide, a, check_random_nodedata(guide, i), NULL));
+            return;
+        case 1:
+            if (a == root)
+                break;
+            guide_delete_subtree(guide, a);
+            return;
+        case 2:
+            if (a == root || b == root || check_is_within(b, a))
+                break;
+            CHECK(tree_move_subtree_after(a, b) == a);
+            return;
+        case 3:
+            swprintf(title, 32, L"changed %d", i);
+            guide_nodedata_set_title((struct guide_nodedata_t *)tree_get_data(a), title);
+            return;
+        }
+    }
+}
+
+static void check_state(struct guide_t *guide, const char *state)
+{
+    char *got = check_dump(NULL, tree_get_root(guide->tree));
+
+    CHECK(strcmp(got, state) == 0);
+    free(got);
+    check_count(tree_get_root(guide->tree));
+    check_uids(guide, tree_get_root(guide->tree));
+}
+
+/* the first child of `parent' titled `title', looked for one by one */
+static struct tree_node_t *first_titled(struct tree_node_t *parent, const wchar_t *title)
+{
+    struct tree_node_t *child;
+
+    for (child = tree_get_first_child(parent); child; child = tree_get_next_sibling(child))
+        if (wcscmp(((struct guide_nodedata_t *)tree_get_data(child))->title, title) == 0)
+            return child;
+    return NULL;
+}
+
+/* the nodes of the subtree at `node' are at increasing addresses in preorder */
+static void check_layout(struct tree_node_t *node)
+{
+    unsigned n = check_preorder(node, nodes), i;
+
+    for (i = 1; i < n; ++i)
+        CHECK((uintptr_t)nodes[i - 1] < (uintptr_t)nodes[i]);
+}
+
+static void guide_layout(void)
+{
+    struct guide_t *guide;
+    struct tree_node_t *wide;
+    struct tree_snapshot_t *ss;
+    uint32 sel_uid, wide_uid;
+    char *dump;
+    int i;
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, N_NODES);
+
+    /* a parent wide enough to have its titles indexed */
+    wide = tree_get_first_child(tree_get_root(guide->tree));
+    for (i = 0; i < 300; ++i)
+        guide_add_child(guide, wide, check_random_nodedata(guide, N_NODES + i), NULL);
+    CHECK(guide_find_child_by_title(guide, wide, L"n2100") == first_titled(wide, L"n2100"));
+    wide_uid = ((struct guide_nodedata_t *)tree_get_data(wide))->uid;
+
+    guide->sel_node = pick(guide);
+    sel_uid = ((struct guide_nodedata_t *)tree_get_data(guide->sel_node))->uid;
+
+    CHECK(guide_set_journal(guide, 1, 0) == 0);
+    states[0] = check_dump(NULL, tree_get_root(guide->tree));
+    for (i = 1; i <= N_TRANS; ++i) {
+        change(guide, i);
+        states[i] = check_dump(NULL, tree_get_root(guide->tree));
+    }
+    for (i = 0; i < N_TRANS / 4; ++i)
+        CHECK(guide_undo(guide) == 0);
+
+    /* not with a snapshot */
+    ss = guide_snapshot(guide);
+    CHECK(ss);
+    CHECK(guide_compact_layout(guide) == -1);
+    guide_snapshot_release(ss);
+    check_state(guide, states[N_TRANS - N_TRANS / 4]);
+
+    CHECK(guide_compact_layout(guide) == 0);
+    check_state(guide, states[N_TRANS - N_TRANS / 4]);
+    check_layout(tree_get_root(guide->tree));
+    CHECK(guide->sel_node == NULL ||
+        ((struct guide_nodedata_t *)tree_get_data(guide->sel_node))->uid == sel_uid);
+    if ((wide = guide_get_node_by_uid(guide, wide_uid)))
+        CHECK(guide_find_child_by_title(guide, wide, L"n2100") == first_titled(wide, L"n2100"));
+
+    /* the journal followed the nodes */
+    for (i = N_TRANS - N_TRANS / 4; i > 0; --i) {
+        CHECK(guide_undo(guide) == 0);
+        check_state(guide, states[i - 1]);
+    }
+    while (guide_redo(guide) == 0)
+        ++i;
+    CHECK(i == N_TRANS);
+    check_state(guide, states[N_TRANS]);
+
+    /* edits of compacted nodes, and compacting again */
+    for (i = 0; i < 200; ++i)
+        change(guide, i);
+    dump = check_dump(NULL, tree_get_root(guide->tree));
+    CHECK(guide_compact_layout(guide) == 0);
+    check_state(guide, dump);
+    check_layout(tree_get_root(guide->tree));
+    free(dump);
+
+    for (i = 0; i <= N_TRANS; ++i)
+        free(states[i]);
+    guide_destroy(guide);
+}
+
+struct moved_t
+{
+    struct tree_node_t **olds;
+    struct tree_node_t **news;
+    unsigned n;
+};
+
+static void moved(struct tree_node_t *old, struct tree_node_t *node, void *cargo)
+{
+    struct moved_t *m = (struct moved_t *)cargo;
+
+    CHECK(old == m->olds[m->n]);
+    CHECK(tree_get_data(node) == tree_get_data(old));
+    m->news[m->n++] = node;
+}
+
+static void cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+static void tree_layout(void)
+{
+    static struct tree_node_t *olds[N_NODES + 1], *news[N_NODES + 1];
+    struct moved_t m = { olds, news, 0 };
+    struct tree_snapshot_t *ss;
+    struct tree_t *tree;
+    uintptr_t i;
+    unsigned n;
+
+    tree = tree_create_with_root((void *)0);
+    CHECK(tree);
+    for (i = 1; i <= N_NODES; ++i)
+        tree_add_child(tree_get_nth_preorder(tree_get_root(tree), rand() % i), (void *)i, NULL);
+    n = check_preorder(tree_get_root(tree), olds);
+
+    ss = tree_snapshot_create(tree);
+    CHECK(tree_compact_layout(tree, moved, &m) == -1);
+    CHECK(m.n == 0);
+    tree_snapshot_release(ss);
+
+    CHECK(tree_compact_layout(tree, moved, &m) == 0);
+    CHECK(m.n == n);
+    CHECK(check_preorder(tree_get_root(tree), nodes) == n);
+    CHECK(memcmp(nodes, news, n * sizeof(*nodes)) == 0);
+    CHECK(check_count(tree_get_root(tree)) == n);
+    CHECK(tree_get_node_count(tree) == n);
+    check_layout(tree_get_root(tree));
+
+    tree_delete_tree(tree, cleanup, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    check_setlocale();
+    srand(33);
+    guide_layout();
+    tree_layout();
+    printf("compact: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copies of subtrees against the subtrees they were copied from: the copy
+ * made by tree_copy_subtree() has the same shape and the data given by the
+ * copy function, each node handed to the node function in preorder, and
+ * tree_copy_subtree_after(), _before() and _as_child() put it in its place,
+ * even inside the subtree being copied. guide_copy_subtree() copies within
+ * a guide and from another, with new uids that are registered, and is
+ * undone in one step.
+ */
+
+#include <stdint.h>
+
+#include <libguide/tree.h>
+#include <libguide/treeutil.h>
+
+#include "check.h"
+
+#define N_NODES     2000
+#define OFFSET      100000
+
+static struct tree_node_t *nodes[N_NODES + 1];
+
+/* the subtree at `node' as "data(children...)", with `offset' taken from
+   the data */
+static void shape(struct check_buf_t *b, struct tree_node_t *node, uintptr_t offset)
+{
+    struct tree_node_t *child;
+
+    check_putf(b, "%lu(", (unsigned long)((uintptr_t)tree_get_data(node) - offset));
+    for (child = tree_get_first_child(node); child; child = tree_get_next_sibling(child))
+        shape(b, child, offset);
+    check_putf(b, ")");
+}
+
+static char *shape_of(struct tree_node_t *node, uintptr_t offset)
+{
+    struct check_buf_t b = { NULL, 0, 0 };
+
+    shape(&b, node, offset);
+    return b.p;
+}
+
+static void *copy_data(void *src, void *cargo)
+{
+    return (void *)((uintptr_t)src + OFFSET);
+}
+
+struct seen_t
+{
+    struct tree_node_t **order;
+    unsigned n;
+};
+
+static int seen(struct tree_node_t *node, void *cargo)
+{
+    struct seen_t *s = (struct seen_t *)cargo;
+
+    CHECK((uintptr_t)tree_get_data(node) ==
+        (uintptr_t)tree_get_data(s->order[s->n]) + OFFSET);
+    ++s->n;
+    return 0;
+}
+
+static void cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+static void tree_copies(void)
+{
+    static struct tree_node_t *order[N_NODES + 1];
+    struct seen_t s;
+    struct tree_t *tree, *copy;
+    struct tree_node_t *src, *dst, *got;
+    char *before, *after;
+    uintptr_t i;
+    unsigned n;
+    int step, how;
+
+    tree = tree_create_with_root((void *)0);
+    CHECK(tree);
+    nodes[0] = tree_get_root(tree);
+    for (i = 1; i <= N_NODES; ++i) {
+        nodes[i] = tree_add_child(nodes[rand() % i], (void *)i, rand() % 2 ? NULL : nodes[i - 1]);
+        CHECK(nodes[i]);
+    }
+
+    /* into a tree of its own */
+    for (step = 0; step < 20; ++step) {
+        src = nodes[step ? rand() % (N_NODES + 1) : 0];
+        s.order = order;
+        s.n = 0;
+        n = check_preorder(src, order);
+        copy = tree_copy_subtree(src, copy_data, seen, &s);
+        CHECK(copy);
+        CHECK(s.n == n);
+        CHECK(tree_get_node_count(copy) == n);
+        before = shape_of(src, 0);
+        after = shape_of(tree_get_root(copy), OFFSET);
+        CHECK(strcmp(before, after) == 0);
+        free(before);
+        free(after);
+        tree_delete_tree(copy, cleanup, NULL);
+    }
+
+    /* in place, now and then inside the subtree copied */
+    for (step = 0; step < 200; ++step) {
+        do {
+            src = nodes[1 + rand() % N_NODES];
+            dst = nodes[1 + rand() % N_NODES];
+        } while (tree_get_subtree_size(src) > 200);
+        if (step % 10 == 0)
+            dst = tree_get_first_child(src) ? tree_get_first_child(src) : dst;
+        before = shape_of(src, 0);
+        n = tree_get_node_count(tree);
+
+        how = rand() % 3;
+        if (how == 0) {
+            got = tree_copy_subtree_after(src, dst, copy_data, NULL);
+            CHECK(got && tree_get_prev_sibling(got) == dst);
+        } else if (how == 1) {
+            got = tree_copy_subtree_before(src, dst, copy_data, NULL);
+            CHECK(got && tree_get_next_sibling(got) == dst);
+        } else {
+            got = tree_copy_subtree_as_child(src, dst, copy_data, NULL);
+            CHECK(got && tree_get_first_child(dst) == got);
+        }
+        after = shape_of(got, OFFSET);
+        CHECK(strcmp(before, after) == 0);
+        free(after);
+        free(before);
+        CHECK(tree_get_node_count(tree) == n + tree_get_subtree_size(got));
+        CHECK(check_count(nodes[0]) == tree_get_node_count(tree));
+
+        /* out of the way of the next copies */
+        tree_delete_subtree(got, cleanup, NULL);
+    }
+
+    tree_delete_tree(tree, cleanup, NULL);
+}
+
+/* `dump' without the uids */
+static char *without_uids(char *dump)
+{
+    char *p, *q;
+
+    for (p = q = dump; *p; ) {
+        *q++ = *p;
+        if (*p++ == '(')
+            while (*p >= '0' && *p <= '9')
+                ++p;
+    }
+    *q = '\0';
+    return dump;
+}
+
+static void check_new_uids(struct tree_node_t *node, uint32 above)
+{
+    struct tree_iter_t it;
+
+    tree_iter_init(&it, node, TREE_ITER_PREORDER);
+    while (tree_iter_next(&it))
+        CHECK(((struct guide_nodedata_t *)tree_get_data(it.node))->uid > above);
+}
+
+static void guide_copies(void)
+{
+    struct guide_t *guide, *other;
+    struct tree_node_t *root, *src, *parent, *after, *got;
+    char *before, *state, *dump;
+    uint32 counter;
+    int step;
+
+    guide = guide_create();
+    other = guide_create();
+    CHECK(guide && other);
+    check_random_guide(guide, 1000);
+    check_random_guide(other, 300);
+    root = tree_get_root(guide->tree);
+    CHECK(guide_set_journal(guide, 1, 0) == 0);
+
+    for (step = 0; step < 100; ++step) {
+        src = rand() % 4 ? tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root)) :
+            tree_get_nth_preorder(tree_get_root(other->tree),
+                rand() % tree_get_subtree_size(tree_get_root(other->tree)));
+        if (tree_get_subtree_size(src) > 300)
+            continue;
+        parent = tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+        after = rand() % 2 ? tree_get_first_child(parent) : NULL;
+
+        before = without_uids(check_dump(NULL, src));
+        state = check_dump(NULL, root);
+        counter = guide->_counter;
+        got = guide_copy_subtree(guide, src, parent, after);
+        CHECK(got && tree_get_parent(got) == parent);
+        CHECK(after ? tree_get_prev_sibling(got) == after : tree_get_first_child(parent) == got);
+        dump = without_uids(check_dump(NULL, got));
+        CHECK(strcmp(dump, before) == 0);
+        free(dump);
+        check_new_uids(got, counter);
+        check_uids(guide, root);
+        CHECK(((struct guide_nodedata_t *)tree_get_data(got))->_guide == guide);
+
+        /* undone in one step, every other time */
+        if (step % 2) {
+            CHECK(guide_undo(guide) == 0);
+            dump = check_dump(NULL, root);
+            CHECK(strcmp(dump, state) == 0);
+            free(dump);
+            check_uids(guide, root);
+        }
+        free(state);
+        free(before);
+    }
+    check_count(root);
+    check_uids(other, tree_get_root(other->tree));
+
+    guide_destroy(other);
+    guide_destroy(guide);
+}
+
+int main(int argc, char *argv[])
+{
+    check_setlocale();
+    srand(36);
+    tree_copies();
+    guide_copies();
+    printf("copy: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/*
+ * The compact tree against a tree_t built alongside it: the same random
+ * adds and deletes go to both, and both must walk the same in preorder,
+ * with the same links, whether the slots are still in preorder (the fast
+ * path of ctree_traverse_preorder()), no longer are, or have been
+ * renumbered by ctree_compact(). A compact tree made from a tree_t starts
+ * out in preorder, and each node deleted is cleaned up once.
+ */
+
+#include <stdint.h>
+
+#include <libguide/ctree.h>
+
+#include "check.h"
+
+#define MAX_NODES   5000
+
+static struct tree_t *mirror;
+static struct tree_node_t *tnodes[MAX_NODES];
+static uint32 handles[MAX_NODES];
+static int alive[MAX_NODES], cleaned[MAX_NODES], n_ids;
+
+struct walk_t
+{
+    struct tree_node_t **order;
+    unsigned n, stop_at;
+    uint32 last;
+    int in_slots;        /* each handle the one after the last */
+};
+
+static int visit(struct ctree_t *ct, uint32 node, void *cargo)
+{
+    struct walk_t *w = (struct walk_t *)cargo;
+    uintptr_t id = (uintptr_t)ctree_get_data(ct, node);
+
+    CHECK(id < (uintptr_t)n_ids && alive[id] && handles[id] == node);
+    CHECK(w->order[w->n] == tnodes[id]);
+    if (w->n && node != w->last + 1)
+        w->in_slots = 0;
+    w->last = node;
+    if (++w->n == w->stop_at)
+        return 5;
+    return 0;
+}
+
+static void cleanup(struct ctree_t *ct, uint32 node, void *cargo)
+{
+    uintptr_t id = (uintptr_t)ctree_get_data(ct, node);
+
+    CHECK(alive[id] && !cleaned[id]);
+    cleaned[id] = 1;
+}
+
+static void tree_cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+/* the links of each node agree with the mirror */
+static void check_links(struct ctree_t *ct)
+{
+    struct tree_node_t *t;
+    uint32 h;
+    int id;
+
+    for (id = 0; id < n_ids; ++id) {
+        if (!alive[id])
+            continue;
+        h = handles[id];
+        CHECK((uintptr_t)ctree_get_data(ct, h) == (uintptr_t)id);
+        t = tree_get_parent(tnodes[id]);
+        CHECK(t ? ctree_get_parent(ct, h) == handles[(uintptr_t)tree_get_data(t)] :
+            ctree_get_parent(ct, h) == CTREE_NONE && ctree_get_root(ct) == h);
+        t = tree_get_first_child(tnodes[id]);
+        CHECK(t ? ctree_get_first_child(ct, h) == handles[(uintptr_t)tree_get_data(t)] :
+            ctree_get_first_child(ct, h) == CTREE_NONE);
+        t = tree_get_next_sibling(tnodes[id]);
+        CHECK(t ? ctree_get_next_sibling(ct, h) == handles[(uintptr_t)tree_get_data(t)] :
+            ctree_get_next_sibling(ct, h) == CTREE_NONE);
+        t = tree_get_prev_sibling(tnodes[id]);
+        CHECK(t ? ctree_get_prev_sibling(ct, h) == handles[(uintptr_t)tree_get_data(t)] :
+            ctree_get_prev_sibling(ct, h) == CTREE_NONE);
+    }
+}
+
+/* walks the whole tree and a subtree; returns nonzero if the whole walk
+   went through the slots in order */
+static int check_walks(struct ctree_t *ct)
+{
+    static struct tree_node_t *order[MAX_NODES];
+    struct walk_t w;
+    unsigned n;
+    int id;
+
+    n = check_preorder(tree_get_root(mirror), order);
+    CHECK(ctree_get_count(ct) == n);
+    memset(&w, 0, sizeof(w));
+    w.order = order;
+    w.in_slots = 1;
+    CHECK(ctree_traverse_preorder(ct, visit, &w) == 0);
+    CHECK(w.n == n);
+
+    /* a stop, somewhere inside */
+    memset(&w, 0, sizeof(w));
+    w.order = order;
+    w.stop_at = 1 + rand() % n;
+    CHECK(ctree_traverse_preorder(ct, visit, &w) == 5);
+    CHECK(w.n == w.stop_at);
+
+    /* a subtree */
+    do
+        id = rand() % n_ids;
+    while (!alive[id]);
+    n = check_preorder(tnodes[id], order);
+    memset(&w, 0, sizeof(w));
+    w.order = order;
+    CHECK(ctree_traverse_subtree_preorder(ct, handles[id], visit, &w) == 0);
+    CHECK(w.n == n);
+
+    check_links(ct);
+
+    memset(&w, 0, sizeof(w));
+    w.order = order;
+    w.in_slots = 1;
+    check_preorder(tree_get_root(mirror), order);
+    ctree_traverse_preorder(ct, visit, &w);
+    return w.in_slots && w.last == ctree_get_count(ct) - 1;
+}
+
+/* handles are renumbered: find them again from the data */
+static int rehandle(struct ctree_t *ct, uint32 node, void *cargo)
+{
+    handles[(uintptr_t)ctree_get_data(ct, node)] = node;
+    return 0;
+}
+
+static void add(struct ctree_t *ct, int k, int how)
+{
+    struct tree_node_t *after;
+    int id = n_ids++;
+
+    if (how == 0 && tree_get_parent(tnodes[k])) {
+        handles[id] = ctree_add_sibling_after(ct, handles[k], (void *)(uintptr_t)id);
+        tnodes[id] = tree_add_sibling_after(tnodes[k], (void *)(uintptr_t)id);
+    } else if (how == 1 && tree_get_parent(tnodes[k])) {
+        handles[id] = ctree_add_sibling_before(ct, handles[k], (void *)(uintptr_t)id);
+        tnodes[id] = tree_add_sibling_before(tnodes[k], (void *)(uintptr_t)id);
+    } else {
+        /* first, or after the first child */
+        after = how == 2 ? NULL : tree_get_first_child(tnodes[k]);
+        handles[id] = ctree_add_child(ct, handles[k], (void *)(uintptr_t)id,
+            after ? handles[(uintptr_t)tree_get_data(after)] : CTREE_NONE);
+        tnodes[id] = tree_add_child(tnodes[k], (void *)(uintptr_t)id, after);
+    }
+    CHECK(handles[id] != CTREE_NONE && tnodes[id]);
+    alive[id] = 1;
+}
+
+/* add a node as the last in preorder, where the slots stay in preorder */
+static void append(struct ctree_t *ct)
+{
+    struct tree_node_t *last = tree_get_root(mirror), *child;
+    uintptr_t k;
+
+    for (;;) {
+        for (child = tree_get_first_child(last); child && tree_get_next_sibling(child);
+                child = tree_get_next_sibling(child))
+            ;
+        if (!child)
+            break;
+        last = child;
+    }
+    k = (uintptr_t)tree_get_data(last);
+    if (rand() % 2 || !tree_get_parent(last))
+        add(ct, (int)k, 3);
+    else
+        add(ct, (int)k, 0);
+}
+
+static void delete(struct ctree_t *ct, int k)
+{
+    int id;
+
+    memset(cleaned, 0, sizeof(cleaned));
+    ctree_delete_subtree(ct, handles[k], cleanup, NULL);
+    for (id = 0; id < n_ids; ++id) {
+        CHECK(cleaned[id] == (alive[id] && check_is_within(tnodes[id], tnodes[k])));
+        if (cleaned[id])
+            alive[id] = 0;
+    }
+    tree_delete_subtree(tnodes[k], tree_cleanup, NULL);
+}
+
+static void delete_all(struct ctree_t *ct)
+{
+    int id;
+
+    memset(cleaned, 0, sizeof(cleaned));
+    ctree_delete_tree(ct, cleanup, NULL);
+    for (id = 0; id < n_ids; ++id)
+        CHECK(cleaned[id] == alive[id]);
+}
+
+static void built(void)
+{
+    struct ctree_t *ct;
+    int k, step;
+
+    mirror = tree_create_with_root((void *)0);
+    CHECK(mirror);
+    tnodes[0] = tree_get_root(mirror);
+    ct = ctree_create(0);
+    CHECK(ct);
+    CHECK(ctree_get_root(ct) == CTREE_NONE && ctree_get_count(ct) == 0);
+    handles[0] = ctree_add_root(ct, (void *)0);
+    CHECK(handles[0] != CTREE_NONE);
+    alive[0] = 1;
+    n_ids = 1;
+
+    /* added in preorder, the slots are too */
+    for (step = 0; step < 500; ++step)
+        append(ct);
+    CHECK(check_walks(ct));
+
+    /* and no longer, once added elsewhere or deleted from */
+    for (step = 0; step < 3000 && n_ids < MAX_NODES; ++step) {
+        do
+            k = rand() % n_ids;
+        while (!alive[k]);
+        if (rand() % 20 == 0 && k)
+            delete(ct, k);
+        else if (rand() % 100 == 0) {
+            ctree_compact(ct);
+            ctree_traverse_preorder(ct, rehandle, NULL);
+            CHECK(check_walks(ct));
+            /* appends keep to the slots, after a compaction */
+            append(ct);
+            CHECK(check_walks(ct));
+        } else
+            add(ct, k, rand() % 4);
+        if (step % 50 == 0)
+            check_walks(ct);
+    }
+    check_walks(ct);
+
+    /* deleted down to the root, and emptied */
+    ctree_compact(ct);
+    ctree_traverse_preorder(ct, rehandle, NULL);
+    CHECK(check_walks(ct));
+    delete_all(ct);
+    tree_delete_tree(mirror, tree_cleanup, NULL);
+}
+
+static void from_tree(void)
+{
+    struct ctree_t *ct;
+    int id, step;
+
+    mirror = tree_create_with_root((void *)0);
+    CHECK(mirror);
+    tnodes[0] = tree_get_root(mirror);
+    memset(alive, 0, sizeof(alive));
+    alive[0] = 1;
+    for (n_ids = 1; n_ids < 2000; ) {
+        id = n_ids++;
+        tnodes[id] = tree_add_child(tnodes[rand() % id], (void *)(uintptr_t)id,
+            rand() % 2 ? NULL : tnodes[id - 1]);
+        CHECK(tnodes[id]);
+        alive[id] = 1;
+    }
+
+    ct = ctree_create_from_tree(mirror);
+    CHECK(ct);
+    ctree_traverse_preorder(ct, rehandle, NULL);
+    CHECK(check_walks(ct));
+
+    /* a delete clears the fast path, which the walks mustn't take */
+    for (step = 0; step < 20; ++step) {
+        do
+            id = 1 + rand() % (n_ids - 1);
+        while (!alive[id]);
+        delete(ct, id);
+        check_walks(ct);
+        add(ct, 0, 2);
+        check_walks(ct);
+    }
+    ctree_compact(ct);
+    ctree_traverse_preorder(ct, rehandle, NULL);
+    CHECK(check_walks(ct));
+
+    delete_all(ct);
+    tree_delete_tree(mirror, tree_cleanup, NULL);
+
+    /* an empty tree */
+    mirror = tree_create();
+    CHECK(mirror);
+    ct = ctree_create_from_tree(mirror);
+    CHECK(ct && ctree_get_count(ct) == 0 && ctree_get_root(ct) == CTREE_NONE);
+    CHECK(ctree_traverse_preorder(ct, rehandle, NULL) == 0);
+    ctree_compact(ct);
+    CHECK(ctree_get_count(ct) == 0);
+    ctree_delete_tree(ct, NULL, NULL);
+    tree_delete_tree(mirror, tree_cleanup, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(26);
+    built();
+    from_tree();
+    printf("ctree: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/*
+ * The preorder index of a tree (tree_set_indexed()) against a walk of the
+ * tree, through random adds, deletes, moves, splits and merges: the ranks
+ * go stale on every change, and each query has to see through that.
+ * tree_is_ancestor() is checked against a walk up the parents, and
+ * tree_get_subtree_range(), tree_get_nth_preorder() and
+ * tree_get_preorder_rank() against a full preorder traversal.
+ */
+
+#include "check.h"
+
+#define MAX_NODES   3000
+
+static struct tree_node_t *nodes[MAX_NODES];
+
+static void cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+int main(int argc, char *argv[])
+{
+    struct tree_t *tree, *split;
+    struct tree_node_t *root, *a, *b;
+    uint32 first, last;
+    unsigned n;
+    int step, op, k, i;
+
+    srand(32);
+    tree = tree_create_with_root(NULL);
+    CHECK(tree);
+    root = tree_get_root(tree);
+    tree_set_indexed(tree, 1);
+
+    for (step = 0; step < 20000; ++step) {
+        n = check_preorder(root, nodes);
+        a = nodes[rand() % n];
+        b = nodes[rand() % n];
+
+        /* one random change */
+        op = rand() % 10;
+        if (op < 5 && n < MAX_NODES - 1) {
+            if (op == 0 && a != root)
+                tree_add_sibling_before(a, NULL);
+            else if (op == 1 && a != root)
+                tree_add_sibling_after(a, NULL);
+            else
+                tree_add_child(a, NULL, rand() % 2 ? NULL : tree_get_first_child(a));
+        } else if (op == 5 && a != root && n > 50) {
+            tree_delete_subtree(a, cleanup, NULL);
+        } else if (op <= 8 && a != root && b != root && !check_is_within(b, a)) {
+            if (op == 6)
+                CHECK(tree_move_subtree_after(a, b) == a);
+            else if (op == 7)
+                CHECK(tree_move_subtree_before(a, b) == a);
+            else
+                CHECK(tree_move_subtree_as_child(a, b) == a);
+        } else if (op == 9 && a != root && !check_is_within(b, a)) {
+            split = tree_split_subtree(a);
+            CHECK(split);
+            tree_merge_tree(b, split);
+        }
+
+        n = check_count(root);
+        CHECK(tree_get_node_count(tree) == n);
+        CHECK(check_preorder(root, nodes) == n);
+
+        for (k = 0; k < 5; ++k) {
+            i = rand() % n;
+            CHECK(tree_get_nth_preorder(root, i) == nodes[i]);
+            CHECK(tree_get_preorder_rank(nodes[i]) == i);
+        }
+        CHECK(tree_get_nth_preorder(root, n) == NULL);
+
+        /* a burst of queries between changes, as when the index pays off */
+        for (k = 0; k < 20; ++k) {
+            a = nodes[rand() % n];
+            b = nodes[rand() % n];
+            CHECK(tree_is_ancestor(tree, a, b) == check_is_within(b, a));
+            tree_get_subtree_range(tree, a, &first, &last);
+            CHECK(nodes[first] == a);
+            CHECK(last - first + 1 == tree_get_subtree_size(a));
+            if (rand() % 200 == 0)
+                tree_set_indexed(tree, rand() % 2);
+        }
+    }
+
+    tree_delete_tree(tree, cleanup, NULL);
+    printf("index: ok\n");
+    return EXIT_SUCCESS;
+}
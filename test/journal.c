@@ -0,0 +1,156 @@
+/*
+ * The undo journal against dumps of the guide after each transaction: random
+ * transactions of adds, deletes, moves and changes of titles and texts are
+ * undone one by one back to the start, each undo giving the dump from before
+ * the transaction, and redone to the end in the same way. A change after
+ * some undos drops the redos, and a journal kept to a size undoes the last
+ * transactions it kept, all the same.
+ */
+
+#include "check.h"
+
+#define N_TRANS     300
+
+static char *states[N_TRANS + 1];
+
+static struct tree_node_t *pick(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree);
+
+    return tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+}
+
+/* one random change; returns 0 if it came to nothing, which the journal
+   doesn't record */
+static int change(struct guide_t *guide, int i)
+{
+    struct tree_node_t *a = pick(guide), *b = pick(guide), *root = tree_get_root(guide->tree);
+    struct guide_nodedata_t *data = (struct guide_nodedata_t *)tree_get_data(a);
+    wchar_t title[32];
+    char text[32];
+
+    switch (rand() % 7) {
+    case 0:
+    case 1:
+        CHECK(guide_add_child(guide, a, check_random_nodedata(guide, i), rand() % 2 ?
+            NULL : tree_get_first_child(a)));
+        break;
+    case 2:
+        if (a == root || tree_get_subtree_size(root) < 100)
+            return 0;
+        guide_delete_subtree(guide, a);
+        break;
+    case 3:
+        if (a == root || b == root || check_is_within(b, a))
+            return 0;
+        if (rand() % 2)
+            CHECK(tree_move_subtree_before(a, b) == a);
+        else
+            CHECK(tree_move_subtree_as_child(a, b) == a);
+        break;
+    case 4:
+        swprintf(title, 32, rand() % 2 ? L"t%d" : L"the title of transaction %d", i);
+        guide_nodedata_set_title(data, title);
+        break;
+    case 5:
+        snprintf(text, sizeof(text), "text of transaction %d", i);
+        guide_nodedata_set_text(data, text);
+        break;
+    case 6:
+        guide_nodedata_set_text(data, "");
+        break;
+    }
+    return 1;
+}
+
+static void transaction(struct guide_t *guide, int i)
+{
+    int n;
+
+    if (rand() % 2) {
+        while (!change(guide, i))
+            ;
+        return;
+    }
+    guide_begin_transaction(guide);
+    for (n = 1 + rand() % 5; n; n -= change(guide, i))
+        ;
+    CHECK(guide_undo(guide) == -1);
+    guide_end_transaction(guide);
+}
+
+static void check_state(struct guide_t *guide, const char *state)
+{
+    char *got = check_dump(NULL, tree_get_root(guide->tree));
+
+    CHECK(strcmp(got, state) == 0);
+    free(got);
+    check_count(tree_get_root(guide->tree));
+    check_uids(guide, tree_get_root(guide->tree));
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_t *guide;
+    int i, n;
+
+    check_setlocale();
+    srand(36);
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 200);
+    CHECK(guide_set_journal(guide, 1, 0) == 0);
+    CHECK(!guide_can_undo(guide) && !guide_can_redo(guide));
+
+    states[0] = check_dump(NULL, tree_get_root(guide->tree));
+    for (i = 1; i <= N_TRANS; ++i) {
+        transaction(guide, i);
+        states[i] = check_dump(NULL, tree_get_root(guide->tree));
+    }
+
+    /* back to the start, and forth to the end */
+    for (i = N_TRANS; i > 0; --i) {
+        CHECK(guide_can_undo(guide));
+        CHECK(guide_undo(guide) == 0);
+        check_state(guide, states[i - 1]);
+    }
+    CHECK(!guide_can_undo(guide) && guide_undo(guide) == -1);
+    for (i = 1; i <= N_TRANS; ++i) {
+        CHECK(guide_can_redo(guide));
+        CHECK(guide_redo(guide) == 0);
+        check_state(guide, states[i]);
+    }
+    CHECK(!guide_can_redo(guide) && guide_redo(guide) == -1);
+
+    /* a change drops the redos */
+    for (i = 0; i < 10; ++i)
+        CHECK(guide_undo(guide) == 0);
+    guide_add_child(guide, tree_get_root(guide->tree), check_random_nodedata(guide, 0), NULL);
+    CHECK(!guide_can_redo(guide) && guide_redo(guide) == -1);
+    CHECK(guide_undo(guide) == 0);
+    check_state(guide, states[N_TRANS - 10]);
+
+    /* a journal kept small undoes the last transactions only */
+    CHECK(guide_set_journal(guide, 0, 0) == 0);
+    CHECK(!guide_can_undo(guide));
+    CHECK(guide_set_journal(guide, 1, 8192) == 0);
+    for (i = 0; i <= N_TRANS; ++i)
+        free(states[i]);
+    states[0] = check_dump(NULL, tree_get_root(guide->tree));
+    for (i = 1; i <= N_TRANS; ++i) {
+        transaction(guide, i);
+        states[i] = check_dump(NULL, tree_get_root(guide->tree));
+    }
+    for (n = 0, i = N_TRANS; guide_undo(guide) == 0; --i, ++n)
+        check_state(guide, states[i - 1]);
+    CHECK(n > 0 && n < N_TRANS);
+    while (guide_redo(guide) == 0)
+        ++i;
+    check_state(guide, states[N_TRANS]);
+
+    for (i = 0; i <= N_TRANS; ++i)
+        free(states[i]);
+    guide_destroy(guide);
+    printf("journal: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/*
+ * guide_find_child_by_title() and guide_find_by_path() against a walk of
+ * the children one by one: parents narrow and wide enough to be indexed,
+ * with titles shared by several children, go through random adds,
+ * renames, moves between parents and deletes, down to few children again,
+ * and every lookup must find the first child with the title, or none.
+ */
+
+#include "check.h"
+
+#define N_PARENTS   6
+#define N_TITLES    40
+
+static struct tree_node_t *parents[N_PARENTS];
+
+static void title_of(wchar_t *title, int k)
+{
+    swprintf(title, 32, k % 3 ? L"t%d" : L"a longer title, number %d", k);
+}
+
+/* the first child of `parent' titled `title', looked for one by one */
+static struct tree_node_t *first_titled(struct tree_node_t *parent, const wchar_t *title,
+    size_t len)
+{
+    struct tree_node_t *child;
+    const wchar_t *t;
+
+    for (child = tree_get_first_child(parent); child; child = tree_get_next_sibling(child)) {
+        t = ((struct guide_nodedata_t *)tree_get_data(child))->title;
+        if (wcslen(t) == len && wcsncmp(t, title, len) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+static void check_lookups(struct guide_t *guide, struct tree_node_t *parent)
+{
+    wchar_t title[32];
+    int k;
+
+    for (k = 0; k < N_TITLES + 2; ++k) {
+        title_of(title, k);
+        CHECK(guide_find_child_by_title(guide, parent, title) ==
+            first_titled(parent, title, wcslen(title)));
+    }
+}
+
+/* the path of titles from the root down to `node', with empty components
+   here and there */
+static void path_of(struct tree_node_t *node, wchar_t *path, size_t size)
+{
+    wchar_t tail[1024];
+    const wchar_t *title;
+
+    path[0] = L'\0';
+    for (; tree_get_parent(node); node = tree_get_parent(node)) {
+        title = ((struct guide_nodedata_t *)tree_get_data(node))->title;
+        swprintf(tail, 1024, L"%ls", path);
+        swprintf(path, size, rand() % 5 ? L"%ls/%ls" : L"%ls//%ls", title, tail);
+    }
+}
+
+/* guide_find_by_path() the slow way */
+static struct tree_node_t *walk_path(struct tree_node_t *node, const wchar_t *path)
+{
+    const wchar_t *end;
+
+    while (node && *path) {
+        for (end = path; *end && *end != L'/'; ++end)
+            ;
+        if (end != path)
+            node = first_titled(node, path, end - path);
+        path = *end ? end + 1 : end;
+    }
+    return node;
+}
+
+static void check_paths(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree), *node;
+    wchar_t path[1024];
+    int i;
+
+    for (i = 0; i < 50; ++i) {
+        node = tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+        path_of(node, path, 1024);
+        CHECK(guide_find_by_path(guide, NULL, path) == walk_path(root, path));
+        CHECK(guide_find_by_path(guide, root, path) == walk_path(root, path));
+    }
+    CHECK(guide_find_by_path(guide, NULL, L"") == root);
+    CHECK(guide_find_by_path(guide, NULL, L"///") == root);
+    CHECK(guide_find_by_path(guide, parents[0], L"") == parents[0]);
+    CHECK(guide_find_by_path(guide, NULL, L"p0/no such title") == NULL);
+    CHECK(guide_find_by_path(guide, NULL, L"no such title/t1") == NULL);
+}
+
+static struct tree_node_t *random_child(struct tree_node_t *parent)
+{
+    unsigned n = tree_get_child_count(parent);
+
+    return n ? tree_get_nth_child(parent, rand() % n) : NULL;
+}
+
+static void change(struct guide_t *guide, int shrink)
+{
+    struct tree_node_t *p = parents[rand() % N_PARENTS], *q = parents[rand() % N_PARENTS];
+    struct tree_node_t *child = random_child(p), *other = random_child(q);
+    wchar_t title[32];
+
+    switch (rand() % (shrink ? 3 : 6)) {
+    case 0:
+        /* a delete */
+        if (child)
+            guide_delete_subtree(guide, child);
+        break;
+    case 1:
+        /* a rename, to a title that may be taken */
+        if (child) {
+            title_of(title, rand() % N_TITLES);
+            guide_nodedata_set_title((struct guide_nodedata_t *)tree_get_data(child), title);
+        }
+        break;
+    case 2:
+        /* a move to another parent, or within the same */
+        if (!child)
+            break;
+        if (other && other != child && rand() % 2)
+            CHECK(tree_move_subtree_after(child, other) == child);
+        else
+            CHECK(tree_move_subtree_as_child(child, q) == child);
+        break;
+    default:
+        /* an add, first or after another */
+        title_of(title, rand() % N_TITLES);
+        CHECK(guide_add_child(guide, p, guide_nodedata_create_with_data(guide, title, ""),
+            rand() % 2 ? NULL : child));
+        break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[N_PARENTS] = { 0, 5, 31, 32, 100, 400 };
+    struct guide_t *guide;
+    struct tree_node_t *root, *node;
+    wchar_t title[32];
+    int i, k, step;
+
+    check_setlocale();
+    srand(33);
+    guide = guide_create();
+    CHECK(guide);
+    root = tree_get_root(guide->tree);
+    for (i = 0; i < N_PARENTS; ++i) {
+        swprintf(title, 32, L"p%d", i);
+        parents[i] = guide_add_child(guide, root, guide_nodedata_create_with_data(guide,
+            title, ""), NULL);
+        CHECK(parents[i]);
+        for (k = 0; k < sizes[i]; ++k) {
+            title_of(title, rand() % N_TITLES);
+            node = guide_add_child(guide, parents[i], guide_nodedata_create_with_data(guide,
+                title, ""), NULL);
+            CHECK(node);
+            /* grandchildren, for the paths */
+            if (k % 10 == 0)
+                CHECK(guide_add_child(guide, node, check_random_nodedata(guide, k), NULL));
+        }
+    }
+    for (i = 0; i < N_PARENTS; ++i)
+        check_lookups(guide, parents[i]);
+    check_paths(guide);
+
+    /* changes, with the indexes built by the lookups above to keep up */
+    for (step = 0; step < 3000; ++step) {
+        change(guide, 0);
+        if (step % 10 == 0) {
+            i = rand() % N_PARENTS;
+            check_lookups(guide, parents[i]);
+        }
+        if (step % 300 == 0)
+            check_paths(guide);
+    }
+    for (i = 0; i < N_PARENTS; ++i)
+        check_lookups(guide, parents[i]);
+
+    /* deletes, moves and renames only, down to a few children */
+    for (step = 0; step < 20000; ++step) {
+        change(guide, 1);
+        if (step % 10 == 0) {
+            i = rand() % N_PARENTS;
+            check_lookups(guide, parents[i]);
+        }
+    }
+    for (i = 0; i < N_PARENTS; ++i) {
+        CHECK(tree_get_child_count(parents[i]) < 32);
+        check_lookups(guide, parents[i]);
+    }
+    check_paths(guide);
+    check_uids(guide, root);
+
+    guide_destroy(guide);
+    printf("lookup: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/*
+ * guide_memory_usage() against sums taken by hand: the titles and texts of
+ * a subtree count what their strings take, the tree nodes what
+ * tree_node_memory() says, and the figures of the subtrees under the root
+ * add up to those of the whole guide, but for the root itself and the
+ * tables of the guide, which only the whole guide counts. The figures
+ * follow adds, deletes and changes of texts, and a text moved to the blob
+ * store counts less.
+ */
+
+#include <unistd.h>
+
+#include "check.h"
+
+#define N_NODES     3000
+
+/* what the titles, texts and tree nodes of the subtree at `node' take */
+static void count(struct tree_node_t *node, struct guide_memory_t *m)
+{
+    struct guide_nodedata_t *data;
+    struct guide_text_t t;
+    struct tree_iter_t it;
+
+    memset(m, 0, sizeof(*m));
+    tree_iter_init(&it, node, TREE_ITER_PREORDER);
+    while (tree_iter_next(&it)) {
+        data = (struct guide_nodedata_t *)tree_get_data(it.node);
+        m->tree_nodes += tree_node_memory(it.node);
+        m->titles += (wcslen(data->title) + 1) * sizeof(wchar_t);
+        CHECK(guide_nodedata_acquire_text(data, &t));
+        m->texts += strlen(t.text) + 1;
+        guide_nodedata_release_text(&t);
+    }
+}
+
+static void check_usage(struct guide_t *guide, struct tree_node_t *node,
+    struct guide_memory_t *usage)
+{
+    struct guide_memory_t m;
+
+    CHECK(guide_memory_usage(guide, node, usage) == 0);
+    CHECK(usage->total == usage->tree_nodes + usage->nodedata + usage->titles +
+        usage->texts + usage->luts);
+    CHECK(usage->nodedata > 0);
+
+    count(node ? node : tree_get_root(guide->tree), &m);
+    CHECK(usage->tree_nodes == m.tree_nodes);
+    CHECK(usage->titles == m.titles);
+    CHECK(usage->texts == m.texts);
+}
+
+/* the whole guide against the subtrees under the root */
+static void check_sum(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree), *child;
+    struct guide_memory_t whole, at_root, sub, sum;
+
+    check_usage(guide, NULL, &whole);
+    check_usage(guide, root, &at_root);
+    CHECK(memcmp(&whole, &at_root, sizeof(whole)) == 0);
+
+    memset(&sum, 0, sizeof(sum));
+    for (child = tree_get_first_child(root); child; child = tree_get_next_sibling(child)) {
+        check_usage(guide, child, &sub);
+        sum.tree_nodes += sub.tree_nodes;
+        sum.nodedata += sub.nodedata;
+        sum.titles += sub.titles;
+        sum.texts += sub.texts;
+        sum.luts += sub.luts;
+    }
+    CHECK(whole.tree_nodes - sum.tree_nodes == tree_node_memory(root));
+    CHECK(whole.titles > sum.titles && whole.texts > sum.texts);
+    CHECK(whole.nodedata > sum.nodedata);
+
+    /* the root has no title index, so the rest is the tables */
+    CHECK(tree_get_child_count(root) < 32);
+    CHECK(whole.luts > sum.luts);
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/libguide-memory-XXXXXX";
+    struct guide_memory_t before, after, sub;
+    struct guide_t *guide;
+    struct guide_nodedata_t *data;
+    struct tree_node_t *wide, *added, *node;
+    char text[5000];
+    int i, fd;
+
+    check_setlocale();
+    srand(50);
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, N_NODES);
+
+    /* a parent wide enough to have its titles indexed, which its subtree
+       counts */
+    wide = tree_get_first_child(tree_get_root(guide->tree));
+    CHECK(guide_memory_usage(guide, wide, &before) == 0);
+    for (i = 0; i < 200; ++i)
+        CHECK(guide_add_child(guide, wide, check_random_nodedata(guide, N_NODES + i), NULL));
+    CHECK(guide_find_child_by_title(guide, wide, L"n3100"));
+    CHECK(guide_memory_usage(guide, wide, &after) == 0);
+    CHECK(after.luts > before.luts);
+    check_sum(guide);
+
+    /* an add, a longer text, a delete */
+    check_usage(guide, NULL, &before);
+    added = guide_add_child(guide, wide, guide_nodedata_create_with_data(guide, L"added",
+        "some text"), NULL);
+    CHECK(added);
+    check_usage(guide, NULL, &after);
+    CHECK(after.titles == before.titles + sizeof(L"added"));
+    CHECK(after.texts == before.texts + sizeof("some text"));
+    CHECK(after.tree_nodes > before.tree_nodes && after.nodedata > before.nodedata);
+
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    guide_nodedata_set_text((struct guide_nodedata_t *)tree_get_data(added), text);
+    check_usage(guide, NULL, &before);
+    CHECK(before.texts == after.texts + sizeof(text) - sizeof("some text"));
+    check_sum(guide);
+
+    node = tree_get_next_sibling(wide);
+    CHECK(node);
+    check_usage(guide, node, &sub);
+    guide_delete_subtree(guide, node);
+    check_usage(guide, NULL, &after);
+    CHECK(after.tree_nodes == before.tree_nodes - sub.tree_nodes);
+    CHECK(after.nodedata == before.nodedata - sub.nodedata);
+    CHECK(after.titles == before.titles - sub.titles);
+    CHECK(after.texts == before.texts - sub.texts);
+    check_sum(guide);
+
+    /* texts in the blob store count the record of where they are */
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+    check_usage(guide, NULL, &before);
+    CHECK(guide_set_blob_store(guide, path, 1000, 0) == 0);
+    CHECK(guide_memory_usage(guide, NULL, &after) == 0);
+    CHECK(after.texts < before.texts - (sizeof(text) - 1000));
+    CHECK(after.titles == before.titles && after.tree_nodes == before.tree_nodes);
+    data = (struct guide_nodedata_t *)tree_get_data(added);
+    CHECK(data->_blob);
+
+    guide_destroy(guide);
+    unlink(path);
+    printf("memory: ok\n");
+    return EXIT_SUCCESS;
+}
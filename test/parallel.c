@@ -0,0 +1,204 @@
+/*
+ * tree_parallel_for_each() and guide_parallel_for_each() against a walk of
+ * the tree: with any number of threads and any grain, every node of the
+ * subtree is visited exactly once and no other, a nonzero return stops the
+ * walk with that value, and what the nodes write reaches the sink in
+ * preorder, however the tasks were cut and stolen.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "check.h"
+
+#define N_NODES     40000
+
+static struct tree_node_t *nodes[N_NODES + 1];
+static _Atomic unsigned visits[N_NODES + 1];
+
+struct sunk_t
+{
+    uintptr_t *p;
+    size_t n;
+};
+
+static int visit(struct tree_node_t *node, void *cargo, struct tree_parallel_out_t *out)
+{
+    uintptr_t i = (uintptr_t)tree_get_data(node);
+
+    atomic_fetch_add(&visits[i], 1);
+    if (cargo && (struct tree_node_t *)cargo == node)
+        return 7;
+
+    /* some nodes write nothing, some twice */
+    if (i % 3)
+        tree_parallel_write(out, &i, sizeof(i));
+    if (i % 5 == 0)
+        tree_parallel_write(out, &i, sizeof(i));
+    return 0;
+}
+
+static void sink(const void *buf, size_t len, void *cargo)
+{
+    struct sunk_t *s = (struct sunk_t *)cargo;
+
+    CHECK(len % sizeof(uintptr_t) == 0);
+    s->p = realloc(s->p, s->n * sizeof(uintptr_t) + len);
+    CHECK(s->p);
+    memcpy(s->p + s->n, buf, len);
+    s->n += len / sizeof(uintptr_t);
+}
+
+/* what visit() writes for the subtree at `node', in preorder */
+static void check_sunk(struct tree_node_t *node, struct sunk_t *s)
+{
+    static struct tree_node_t *order[N_NODES + 1];
+    unsigned n = check_preorder(node, order), k;
+    uintptr_t i;
+    size_t at = 0;
+
+    for (k = 0; k < n; ++k) {
+        i = (uintptr_t)tree_get_data(order[k]);
+        if (i % 3)
+            CHECK(at < s->n && s->p[at++] == i);
+        if (i % 5 == 0)
+            CHECK(at < s->n && s->p[at++] == i);
+    }
+    CHECK(at == s->n);
+}
+
+static void check_visits(struct tree_node_t *node)
+{
+    uintptr_t i;
+
+    for (i = 0; i <= N_NODES; ++i) {
+        CHECK(atomic_load(&visits[i]) == (unsigned)check_is_within(nodes[i], node));
+        atomic_store(&visits[i], 0);
+    }
+}
+
+static void cleanup(struct tree_node_t *node, void *cargo)
+{
+}
+
+static void tree_walks(void)
+{
+    static const unsigned threads[] = { 1, 2, 3, 8 };
+    static const uint32 grains[] = { 0, 1, 16, 5000 };
+    struct tree_parallel_opts_t opts;
+    struct sunk_t s = { NULL, 0 };
+    struct tree_node_t *sub;
+    struct tree_t *tree;
+    uintptr_t i;
+    unsigned t, g, n;
+
+    /* deep and wide parts alike */
+    tree = tree_create_with_root((void *)0);
+    CHECK(tree);
+    nodes[0] = tree_get_root(tree);
+    for (i = 1; i <= N_NODES; ++i) {
+        nodes[i] = tree_add_child(nodes[rand() % 4 ? i - 1 - rand() % (i < 10 ? i : 10) :
+            rand() % i], (void *)i, NULL);
+        CHECK(nodes[i]);
+    }
+    sub = tree_get_first_child(nodes[0]);
+
+    for (t = 0; t < sizeof(threads) / sizeof(*threads); ++t)
+        for (g = 0; g < sizeof(grains) / sizeof(*grains); ++g) {
+            memset(&opts, 0, sizeof(opts));
+            opts.n_threads = threads[t];
+            opts.grain = grains[g];
+            CHECK(tree_parallel_for_each(nodes[0], visit, NULL, &opts) == 0);
+            check_visits(nodes[0]);
+            CHECK(tree_parallel_for_each(sub, visit, NULL, &opts) == 0);
+            check_visits(sub);
+
+            opts.sink = sink;
+            opts.sink_cargo = &s;
+            CHECK(tree_parallel_for_each(nodes[0], visit, NULL, &opts) == 0);
+            check_visits(nodes[0]);
+            check_sunk(nodes[0], &s);
+            s.n = 0;
+
+            /* a stop, somewhere inside */
+            i = 1 + rand() % N_NODES;
+            CHECK(tree_parallel_for_each(nodes[0], visit, nodes[i], &opts) == 7);
+            CHECK(atomic_load(&visits[i]) == 1);
+            for (i = n = 0; i <= N_NODES; ++i) {
+                CHECK(atomic_load(&visits[i]) <= 1);
+                n += atomic_load(&visits[i]);
+                atomic_store(&visits[i], 0);
+            }
+            CHECK(n >= 1 && n <= N_NODES + 1);
+            s.n = 0;
+        }
+
+    CHECK(tree_parallel_for_each(nodes[N_NODES], visit, NULL, NULL) == 0);
+    check_visits(nodes[N_NODES]);
+
+    free(s.p);
+    tree_delete_tree(tree, cleanup, NULL);
+}
+
+static int add_uid(struct tree_node_t *node, void *cargo, struct tree_parallel_out_t *out)
+{
+    uint32 uid = ((struct guide_nodedata_t *)tree_get_data(node))->uid;
+
+    atomic_fetch_add((_Atomic uint64_t *)cargo, uid);
+    tree_parallel_write(out, &uid, sizeof(uid));
+    return 0;
+}
+
+static void sink_uids(const void *buf, size_t len, void *cargo)
+{
+    struct check_buf_t *b = (struct check_buf_t *)cargo;
+    size_t k;
+
+    for (k = 0; k < len / sizeof(uint32); ++k)
+        check_putf(b, "%u,", ((const uint32 *)buf)[k]);
+}
+
+static void guide_walk(void)
+{
+    struct tree_parallel_opts_t opts;
+    struct check_buf_t got = { NULL, 0, 0 }, expect = { NULL, 0, 0 };
+    struct guide_t *guide;
+    struct tree_iter_t it;
+    _Atomic uint64_t sum = 0;
+    uint64_t serial = 0;
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 5000);
+    guide_set_concurrent(guide, 1);
+
+    check_putf(&expect, "%s", "");
+    tree_iter_init(&it, tree_get_root(guide->tree), TREE_ITER_PREORDER);
+    while (tree_iter_next(&it)) {
+        serial += ((struct guide_nodedata_t *)tree_get_data(it.node))->uid;
+        check_putf(&expect, "%u,", ((struct guide_nodedata_t *)tree_get_data(it.node))->uid);
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.n_threads = 4;
+    opts.grain = 8;
+    opts.sink = sink_uids;
+    opts.sink_cargo = &got;
+    check_putf(&got, "%s", "");
+    CHECK(guide_parallel_for_each(guide, add_uid, &sum, &opts) == 0);
+    CHECK(atomic_load(&sum) == serial);
+    CHECK(strcmp(got.p, expect.p) == 0);
+
+    free(got.p);
+    free(expect.p);
+    guide_destroy(guide);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(42);
+    tree_walks();
+    guide_walk();
+    printf("parallel: ok\n");
+    return EXIT_SUCCESS;
+}
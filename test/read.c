@@ -14,8 +14,11 @@ static void fspace(FILE *fp, int n, char c)
         fprintf(fp, "%c", c);
 }
 
-static int _guide_reader(struct tree_node_t *node, int depth)
+static int _guide_reader(struct tree_node_t *node, void *cargo, int depth, int index, int after)
 {
+    if (after)
+        return 0;
+
     struct guide_nodedata_t *data =
         (struct guide_nodedata_t *)tree_get_data(node);
     fspace(stdout, depth, '-');
@@ -47,5 +50,5 @@ int main(int argc, char *argv[])
     }
     printf("Filename=%ls\n", filename);
 
-    tree_traverse_preorder_wd(guide->tree, _guide_reader);
+    tree_traverse_preorder_ex(guide->tree, _guide_reader, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+/*
+ * guide_destroy_async() and guide_reclaimer_drain(), watched through an
+ * allocator of each guide that counts what it holds: the guides are freed
+ * on the background thread, more of them than wait at once, and all of
+ * them by the time guide_reclaimer_drain() returns. The thread starts
+ * again after a drain, a drain with nothing to do returns at once, and
+ * guides handed over while draining are still freed.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "check.h"
+
+#define N_GUIDES    40
+
+struct counted_t
+{
+    struct guide_allocator_t alloc;
+    _Atomic long live;           /* allocations not freed yet */
+    _Atomic int frees_on_main;   /* frees on the main thread, once built */
+};
+
+static struct counted_t counted[N_GUIDES];
+static pthread_t main_thread;
+
+static void *counted_malloc(size_t size, void *cargo)
+{
+    void *p = malloc(size);
+
+    if (p)
+        atomic_fetch_add(&((struct counted_t *)cargo)->live, 1);
+    return p;
+}
+
+static void *counted_realloc(void *p, size_t size, void *cargo)
+{
+    void *q = realloc(p, size);
+
+    if (!p && q)
+        atomic_fetch_add(&((struct counted_t *)cargo)->live, 1);
+    return q;
+}
+
+static void counted_free(void *p, void *cargo)
+{
+    struct counted_t *c = (struct counted_t *)cargo;
+
+    if (!p)
+        return;
+    atomic_fetch_sub(&c->live, 1);
+    if (pthread_equal(pthread_self(), main_thread))
+        atomic_fetch_add(&c->frees_on_main, 1);
+    free(p);
+}
+
+static struct guide_t *make_guide(int i)
+{
+    struct counted_t *c = &counted[i];
+    struct guide_t *guide;
+
+    c->alloc.malloc_fn = counted_malloc;
+    c->alloc.realloc_fn = counted_realloc;
+    c->alloc.free_fn = counted_free;
+    c->alloc.cargo = c;
+    atomic_store(&c->live, 0);
+
+    guide = guide_create();
+    CHECK(guide);
+    CHECK(guide_set_allocator(guide, &c->alloc) == 0);
+    check_random_guide(guide, 500 + rand() % 500);
+    CHECK(atomic_load(&c->live) > 0);
+    atomic_store(&c->frees_on_main, 0);
+    return guide;
+}
+
+static void *hand_over(void *arg)
+{
+    struct guide_t **guides = (struct guide_t **)arg;
+    int i;
+
+    for (i = 0; i < N_GUIDES / 2; ++i)
+        guide_destroy_async(guides[i]);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_t *guides[N_GUIDES];
+    pthread_t thread;
+    int i, round;
+
+    check_setlocale();
+    srand(37);
+    main_thread = pthread_self();
+
+    /* nothing to drain yet */
+    guide_reclaimer_drain();
+
+    for (round = 0; round < 2; ++round) {
+        for (i = 0; i < N_GUIDES; ++i)
+            guides[i] = make_guide(i);
+        for (i = 0; i < N_GUIDES; ++i)
+            guide_destroy_async(guides[i]);
+        guide_reclaimer_drain();
+        for (i = 0; i < N_GUIDES; ++i) {
+            CHECK(atomic_load(&counted[i].live) == 0);
+            CHECK(atomic_load(&counted[i].frees_on_main) == 0);
+        }
+        guide_reclaimer_drain();
+    }
+
+    /* handed over while draining: freed all the same, here or there */
+    for (i = 0; i < N_GUIDES; ++i)
+        guides[i] = make_guide(i);
+    for (i = N_GUIDES / 2; i < N_GUIDES; ++i)
+        guide_destroy_async(guides[i]);
+    CHECK(pthread_create(&thread, NULL, hand_over, guides) == 0);
+    guide_reclaimer_drain();
+    CHECK(pthread_join(thread, NULL) == 0);
+    guide_reclaimer_drain();
+    for (i = 0; i < N_GUIDES; ++i)
+        CHECK(atomic_load(&counted[i].live) == 0);
+
+    printf("reclaim: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/*
+ * Snapshots of a guide against dumps taken when they were taken: through
+ * random adds, deletes, moves and changes of titles and texts, every live
+ * snapshot must still dump as it did, however many changes it has seen
+ * and whichever snapshots were released in between. The guide is then
+ * destroyed before its last snapshots, which must stay readable.
+ */
+
+#include "check.h"
+
+#define MAX_SNAPSHOTS   8
+
+struct snap_t
+{
+    struct tree_snapshot_t *ss;
+    char *dump;
+};
+
+static int count_tvr(struct tree_node_t *node, void *cargo)
+{
+    ++*(unsigned *)cargo;
+    return 0;
+}
+
+static void verify(struct snap_t *snaps, int n)
+{
+    unsigned count;
+    char *got;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        got = check_dump(snaps[i].ss, tree_snapshot_get_root(snaps[i].ss));
+        CHECK(strcmp(got, snaps[i].dump) == 0);
+        free(got);
+
+        /* the traversal sees the same nodes */
+        count = 0;
+        tree_snapshot_traverse_preorder(snaps[i].ss, count_tvr, &count);
+        got = snaps[i].dump;
+        while ((got = strchr(got, '(')))
+            --count, ++got;
+        CHECK(count == 0);
+    }
+}
+
+/* a live dump as a snapshot dumps it: "(uid title|text" of each node, the
+   attributes after the next '|' taken out */
+static char *without_attrs(char *dump)
+{
+    char *p = dump, *q = dump;
+    int bars = 0;
+
+    for (; *p; ++p) {
+        if (*p == '(' || *p == ')')
+            bars = 0;
+        else if (*p == '|' && ++bars == 2)
+            continue;
+        if (bars < 2)
+            *q++ = *p;
+    }
+    *q = '\0';
+    return dump;
+}
+
+static struct tree_node_t *pick(struct guide_t *guide)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree);
+
+    return tree_get_nth_preorder(root, rand() % tree_get_subtree_size(root));
+}
+
+int main(int argc, char *argv[])
+{
+    struct snap_t snaps[MAX_SNAPSHOTS];
+    struct guide_t *guide;
+    struct tree_node_t *a, *b, *root;
+    struct guide_nodedata_t *data;
+    wchar_t title[32];
+    char text[32], *got;
+    int n = 0, step, i;
+
+    check_setlocale();
+    srand(38);
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 300);
+    root = tree_get_root(guide->tree);
+
+    for (step = 0; step < 3000; ++step) {
+        /* take one, or release one */
+        if (n < MAX_SNAPSHOTS && rand() % 20 == 0) {
+            snaps[n].ss = guide_snapshot(guide);
+            CHECK(snaps[n].ss);
+            snaps[n].dump = check_dump(snaps[n].ss, tree_snapshot_get_root(snaps[n].ss));
+            got = without_attrs(check_dump(NULL, root));
+            CHECK(strcmp(snaps[n].dump, got) == 0);
+            free(got);
+            ++n;
+        } else if (n && rand() % 40 == 0) {
+            verify(snaps, n);
+            i = rand() % n;
+            guide_snapshot_release(snaps[i].ss);
+            free(snaps[i].dump);
+            snaps[i] = snaps[--n];
+        }
+
+        a = pick(guide);
+        b = pick(guide);
+        switch (rand() % 6) {
+        case 0:
+            guide_add_child(guide, a, check_random_nodedata(guide, step), rand() % 2 ?
+                NULL : tree_get_first_child(a));
+            break;
+        case 1:
+            if (a != root && tree_get_subtree_size(root) > 200)
+                guide_delete_subtree(guide, a);
+            break;
+        case 2:
+            if (a == root || b == root || check_is_within(b, a))
+                break;
+            if (rand() % 2)
+                CHECK(tree_move_subtree_after(a, b) == a);
+            else
+                CHECK(tree_move_subtree_as_child(a, b) == a);
+            break;
+        case 3:
+            data = (struct guide_nodedata_t *)tree_get_data(a);
+            swprintf(title, 32, rand() % 2 ? L"t%d" : L"a longer title, at step %d", step);
+            guide_nodedata_set_title(data, title);
+            break;
+        case 4:
+            data = (struct guide_nodedata_t *)tree_get_data(a);
+            snprintf(text, sizeof(text), "text at step %d", step);
+            guide_nodedata_set_text(data, text);
+            break;
+        case 5:
+            data = (struct guide_nodedata_t *)tree_get_data(a);
+            guide_nodedata_set_text(data, "");
+            break;
+        }
+
+        if (step % 10 == 0)
+            verify(snaps, n);
+    }
+
+    /* snapshots outlive the guide */
+    while (n < 2) {
+        snaps[n].ss = guide_snapshot(guide);
+        snaps[n].dump = check_dump(snaps[n].ss, root);
+        ++n;
+    }
+    guide_delete_subtree(guide, tree_get_first_child(root));
+    guide_destroy(guide);
+    verify(snaps, n);
+    for (i = 0; i < n; ++i) {
+        guide_snapshot_release(snaps[i].ss);
+        free(snaps[i].dump);
+    }
+
+    printf("snapshot: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/*
+ * Splitting subtrees off a guide into guides of their own and merging them
+ * back, checked against the dump of the guide before each step: a split
+ * takes the dump of the subtree out of the dump of the guide, and a merge
+ * puts it back in as the first child of the node merged under.
+ */
+
+#include "check.h"
+
+/* `dump' without the first occurrence of `sub' */
+static char *cut(const char *dump, const char *sub)
+{
+    const char *p = strstr(dump, sub);
+    size_t len = strlen(sub);
+    char *ret;
+
+    CHECK(p);
+    ret = malloc(strlen(dump) - len + 1);
+    memcpy(ret, dump, p - dump);
+    strcpy(ret + (p - dump), p + len);
+    return ret;
+}
+
+/* `dump' with `sub' as the first child of the node `uid' */
+static char *paste(const char *dump, const char *sub, uint32 uid)
+{
+    char head[32];
+    const char *p;
+    char *ret;
+
+    snprintf(head, sizeof(head), "(%u ", uid);
+    p = strstr(dump, head);
+    CHECK(p);
+    p += strcspn(p + 1, "()") + 1;
+    ret = malloc(strlen(dump) + strlen(sub) + 1);
+    memcpy(ret, dump, p - dump);
+    strcpy(ret + (p - dump), sub);
+    strcat(ret, p);
+    return ret;
+}
+
+static struct tree_node_t *pick(struct guide_t *guide, int non_root)
+{
+    struct tree_node_t *root = tree_get_root(guide->tree);
+    uint32 n = tree_get_subtree_size(root);
+
+    if (non_root && n < 2)
+        return NULL;
+    return tree_get_nth_preorder(root, non_root ? 1 + rand() % (n - 1) : rand() % n);
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_t *guide, *other;
+    struct tree_node_t *node, *dst;
+    struct guide_nodedata_t *data;
+    char *dump, *sub, *expect, *got;
+    unsigned count;
+    uint32 uid;
+    int i;
+
+    check_setlocale();
+    srand(26);
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 1000);
+
+    for (i = 0; i < 150; ++i) {
+        dump = check_dump(NULL, tree_get_root(guide->tree));
+        count = check_count(tree_get_root(guide->tree));
+
+        /* split */
+        node = pick(guide, 1);
+        CHECK(node);
+        sub = check_dump(NULL, node);
+        other = guide_split_subtree(guide, node);
+        CHECK(other);
+        CHECK(tree_get_root(other->tree) == node);
+        CHECK(check_count(node) + check_count(tree_get_root(guide->tree)) == count);
+        CHECK(tree_get_node_count(guide->tree) + tree_get_node_count(other->tree) == count);
+
+        expect = cut(dump, sub);
+        got = check_dump(NULL, tree_get_root(guide->tree));
+        CHECK(strcmp(got, expect) == 0);
+        free(got);
+        got = check_dump(NULL, tree_get_root(other->tree));
+        CHECK(strcmp(got, sub) == 0);
+        free(got);
+
+        /* the uids went along */
+        check_uids(guide, tree_get_root(guide->tree));
+        check_uids(other, node);
+        data = (struct guide_nodedata_t *)tree_get_data(node);
+        CHECK(guide_get_node_by_uid(guide, data->uid) == NULL);
+
+        /* merge back, somewhere else */
+        dst = pick(guide, 0);
+        uid = ((struct guide_nodedata_t *)tree_get_data(dst))->uid;
+        guide_merge_guide(guide, dst, other);
+        CHECK(tree_get_first_child(dst) == node);
+        CHECK(check_count(tree_get_root(guide->tree)) == count);
+        CHECK(tree_get_node_count(guide->tree) == count);
+
+        free(dump);
+        dump = paste(expect, sub, uid);
+        got = check_dump(NULL, tree_get_root(guide->tree));
+        CHECK(strcmp(got, dump) == 0);
+        check_uids(guide, tree_get_root(guide->tree));
+
+        free(got);
+        free(expect);
+        free(sub);
+        free(dump);
+    }
+
+    /* a guide merged into another whose uids collide gets new ones */
+    other = guide_create();
+    check_random_guide(other, 50);
+    count = tree_get_node_count(guide->tree) + tree_get_node_count(other->tree);
+    guide_merge_guide(guide, tree_get_root(guide->tree), other);
+    CHECK(check_count(tree_get_root(guide->tree)) == count);
+    check_uids(guide, tree_get_root(guide->tree));
+
+    guide_destroy(guide);
+    printf("split: ok\n");
+    return EXIT_SUCCESS;
+}
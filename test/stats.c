@@ -0,0 +1,212 @@
+/*
+ * guide_get_stats() and guide_reset_stats(): built without statistics,
+ * they're all zeros and guide_get_stats() says so. Built with them (make
+ * STATS=1), a reset brings them back to zero, storing and loading a guide
+ * counts its nodes and the bytes of the file, times the phases, nested as
+ * documented, and probes the uid table, the blob store counts what it
+ * writes and reads back, and allocations are counted exactly, from several
+ * threads at once.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libguide/stats.h>
+
+#include "check.h"
+
+#define N_THREADS   4
+#define N_ALLOCS    1000
+
+static void check_zero(const struct guide_stats_t *stats)
+{
+    static const struct guide_stats_t zero;
+
+    CHECK(memcmp(stats, &zero, sizeof(zero)) == 0);
+}
+
+static void *allocate(void *arg)
+{
+    void *p;
+    int i;
+
+    for (i = 0; i < N_ALLOCS; ++i) {
+        p = i % 2 ? guide_malloc(16) : guide_calloc(2, 8);
+        CHECK(p);
+        guide_free(p);
+    }
+    return NULL;
+}
+
+static long file_size(const char *file)
+{
+    struct stat st;
+
+    CHECK(stat(file, &st) == 0);
+    return (long)st.st_size;
+}
+
+static void load_and_store(void)
+{
+    char file[] = "/tmp/libguide-stats-XXXXXX";
+    struct guide_stats_t stats;
+    struct guide_t *guide, *loaded;
+    wchar_t wfile[64];
+    unsigned os_errcode;
+    uint32 format;
+    int fd, i;
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 2000);
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+
+    guide_reset_stats();
+    CHECK(guide_store(wfile, guide) == 0);
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.nodes == tree_get_node_count(guide->tree));
+    CHECK(stats.bytes_written == (uint64_t)file_size(file));
+    CHECK(stats.bytes_read == 0);
+    CHECK(stats.allocs > 0);
+    CHECK(stats.phase_ns[GP_STORE] > 0);
+    CHECK(stats.phase_ns[GP_UTF8] <= stats.phase_ns[GP_STORE]);
+    for (i = 0; i < GP_COUNT; ++i)
+        if (i != GP_STORE && i != GP_UTF8)
+            CHECK(stats.phase_ns[i] == 0);
+
+    guide_reset_stats();
+    loaded = guide_load(wfile, &os_errcode, &format);
+    CHECK(loaded);
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.nodes == tree_get_node_count(loaded->tree));
+    CHECK(stats.bytes_read == (uint64_t)file_size(file));
+    CHECK(stats.bytes_written == 0);
+    CHECK(stats.lut_probes >= stats.nodes);
+    CHECK(stats.phase_ns[GP_DECODE] > 0 && stats.phase_ns[GP_LINK] > 0);
+    CHECK(stats.phase_ns[GP_UTF8] <= stats.phase_ns[GP_DECODE]);
+    CHECK(stats.phase_ns[GP_UIDS] <= stats.phase_ns[GP_LINK]);
+    CHECK(stats.phase_ns[GP_STORE] == 0);
+
+    unlink(file);
+    guide_destroy(loaded);
+    guide_destroy(guide);
+}
+
+static void blob_store(void)
+{
+    char path[] = "/tmp/libguide-stats-XXXXXX";
+    struct guide_stats_t stats;
+    struct guide_text_t t;
+    struct guide_t *guide;
+    struct guide_nodedata_t *data;
+    struct tree_node_t *node;
+    char text[1000];
+    uint64_t written;
+    int fd, i;
+
+    guide = guide_create();
+    CHECK(guide);
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+    memset(text, 'b', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+
+    guide_reset_stats();
+    CHECK(guide_set_blob_store(guide, path, 100, 1) == 0);
+    for (i = 0; i < 100; ++i) {
+        node = guide_add_child(guide, tree_get_root(guide->tree),
+            guide_nodedata_create_with_data(guide, L"blob", text), NULL);
+        CHECK(node);
+    }
+    CHECK(guide_get_stats(&stats) == 0);
+    written = stats.bytes_written;
+    CHECK(written >= 100 * (sizeof(text) - 1));
+    CHECK(written == (uint64_t)file_size(path));
+
+    /* read back, as the cache holds next to none of them */
+    for (node = tree_get_first_child(tree_get_root(guide->tree)); node;
+            node = tree_get_next_sibling(node)) {
+        data = (struct guide_nodedata_t *)tree_get_data(node);
+        CHECK(strcmp(guide_nodedata_acquire_text(data, &t), text) == 0);
+        guide_nodedata_release_text(&t);
+    }
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.bytes_read >= 100 * (sizeof(text) - 1));
+    CHECK(stats.bytes_written == written);
+
+    guide_destroy(guide);
+    unlink(path);
+}
+
+static void allocations(void)
+{
+    struct guide_stats_t stats;
+    pthread_t threads[N_THREADS];
+    void *p;
+    int i;
+
+    guide_reset_stats();
+    p = guide_malloc(10);
+    p = guide_realloc(p, 100);
+    CHECK(p);
+    guide_free(p);
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.allocs == 2);
+
+    guide_reset_stats();
+    for (i = 0; i < N_THREADS; ++i)
+        CHECK(pthread_create(&threads[i], NULL, allocate, NULL) == 0);
+    for (i = 0; i < N_THREADS; ++i)
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.allocs == N_THREADS * N_ALLOCS);
+    CHECK(stats.lut_probes == 0 && stats.nodes == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_stats_t stats;
+    struct guide_t *guide;
+    int i;
+
+    check_setlocale();
+    srand(49);
+    for (i = 0; i < GP_COUNT; ++i)
+        CHECK(guide_stats_phase_name(i) && *guide_stats_phase_name(i));
+    CHECK(strcmp(guide_stats_phase_name(GP_STORE), "store") == 0);
+    CHECK(guide_stats_phase_name(-1) == NULL);
+    CHECK(guide_stats_phase_name(GP_COUNT) == NULL);
+
+    /* built without them */
+    if (guide_get_stats(&stats) < 0) {
+        check_zero(&stats);
+        guide = guide_create();
+        CHECK(guide);
+        check_random_guide(guide, 100);
+        guide_destroy(guide);
+        guide_reset_stats();
+        CHECK(guide_get_stats(&stats) < 0);
+        check_zero(&stats);
+        printf("stats: ok (not built with them)\n");
+        return EXIT_SUCCESS;
+    }
+
+    guide = guide_create();
+    CHECK(guide);
+    check_random_guide(guide, 100);
+    CHECK(guide_get_stats(&stats) == 0);
+    CHECK(stats.allocs > 0 && stats.lut_probes > 0);
+    guide_reset_stats();
+    CHECK(guide_get_stats(&stats) == 0);
+    check_zero(&stats);
+    guide_destroy(guide);
+
+    load_and_store();
+    blob_store();
+    allocations();
+    printf("stats: ok\n");
+    return EXIT_SUCCESS;
+}
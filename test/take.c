@@ -0,0 +1,282 @@
+/*
+ * The *_take variants against the ones that copy: two guides go through
+ * the same changes, one handing over strings allocated from its allocator
+ * (NULL now and then), the other passing copies, on node data made as
+ * usual, inline, by a builder, loaded, or with texts in the blob store,
+ * with the changes undone and redone, and a snapshot taken meanwhile.
+ * Both must dump the same all along, and each allocator must get back
+ * all it gave, the strings handed over included.
+ */
+
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "check.h"
+
+#define N_NODES     400
+
+struct counted_t
+{
+    struct guide_allocator_t alloc;
+    _Atomic long live;
+};
+
+struct side_t
+{
+    struct counted_t counted;
+    struct guide_t *guide;
+    struct tree_node_t *nodes[N_NODES + 1];
+};
+
+static struct side_t sides[2];    /* [0] takes, [1] copies */
+
+static void *counted_malloc(size_t size, void *cargo)
+{
+    void *p = malloc(size);
+
+    if (p)
+        atomic_fetch_add(&((struct counted_t *)cargo)->live, 1);
+    return p;
+}
+
+static void *counted_realloc(void *p, size_t size, void *cargo)
+{
+    void *q = realloc(p, size);
+
+    if (!p && q)
+        atomic_fetch_add(&((struct counted_t *)cargo)->live, 1);
+    return q;
+}
+
+static void counted_free(void *p, void *cargo)
+{
+    if (p)
+        atomic_fetch_sub(&((struct counted_t *)cargo)->live, 1);
+    free(p);
+}
+
+/* `title' and `text' from the allocator of the guide taking them, NULL if
+   they're NULL */
+static wchar_t *title_for(const wchar_t *title)
+{
+    const struct guide_allocator_t *prev;
+    wchar_t *p;
+
+    if (!title)
+        return NULL;
+    prev = guide_use_allocator(&sides[0].counted.alloc);
+    p = guide_wcsdup(title);
+    guide_use_allocator(prev);
+    CHECK(p);
+    return p;
+}
+
+static char *text_for(const char *text)
+{
+    const struct guide_allocator_t *prev;
+    char *p;
+
+    if (!text)
+        return NULL;
+    prev = guide_use_allocator(&sides[0].counted.alloc);
+    p = guide_strdup(text);
+    guide_use_allocator(prev);
+    CHECK(p);
+    return p;
+}
+
+static void random_strings(wchar_t *title, char *text, int i, const wchar_t **t, const char **x)
+{
+    static char long_text[3000];
+    int len = rand() % 4 ? rand() % 40 : 1000 + rand() % 2000;
+
+    swprintf(title, 64, rand() % 2 ? L"t%d" : L"a title too long to keep inline, %d", i);
+    memset(long_text, 'a' + i % 26, len);
+    long_text[len] = '\0';
+    strcpy(text, long_text);
+    *t = rand() % 10 ? title : NULL;
+    *x = rand() % 10 ? text : NULL;
+}
+
+static void check_same(void)
+{
+    char *a = check_dump(NULL, tree_get_root(sides[0].guide->tree));
+    char *b = check_dump(NULL, tree_get_root(sides[1].guide->tree));
+
+    CHECK(strcmp(a, b) == 0);
+    free(a);
+    free(b);
+}
+
+/* both guides stored by the one that copies and loaded back, each with
+   its allocator */
+static void reload(void)
+{
+    static struct tree_node_t *order[N_NODES + 1];
+    static unsigned at[N_NODES + 1];
+    char file[] = "/tmp/libguide-take-XXXXXX";
+    const struct guide_allocator_t *prev;
+    wchar_t wfile[64];
+    struct side_t *s;
+    unsigned os_errcode, n, j;
+    uint32 format;
+    int i, fd;
+
+    n = check_preorder(tree_get_root(sides[1].guide->tree), order);
+    for (i = 0; i <= N_NODES; ++i) {
+        for (j = 0; order[j] != sides[1].nodes[i]; ++j)
+            ;
+        at[i] = j;
+    }
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+    CHECK(guide_store(wfile, sides[1].guide) == 0);
+    for (s = sides; s < sides + 2; ++s) {
+        guide_destroy(s->guide);
+        prev = guide_use_allocator(&s->counted.alloc);
+        s->guide = guide_load(wfile, &os_errcode, &format);
+        guide_use_allocator(prev);
+        CHECK(s->guide && s->guide->_alloc == &s->counted.alloc);
+        CHECK(check_preorder(tree_get_root(s->guide->tree), order) == n);
+        for (i = 0; i <= N_NODES; ++i)
+            s->nodes[i] = order[at[i]];
+    }
+    unlink(file);
+}
+
+static void change(int k, int i)
+{
+    struct guide_nodedata_t *data[2];
+    wchar_t title[64];
+    char text[3000];
+    const wchar_t *t;
+    const char *x;
+
+    data[0] = (struct guide_nodedata_t *)tree_get_data(sides[0].nodes[k]);
+    data[1] = (struct guide_nodedata_t *)tree_get_data(sides[1].nodes[k]);
+    random_strings(title, text, i, &t, &x);
+    if (rand() % 2) {
+        guide_nodedata_set_title_take(data[0], title_for(t));
+        guide_nodedata_set_title(data[1], t);
+    } else {
+        guide_nodedata_set_text_take(data[0], text_for(x));
+        guide_nodedata_set_text(data[1], x);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char path[2][32] = { "/tmp/libguide-take-XXXXXX", "/tmp/libguide-take-XXXXXX" };
+    struct guide_builder_t *b[2];
+    struct guide_nodedata_t *data[2];
+    struct tree_snapshot_t *ss;
+    struct side_t *s;
+    wchar_t title[64];
+    char text[3000], *before, *got;
+    const wchar_t *t;
+    const char *x;
+    int i, k, step, fd;
+
+    check_setlocale();
+    srand(43);
+    for (s = sides; s < sides + 2; ++s) {
+        s->counted.alloc.malloc_fn = counted_malloc;
+        s->counted.alloc.realloc_fn = counted_realloc;
+        s->counted.alloc.free_fn = counted_free;
+        s->counted.alloc.cargo = &s->counted;
+        s->guide = guide_create();
+        CHECK(s->guide);
+        CHECK(guide_set_allocator(s->guide, &s->counted.alloc) == 0);
+        s->nodes[0] = tree_get_root(s->guide->tree);
+        b[s - sides] = guide_builder_create(s->guide);
+        CHECK(b[s - sides]);
+    }
+
+    /* made as usual, and by builders */
+    for (i = 1; i <= N_NODES; ++i) {
+        random_strings(title, text, i, &t, &x);
+        k = rand() % i;
+        if (i % 5) {
+            data[0] = guide_nodedata_create_take(sides[0].guide, title_for(t), text_for(x));
+            data[1] = guide_nodedata_create_with_data(sides[1].guide, t, x);
+            CHECK(data[0] && data[1]);
+            for (s = sides; s < sides + 2; ++s) {
+                s->nodes[i] = guide_add_child(s->guide, s->nodes[k], data[s - sides], NULL);
+                CHECK(s->nodes[i]);
+            }
+        } else {
+            for (s = sides; s < sides + 2; ++s) {
+                data[s - sides] = guide_builder_nodedata(b[s - sides], t, x);
+                CHECK(data[s - sides]);
+                CHECK(guide_builder_add_child(b[s - sides], NULL, data[s - sides], NULL));
+                CHECK(guide_builder_publish(b[s - sides], s->nodes[k], NULL) == 0);
+                s->nodes[i] = tree_get_first_child(s->nodes[k]);
+            }
+        }
+    }
+    check_same();
+    for (s = sides; s < sides + 2; ++s)
+        guide_builder_destroy(b[s - sides]);
+    for (step = 0; step < 500; ++step)
+        change(1 + rand() % N_NODES, step);
+    check_same();
+
+    /* loaded */
+    reload();
+    check_same();
+
+    /* changed, undone and redone */
+    for (s = sides; s < sides + 2; ++s)
+        CHECK(guide_set_journal(s->guide, 1, 0) == 0);
+    for (step = 0; step < 2000; ++step)
+        change(1 + rand() % N_NODES, step);
+    check_same();
+    for (step = 0; step < 500; ++step) {
+        CHECK(guide_undo(sides[0].guide) == 0);
+        CHECK(guide_undo(sides[1].guide) == 0);
+    }
+    check_same();
+    for (step = 0; step < 200; ++step) {
+        CHECK(guide_redo(sides[0].guide) == 0);
+        CHECK(guide_redo(sides[1].guide) == 0);
+    }
+    check_same();
+
+    /* a snapshot sees the strings from before they were handed over */
+    ss = guide_snapshot(sides[0].guide);
+    CHECK(ss);
+    before = check_dump(ss, sides[0].nodes[0]);
+    for (step = 0; step < 300; ++step)
+        change(1 + rand() % N_NODES, step);
+    got = check_dump(ss, sides[0].nodes[0]);
+    CHECK(strcmp(got, before) == 0);
+    free(got);
+    free(before);
+    guide_snapshot_release(ss);
+    check_same();
+
+    /* with long texts in the blob store */
+    for (s = sides; s < sides + 2; ++s) {
+        CHECK((fd = mkstemp(path[s - sides])) >= 0);
+        close(fd);
+        unlink(path[s - sides]);
+        CHECK(guide_set_blob_store(s->guide, path[s - sides], 500, 4096) == 0);
+    }
+    for (step = 0; step < 1000; ++step)
+        change(1 + rand() % N_NODES, step);
+    check_same();
+    for (step = 0; step < 100; ++step) {
+        CHECK(guide_undo(sides[0].guide) == 0);
+        CHECK(guide_undo(sides[1].guide) == 0);
+    }
+    check_same();
+
+    for (s = sides; s < sides + 2; ++s) {
+        guide_destroy(s->guide);
+        unlink(path[s - sides]);
+        CHECK(atomic_load(&s->counted.live) == 0);
+    }
+    printf("take: ok\n");
+    return EXIT_SUCCESS;
+}
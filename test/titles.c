@@ -0,0 +1,169 @@
+/*
+ * Titles kept inline with the node data or not, on either side of the
+ * bounds (23 characters when made, 23 bytes of UTF-8 when loaded), empty,
+ * or made of characters of two, three and four bytes in UTF-8: each comes
+ * back the same through guide_nodedata_set_title(), from inline to not and
+ * back, and through a store and load round trip, after which the loaded
+ * titles take new ones in the same way.
+ */
+
+#include <unistd.h>
+
+#include "check.h"
+
+#define MAX_TITLES  32
+
+static wchar_t *titles[MAX_TITLES];
+static int n_titles;
+
+/* `n' times `c', and `tail' */
+static void add_title(wchar_t c, int n, const wchar_t *tail)
+{
+    wchar_t *title = malloc((n + wcslen(tail) + 1) * sizeof(wchar_t));
+    int i;
+
+    CHECK(title && n_titles < MAX_TITLES);
+    for (i = 0; i < n; ++i)
+        title[i] = c;
+    wcscpy(title + n, tail);
+    titles[n_titles++] = title;
+}
+
+static void check_titles(struct guide_t *guide, int shift)
+{
+    struct tree_node_t *node;
+    struct guide_nodedata_t *data;
+    int i = 0;
+
+    for (node = tree_get_first_child(tree_get_root(guide->tree)); node;
+            node = tree_get_next_sibling(node), ++i) {
+        data = (struct guide_nodedata_t *)tree_get_data(node);
+        CHECK(wcscmp(guide_nodedata_get_title(data), titles[(i + shift) % n_titles]) == 0);
+        CHECK(data->title == guide_nodedata_get_title(data));
+    }
+    CHECK(i == n_titles);
+}
+
+/* give each node the title `shift' further on, through all the others */
+static void retitle(struct guide_t *guide, int shift)
+{
+    struct tree_node_t *node;
+    struct guide_nodedata_t *data;
+    int i = 0, k;
+
+    for (node = tree_get_first_child(tree_get_root(guide->tree)); node;
+            node = tree_get_next_sibling(node), ++i) {
+        data = (struct guide_nodedata_t *)tree_get_data(node);
+        for (k = 0; k < n_titles; ++k) {
+            guide_nodedata_set_title(data, titles[k]);
+            CHECK(wcscmp(data->title, titles[k]) == 0);
+        }
+        guide_nodedata_set_title(data, NULL);
+        CHECK(wcscmp(data->title, L"") == 0);
+        guide_nodedata_set_title(data, titles[(i + shift) % n_titles]);
+    }
+}
+
+static struct guide_t *round_trip(struct guide_t *guide)
+{
+    char file[] = "/tmp/libguide-titles-XXXXXX";
+    wchar_t wfile[64];
+    struct guide_t *loaded;
+    unsigned os_errcode;
+    uint32 format;
+    char *dump, *got;
+    int fd;
+
+    CHECK((fd = mkstemp(file)) >= 0);
+    close(fd);
+    swprintf(wfile, 64, L"%s", file);
+    CHECK(guide_store(wfile, guide) == 0);
+    loaded = guide_load(wfile, &os_errcode, &format);
+    CHECK(loaded);
+    unlink(file);
+
+    dump = check_dump(NULL, tree_get_root(guide->tree));
+    got = check_dump(NULL, tree_get_root(loaded->tree));
+    CHECK(strcmp(got, dump) == 0);
+    free(got);
+    free(dump);
+    return loaded;
+}
+
+int main(int argc, char *argv[])
+{
+    struct guide_t *guide, *loaded;
+    struct guide_nodedata_t *data;
+    wchar_t *t;
+    char text[40];
+    int i;
+
+    check_setlocale();
+    srand(46);
+
+    add_title(L'a', 0, L"");
+    add_title(L'a', 1, L"");
+    add_title(L'a', 22, L"");
+    add_title(L'a', 23, L"");
+    add_title(L'a', 24, L"");
+    add_title(L'a', 25, L"");
+    add_title(L'a', 300, L"");
+    add_title(L'a', 22, L"/");
+    if (check_utf8) {
+        /* two bytes: 23 bytes, 24 bytes, and 23 characters of 46 bytes */
+        add_title(L'\u00e9', 11, L"x");
+        add_title(L'\u00e9', 12, L"");
+        add_title(L'\u00e9', 23, L"");
+        add_title(L'\u00e9', 24, L"");
+        /* three bytes */
+        add_title(L'\u4e2d', 7, L"ab");
+        add_title(L'\u4e2d', 8, L"");
+        add_title(L'\u4e2d', 40, L"");
+        /* four bytes, where wchar_t takes them */
+        if (sizeof(wchar_t) == 4) {
+            add_title((wchar_t)0x1f600, 5, L"abc");
+            add_title((wchar_t)0x1f600, 6, L"");
+            add_title((wchar_t)0x1f600, 23, L"");
+        }
+        add_title(L'a', 20, L"\u00e9\u4e2d");
+    }
+
+    guide = guide_create();
+    CHECK(guide);
+    for (i = 0; i < n_titles; ++i) {
+        snprintf(text, sizeof(text), "text %d", i);
+        data = guide_nodedata_create_with_data(guide, titles[i], text);
+        CHECK(data);
+        CHECK(wcscmp(data->title, titles[i]) == 0);
+        CHECK(guide_add_child(guide, tree_get_root(guide->tree), data, NULL));
+    }
+    /* added as first children: the last title comes first */
+    for (i = 0; i < n_titles / 2; ++i) {
+        t = titles[i];
+        titles[i] = titles[n_titles - 1 - i];
+        titles[n_titles - 1 - i] = t;
+    }
+    check_titles(guide, 0);
+
+    /* from inline to not and back */
+    retitle(guide, 1);
+    check_titles(guide, 1);
+    retitle(guide, 0);
+    check_titles(guide, 0);
+
+    /* loaded, and titled again */
+    loaded = round_trip(guide);
+    check_titles(loaded, 0);
+    retitle(loaded, 3);
+    check_titles(loaded, 3);
+    guide_destroy(guide);
+    guide = round_trip(loaded);
+    check_titles(guide, 3);
+
+    guide_destroy(loaded);
+    guide_destroy(guide);
+    for (i = 0; i < n_titles; ++i)
+        free(titles[i]);
+    printf("titles: ok\n");
+    return EXIT_SUCCESS;
+}